@@ -6,22 +6,16 @@
  * Standard Ethernet does it manually with client.connected.
  * 
  * ESP32_W5500 can not co-exist with the standard Arduino core for ESP32. The SPI and interrupt drivers fight.
- * To resolve this, the code boots into either ESP32_W5500 mode or standard Ethernet mode.
- * ESP.restart() restarts the code to change mode.
- * The code creates or deletes a file in LittleFS to indicate which mode should be used next time.
+ * To resolve this, ETH.detach() hands the SPI bus, interrupt pin and ISR service over to Arduino SPI and Ethernet,
+ * and ETH.attach() takes them back. The mode changes without a restart.
  * 
  * Licence: please see LICENSE.md for more details.
  */
 
 #include <Arduino.h>
 
-#include "FS.h"
-#include <LittleFS.h> //We use LittleFS to control the Ethernet mode
-
 #include <SPI.h> //Needed for SPI to W5500
 
-#include <Esp.h>
-
 // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 // Pin definitions
 
@@ -55,6 +49,10 @@ EthernetServer *ethernetServer;
 
 // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+bool useArduinoEthernet = false;
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
 void setup()
 {
   //Set up the W5500 Chip Select
@@ -76,13 +74,6 @@ void setup()
   Serial.begin(115200);
   Serial.println("SparkFun WebServer ESP32 W5500 Example");
 
-  //Start LittleFS
-  if(!LittleFS.begin(true))
-  {
-    Serial.println("LittleFS mount failed");
-    return;
-  }
-
   //Empty the serial buffer
   while (Serial.available())
     Serial.read();
@@ -90,184 +81,281 @@ void setup()
   Serial.println();
   Serial.println("Press any key (send any character) to change modes");
   Serial.println();
+
+  startESP32_W5500();
 }
 
 // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
 void loop()
 {
-  // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-  //If useArduinoEthernet.txt does not exist in LittleFS, use ESP32_W5500 and ESPAsyncWebServer
+  if (!useArduinoEthernet)
+  {
+    static bool firstRequestPrinted = false;
 
-  if (!LittleFS.exists("/useArduinoEthernet.txt"))
+    if ((!firstRequestPrinted) && (ETH.bootTimes().firstRequest))
+    {
+      Serial.printf("Power on to first request: %.1f ms (DHCP fast reconnect %s)\r\n", ETH.bootTimes().firstRequest / 1000.0,
+                    ETH.bootTimes().fastReconnect ? "used" : "not used");
+      firstRequestPrinted = true;
+    }
+  }
+  else
   {
-  
-    // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-    // ESP32_W5500
+    serveArduinoEthernet();
+  }
 
-    //Create useArduinoEthernet.txt so the code will use Arduino Ethernet next time
-    File file = LittleFS.open("/useArduinoEthernet.txt", FILE_WRITE);
-    file.close();
+  if (Serial.available()) //Check if the user has pressed a key
+  {
+    while (Serial.available())
+      Serial.read();
 
-    Serial.println("Using ESP32_W5500:");
-    Serial.println();
+    if (!useArduinoEthernet)
+      changeToArduinoEthernet();
+    else
+      changeToESP32_W5500();
+  }
 
-    // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-    // Configure the W5500
-  
-    //Must be called before ETH.begin()
-    ESP32_W5500_onEvent();
-  
-    //Start the ethernet connection
-    ETH.begin( pin_POCI, pin_PICO, pin_SCK, pin_W5500_CS, pin_W5500_INT ); //Use default clock speed and SPI Host
-  
-    ESP32_W5500_waitForConnect();
-  
-    // Print your local IP address:
-    Serial.print("My IP address: ");
-    Serial.println(ETH.localIP());
-    Serial.println();
-  
-    // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-    // Configure the Web Server
-  
-    Serial.println("Starting Web Server");
+  delay(1);
+}
 
-    asyncWebServer = new AsyncWebServer(80); //Instantiate the web server. Use port 80
-    asyncWebSocket = new AsyncWebSocket("/ws"); //Instantiate the web socket
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
-    asyncWebSocket->onEvent(onWsEvent);
-    asyncWebServer->addHandler(asyncWebSocket);
+void startESP32_W5500()
+{
+  Serial.println("Using ESP32_W5500:");
+  Serial.println();
 
-    static char webPage[100];
-    snprintf(webPage, sizeof(webPage), "<!DOCTYPE html>\r\n<html>\r\n<h2>I am an ESP32_W5500 web page</h2>\r\n<br>\r\n</html>\r\n");
-    
-    asyncWebServer->on("/", HTTP_GET, [](AsyncWebServerRequest *request){
-      request->send(200, "text/html", webPage);
-      });
-    
-    asyncWebServer->onNotFound(notFound);
+  // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+  // Configure the W5500
 
-    asyncWebServer->begin();
+  //Must be called before ETH.begin()
+  ESP32_W5500_onEvent();
 
-    // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-    // Loop until the user presses a key
+  //Start the ethernet connection
+  ETH.begin( pin_POCI, pin_PICO, pin_SCK, pin_W5500_CS, pin_W5500_INT ); //Use default clock speed and SPI Host
 
-    while(1)
-    {
-      if (Serial.available()) //Check if the user has pressed a key
-      {
-        ETH.end(); //End ESP32_W5500. This is _really_ important!
-        
-        ESP.restart(); //Restart the ESP32
-      }
-      delay(1);
-    }
-  }
+  ESP32_W5500_waitForConnect();
 
-  else
+  // Print your local IP address:
+  Serial.print("My IP address: ");
+  Serial.println(ETH.localIP());
+
+  // Print how long each phase of the start-up took
+  const ESP32_W5500_BootTimes &times = ETH.bootTimes();
+  Serial.printf("Start-up (ms): SPI %.1f, chip %.1f, start %.1f, link %.1f, DHCP %.1f, total %.1f, since power on %.1f\r\n",
+                times.spiInit / 1000.0, times.chipInit / 1000.0, times.start / 1000.0, times.phyLink / 1000.0,
+                times.dhcp / 1000.0, times.gotIP / 1000.0, times.sincePowerOn / 1000.0);
+  Serial.println();
+
+  // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+  // Configure the Web Server
+
+  Serial.println("Starting Web Server");
+
+  asyncWebServer = new AsyncWebServer(80); //Instantiate the web server. Use port 80
+  asyncWebSocket = new AsyncWebSocket("/ws"); //Instantiate the web socket
+
+  asyncWebSocket->onEvent(onWsEvent);
+  asyncWebServer->addHandler(asyncWebSocket);
+
+  static char webPage[100];
+  snprintf(webPage, sizeof(webPage), "<!DOCTYPE html>\r\n<html>\r\n<h2>I am an ESP32_W5500 web page</h2>\r\n<br>\r\n</html>\r\n");
+
+  asyncWebServer->on("/", HTTP_GET, [](AsyncWebServerRequest *request){
+    ETH.markFirstRequest(); //Record the power-on to first request time (only the first call counts)
+    request->send(200, "text/html", webPage);
+    });
+
+  asyncWebServer->on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request){
+    AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+    ETH.printMetrics(*response); //Driver counters in the Prometheus text format
+    request->send(response);
+    });
+
+#if W5500_TRACE
+  ETH.startTrace(); //Build with -DW5500_TRACE=1 to record SPI and frame events
+
+  asyncWebServer->on("/trace", HTTP_GET, [](AsyncWebServerRequest *request){
+    AsyncResponseStream *response = request->beginResponseStream("text/plain");
+    ETH.dumpTrace(*response); //Convert with extras/w5500_trace_to_perfetto.py
+    request->send(response);
+    });
+#endif
+
+#if W5500_FLOW_TABLE
+  asyncWebServer->on("/flows", HTTP_GET, [](AsyncWebServerRequest *request){
+    AsyncResponseStream *response = request->beginResponseStream("text/plain");
+    ETH.printTopFlows(*response); //The ten busiest peers by packets
+    request->send(response);
+    });
+#endif
+
+#if W5500_CAPTURE
+  asyncWebServer->on("/capture/start", HTTP_GET, [](AsyncWebServerRequest *request){
+    w5500_capture_config_t config = { };
+    config.directions = W5500_CAPTURE_RX | W5500_CAPTURE_TX;
+    config.snap_len = 256; //Headers are usually enough
+    config.skip_port = 80; //Leave out this web server, or the download would capture itself
+    request->send(200, "text/plain", ETH.startCapture(config) ? "Capturing\n" : "Capture failed\n");
+    });
+
+  asyncWebServer->on("/capture.pcap", HTTP_GET, [](AsyncWebServerRequest *request){
+    //Everything captured so far, open it with Wireshark
+    request->send(request->beginChunkedResponse("application/vnd.tcpdump.pcap",
+      [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        return ETH.readCapture(buffer, maxLen, index);
+      }));
+    });
+#endif
+
+  asyncWebServer->onNotFound(notFound);
+
+  asyncWebServer->begin();
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+void changeToArduinoEthernet()
+{
+  //Remember the address so Arduino Ethernet can use it without a DHCP round trip
+  IPAddress ip = ETH.localIP();
+  IPAddress dns = ETH.dnsIP();
+  IPAddress gateway = ETH.gatewayIP();
+  IPAddress subnet = ETH.subnetMask();
+
+  //Hand the SPI bus, interrupt pin and ISR service over. The AsyncWebServer stays, it just sees no traffic
+  if (!ETH.detach())
   {
-    // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-    // Ethernet
+    Serial.println("ETH.detach failed");
+    return;
+  }
 
-    //Delete useArduinoEthernet.txt so the code will use ESP32_W5500 next time
-    LittleFS.remove("/useArduinoEthernet.txt");
+  Serial.println("Using Arduino Ethernet:");
+  Serial.println();
 
-    Serial.println("Using Arduino Ethernet:");
-    Serial.println();
+  // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+  // Configure the W5500
 
-    // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-    // Configure the W5500
+  unsigned long startMillis = millis();
 
-    Ethernet.init(pin_W5500_CS); //Set the chip select pin
+  SPI.begin(pin_SCK, pin_POCI, pin_PICO);
 
-    //Get MAC address
-    uint8_t ethernetMACAddress[6];
-    esp_read_mac(ethernetMACAddress, ESP_MAC_WIFI_STA);
-    ethernetMACAddress[5] += 3; //Convert WiFi MAC address to Ethernet MAC (add 3)
-    
-    Ethernet.begin(ethernetMACAddress); //Use default mac and IP
+  Ethernet.init(pin_W5500_CS); //Set the chip select pin
 
-    if (Ethernet.hardwareStatus() == EthernetNoHardware)
+  //Get MAC address
+  uint8_t ethernetMACAddress[6];
+  esp_read_mac(ethernetMACAddress, ESP_MAC_WIFI_STA);
+  ethernetMACAddress[5] += 3; //Convert WiFi MAC address to Ethernet MAC (add 3)
+
+  Ethernet.begin(ethernetMACAddress, ip, dns, gateway, subnet); //Use the address ESP32_W5500 had
+
+  if (Ethernet.hardwareStatus() == EthernetNoHardware)
+  {
+    Serial.println("W5500 was not found.  Sorry, can't run without hardware. :(");
+    while (true)
     {
-      Serial.println("W5500 was not found.  Sorry, can't run without hardware. :(");
-      while (true)
-      {
-        delay(1); // do nothing, no point running without Ethernet hardware
-      }
+      delay(1); // do nothing, no point running without Ethernet hardware
     }
+  }
 
-    // Print your local IP address:
-    Serial.print("My IP address: ");
-    Serial.println(Ethernet.localIP());
-    Serial.println();  
+  Serial.printf("Mode change took %.1f ms (ETH.detach %.1f ms)\r\n", (float)(millis() - startMillis) + ETH.bootTimes().detach / 1000.0,
+                ETH.bootTimes().detach / 1000.0);
 
-    // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-    // Configure the Web Server
-  
-    Serial.println("Starting Web Server");
+  // Print your local IP address:
+  Serial.print("My IP address: ");
+  Serial.println(Ethernet.localIP());
+  Serial.println();
+
+  // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+  // Configure the Web Server
+
+  Serial.println("Starting Web Server");
 
+  if (ethernetServer == nullptr)
     ethernetServer = new EthernetServer(80); //Instantiate the web server. Use port 80
 
-    ethernetServer->begin(); //Start the server
+  ethernetServer->begin(); //Start the server
+
+  useArduinoEthernet = true;
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+void changeToESP32_W5500()
+{
+  SPI.end(); //Release the SPI bus so ESP32_W5500 can take it back
+
+  if (!ETH.attach())
+  {
+    Serial.println("ETH.attach failed");
+    return;
+  }
+
+  useArduinoEthernet = false;
+
+  Serial.println("Using ESP32_W5500:");
+  Serial.printf("Mode change took %.1f ms\r\n", ETH.bootTimes().attach / 1000.0);
+  Serial.println();
+
+  //The lease was kept. Wait for DHCP to confirm it (INIT-REBOOT)
+  ETH.waitForIP(5000);
+
+  // Print your local IP address:
+  Serial.print("My IP address: ");
+  Serial.println(ETH.localIP());
+  Serial.println();
+}
 
-    // =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-    // Loop until the user presses a key
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
-    while(1)
+void serveArduinoEthernet()
+{
+  // listen for incoming clients
+  EthernetClient client = ethernetServer->available();
+  if (client) {
+    Serial.println("New client conected");
+    // an http request ends with a blank line
+    bool currentLineIsBlank = true;
+    while (client.connected())
     {
-      // listen for incoming clients
-      EthernetClient client = ethernetServer->available();
-      if (client) {
-        Serial.println("New client conected");
-        // an http request ends with a blank line
-        bool currentLineIsBlank = true;
-        while (client.connected())
-        {
-          if (client.available())
-          {
-            char c = client.read();
-            // if you've gotten to the end of the line (received a newline
-            // character) and the line is blank, the http request has ended,
-            // so you can send a reply
-            if (c == '\n' && currentLineIsBlank) {
-              // send a standard http response header
-              client.println("HTTP/1.1 200 OK");
-              client.println("Content-Type: text/html");
-              client.println("Connection: close");  // the connection will be closed after completion of the response
-              client.println("Refresh: 5");  // refresh the page automatically every 5 sec
-              client.println();
-              client.println("<!DOCTYPE HTML>");
-              client.println("<html>");
-              client.println("<h2>I am an Ethernet web page</h2>");
-              client.println("</html>");
-              break;
-            }
-            
-            if (c == '\n')
-            {
-              // you're starting a new line
-              currentLineIsBlank = true;
-            }
-            else if (c != '\r')
-            {
-              // you've gotten a character on the current line
-              currentLineIsBlank = false;
-            }
-          }
+      if (client.available())
+      {
+        char c = client.read();
+        // if you've gotten to the end of the line (received a newline
+        // character) and the line is blank, the http request has ended,
+        // so you can send a reply
+        if (c == '\n' && currentLineIsBlank) {
+          // send a standard http response header
+          client.println("HTTP/1.1 200 OK");
+          client.println("Content-Type: text/html");
+          client.println("Connection: close");  // the connection will be closed after completion of the response
+          client.println("Refresh: 5");  // refresh the page automatically every 5 sec
+          client.println();
+          client.println("<!DOCTYPE HTML>");
+          client.println("<html>");
+          client.println("<h2>I am an Ethernet web page</h2>");
+          client.println("</html>");
+          break;
         }
-        // give the web browser time to receive the data
-        delay(1);
-        // close the connection:
-        client.stop();
-        Serial.println("Client disconnected");
-      }
 
-      if (Serial.available()) //Check if the user has pressed a key
-      {
-        ESP.restart(); //Restart the ESP32
+        if (c == '\n')
+        {
+          // you're starting a new line
+          currentLineIsBlank = true;
+        }
+        else if (c != '\r')
+        {
+          // you've gotten a character on the current line
+          currentLineIsBlank = false;
+        }
       }
     }
+    // give the web browser time to receive the data
+    delay(1);
+    // close the connection:
+    client.stop();
+    Serial.println("Client disconnected");
   }
 }
 
@@ -0,0 +1,1467 @@
+/*
+ * SparkFun WebServer ESP32 W5500 Example2 : network benchmark, ESP32_W5500 against standard Arduino Ethernet
+ *
+ * This code runs the same workload over ESP32_W5500 (lwIP, with ESPAsyncWebServer for HTTP) at each SPI clock
+ * in spiClocksMHz, then over standard Arduino Ethernet, switching modes as Example1 does, and prints a table of
+ * the results:
+ *   TCP TX / RX    iperf2 client. The TX stream asks the peer to connect back and send for as long (iperf -r)
+ *   UDP TX / RX    iperf2 client, as fast as possible. Loss comes from the receiver's report
+ *   RTT            UDP ping-pong with an echo server: 50th, 90th and 99th percentile and worst round trip
+ *   HTTP           requests per second to http://<this board>/bench
+ *   CPU            load of each core during each test, from FreeRTOS idle hooks
+ *
+ * The board also runs an iperf2 server (TCP and UDP on 5001, -r too) and a UDP echo server (5007), so the
+ * peer can measure it the other way: iperf -c <board> [-u -b 20M] [-r], or ping-pong against port 5007.
+ *
+ * Peer (a laptop on the same switch, peerIP below). Run:
+ *   iperf -s                   (iperf2, not iperf3)
+ *   iperf -s -u
+ *   python3 -c "import socket;s=socket.socket(2,2);s.bind(('',5007));[s.sendto(*s.recvfrom(2048)) for _ in iter(int,1)]"
+ * and, when the board asks for it during the HTTP test:
+ *   ab -n 2000 -c 4 http://<board>/bench         (or wrk -d 5 http://<board>/bench)
+ * Set peerIP to 127.0.0.1 to run everything against the board's own servers instead. That measures lwIP and
+ * the CPU only, not the W5500, and only works with ESP32_W5500: Arduino Ethernet has no loopback.
+ *
+ * Arduino Ethernet clocks SPI at the speed set inside the Ethernet library (14 MHz), whatever spiClocksMHz says.
+ *
+ * Licence: please see LICENSE.md for more details.
+ */
+
+#include <Arduino.h>
+
+#include <SPI.h> //Needed for SPI to W5500
+
+#include "esp_freertos_hooks.h" //For the CPU load
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Pin definitions
+
+int pin_PICO = 23;      //The digital pin for SPI PICO
+int pin_POCI = 19;      //The digital pin for SPI POCI
+int pin_SCK = 18;       //The digital pin for SPI SCK
+int pin_W5500_CS = 27;  //The digital pin for the W5500 Chip Select. Change this if required
+int pin_W5500_INT = 33; //The digital pin for the W5500 Interrupt. Change this if required
+
+int pin_POWER_CONTROL = 32; //If your board has a power enable pin, define it here. Set to -1 if not needed.
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Benchmark settings
+
+IPAddress peerIP(192, 168, 1, 100); //The peer running iperf and the echo server. 127.0.0.1 = this board
+
+const int spiClocksMHz[] = { 14, 20, 25 }; //ESP32_W5500 runs the workload once at each clock
+
+const uint32_t testSeconds = 5;          //Length of each throughput test
+const uint32_t udpReverseRate = 30000000; //UDP RX: the rate the peer is asked to send at (bits/s)
+const uint32_t pingCount = 500;          //Round trips per latency test
+const uint32_t httpWaitSeconds = 30;     //How long to wait for the peer to start the HTTP load. 0 = skip the test
+
+const uint16_t iperfPort = 5001;   //Both the peer's iperf server and this board's
+const uint16_t reversePort = 5002; //Where the peer connects back to for the RX tests
+const uint16_t serverPort = 5003;  //This board's iperf server sends from here for UDP -r
+const uint16_t echoPort = 5007;    //Both the peer's UDP echo server and this board's
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// ESP32_W5500 WebServer
+
+#include <SparkFun_WebServer_ESP32_W5500.h> //http://librarymanager/All#SparkFun_WebServer_ESP32_W5500
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// ESPAsyncWebServer
+
+#include <ESPAsyncWebServer.h> //https://github.com/me-no-dev/ESPAsyncWebServer
+
+AsyncWebServer *asyncWebServer;
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Arduino Ethernet
+
+#include <Ethernet.h>
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// The two network stacks behind one interface, so every test runs the same code in both modes.
+// The objects are kept for the whole run: Arduino Ethernet has a fixed number of W5500 sockets
+
+enum
+{
+  LISTEN_IPERF,   //This board's iperf server
+  LISTEN_REVERSE, //The peer connecting back for TCP RX
+  LISTEN_HTTP,    //Arduino Ethernet's HTTP server. ESP32_W5500 uses the AsyncWebServer
+  LISTEN_COUNT
+};
+
+enum
+{
+  UDP_TEST,       //iperf client and ping probe, on reversePort
+  UDP_IPERF,      //This board's iperf server
+  UDP_ECHO,       //This board's echo server
+  UDP_SERVER,     //This board's iperf server sending back (iperf -r)
+  UDP_COUNT
+};
+
+enum
+{
+  CLIENT_TEST,    //Connections the tests make
+  CLIENT_SERVER,  //This board's iperf server connecting back (iperf -r)
+  CLIENT_COUNT
+};
+
+class BenchNet
+{
+  public:
+    virtual const char *name() = 0;
+    virtual void begin() = 0; //After each switch to this mode
+    virtual Client &client(int n) = 0;
+    virtual UDP &udp(int n) = 0;
+    //A new connection or NULL. It stays valid until the next accept on this listener
+    virtual Client *accept(int listener, IPAddress &remote) = 0;
+};
+
+class ESP32_W5500_Net : public BenchNet
+{
+  private:
+    WiFiServer servers[LISTEN_COUNT] = { WiFiServer(iperfPort), WiFiServer(reversePort), WiFiServer(80) };
+    WiFiClient accepted[LISTEN_COUNT];
+    WiFiClient clients[CLIENT_COUNT];
+    WiFiUDP udps[UDP_COUNT];
+    bool started = false;
+
+  public:
+    const char *name() { return "ESP32_W5500"; }
+
+    void begin()
+    {
+      //The servers listen on every interface, so they outlive ETH.end() and detach()
+      if (started)
+        return;
+
+      servers[LISTEN_IPERF].begin();
+      servers[LISTEN_REVERSE].begin();
+      udps[UDP_IPERF].begin(iperfPort);
+      udps[UDP_ECHO].begin(echoPort);
+      started = true;
+    }
+
+    Client &client(int n) { return clients[n]; }
+    UDP &udp(int n) { return udps[n]; }
+
+    Client *accept(int listener, IPAddress &remote)
+    {
+      WiFiClient client = servers[listener].accept();
+
+      if (!client)
+        return NULL;
+
+      accepted[listener] = client;
+      remote = accepted[listener].remoteIP();
+
+      return &accepted[listener];
+    }
+};
+
+class ArduinoEthernetNet : public BenchNet
+{
+  private:
+    EthernetServer servers[LISTEN_COUNT] = { EthernetServer(iperfPort), EthernetServer(reversePort), EthernetServer(80) };
+    EthernetClient accepted[LISTEN_COUNT];
+    EthernetClient clients[CLIENT_COUNT];
+    EthernetUDP udps[UDP_SERVER]; //The W5500 has 8 sockets. The servers only run between tests, so they share UDP_TEST
+
+  public:
+    const char *name() { return "Arduino Ethernet"; }
+
+    void begin()
+    {
+      //Ethernet.begin resets the W5500, so the sockets are opened again each time
+      for (int i = 0; i < LISTEN_COUNT; i++)
+        servers[i].begin();
+
+      udps[UDP_IPERF].begin(iperfPort);
+      udps[UDP_ECHO].begin(echoPort);
+    }
+
+    Client &client(int n) { return clients[n]; }
+    UDP &udp(int n) { return udps[(n == UDP_SERVER) ? UDP_TEST : n]; }
+
+    Client *accept(int listener, IPAddress &remote)
+    {
+      EthernetClient client = servers[listener].accept();
+
+      if (!client)
+        return NULL;
+
+      accepted[listener] = client;
+      remote = accepted[listener].remoteIP();
+
+      return &accepted[listener];
+    }
+};
+
+ESP32_W5500_Net esp32Net;
+ArduinoEthernetNet arduinoNet;
+BenchNet *net = &esp32Net;
+
+bool useArduinoEthernet = false;
+int spiClockMHz = 25; //ESP32_W5500's clock now
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// CPU load: the idle task calls these hooks in a loop while nothing else runs on its core.
+// Returning false keeps it looping rather than waiting for an interrupt, so the count follows the idle time
+
+volatile uint32_t idleCount[portNUM_PROCESSORS];
+float idlePerMs[portNUM_PROCESSORS]; //With nothing to do, from calibrateCPU
+
+bool idleHook0() { idleCount[0]++; return false; }
+#if portNUM_PROCESSORS > 1
+bool idleHook1() { idleCount[1]++; return false; }
+#endif
+
+typedef struct
+{
+  uint32_t idle[portNUM_PROCESSORS];
+  uint32_t startMillis;
+} CpuSample;
+
+void cpuStart(CpuSample &sample)
+{
+  for (int i = 0; i < portNUM_PROCESSORS; i++)
+    sample.idle[i] = idleCount[i];
+
+  sample.startMillis = millis();
+}
+
+//Percent busy on each core since cpuStart
+void cpuStop(const CpuSample &sample, float *load)
+{
+  uint32_t ms = millis() - sample.startMillis;
+
+  for (int i = 0; i < portNUM_PROCESSORS; i++)
+  {
+    float idle = (ms && idlePerMs[i]) ? (idleCount[i] - sample.idle[i]) / (ms * idlePerMs[i]) : 1.0;
+    load[i] = constrain(100.0 * (1.0 - idle), 0.0, 100.0);
+  }
+}
+
+void calibrateCPU()
+{
+  CpuSample sample;
+
+  esp_register_freertos_idle_hook_for_cpu(idleHook0, 0);
+#if portNUM_PROCESSORS > 1
+  esp_register_freertos_idle_hook_for_cpu(idleHook1, 1);
+#endif
+
+  cpuStart(sample);
+  delay(1000);
+
+  for (int i = 0; i < portNUM_PROCESSORS; i++)
+    idlePerMs[i] = (float)(idleCount[i] - sample.idle[i]) / (millis() - sample.startMillis);
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Results
+
+enum
+{
+  TEST_TCP_TX,
+  TEST_TCP_RX,
+  TEST_UDP_TX,
+  TEST_UDP_RX,
+  TEST_PING,
+  TEST_HTTP,
+  TEST_COUNT
+};
+
+const char *testNames[TEST_COUNT] = { "TCP TX", "TCP RX", "UDP TX", "UDP RX", "RTT", "HTTP" };
+
+typedef struct
+{
+  const char *mode;
+  int spiMHz;
+  float mbps[TEST_COUNT];      //Throughput tests, < 0 = not measured
+  float loss[TEST_COUNT];      //UDP tests, percent, < 0 = unknown
+  uint32_t rtt[4];             //p50, p90, p99, max in microseconds
+  uint32_t pingLost;
+  float httpRate;              //Requests per second, < 0 = not measured
+  float cpu[TEST_COUNT][portNUM_PROCESSORS];
+} BenchResult;
+
+#define MAX_RESULTS ((sizeof(spiClocksMHz) / sizeof(spiClocksMHz[0])) + 1)
+
+BenchResult results[MAX_RESULTS];
+int resultCount = 0;
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// iperf2 wire format (2.0.x, still understood by 2.1 and later). Every field is big endian
+
+#define IPERF_HEADER_VERSION1 0x80000000 //A client header follows: run a test back to the client afterwards
+#define IPERF_BUFFER_SIZE     1460       //TCP writes and UDP datagrams (WiFiUDP holds at most 1460 bytes)
+
+typedef struct
+{
+  int32_t id;          //Datagram number, negative on the last one
+  uint32_t sec;
+  uint32_t usec;
+} IperfDatagram;
+
+typedef struct
+{
+  int32_t flags;
+  int32_t threads;
+  int32_t port;        //Where to connect back to
+  int32_t bufferLen;
+  int32_t rate;        //UDP: bits per second
+  int32_t amount;      //Bytes, or if negative the time in 10 ms units
+} IperfClientHeader;
+
+typedef struct
+{
+  int32_t flags;
+  int32_t totalHigh;
+  int32_t totalLow;
+  int32_t stopSec;
+  int32_t stopUsec;
+  int32_t errors;
+  int32_t outOfOrder;
+  int32_t datagrams;
+  int32_t jitterSec;
+  int32_t jitterUsec;
+} IperfServerReport;
+
+static inline int32_t be32(int32_t value) { return (int32_t)__builtin_bswap32((uint32_t)value); }
+
+void makeClientHeader(IperfClientHeader &header, uint32_t rate)
+{
+  header.flags = be32(IPERF_HEADER_VERSION1);
+  header.threads = be32(1);
+  header.port = be32(reversePort);
+  header.bufferLen = be32(IPERF_BUFFER_SIZE);
+  header.rate = be32(rate);
+  header.amount = be32(-(int32_t)(testSeconds * 100));
+}
+
+//Milliseconds a client header asks for
+uint32_t headerMillis(const IperfClientHeader &header)
+{
+  int32_t amount = be32(header.amount);
+
+  return (amount < 0) ? -amount * 10 : testSeconds * 1000;
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// iperf2 TCP
+
+//Write for ms milliseconds, the client header first if there is one. Returns the bytes written
+uint64_t tcpSend(Client &client, uint32_t ms, const IperfClientHeader *header)
+{
+  static uint8_t buffers[2][IPERF_BUFFER_SIZE]; //The tests and the server task can send at the same time
+  uint8_t *buffer = buffers[(&client == &net->client(CLIENT_SERVER)) ? 1 : 0];
+  uint64_t bytes = 0;
+  uint32_t start = millis();
+
+  for (int i = 0; i < IPERF_BUFFER_SIZE; i++)
+    buffer[i] = '0' + (i % 10);
+
+  if (header)
+    memcpy(buffer, header, sizeof(*header));
+
+  while (client.connected() && ((millis() - start) < ms))
+  {
+    size_t written = client.write(buffer, IPERF_BUFFER_SIZE);
+
+    if (written == 0)
+      break;
+
+    bytes += written;
+
+    if (header)
+    {
+      for (int i = 0; i < (int)sizeof(*header); i++)
+        buffer[i] = '0' + (i % 10);
+
+      header = NULL;
+    }
+  }
+
+  return bytes;
+}
+
+//Read until the peer closes or ms pass. Returns the bytes read; elapsedMs runs from the first byte to the last.
+//header, if not NULL, gets the first bytes of the stream
+uint64_t tcpSink(Client &client, uint32_t ms, uint32_t &elapsedMs, IperfClientHeader *header)
+{
+  static uint8_t buffers[2][IPERF_BUFFER_SIZE];
+  uint8_t *buffer = buffers[header ? 1 : 0]; //Only the server task passes a header
+  uint64_t bytes = 0;
+  uint32_t start = millis();
+  uint32_t first = 0;
+  uint32_t last = 0;
+
+  elapsedMs = 0;
+
+  while ((millis() - start) < ms)
+  {
+    int length = client.available() ? client.read(buffer, IPERF_BUFFER_SIZE) : 0;
+
+    if (length > 0)
+    {
+      if ((bytes == 0) && header)
+        memcpy(header, buffer, min((size_t)length, sizeof(*header)));
+
+      if (bytes == 0)
+        first = millis();
+
+      bytes += length;
+      last = millis();
+    }
+    else if (!client.connected())
+    {
+      break;
+    }
+    else
+    {
+      delay(1);
+    }
+  }
+
+  if (bytes)
+    elapsedMs = max(last - first, (uint32_t)1);
+
+  return bytes;
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// iperf2 UDP
+
+//The receiving side of a UDP test: counts, loss, reordering and jitter (RFC 1889), and the report for the sender
+class UdpSession
+{
+  public:
+    bool active;
+    bool finished;
+    IPAddress remote;
+    uint16_t remotePort;
+    IperfClientHeader header;
+    bool hasHeader;
+    uint32_t received;
+    uint64_t bytes;
+    int32_t nextId;
+    uint32_t outOfOrder;
+    uint32_t firstUs;
+    uint32_t lastUs;
+    int32_t lastTransit;
+    float jitterUs;
+
+    UdpSession() { active = false; finished = false; }
+
+    //Returns true on the sender's last datagram
+    bool add(const uint8_t *data, int length, IPAddress from, uint16_t fromPort)
+    {
+      IperfDatagram datagram;
+      uint32_t now = micros();
+
+      if (length < (int)sizeof(datagram))
+        return false;
+
+      memcpy(&datagram, data, sizeof(datagram));
+
+      int32_t id = be32(datagram.id);
+
+      if (id < 0)
+        return active || finished;
+
+      //A new test: the first datagram, or one from someone else
+      if ((!active) || (from != remote) || (fromPort != remotePort))
+      {
+        active = true;
+        finished = false;
+        remote = from;
+        remotePort = fromPort;
+        received = 0;
+        bytes = 0;
+        nextId = 0;
+        outOfOrder = 0;
+        firstUs = now;
+        jitterUs = 0;
+        lastTransit = 0;
+        hasHeader = (length >= (int)(sizeof(datagram) + sizeof(header)));
+
+        if (hasHeader)
+        {
+          memcpy(&header, data + sizeof(datagram), sizeof(header));
+          hasHeader = (be32(header.flags) & IPERF_HEADER_VERSION1) != 0;
+        }
+      }
+
+      //The sender's clock is not ours, but the offset cancels out of the jitter
+      int32_t transit = (int32_t)(now - ((uint32_t)be32(datagram.sec) * 1000000 + (uint32_t)be32(datagram.usec)));
+
+      if (received)
+      {
+        int32_t d = transit - lastTransit;
+        jitterUs += ((d < 0 ? -d : d) - jitterUs) / 16;
+      }
+
+      lastTransit = transit;
+      received++;
+      bytes += length;
+      lastUs = now;
+
+      if (id < nextId)
+        outOfOrder++;
+      else
+        nextId = id + 1;
+
+      return false;
+    }
+
+    void end()
+    {
+      if (active)
+      {
+        active = false;
+        finished = true;
+      }
+    }
+
+    float mbps()
+    {
+      uint32_t us = lastUs - firstUs;
+
+      return us ? (bytes * 8.0) / us : 0;
+    }
+
+    float lossPercent()
+    {
+      return nextId ? (100.0 * (nextId - (int32_t)min(received, (uint32_t)nextId))) / nextId : 0;
+    }
+
+    void report(IperfServerReport &report)
+    {
+      uint32_t us = lastUs - firstUs;
+
+      report.flags = be32(IPERF_HEADER_VERSION1);
+      report.totalHigh = be32((int32_t)(bytes >> 32));
+      report.totalLow = be32((int32_t)(bytes & 0xFFFFFFFF));
+      report.stopSec = be32(us / 1000000);
+      report.stopUsec = be32(us % 1000000);
+      report.errors = be32(nextId - (int32_t)min(received, (uint32_t)nextId));
+      report.outOfOrder = be32(outOfOrder);
+      report.datagrams = be32(nextId);
+      report.jitterSec = be32((int32_t)jitterUs / 1000000);
+      report.jitterUsec = be32((int32_t)jitterUs % 1000000);
+    }
+};
+
+//Reply to a last datagram with the report, as an iperf2 server does
+void sendReport(UDP &udp, UdpSession &session, const uint8_t *last)
+{
+  uint8_t reply[sizeof(IperfDatagram) + sizeof(IperfServerReport)];
+  IperfServerReport report;
+
+  session.report(report);
+  memcpy(reply, last, sizeof(IperfDatagram));
+  memcpy(reply + sizeof(IperfDatagram), &report, sizeof(report));
+  udp.beginPacket(session.remote, session.remotePort);
+  udp.write(reply, sizeof(reply));
+  udp.endPacket();
+}
+
+//Send iperf2 datagrams to ip:port for ms milliseconds at rate bits/s (0 = as fast as possible), then the last one
+//until the report comes back. Returns the datagrams sent. report is valid if gotReport
+uint32_t udpSend(UDP &udp, IPAddress ip, uint16_t port, uint32_t ms, uint32_t rate, const IperfClientHeader *header,
+                 IperfServerReport &report, bool &gotReport)
+{
+  uint8_t buffer[IPERF_BUFFER_SIZE];
+  IperfDatagram datagram;
+  int32_t id = 0;
+  uint32_t start = micros();
+  uint32_t gapUs = rate ? (uint32_t)((IPERF_BUFFER_SIZE * 8ULL * 1000000) / rate) : 0;
+  uint32_t next = start;
+
+  memset(buffer, 0, sizeof(buffer));
+
+  if (header)
+    memcpy(buffer + sizeof(datagram), header, sizeof(*header));
+
+  while ((micros() - start) < (ms * 1000))
+  {
+    if (gapUs)
+    {
+      while ((int32_t)(micros() - next) < 0)
+      {
+        if ((int32_t)(next - micros()) > 2000)
+          delay(1);
+      }
+
+      next += gapUs;
+    }
+
+    uint32_t now = micros();
+    datagram.id = be32(id);
+    datagram.sec = be32(now / 1000000);
+    datagram.usec = be32(now % 1000000);
+    memcpy(buffer, &datagram, sizeof(datagram));
+
+    udp.beginPacket(ip, port);
+    udp.write(buffer, sizeof(buffer));
+
+    if (udp.endPacket())
+      id++;
+    else
+      delay(1); //Out of buffers, let them drain
+  }
+
+  //The last datagram, up to 10 times until the report comes back
+  gotReport = false;
+  datagram.id = be32(-id);
+  memcpy(buffer, &datagram, sizeof(datagram));
+
+  for (int retry = 0; (retry < 10) && !gotReport; retry++)
+  {
+    udp.beginPacket(ip, port);
+    udp.write(buffer, sizeof(datagram));
+    udp.endPacket();
+
+    uint32_t waitStart = millis();
+
+    while ((millis() - waitStart) < 250)
+    {
+      uint8_t reply[sizeof(IperfDatagram) + sizeof(IperfServerReport)];
+
+      if ((udp.parsePacket() >= (int)sizeof(reply)) && (udp.read(reply, sizeof(reply)) == sizeof(reply)))
+      {
+        memcpy(&report, reply + sizeof(IperfDatagram), sizeof(report));
+        gotReport = true;
+        break;
+      }
+
+      delay(1);
+    }
+  }
+
+  return id;
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This board's servers: iperf2 TCP and UDP (with -r) and UDP echo.
+// With ESP32_W5500 they run in their own task, with Arduino Ethernet from loop() between tests
+
+UdpSession serverSession;
+volatile bool serversPaused = false;
+TaskHandle_t serverTask;
+
+void pollServers()
+{
+  uint8_t buffer[IPERF_BUFFER_SIZE];
+  IPAddress remote;
+
+  //UDP echo
+  UDP &echo = net->udp(UDP_ECHO);
+  int length = echo.parsePacket();
+
+  if (length > 0)
+  {
+    length = echo.read(buffer, sizeof(buffer));
+    echo.beginPacket(echo.remoteIP(), echo.remotePort());
+    echo.write(buffer, length);
+    echo.endPacket();
+  }
+
+  //iperf UDP
+  UDP &iperfUdp = net->udp(UDP_IPERF);
+
+  while ((length = iperfUdp.parsePacket()) > 0)
+  {
+    length = iperfUdp.read(buffer, sizeof(buffer));
+
+    if (!serverSession.add(buffer, length, iperfUdp.remoteIP(), iperfUdp.remotePort()))
+      continue;
+
+    bool reverse = serverSession.active && serverSession.hasHeader;
+
+    serverSession.end();
+    sendReport(iperfUdp, serverSession, buffer);
+
+    if (reverse)
+    {
+      //iperf -r: now send to the client for as long as it did
+      IperfServerReport report;
+      bool gotReport;
+      UDP &udp = net->udp(UDP_SERVER);
+
+      udp.begin(serverPort);
+      udpSend(udp, serverSession.remote, be32(serverSession.header.port), headerMillis(serverSession.header),
+              be32(serverSession.header.rate), NULL, report, gotReport);
+      udp.stop();
+    }
+  }
+
+  //iperf TCP
+  Client *client = net->accept(LISTEN_IPERF, remote);
+
+  if (client)
+  {
+    IperfClientHeader header;
+    uint32_t elapsedMs;
+
+    memset(&header, 0, sizeof(header));
+    uint64_t bytes = tcpSink(*client, 3600000, elapsedMs, &header);
+    client->stop();
+
+    Serial.printf("iperf server: %llu bytes from %s, %.2f Mbit/s\r\n", (unsigned long long)bytes, remote.toString().c_str(),
+                  elapsedMs ? (bytes * 8.0) / (elapsedMs * 1000.0) : 0.0);
+
+    if (be32(header.flags) & IPERF_HEADER_VERSION1)
+    {
+      Client &back = net->client(CLIENT_SERVER);
+
+      if (back.connect(remote, be32(header.port)))
+      {
+        tcpSend(back, headerMillis(header), NULL);
+        back.stop();
+      }
+    }
+  }
+}
+
+void serverTaskLoop(void *arg)
+{
+  while (true)
+  {
+    if ((!useArduinoEthernet) && !serversPaused)
+      pollServers();
+
+    delay(1);
+  }
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// The tests
+
+bool loopback() { return peerIP == IPAddress(127, 0, 0, 1); }
+
+void runTcp(BenchResult &result)
+{
+  CpuSample sample;
+  IperfClientHeader header;
+  IPAddress remote;
+  Client &client = net->client(CLIENT_TEST);
+
+  Serial.print("TCP TX... ");
+
+  if (!client.connect(peerIP, iperfPort))
+  {
+    Serial.printf("no iperf server at %s:%d (iperf -s)\r\n", peerIP.toString().c_str(), iperfPort);
+    return;
+  }
+
+  makeClientHeader(header, 0);
+  cpuStart(sample);
+  uint32_t start = millis();
+  uint64_t bytes = tcpSend(client, testSeconds * 1000, &header);
+  client.stop();
+  uint32_t ms = millis() - start;
+  cpuStop(sample, result.cpu[TEST_TCP_TX]);
+  result.mbps[TEST_TCP_TX] = (bytes * 8.0) / ((ms ? ms : 1) * 1000.0);
+  Serial.printf("%.2f Mbit/s\r\n", result.mbps[TEST_TCP_TX]);
+
+  //The peer connects back and sends for as long
+  Serial.print("TCP RX... ");
+  Client *reverse = NULL;
+  start = millis();
+
+  while ((!reverse) && ((millis() - start) < 3000))
+  {
+    reverse = net->accept(LISTEN_REVERSE, remote);
+    delay(1);
+  }
+
+  if (!reverse)
+  {
+    Serial.println("the peer did not connect back (an iperf2 server which does not support -r?)");
+    return;
+  }
+
+  uint32_t elapsedMs;
+  cpuStart(sample);
+  bytes = tcpSink(*reverse, testSeconds * 1000 + 5000, elapsedMs, NULL);
+  reverse->stop();
+  cpuStop(sample, result.cpu[TEST_TCP_RX]);
+
+  if (elapsedMs)
+  {
+    result.mbps[TEST_TCP_RX] = (bytes * 8.0) / (elapsedMs * 1000.0);
+    Serial.printf("%.2f Mbit/s\r\n", result.mbps[TEST_TCP_RX]);
+  }
+  else
+  {
+    Serial.println("no data");
+  }
+}
+
+void runUdp(BenchResult &result)
+{
+  CpuSample sample;
+  IperfClientHeader header;
+  IperfServerReport report;
+  bool gotReport;
+  UDP &udp = net->udp(UDP_TEST);
+
+  Serial.print("UDP TX... ");
+  udp.begin(reversePort);
+  makeClientHeader(header, udpReverseRate);
+  cpuStart(sample);
+  uint32_t start = micros();
+  uint32_t sent = udpSend(udp, peerIP, iperfPort, testSeconds * 1000, 0, &header, report, gotReport);
+  uint32_t us = micros() - start;
+  cpuStop(sample, result.cpu[TEST_UDP_TX]);
+
+  if (gotReport)
+  {
+    uint64_t total = ((uint64_t)(uint32_t)be32(report.totalHigh) << 32) | (uint32_t)be32(report.totalLow);
+    uint64_t reportUs = (uint64_t)be32(report.stopSec) * 1000000 + be32(report.stopUsec);
+    int32_t datagrams = be32(report.datagrams);
+
+    result.mbps[TEST_UDP_TX] = reportUs ? (total * 8.0) / reportUs : 0;
+    result.loss[TEST_UDP_TX] = datagrams ? (100.0 * be32(report.errors)) / datagrams : 0;
+    Serial.printf("%.2f Mbit/s received, %.2f%% lost\r\n", result.mbps[TEST_UDP_TX], result.loss[TEST_UDP_TX]);
+  }
+  else
+  {
+    //Only what was sent
+    result.mbps[TEST_UDP_TX] = (sent * (float)IPERF_BUFFER_SIZE * 8.0) / us;
+    Serial.printf("%.2f Mbit/s sent, no report from %s:%d (iperf -s -u)\r\n", result.mbps[TEST_UDP_TX],
+                  peerIP.toString().c_str(), iperfPort);
+
+    if (sent == 0)
+      result.mbps[TEST_UDP_TX] = -1;
+  }
+
+  //The peer sends back for as long, at udpReverseRate
+  Serial.print("UDP RX... ");
+  UdpSession session;
+  uint8_t buffer[IPERF_BUFFER_SIZE];
+  bool done = false;
+  start = millis();
+  uint32_t lastData = 0;
+
+  cpuStart(sample);
+
+  while (!done)
+  {
+    int length = udp.parsePacket();
+
+    if (length > 0)
+    {
+      length = udp.read(buffer, sizeof(buffer));
+      lastData = millis();
+
+      if (session.add(buffer, length, udp.remoteIP(), udp.remotePort()))
+      {
+        session.end();
+        sendReport(udp, session, buffer);
+        done = true;
+      }
+    }
+    else if (lastData ? ((millis() - lastData) > 2000) : ((millis() - start) > 3000))
+    {
+      //The last datagram was lost, or nothing came at all
+      session.end();
+      done = true;
+    }
+    else
+    {
+      delay(1);
+    }
+  }
+
+  cpuStop(sample, result.cpu[TEST_UDP_RX]);
+  udp.stop();
+
+  if (session.finished && session.received)
+  {
+    result.mbps[TEST_UDP_RX] = session.mbps();
+    result.loss[TEST_UDP_RX] = session.lossPercent();
+    Serial.printf("%.2f Mbit/s, %.2f%% lost, %lu out of order\r\n", result.mbps[TEST_UDP_RX], result.loss[TEST_UDP_RX],
+                  (unsigned long)session.outOfOrder);
+  }
+  else
+  {
+    Serial.println("the peer did not send back (an iperf2 server which does not support -r?)");
+  }
+}
+
+int compareRtt(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+void runPing(BenchResult &result)
+{
+  CpuSample sample;
+  UDP &udp = net->udp(UDP_TEST);
+  uint32_t *rtt = (uint32_t *)malloc(pingCount * sizeof(uint32_t));
+  uint32_t count = 0;
+  uint8_t probe[32];
+
+  Serial.print("RTT... ");
+
+  if (!rtt)
+  {
+    Serial.println("no memory");
+    return;
+  }
+
+  memset(probe, 0, sizeof(probe));
+  udp.begin(reversePort);
+  cpuStart(sample);
+
+  for (uint32_t seq = 0; seq < pingCount; seq++)
+  {
+    uint32_t start = micros();
+
+    memcpy(probe, &seq, sizeof(seq));
+    udp.beginPacket(peerIP, echoPort);
+    udp.write(probe, sizeof(probe));
+    udp.endPacket();
+
+    while ((micros() - start) < 100000)
+    {
+      uint8_t reply[sizeof(probe)];
+      uint32_t replySeq;
+
+      if ((udp.parsePacket() > 0) && (udp.read(reply, sizeof(reply)) >= (int)sizeof(replySeq)))
+      {
+        memcpy(&replySeq, reply, sizeof(replySeq));
+
+        //Late replies to earlier probes are skipped
+        if (replySeq == seq)
+        {
+          rtt[count++] = micros() - start;
+          break;
+        }
+      }
+    }
+
+    delay(2);
+  }
+
+  cpuStop(sample, result.cpu[TEST_PING]);
+  udp.stop();
+  result.pingLost = pingCount - count;
+
+  if (count)
+  {
+    qsort(rtt, count, sizeof(rtt[0]), compareRtt);
+    result.rtt[0] = rtt[(count * 50) / 100];
+    result.rtt[1] = rtt[(count * 90) / 100];
+    result.rtt[2] = rtt[(count * 99) / 100];
+    result.rtt[3] = rtt[count - 1];
+    Serial.printf("%lu / %lu / %lu / %lu us (p50 / p90 / p99 / max), %lu lost\r\n", (unsigned long)result.rtt[0],
+                  (unsigned long)result.rtt[1], (unsigned long)result.rtt[2], (unsigned long)result.rtt[3],
+                  (unsigned long)result.pingLost);
+  }
+  else
+  {
+    Serial.printf("no echo from %s:%d\r\n", peerIP.toString().c_str(), echoPort);
+  }
+
+  free(rtt);
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// HTTP: /bench answers with a few bytes. The AsyncWebServer counts them with ESP32_W5500,
+// serveArduinoEthernet with Arduino Ethernet
+
+volatile uint32_t httpRequests = 0;
+const char benchReply[] = "ok\n";
+
+void serveArduinoEthernet()
+{
+  IPAddress remote;
+  Client *client = net->accept(LISTEN_HTTP, remote);
+
+  if (!client)
+    return;
+
+  //Read up to the blank line at the end of the request
+  bool currentLineIsBlank = true;
+  uint32_t start = millis();
+
+  while (client->connected() && ((millis() - start) < 1000))
+  {
+    if (!client->available())
+      continue;
+
+    char c = client->read();
+
+    if (c == '\n' && currentLineIsBlank)
+    {
+      client->print("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 3\r\nConnection: close\r\n\r\n");
+      client->print(benchReply);
+      httpRequests++;
+      break;
+    }
+
+    if (c == '\n')
+      currentLineIsBlank = true;
+    else if (c != '\r')
+      currentLineIsBlank = false;
+  }
+
+  client->stop();
+}
+
+//One request to our own /bench, over the loopback interface
+bool httpGetLoopback()
+{
+  Client &client = net->client(CLIENT_TEST);
+
+  if (!client.connect(peerIP, 80))
+    return false;
+
+  client.print("GET /bench HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n");
+
+  uint32_t start = millis();
+
+  while (client.connected() && ((millis() - start) < 1000))
+  {
+    if (client.available())
+      client.read();
+  }
+
+  client.stop();
+
+  return true;
+}
+
+void runHttp(BenchResult &result)
+{
+  CpuSample sample;
+  IPAddress ip = useArduinoEthernet ? Ethernet.localIP() : ETH.localIP();
+
+  Serial.print("HTTP... ");
+
+  if (loopback() && !useArduinoEthernet)
+  {
+    cpuStart(sample);
+    uint32_t before = httpRequests;
+    uint32_t start = millis();
+
+    while ((millis() - start) < (testSeconds * 1000))
+    {
+      if (!httpGetLoopback())
+        break;
+    }
+
+    uint32_t ms = millis() - start;
+    cpuStop(sample, result.cpu[TEST_HTTP]);
+    result.httpRate = ((httpRequests - before) * 1000.0) / (ms ? ms : 1);
+    Serial.printf("%.1f requests/s\r\n", result.httpRate);
+    return;
+  }
+
+  if (httpWaitSeconds == 0)
+  {
+    Serial.println("skipped");
+    return;
+  }
+
+  //The peer makes the load. Time from its first request until it stops for a second
+  Serial.printf("run ab -n 2000 -c 4 http://%s/bench on the peer now\r\n", ip.toString().c_str());
+
+  uint32_t before = httpRequests;
+  uint32_t start = millis();
+
+  while ((httpRequests == before) && ((millis() - start) < (httpWaitSeconds * 1000)))
+  {
+    if (useArduinoEthernet)
+      serveArduinoEthernet();
+    else
+      delay(1);
+  }
+
+  if (httpRequests == before)
+  {
+    Serial.println("HTTP: no requests, skipped");
+    return;
+  }
+
+  cpuStart(sample);
+  uint32_t first = millis();
+  uint32_t last = first;
+  uint32_t seen = httpRequests;
+
+  while ((millis() - last) < 1000)
+  {
+    if (useArduinoEthernet)
+      serveArduinoEthernet();
+    else
+      delay(1);
+
+    if (httpRequests != seen)
+    {
+      seen = httpRequests;
+      last = millis();
+    }
+  }
+
+  cpuStop(sample, result.cpu[TEST_HTTP]);
+  result.httpRate = ((seen - before) * 1000.0) / ((last > first) ? (last - first) : 1);
+  Serial.printf("HTTP: %lu requests, %.1f requests/s\r\n", (unsigned long)(seen - before), result.httpRate);
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//The whole workload in the current mode, into the next row of the table
+void runWorkload()
+{
+  if (resultCount >= (int)MAX_RESULTS)
+  {
+    Serial.println("The table is full, press c to clear it");
+    return;
+  }
+
+  if (useArduinoEthernet && loopback())
+  {
+    Serial.println("Arduino Ethernet has no loopback interface, set peerIP to another machine");
+    return;
+  }
+
+  BenchResult &result = results[resultCount++];
+
+  memset(&result, 0, sizeof(result));
+  result.mode = net->name();
+  result.spiMHz = useArduinoEthernet ? 14 : spiClockMHz;
+  result.httpRate = -1;
+
+  for (int i = 0; i < TEST_COUNT; i++)
+  {
+    result.mbps[i] = -1;
+    result.loss[i] = -1;
+
+    for (int j = 0; j < portNUM_PROCESSORS; j++)
+      result.cpu[i][j] = -1;
+  }
+
+  Serial.printf("%s, SPI %d MHz, peer %s\r\n", result.mode, result.spiMHz, peerIP.toString().c_str());
+
+  //Our own servers answer the loopback tests. Otherwise they would only take CPU time
+  serversPaused = !loopback();
+
+  runTcp(result);
+  runUdp(result);
+  runPing(result);
+  runHttp(result);
+
+  serversPaused = false;
+  Serial.println();
+}
+
+void printTable()
+{
+  Serial.println();
+  Serial.println("Mbit/s (UDP: % lost), round trip in us, HTTP requests/s");
+  Serial.println("Mode              SPI   TCP TX  TCP RX  UDP TX         UDP RX         RTT p50/p90/p99/max       HTTP");
+
+  for (int i = 0; i < resultCount; i++)
+  {
+    BenchResult &r = results[i];
+    char cell[TEST_COUNT][32];
+
+    for (int t = TEST_TCP_TX; t <= TEST_UDP_RX; t++)
+    {
+      if (r.mbps[t] < 0)
+        snprintf(cell[t], sizeof(cell[t]), "-");
+      else if (r.loss[t] < 0)
+        snprintf(cell[t], sizeof(cell[t]), "%.2f", r.mbps[t]);
+      else
+        snprintf(cell[t], sizeof(cell[t]), "%.2f (%.1f%%)", r.mbps[t], r.loss[t]);
+    }
+
+    if (r.rtt[3])
+      snprintf(cell[TEST_PING], sizeof(cell[TEST_PING]), "%lu/%lu/%lu/%lu", (unsigned long)r.rtt[0],
+               (unsigned long)r.rtt[1], (unsigned long)r.rtt[2], (unsigned long)r.rtt[3]);
+    else
+      snprintf(cell[TEST_PING], sizeof(cell[TEST_PING]), "-");
+
+    if (r.httpRate < 0)
+      snprintf(cell[TEST_HTTP], sizeof(cell[TEST_HTTP]), "-");
+    else
+      snprintf(cell[TEST_HTTP], sizeof(cell[TEST_HTTP]), "%.1f", r.httpRate);
+
+    Serial.printf("%-17s %3d   %-7s %-7s %-14s %-14s %-25s %s\r\n", r.mode, r.spiMHz, cell[TEST_TCP_TX],
+                  cell[TEST_TCP_RX], cell[TEST_UDP_TX], cell[TEST_UDP_RX], cell[TEST_PING], cell[TEST_HTTP]);
+  }
+
+  Serial.println();
+  Serial.printf("CPU load %% during each test (%s)\r\n", (portNUM_PROCESSORS > 1) ? "core 0 / core 1" : "core 0");
+  Serial.print("Mode              SPI ");
+
+  for (int t = 0; t < TEST_COUNT; t++)
+    Serial.printf("  %-9s", testNames[t]);
+
+  Serial.println();
+
+  for (int i = 0; i < resultCount; i++)
+  {
+    BenchResult &r = results[i];
+
+    Serial.printf("%-17s %3d ", r.mode, r.spiMHz);
+
+    for (int t = 0; t < TEST_COUNT; t++)
+    {
+      char cell[16];
+
+      if (r.cpu[t][0] < 0)
+        snprintf(cell, sizeof(cell), "-");
+#if portNUM_PROCESSORS > 1
+      else
+        snprintf(cell, sizeof(cell), "%.0f/%.0f", r.cpu[t][0], r.cpu[t][1]);
+#else
+      else
+        snprintf(cell, sizeof(cell), "%.0f", r.cpu[t][0]);
+#endif
+
+      Serial.printf("  %-9s", cell);
+    }
+
+    Serial.println();
+  }
+
+  Serial.println();
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+void setup()
+{
+  //Set up the W5500 Chip Select
+  pinMode(pin_W5500_CS, OUTPUT);
+  digitalWrite(pin_W5500_CS, HIGH);
+
+  //Set up the W5500 interrupt pin
+  pinMode(pin_W5500_INT, INPUT_PULLUP);
+
+  //Check if the board has a power enable pin. Configure it if required
+  if (pin_POWER_CONTROL >= 0)
+  {
+    pinMode(pin_POWER_CONTROL, OUTPUT);
+    digitalWrite(pin_POWER_CONTROL, HIGH);
+  }
+
+  delay(1000);
+
+  Serial.begin(115200);
+  Serial.println("SparkFun WebServer ESP32 W5500 Network Benchmark");
+
+  //Empty the serial buffer
+  while (Serial.available())
+    Serial.read();
+
+  //Must be called before ETH.begin()
+  ESP32_W5500_onEvent();
+
+  startESP32_W5500(spiClocksMHz[(sizeof(spiClocksMHz) / sizeof(spiClocksMHz[0])) - 1]);
+
+  asyncWebServer = new AsyncWebServer(80); //Instantiate the web server. Use port 80
+
+  asyncWebServer->on("/bench", HTTP_GET, [](AsyncWebServerRequest *request){
+    httpRequests++;
+    request->send(200, "text/plain", benchReply);
+    });
+
+  asyncWebServer->on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request){
+    AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+    ETH.printMetrics(*response); //Driver counters in the Prometheus text format
+    request->send(response);
+    });
+
+  asyncWebServer->begin();
+
+  esp32Net.begin();
+  xTaskCreate(serverTaskLoop, "bench_srv", 6144, NULL, 1, &serverTask);
+
+  Serial.println("Measuring the idle CPU...");
+  calibrateCPU();
+
+  printMenu();
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+void printMenu()
+{
+  Serial.println();
+  Serial.println("a: run the workload at every SPI clock with ESP32_W5500, then with Arduino Ethernet");
+  Serial.println("r: run the workload once in the current mode");
+  Serial.println("m: change modes");
+  Serial.println("t: print the table");
+  Serial.println("c: clear the table");
+  Serial.println();
+}
+
+void loop()
+{
+  //ESP32_W5500's servers have their own task
+  if (useArduinoEthernet)
+  {
+    pollServers();
+    serveArduinoEthernet();
+  }
+
+  if (Serial.available())
+  {
+    char c = Serial.read();
+
+    while (Serial.available())
+      Serial.read();
+
+    switch (c)
+    {
+      case 'a':
+        if (useArduinoEthernet)
+          changeToESP32_W5500();
+
+        for (size_t i = 0; i < sizeof(spiClocksMHz) / sizeof(spiClocksMHz[0]); i++)
+        {
+          if (spiClocksMHz[i] != spiClockMHz)
+          {
+            ETH.end();
+            startESP32_W5500(spiClocksMHz[i]);
+          }
+
+          runWorkload();
+        }
+
+        if (!loopback())
+        {
+          changeToArduinoEthernet();
+          runWorkload();
+          changeToESP32_W5500();
+        }
+
+        printTable();
+        break;
+
+      case 'r':
+        runWorkload();
+        printTable();
+        break;
+
+      case 'm':
+        if (!useArduinoEthernet)
+          changeToArduinoEthernet();
+        else
+          changeToESP32_W5500();
+
+        break;
+
+      case 't':
+        printTable();
+        break;
+
+      case 'c':
+        resultCount = 0;
+        break;
+
+      default:
+        printMenu();
+        break;
+    }
+  }
+
+  delay(1);
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+void startESP32_W5500(int mhz)
+{
+  ESP32_W5500_Config config = ESP32_W5500_DEFAULT_CONFIG(pin_POCI, pin_PICO, pin_SCK, pin_W5500_CS, pin_W5500_INT);
+  config.spiClockMHz = mhz;
+
+  //Start the ethernet connection
+  if (!ETH.begin(config))
+  {
+    Serial.println("ETH.begin failed");
+    return;
+  }
+
+  spiClockMHz = mhz;
+  ESP32_W5500_waitForConnect();
+
+  Serial.printf("Using ESP32_W5500 at %d MHz. My IP address: %s\r\n", mhz, ETH.localIP().toString().c_str());
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+void changeToArduinoEthernet()
+{
+  //Remember the address so Arduino Ethernet can use it without a DHCP round trip
+  IPAddress ip = ETH.localIP();
+  IPAddress dns = ETH.dnsIP();
+  IPAddress gateway = ETH.gatewayIP();
+  IPAddress subnet = ETH.subnetMask();
+
+  //Hand the SPI bus, interrupt pin and ISR service over. The server task sees useArduinoEthernet and stops
+  useArduinoEthernet = true;
+  delay(10);
+
+  if (!ETH.detach())
+  {
+    Serial.println("ETH.detach failed");
+    useArduinoEthernet = false;
+    return;
+  }
+
+  SPI.begin(pin_SCK, pin_POCI, pin_PICO);
+
+  Ethernet.init(pin_W5500_CS); //Set the chip select pin
+
+  //Get MAC address
+  uint8_t ethernetMACAddress[6];
+  esp_read_mac(ethernetMACAddress, ESP_MAC_WIFI_STA);
+  ethernetMACAddress[5] += 3; //Convert WiFi MAC address to Ethernet MAC (add 3)
+
+  Ethernet.begin(ethernetMACAddress, ip, dns, gateway, subnet); //Use the address ESP32_W5500 had
+
+  if (Ethernet.hardwareStatus() == EthernetNoHardware)
+  {
+    Serial.println("W5500 was not found.  Sorry, can't run without hardware. :(");
+    while (true)
+    {
+      delay(1); // do nothing, no point running without Ethernet hardware
+    }
+  }
+
+  net = &arduinoNet;
+  net->begin();
+
+  Serial.printf("Using Arduino Ethernet. My IP address: %s\r\n", Ethernet.localIP().toString().c_str());
+}
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+void changeToESP32_W5500()
+{
+  SPI.end(); //Release the SPI bus so ESP32_W5500 can take it back
+
+  if (!ETH.attach())
+  {
+    Serial.println("ETH.attach failed");
+    return;
+  }
+
+  net = &esp32Net;
+  useArduinoEthernet = false;
+
+  //The lease was kept. Wait for DHCP to confirm it (INIT-REBOOT)
+  ETH.waitForIP(5000);
+
+  Serial.printf("Using ESP32_W5500 at %d MHz. My IP address: %s\r\n", spiClockMHz, ETH.localIP().toString().c_str());
+}
@@ -0,0 +1,612 @@
+/****************************************************************************************************************************
+  host_idf.c
+
+  The parts of FreeRTOS and ESP-IDF the W5500 driver uses, on POSIX threads, for the host build. See Makefile
+
+  Tasks are threads with a notification count. Priorities and core affinity are ignored. Every portMUX critical
+  section and vTaskSuspendAll is one process-wide recursive mutex. SPI transactions and the INT pin go to the
+  simulated chip in w5500_sim.c
+ *****************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_sys.h"
+#include "esp_rom_gpio.h"
+#include "hal/cpu_hal.h"
+#include "driver/gpio.h"
+#include "driver/spi_master.h"
+#include "w5500_sim.h"
+#include "host_idf.h"
+
+////////////////////////////////////////
+
+static uint64_t host_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Absolute CLOCK_REALTIME deadline for pthread_cond_timedwait, ticks from now
+static struct timespec host_deadline(TickType_t ticks)
+{
+  struct timespec ts;
+  uint64_t ns = (uint64_t) ticks * (1000000000ULL / CONFIG_FREERTOS_HZ);
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ns += ts.tv_nsec;
+  ts.tv_sec += ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+
+  return ts;
+}
+
+////////////////////////////////////////
+// Critical sections
+////////////////////////////////////////
+
+static pthread_mutex_t s_critical;
+static pthread_once_t s_critical_once = PTHREAD_ONCE_INIT;
+
+static void host_critical_init(void)
+{
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&s_critical, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+void vPortEnterCritical(portMUX_TYPE *mux)
+{
+  (void) mux;
+  pthread_once(&s_critical_once, host_critical_init);
+  pthread_mutex_lock(&s_critical);
+}
+
+void vPortExitCritical(portMUX_TYPE *mux)
+{
+  (void) mux;
+  pthread_mutex_unlock(&s_critical);
+}
+
+void vPortYieldFromISR(void)
+{
+}
+
+void vTaskSuspendAll(void)
+{
+  vPortEnterCritical(NULL);
+}
+
+BaseType_t xTaskResumeAll(void)
+{
+  vPortExitCritical(NULL);
+
+  return pdFALSE;
+}
+
+////////////////////////////////////////
+// Tasks
+////////////////////////////////////////
+
+struct tskTaskControlBlock
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t notify;
+  bool waiting;                         // In ulTaskNotifyTake
+  char name[16];
+  TaskFunction_t fn;
+  void *arg;
+  struct tskTaskControlBlock *next;     // All tasks made by xTaskCreate, newest first
+};
+
+static __thread TaskHandle_t s_current;
+static TaskHandle_t s_tasks;
+static pthread_mutex_t s_tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static TaskHandle_t host_task_new(void)
+{
+  TaskHandle_t task = calloc(1, sizeof(*task));
+
+  if (task)
+  {
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->cond, NULL);
+  }
+
+  return task;
+}
+
+static void *host_task_main(void *arg)
+{
+  TaskHandle_t task = arg;
+
+  s_current = task;
+  task->fn(task->arg);
+
+  // A FreeRTOS task must not return; treat it as vTaskDelete(NULL)
+  return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio,
+                                   TaskHandle_t *handle, BaseType_t core)
+{
+  (void) stack;
+  (void) prio;
+  (void) core;
+
+  TaskHandle_t task = host_task_new();
+
+  if (!task)
+    return pdFAIL;
+
+  task->fn = fn;
+  task->arg = arg;
+  snprintf(task->name, sizeof(task->name), "%s", name);
+
+  if (pthread_create(&task->thread, NULL, host_task_main, task) != 0)
+  {
+    free(task);
+    return pdFAIL;
+  }
+
+  pthread_detach(task->thread);
+
+  pthread_mutex_lock(&s_tasks_lock);
+  task->next = s_tasks;
+  s_tasks = task;
+  pthread_mutex_unlock(&s_tasks_lock);
+
+  if (handle)
+    *handle = task;
+
+  return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                           UBaseType_t prio, StackType_t *stack_buffer, StaticTask_t *task_buffer,
+                                           BaseType_t core)
+{
+  (void) stack_buffer;
+  (void) task_buffer;
+
+  TaskHandle_t task = NULL;
+
+  xTaskCreatePinnedToCore(fn, name, stack, arg, prio, &task, core);
+
+  return task;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+  // The main thread, and any thread not made by xTaskCreate, gets a handle on first use
+  if (!s_current)
+  {
+    s_current = host_task_new();
+    s_current->thread = pthread_self();
+  }
+
+  return s_current;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+  // Blocked tasks wait in pthread_cond_timedwait or nanosleep, both cancellation points.
+  // The handle is leaked: another thread may still be about to notify it
+  if (!task || (task == s_current))
+    pthread_exit(NULL);
+
+  pthread_cancel(task->thread);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  uint64_t ns = (uint64_t) ticks * (1000000000ULL / CONFIG_FREERTOS_HZ);
+  struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+
+  nanosleep(&ts, NULL);
+}
+
+void taskYIELD(void)
+{
+  sched_yield();
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+  return host_now_ns() / (1000000000ULL / CONFIG_FREERTOS_HZ);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait)
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  struct timespec deadline = host_deadline(wait);
+  uint32_t value;
+
+  pthread_mutex_lock(&task->lock);
+  task->waiting = true;
+
+  while (!task->notify && wait)
+  {
+    if (wait == portMAX_DELAY)
+      pthread_cond_wait(&task->cond, &task->lock);
+    else if (pthread_cond_timedwait(&task->cond, &task->lock, &deadline) != 0)
+      break;
+  }
+
+  task->waiting = false;
+  value = task->notify;
+
+  if (value)
+    task->notify = clear ? 0 : value - 1;
+
+  pthread_mutex_unlock(&task->lock);
+
+  return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  pthread_mutex_lock(&task->lock);
+  task->notify++;
+  pthread_cond_signal(&task->cond);
+  pthread_mutex_unlock(&task->lock);
+
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken)
+{
+  xTaskNotifyGive(task);
+
+  if (woken)
+    *woken = pdFALSE;
+}
+
+bool host_task_idle(const char *name)
+{
+  bool idle = false;
+
+  pthread_mutex_lock(&s_tasks_lock);
+
+  for (TaskHandle_t task = s_tasks; task; task = task->next)
+  {
+    if (strcmp(task->name, name) == 0)
+    {
+      pthread_mutex_lock(&task->lock);
+      idle = task->waiting && !task->notify;
+      pthread_mutex_unlock(&task->lock);
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&s_tasks_lock);
+
+  return idle;
+}
+
+////////////////////////////////////////
+// Semaphores
+////////////////////////////////////////
+
+struct QueueDefinition
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t count;
+};
+
+static SemaphoreHandle_t host_semaphore_new(uint32_t count)
+{
+  SemaphoreHandle_t semaphore = calloc(1, sizeof(*semaphore));
+
+  if (semaphore)
+  {
+    pthread_mutex_init(&semaphore->lock, NULL);
+    pthread_cond_init(&semaphore->cond, NULL);
+    semaphore->count = count;
+  }
+
+  return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+  return host_semaphore_new(1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer)
+{
+  (void) buffer;
+
+  return host_semaphore_new(1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+  return host_semaphore_new(0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buffer)
+{
+  (void) buffer;
+
+  return host_semaphore_new(0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t wait)
+{
+  struct timespec deadline = host_deadline(wait);
+  BaseType_t taken;
+
+  pthread_mutex_lock(&semaphore->lock);
+
+  while (!semaphore->count && wait)
+  {
+    if (wait == portMAX_DELAY)
+      pthread_cond_wait(&semaphore->cond, &semaphore->lock);
+    else if (pthread_cond_timedwait(&semaphore->cond, &semaphore->lock, &deadline) != 0)
+      break;
+  }
+
+  taken = semaphore->count ? pdTRUE : pdFALSE;
+
+  if (taken)
+    semaphore->count--;
+
+  pthread_mutex_unlock(&semaphore->lock);
+
+  return taken;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+  BaseType_t given = pdFALSE;
+
+  pthread_mutex_lock(&semaphore->lock);
+
+  if (!semaphore->count)
+  {
+    semaphore->count = 1;
+    pthread_cond_signal(&semaphore->cond);
+    given = pdTRUE;
+  }
+
+  pthread_mutex_unlock(&semaphore->lock);
+
+  return given;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+  if (semaphore)
+  {
+    pthread_cond_destroy(&semaphore->cond);
+    pthread_mutex_destroy(&semaphore->lock);
+    free(semaphore);
+  }
+}
+
+////////////////////////////////////////
+// Log, time, heap, random
+////////////////////////////////////////
+
+static esp_log_level_t s_log_level = ESP_LOG_WARN;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+  (void) tag;
+  s_log_level = level;
+}
+
+uint32_t esp_log_timestamp(void)
+{
+  return host_now_ns() / 1000000;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+  static const char letter[] = "NEWIDV";
+  va_list args;
+
+  if ((level > s_log_level) || (level == ESP_LOG_NONE))
+    return;
+
+  fprintf(stderr, "%c (%u) %s: ", letter[level], (unsigned) esp_log_timestamp(), tag);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+int64_t esp_timer_get_time(void)
+{
+  return host_now_ns() / 1000;
+}
+
+void esp_rom_delay_us(uint32_t us)
+{
+  struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+
+  nanosleep(&ts, NULL);
+}
+
+int cpu_hal_get_core_id(void)
+{
+  return 0;
+}
+
+uint32_t cpu_hal_get_cycle_count(void)
+{
+  return host_now_ns() * 240 / 1000;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+  (void) caps;
+
+  return malloc(size);
+}
+
+void heap_caps_free(void *ptr)
+{
+  free(ptr);
+}
+
+uint32_t esp_random(void)
+{
+  return ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+}
+
+////////////////////////////////////////
+// GPIO: only the INT pin, which is the simulated chip's
+////////////////////////////////////////
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+  (void) intr_alloc_flags;
+
+  return ESP_OK;
+}
+
+void gpio_uninstall_isr_service(void)
+{
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void *args)
+{
+  (void) gpio_num;
+  w5500_sim_set_isr(isr_handler, args);
+
+  return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t gpio_num)
+{
+  (void) gpio_num;
+  w5500_sim_set_isr(NULL, NULL);
+
+  return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+  (void) gpio_num;
+
+  return w5500_sim_int_level();
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+  (void) gpio_num;
+  (void) mode;
+
+  return ESP_OK;
+}
+
+esp_err_t gpio_set_pull_mode(gpio_num_t gpio_num, gpio_pull_mode_t pull)
+{
+  (void) gpio_num;
+  (void) pull;
+
+  return ESP_OK;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+{
+  (void) gpio_num;
+  (void) intr_type;
+
+  return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t gpio_num)
+{
+  (void) gpio_num;
+
+  return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+  (void) gpio_num;
+  (void) level;
+
+  return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t gpio_num)
+{
+  (void) gpio_num;
+
+  return ESP_OK;
+}
+
+void esp_rom_gpio_pad_select_gpio(uint32_t iopad_num)
+{
+  (void) iopad_num;
+}
+
+////////////////////////////////////////
+// SPI: one device, the simulated chip
+////////////////////////////////////////
+
+esp_err_t spi_bus_initialize(spi_host_device_t host_id, const spi_bus_config_t *bus_config, spi_common_dma_t dma_chan)
+{
+  (void) host_id;
+  (void) bus_config;
+  (void) dma_chan;
+
+  return ESP_OK;
+}
+
+esp_err_t spi_bus_free(spi_host_device_t host_id)
+{
+  (void) host_id;
+
+  return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host_id, const spi_device_interface_config_t *dev_config,
+                             spi_device_handle_t *handle)
+{
+  (void) host_id;
+  (void) dev_config;
+
+  // Any non-NULL handle will do
+  *handle = (spi_device_handle_t) &s_critical;
+
+  return ESP_OK;
+}
+
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle)
+{
+  (void) handle;
+
+  return ESP_OK;
+}
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *trans_desc)
+{
+  (void) handle;
+
+  return w5500_sim_transfer(trans_desc);
+}
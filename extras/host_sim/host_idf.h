@@ -0,0 +1,13 @@
+/****************************************************************************************************************************
+  host_idf.h
+
+  What the host build's FreeRTOS adds for the benchmark, see host_idf.c
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+
+// True while the task called name is blocked in ulTaskNotifyTake with nothing pending,
+// i.e. done with everything it was told about
+bool host_task_idle(const char *name);
@@ -0,0 +1,7 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile
+
+#pragma once
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define EXT_RAM_ATTR
@@ -0,0 +1,7 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile
+
+#pragma once
+
+#include "esp_eth_com.h"
+#include "esp_eth_mac.h"
+#include "esp_eth_phy.h"
@@ -0,0 +1,53 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile. The parts of ESP-IDF 4.4's esp_eth the driver uses
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifndef __containerof
+  #define __containerof(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+#define ETH_MAX_PACKET_SIZE           1536
+#define ETH_ADDR_LEN                  6
+
+typedef enum
+{
+  ETH_STATE_LLINIT,
+  ETH_STATE_DEINIT,
+  ETH_STATE_LINK,
+  ETH_STATE_SPEED,
+  ETH_STATE_DUPLEX,
+  ETH_STATE_PAUSE
+} esp_eth_state_t;
+
+typedef enum
+{
+  ETH_LINK_UP,
+  ETH_LINK_DOWN
+} eth_link_t;
+
+typedef enum
+{
+  ETH_SPEED_10M,
+  ETH_SPEED_100M
+} eth_speed_t;
+
+typedef enum
+{
+  ETH_DUPLEX_HALF,
+  ETH_DUPLEX_FULL
+} eth_duplex_t;
+
+typedef struct esp_eth_mediator_s esp_eth_mediator_t;
+
+struct esp_eth_mediator_s
+{
+  esp_err_t (*phy_reg_read)(esp_eth_mediator_t *eth, uint32_t phy_addr, uint32_t phy_reg, uint32_t *reg_value);
+  esp_err_t (*phy_reg_write)(esp_eth_mediator_t *eth, uint32_t phy_addr, uint32_t phy_reg, uint32_t reg_value);
+  esp_err_t (*stack_input)(esp_eth_mediator_t *eth, uint8_t *buffer, uint32_t length);
+  esp_err_t (*on_state_changed)(esp_eth_mediator_t *eth, esp_eth_state_t state, void *args);
+};
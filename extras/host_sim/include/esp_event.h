@@ -0,0 +1,5 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile. Included but not used by the driver
+
+#pragma once
+
+#include "esp_err.h"
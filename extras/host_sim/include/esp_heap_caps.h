@@ -0,0 +1,14 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile. Every capability is plain malloc
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT               (1 << 2)
+#define MALLOC_CAP_DMA                (1 << 3)
+#define MALLOC_CAP_SPIRAM             (1 << 10)
+#define MALLOC_CAP_INTERNAL           (1 << 11)
+
+void *heap_caps_malloc(size_t size, uint32_t caps);
+void heap_caps_free(void *ptr);
@@ -0,0 +1,5 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile
+
+#pragma once
+
+#define ESP_INTR_FLAG_IRAM            (1 << 10)
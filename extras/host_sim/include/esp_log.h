@@ -0,0 +1,36 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile
+
+#pragma once
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+typedef enum
+{
+  ESP_LOG_NONE,
+  ESP_LOG_ERROR,
+  ESP_LOG_WARN,
+  ESP_LOG_INFO,
+  ESP_LOG_DEBUG,
+  ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+#ifndef LOG_LOCAL_LEVEL
+  #define LOG_LOCAL_LEVEL             CONFIG_LOG_DEFAULT_LEVEL
+#endif
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+  __attribute__((format(printf, 3, 4)));
+uint32_t esp_log_timestamp(void);
+
+// Messages above this level are not printed. Default ESP_LOG_WARN
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+
+#define ESP_LOG_LEVEL_LOCAL(level, tag, format, ...) \
+  do { if (LOG_LOCAL_LEVEL >= (level)) esp_log_write((level), (tag), format, ##__VA_ARGS__); } while (0)
+
+#define ESP_LOGE(tag, format, ...)    ESP_LOG_LEVEL_LOCAL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)    ESP_LOG_LEVEL_LOCAL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)    ESP_LOG_LEVEL_LOCAL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)    ESP_LOG_LEVEL_LOCAL(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)    ESP_LOG_LEVEL_LOCAL(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
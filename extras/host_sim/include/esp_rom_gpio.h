@@ -0,0 +1,7 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile
+
+#pragma once
+
+#include <stdint.h>
+
+void esp_rom_gpio_pad_select_gpio(uint32_t iopad_num);
@@ -0,0 +1,7 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile
+
+#pragma once
+
+#include <stdint.h>
+
+void esp_rom_delay_us(uint32_t us);
@@ -0,0 +1,8 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+uint32_t esp_random(void);
@@ -0,0 +1,7 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile
+
+#pragma once
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
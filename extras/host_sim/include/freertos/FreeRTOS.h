@@ -0,0 +1,46 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile. FreeRTOS on POSIX threads:
+// tasks are threads, and every portMUX critical section is one process-wide recursive mutex
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint32_t StackType_t;
+
+#define pdTRUE                        1
+#define pdFALSE                       0
+#define pdPASS                        1
+#define pdFAIL                        0
+#define portMAX_DELAY                 0xFFFFFFFFUL
+#define portTICK_PERIOD_MS            (1000 / CONFIG_FREERTOS_HZ)
+#define pdMS_TO_TICKS(ms)             ((TickType_t)(((uint64_t)(ms) * CONFIG_FREERTOS_HZ) / 1000))
+#define tskNO_AFFINITY                0x7FFFFFFF
+
+typedef struct
+{
+  uint32_t owner;
+  uint32_t count;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED  { 0, 0 }
+#define portMUX_INITIALIZE(mux)       do { (mux)->owner = 0; (mux)->count = 0; } while (0)
+
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+void vPortYieldFromISR(void);
+
+#define portENTER_CRITICAL(mux)       vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux)        vPortExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux)   vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux)    vPortExitCritical(mux)
+#define portYIELD_FROM_ISR()          vPortYieldFromISR()
+
+// Only their size matters: the host objects are allocated separately
+typedef struct { uint8_t dummy[352]; } StaticTask_t;
+typedef struct { uint8_t dummy[84]; } StaticSemaphore_t;
@@ -0,0 +1,8 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile. Cycles of a 240 MHz core, from the host clock
+
+#pragma once
+
+#include <stdint.h>
+
+int cpu_hal_get_core_id(void);
+uint32_t cpu_hal_get_cycle_count(void);
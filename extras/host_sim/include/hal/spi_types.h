@@ -0,0 +1,11 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile
+
+#pragma once
+
+typedef enum
+{
+  SPI1_HOST = 0,
+  SPI2_HOST = 1,
+  SPI3_HOST = 2,
+  SPI_HOST_MAX = 3
+} spi_host_device_t;
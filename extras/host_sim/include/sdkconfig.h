@@ -0,0 +1,6 @@
+// Host build of the W5500 driver, see extras/host_sim/Makefile
+
+#pragma once
+
+#define CONFIG_FREERTOS_HZ            1000
+#define CONFIG_LOG_DEFAULT_LEVEL      3
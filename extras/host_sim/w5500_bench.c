@@ -0,0 +1,840 @@
+/****************************************************************************************************************************
+  w5500_bench.c
+
+  SPI cost per frame of the W5500 MAC driver, on the host against the simulated chip. See Makefile
+
+  For each frame size it measures, per frame:
+    tx        mac->transmit of one frame
+    rx        one frame arrives, its interrupt is handled and the frame reaches the stack
+    rx-burst  W5500_RX_BATCH_FRAMES frames arrive behind one interrupt
+    pktgen    w5500_pktgen_run, as fast as it can
+    sink      as rx-burst, with test frames the sink discards before allocating a buffer
+  the SPI transactions, the bytes clocked (3 command and address bytes per transaction included) and the time
+  those would take on the bus. Transactions and bytes depend only on the driver, so they are compared with a
+  baseline to catch changes which add SPI traffic. The time depends on --spi-mhz and --txn-us.
+  Then pktgen runs while another task transmits, as lwIP would: every frame of both must reach the wire
+  whole and in order, without a turn timeout
+ *****************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "esp_eth_w5500.h"
+#include "w5500_sim.h"
+#include "host_idf.h"
+
+////////////////////////////////////////
+
+#define BENCH_RX_TASK         "w5500_tsk"
+#define BENCH_WAIT_MS         2000
+
+static const uint32_t s_sizes[] = { 64, 128, 256, 512, 1024, 1514 };
+static const uint8_t s_mac_addr[6] = { 0x02, 0x00, 0x00, 0x57, 0x55, 0x00 };
+static const uint8_t s_peer_addr[6] = { 0x02, 0x00, 0x00, 0x57, 0x55, 0x01 };
+
+typedef struct
+{
+  char test[16];
+  uint32_t size;
+  double txn;
+  double bytes;
+  double us;
+} bench_result_t;
+
+static struct
+{
+  esp_eth_mediator_t mediator;
+  pthread_mutex_t lock;
+  uint32_t rx_frames;
+  FILE *pcap_out;
+  esp_eth_mac_t *mac;
+  uint32_t mixed_pktgen;                // bench_pktgen_mixed: frames of each sender seen on the wire
+  uint32_t mixed_tx;
+  uint32_t mixed_bad;                   // Frames out of order, cut or mixed with another
+} s_bench = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+////////////////////////////////////////
+// The stack: counts frames and frees them
+////////////////////////////////////////
+
+static esp_err_t bench_stack_input(esp_eth_mediator_t *eth, uint8_t *buffer, uint32_t length)
+{
+  (void) eth;
+  (void) length;
+
+  free(buffer);
+  pthread_mutex_lock(&s_bench.lock);
+  s_bench.rx_frames++;
+  pthread_mutex_unlock(&s_bench.lock);
+
+  return ESP_OK;
+}
+
+static esp_err_t bench_on_state_changed(esp_eth_mediator_t *eth, esp_eth_state_t state, void *args)
+{
+  (void) eth;
+  (void) state;
+  (void) args;
+
+  return ESP_OK;
+}
+
+static esp_err_t bench_phy_reg_read(esp_eth_mediator_t *eth, uint32_t phy_addr, uint32_t phy_reg, uint32_t *reg_value)
+{
+  (void) eth;
+  (void) phy_addr;
+  (void) phy_reg;
+
+  *reg_value = 0;
+
+  return ESP_OK;
+}
+
+static esp_err_t bench_phy_reg_write(esp_eth_mediator_t *eth, uint32_t phy_addr, uint32_t phy_reg, uint32_t reg_value)
+{
+  (void) eth;
+  (void) phy_addr;
+  (void) phy_reg;
+  (void) reg_value;
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+static uint32_t bench_rx_frames(void)
+{
+  pthread_mutex_lock(&s_bench.lock);
+  uint32_t frames = s_bench.rx_frames;
+  pthread_mutex_unlock(&s_bench.lock);
+
+  return frames;
+}
+
+#if W5500_PKTGEN
+static uint32_t bench_sink_frames(void)
+{
+  w5500_sink_stats_t stats;
+
+  w5500_sink_get_stats(s_bench.mac, &stats);
+
+  return stats.frames;
+}
+#endif
+
+// Wait until counter() reaches frames (the stack's or the sink's) and the RX task has nothing left to do,
+// so the next measurement starts from the same state. False on timeout
+static bool bench_wait_count(uint32_t (*counter)(void), uint32_t frames)
+{
+  struct timespec pause = { 0, 20000 };
+
+  for (int i = 0; i < BENCH_WAIT_MS * 50; i++)
+  {
+    if ((counter() >= frames) && host_task_idle(BENCH_RX_TASK))
+      return true;
+
+    nanosleep(&pause, NULL);
+  }
+
+  return false;
+}
+
+static bool bench_wait_rx(uint32_t frames)
+{
+  return bench_wait_count(bench_rx_frames, frames);
+}
+
+////////////////////////////////////////
+
+static void bench_frame(uint8_t *frame, uint32_t size, const uint8_t *dst, const uint8_t *src, uint32_t seq)
+{
+  memcpy(frame, dst, 6);
+  memcpy(frame + 6, src, 6);
+  frame[12] = 0x88;                     // Local experimental EtherType
+  frame[13] = 0xB5;
+
+  for (uint32_t i = 14; i < size; i++)
+    frame[i] = (uint8_t)(seq + i);
+}
+
+static void bench_result(bench_result_t *result, const char *test, uint32_t size, uint32_t frames,
+                         const w5500_sim_stats_t *stats)
+{
+  snprintf(result->test, sizeof(result->test), "%s", test);
+  result->size = size;
+  result->txn = (double) stats->transactions / frames;
+  result->bytes = (double) stats->bytes / frames;
+  result->us = (double) stats->time_ns / frames / 1000.0;
+}
+
+////////////////////////////////////////
+
+static bool bench_tx(esp_eth_mac_t *mac, uint32_t size, uint32_t frames, bench_result_t *result)
+{
+  uint8_t frame[1514];
+  w5500_sim_stats_t stats;
+
+  w5500_sim_reset_stats();
+
+  for (uint32_t i = 0; i < frames; i++)
+  {
+    bench_frame(frame, size, s_peer_addr, s_mac_addr, i);
+
+    if (mac->transmit(mac, frame, size) != ESP_OK)
+    {
+      fprintf(stderr, "tx %u: frame %u not sent\n", (unsigned) size, (unsigned) i);
+      return false;
+    }
+  }
+
+  w5500_sim_get_stats(&stats);
+  bench_result(result, "tx", size, frames, &stats);
+
+  return true;
+}
+
+////////////////////////////////////////
+
+// burst 1: each frame on its own interrupt. Else frames arrive burst at a time behind one interrupt
+static bool bench_rx(uint32_t size, uint32_t frames, uint32_t burst, bench_result_t *result)
+{
+  uint8_t frame[1514];
+  w5500_sim_stats_t stats;
+  uint32_t expected = bench_rx_frames();
+
+  frames -= frames % burst;
+  w5500_sim_reset_stats();
+
+  for (uint32_t i = 0; i < frames; i += burst)
+  {
+    w5500_sim_hold_interrupt(true);
+
+    for (uint32_t j = 0; j < burst; j++)
+    {
+      bench_frame(frame, size, s_mac_addr, s_peer_addr, i + j);
+
+      if (w5500_sim_receive(frame, size))
+        expected++;
+    }
+
+    w5500_sim_hold_interrupt(false);
+
+    if (!bench_wait_rx(expected))
+    {
+      fprintf(stderr, "%s %u: frame %u not received\n", (burst > 1) ? "rx-burst" : "rx", (unsigned) size,
+              (unsigned) i);
+      return false;
+    }
+  }
+
+  w5500_sim_get_stats(&stats);
+  bench_result(result, (burst > 1) ? "rx-burst" : "rx", size, frames, &stats);
+
+  return true;
+}
+
+////////////////////////////////////////
+// pcap files
+////////////////////////////////////////
+
+#if W5500_PKTGEN
+
+static bool bench_pktgen(esp_eth_mac_t *mac, uint32_t size, uint32_t frames, bench_result_t *result)
+{
+  w5500_pktgen_config_t config = { .ether_type = 0, .frame_len = size, .rate_pps = 0, .count = frames };
+  w5500_pktgen_result_t sent;
+  w5500_sim_stats_t stats;
+
+  memcpy(config.dest, s_peer_addr, 6);
+  w5500_sim_reset_stats();
+
+  if ((w5500_pktgen_run(mac, &config, &sent) != ESP_OK) || (sent.frames != frames))
+  {
+    fprintf(stderr, "pktgen %u: %u of %u frames sent\n", (unsigned) size, (unsigned) sent.frames, (unsigned) frames);
+    return false;
+  }
+
+  w5500_sim_get_stats(&stats);
+  bench_result(result, "pktgen", size, frames, &stats);
+
+  return true;
+}
+
+////////////////////////////////////////
+// pktgen and another transmitting task at the same time
+////////////////////////////////////////
+
+#define BENCH_MIXED_ETHERTYPE 0x88B6
+
+static void bench_pcap_out(const uint8_t *frame, uint32_t len, void *arg);
+
+typedef struct
+{
+  esp_eth_mac_t *mac;
+  uint32_t size;
+  uint32_t frames;
+  uint32_t sent;
+} bench_sender_t;
+
+// On the wire: pktgen's frames carry their sequence number then zeros, the other task's bench_frame's pattern.
+// Each stream must arrive in order
+static void bench_mixed_out(const uint8_t *frame, uint32_t len, void *arg)
+{
+  uint16_t ether_type = (frame[12] << 8) | frame[13];
+  bool ok = (len >= 18);
+
+  pthread_mutex_lock(&s_bench.lock);
+
+  if (ok && (ether_type == W5500_PKTGEN_ETHERTYPE))
+  {
+    uint32_t seq = ((uint32_t) frame[14] << 24) | (frame[15] << 16) | (frame[16] << 8) | frame[17];
+
+    ok = (seq == s_bench.mixed_pktgen++);
+
+    for (uint32_t i = 18; ok && (i < len); i++)
+      ok = !frame[i];
+  }
+  else if (ok && (ether_type == BENCH_MIXED_ETHERTYPE))
+  {
+    uint32_t seq = s_bench.mixed_tx++;
+
+    for (uint32_t i = 14; ok && (i < len); i++)
+      ok = (frame[i] == (uint8_t)(seq + i));
+  }
+  else
+    ok = false;
+
+  if (!ok)
+    s_bench.mixed_bad++;
+
+  pthread_mutex_unlock(&s_bench.lock);
+
+  if (arg)
+    bench_pcap_out(frame, len, arg);
+}
+
+static void *bench_mixed_sender(void *arg)
+{
+  bench_sender_t *sender = arg;
+  uint8_t frame[1514];
+
+  for (uint32_t i = 0; i < sender->frames; i++)
+  {
+    bench_frame(frame, sender->size, s_peer_addr, s_mac_addr, i);
+    frame[12] = BENCH_MIXED_ETHERTYPE >> 8;
+    frame[13] = BENCH_MIXED_ETHERTYPE & 0xFF;
+
+    if (sender->mac->transmit(sender->mac, frame, sender->size) == ESP_OK)
+      sender->sent++;
+  }
+
+  return NULL;
+}
+
+// Not part of the baseline: which sender gets the turn when, so the transactions per frame, is up to the threads
+static bool bench_pktgen_mixed(esp_eth_mac_t *mac, uint32_t size, uint32_t frames)
+{
+  w5500_pktgen_config_t config = { .ether_type = 0, .frame_len = size, .rate_pps = 0, .count = frames };
+  w5500_pktgen_result_t sent = { 0 };
+  bench_sender_t sender = { .mac = mac, .size = size, .frames = frames };
+  w5500_sched_stats_t before, after;
+  w5500_sim_stats_t stats;
+  pthread_t thread;
+  bool ok;
+
+  memcpy(config.dest, s_peer_addr, 6);
+  s_bench.mixed_pktgen = s_bench.mixed_tx = s_bench.mixed_bad = 0;
+  w5500_sim_set_tx_callback(bench_mixed_out, s_bench.pcap_out);
+  w5500_get_sched_stats(mac, &before);
+  w5500_sim_reset_stats();
+
+  if (pthread_create(&thread, NULL, bench_mixed_sender, &sender))
+    return false;
+
+  ok = (w5500_pktgen_run(mac, &config, &sent) == ESP_OK);
+  pthread_join(thread, NULL);
+
+  w5500_sim_get_stats(&stats);
+  w5500_get_sched_stats(mac, &after);
+  w5500_sim_set_tx_callback(s_bench.pcap_out ? bench_pcap_out : NULL, s_bench.pcap_out);
+
+  if (!ok || (sent.frames != frames) || (sender.sent != frames) || (stats.tx_frames != 2 * frames) ||
+      (s_bench.mixed_pktgen != frames) || (s_bench.mixed_tx != frames) || s_bench.mixed_bad ||
+      (after.tx_turn_timeouts != before.tx_turn_timeouts))
+  {
+    fprintf(stderr, "pktgen+tx %u: %u and %u of %u frames sent, %u on the wire (%u bad), %u turn timeouts\n",
+            (unsigned) size, (unsigned) sent.frames, (unsigned) sender.sent, (unsigned) frames,
+            (unsigned) stats.tx_frames, (unsigned) s_bench.mixed_bad,
+            (unsigned) (after.tx_turn_timeouts - before.tx_turn_timeouts));
+    return false;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
+// Test frames, W5500_RX_BATCH_FRAMES behind each interrupt. None may reach the stack
+static bool bench_sink(esp_eth_mac_t *mac, uint32_t size, uint32_t frames, bench_result_t *result)
+{
+  uint8_t frame[1514];
+  w5500_sim_stats_t stats;
+  w5500_sink_stats_t sink;
+  uint32_t stack_frames = bench_rx_frames();
+  uint32_t expected = 0;
+  uint32_t burst = W5500_RX_BATCH_FRAMES;
+  bool ok = true;
+
+  frames -= frames % burst;
+  w5500_sink_start(mac, 0);
+  w5500_sim_reset_stats();
+
+  for (uint32_t i = 0; ok && (i < frames); i += burst)
+  {
+    w5500_sim_hold_interrupt(true);
+
+    for (uint32_t j = 0; j < burst; j++)
+    {
+      bench_frame(frame, size, s_mac_addr, s_peer_addr, i + j);
+      frame[14] = (i + j) >> 24;          // Sequence number
+      frame[15] = (i + j) >> 16;
+      frame[16] = (i + j) >> 8;
+      frame[17] = (i + j);
+
+      if (w5500_sim_receive(frame, size))
+        expected++;
+    }
+
+    w5500_sim_hold_interrupt(false);
+
+    if (!bench_wait_count(bench_sink_frames, expected))
+    {
+      fprintf(stderr, "sink %u: frame %u not received\n", (unsigned) size, (unsigned) i);
+      ok = false;
+    }
+  }
+
+  w5500_sim_get_stats(&stats);
+  w5500_sink_get_stats(mac, &sink);
+  w5500_sink_stop(mac);
+
+  if (ok && ((bench_rx_frames() != stack_frames) || sink.lost || sink.out_of_order))
+  {
+    fprintf(stderr, "sink %u: %u frames reached the stack, %u lost, %u out of order\n", (unsigned) size,
+            (unsigned) (bench_rx_frames() - stack_frames), (unsigned) sink.lost, (unsigned) sink.out_of_order);
+    ok = false;
+  }
+
+  if (ok)
+    bench_result(result, "sink", size, frames, &stats);
+
+  return ok;
+}
+
+#endif
+
+////////////////////////////////////////
+
+static uint32_t pcap_u32(const uint8_t *p, bool swap)
+{
+  uint32_t v;
+
+  memcpy(&v, p, 4);
+
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+// Replays every frame of a classic Ethernet pcap file as received traffic, one interrupt each
+static bool bench_pcap_in(const char *path, bench_result_t *result)
+{
+  FILE *f = fopen(path, "rb");
+  uint8_t header[24];
+  uint8_t record[16];
+  uint8_t frame[1514];
+  uint32_t frames = 0;
+  uint32_t bytes = 0;
+  uint32_t skipped = 0;
+  uint32_t expected = bench_rx_frames();
+  w5500_sim_stats_t stats;
+  bool swap;
+
+  if (!f || (fread(header, 1, sizeof(header), f) != sizeof(header)))
+  {
+    fprintf(stderr, "%s: cannot read\n", path);
+    goto fail;
+  }
+
+  uint32_t magic = pcap_u32(header, false);
+  swap = (magic == 0xD4C3B2A1) || (magic == 0x4D3CB2A1);
+
+  if (!swap && (magic != 0xA1B2C3D4) && (magic != 0xA1B23C4D))
+  {
+    fprintf(stderr, "%s: not a pcap file (pcapng is not supported)\n", path);
+    goto fail;
+  }
+
+  if ((pcap_u32(header + 20, swap) & 0xFFFF) != 1)
+  {
+    fprintf(stderr, "%s: link type %u, only Ethernet (1) is supported\n", path,
+            (unsigned) pcap_u32(header + 20, swap));
+    goto fail;
+  }
+
+  w5500_sim_reset_stats();
+
+  while (fread(record, 1, sizeof(record), f) == sizeof(record))
+  {
+    uint32_t len = pcap_u32(record + 8, swap);
+
+    if ((len < 14) || (len > sizeof(frame)))
+    {
+      fseek(f, len, SEEK_CUR);
+      skipped++;
+      continue;
+    }
+
+    if (fread(frame, 1, len, f) != len)
+      break;
+
+    if (w5500_sim_receive(frame, len))
+    {
+      expected++;
+      frames++;
+      bytes += len;
+    }
+    else
+    {
+      skipped++;
+    }
+
+    if (!bench_wait_rx(expected))
+    {
+      fprintf(stderr, "%s: frame %u not received\n", path, (unsigned) frames);
+      goto fail;
+    }
+  }
+
+  fclose(f);
+
+  if (!frames)
+  {
+    fprintf(stderr, "%s: no frames received (%u skipped or filtered, try --promiscuous)\n", path,
+            (unsigned) skipped);
+    return false;
+  }
+
+  if (skipped)
+    fprintf(stderr, "%s: %u frames skipped or filtered\n", path, (unsigned) skipped);
+
+  w5500_sim_get_stats(&stats);
+  bench_result(result, "pcap", bytes / frames, frames, &stats);
+
+  return true;
+
+fail:
+
+  if (f)
+    fclose(f);
+
+  return false;
+}
+
+// Frames the driver sends, as a pcap file
+static void bench_pcap_out(const uint8_t *frame, uint32_t len, void *arg)
+{
+  FILE *f = arg;
+  struct timespec ts;
+  uint32_t record[4];
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  record[0] = ts.tv_sec;
+  record[1] = ts.tv_nsec / 1000;
+  record[2] = len;
+  record[3] = len;
+  fwrite(record, sizeof(record), 1, f);
+  fwrite(frame, 1, len, f);
+}
+
+static FILE *bench_pcap_create(const char *path)
+{
+  FILE *f = fopen(path, "wb");
+  const uint32_t header[6] = { 0xA1B2C3D4, 0x00040002, 0, 0, 65535, 1 };
+
+  if (f)
+    fwrite(header, sizeof(header), 1, f);
+
+  return f;
+}
+
+////////////////////////////////////////
+// Baseline: "frames N", then "test size txn bytes" per line. Where the buffer pointers wrap depends on
+// the number of frames, so results only compare with the same --frames
+////////////////////////////////////////
+
+static bool bench_write_baseline(const char *path, uint32_t frames, const bench_result_t *results, int count)
+{
+  FILE *f = fopen(path, "w");
+
+  if (!f)
+  {
+    fprintf(stderr, "%s: cannot write\n", path);
+    return false;
+  }
+
+  fprintf(f, "# test size txn/frame bytes/frame, written by w5500_bench --write-baseline\n");
+  fprintf(f, "frames %u\n", (unsigned) frames);
+
+  for (int i = 0; i < count; i++)
+    fprintf(f, "%s %u %.2f %.1f\n", results[i].test, (unsigned) results[i].size, results[i].txn, results[i].bytes);
+
+  fclose(f);
+
+  return true;
+}
+
+// False if any result takes more transactions or bytes than its baseline
+static bool bench_check_baseline(const char *path, uint32_t frames, const bench_result_t *results, int count)
+{
+  FILE *f = fopen(path, "r");
+  char line[128];
+  bool pass = true;
+
+  if (!f)
+  {
+    fprintf(stderr, "%s: cannot read\n", path);
+    return false;
+  }
+
+  printf("\nAgainst %s:\n", path);
+
+  while (fgets(line, sizeof(line), f))
+  {
+    char test[16];
+    unsigned size;
+    double txn;
+    double bytes;
+
+    if (sscanf(line, "frames %u", &size) == 1)
+    {
+      if (size != frames)
+      {
+        printf("  %s is for --frames %u\n  FAIL\n", path, size);
+        fclose(f);
+        return false;
+      }
+
+      continue;
+    }
+
+    if ((line[0] == '#') || (sscanf(line, "%15s %u %lf %lf", test, &size, &txn, &bytes) != 4))
+      continue;
+
+    for (int i = 0; i < count; i++)
+    {
+      const bench_result_t *r = &results[i];
+
+      if (strcmp(r->test, test) || (r->size != size))
+        continue;
+
+      // Both are printed rounded, so allow for that
+      bool worse = (r->txn > txn + 0.005) || (r->bytes > bytes + 0.05);
+      bool better = (r->txn < txn - 0.005) || (r->bytes < bytes - 0.05);
+
+      if (worse || better)
+        printf("  %-8s %5u  txn %.2f -> %.2f  bytes %.1f -> %.1f  %s\n", test, size, txn, r->txn, bytes, r->bytes,
+               worse ? "REGRESSION" : "better, update the baseline");
+
+      pass &= !worse;
+    }
+  }
+
+  fclose(f);
+  printf("  %s\n", pass ? "pass" : "FAIL");
+
+  return pass;
+}
+
+////////////////////////////////////////
+
+static void bench_usage(void)
+{
+  fprintf(stderr,
+          "w5500_bench [options]\n"
+          "  --spi-mhz N            SPI clock, default 25\n"
+          "  --txn-us N             fixed cost of one transaction in microseconds, default 10\n"
+          "  --wire-mbps N          SEND_OK after the frame's time on the wire, default 0 (at once)\n"
+          "  --frames N             frames per test, default 200\n"
+          "  --promiscuous          turn the MAC filter off\n"
+          "  --pcap-in FILE         also replay FILE (classic pcap, Ethernet) as received traffic\n"
+          "  --pcap-out FILE        write the frames the driver sends to FILE\n"
+          "  --baseline FILE        exit 1 if transactions or bytes per frame are above FILE's\n"
+          "  --write-baseline FILE  write the results to FILE\n"
+          "  --verbose              driver log at debug level\n");
+}
+
+int main(int argc, char **argv)
+{
+  w5500_sim_timing_t timing = { .spi_hz = 25000000, .transaction_ns = 10000, .wire_mbps = 0 };
+  uint32_t frames = 200;
+  bool promiscuous = false;
+  const char *pcap_in = NULL;
+  const char *pcap_out = NULL;
+  const char *baseline = NULL;
+  const char *write_baseline = NULL;
+  bench_result_t results[5 * sizeof(s_sizes) / sizeof(s_sizes[0]) + 1];
+  int count = 0;
+  bool ok = true;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+    if (!strcmp(arg, "--promiscuous"))
+    {
+      promiscuous = true;
+      continue;
+    }
+
+    if (!strcmp(arg, "--verbose"))
+    {
+      esp_log_level_set("*", ESP_LOG_DEBUG);
+      continue;
+    }
+
+    if (!value)
+      goto usage;
+    else if (!strcmp(arg, "--spi-mhz"))
+      timing.spi_hz = atof(value) * 1000000;
+    else if (!strcmp(arg, "--txn-us"))
+      timing.transaction_ns = atof(value) * 1000;
+    else if (!strcmp(arg, "--wire-mbps"))
+      timing.wire_mbps = atoi(value);
+    else if (!strcmp(arg, "--frames"))
+      frames = atoi(value);
+    else if (!strcmp(arg, "--pcap-in"))
+      pcap_in = value;
+    else if (!strcmp(arg, "--pcap-out"))
+      pcap_out = value;
+    else if (!strcmp(arg, "--baseline"))
+      baseline = value;
+    else if (!strcmp(arg, "--write-baseline"))
+      write_baseline = value;
+    else
+      goto usage;
+
+    i++;
+  }
+
+  if (!timing.spi_hz || (frames < W5500_RX_BATCH_FRAMES))
+    goto usage;
+
+  w5500_sim_init(&timing);
+
+  if (pcap_out)
+  {
+    s_bench.pcap_out = bench_pcap_create(pcap_out);
+
+    if (!s_bench.pcap_out)
+    {
+      fprintf(stderr, "%s: cannot write\n", pcap_out);
+      return 2;
+    }
+
+    w5500_sim_set_tx_callback(bench_pcap_out, s_bench.pcap_out);
+  }
+
+  // The driver, as esp_eth_driver_install and esp_eth_start would set it up
+  eth_w5500_config_t w5500_config = ETH_W5500_DEFAULT_CONFIG((void *) &s_bench);
+  eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
+  esp_eth_mac_t *mac = esp_eth_mac_new_w5500(&w5500_config, &mac_config);
+
+  s_bench.mac = mac;
+
+  s_bench.mediator.phy_reg_read = bench_phy_reg_read;
+  s_bench.mediator.phy_reg_write = bench_phy_reg_write;
+  s_bench.mediator.stack_input = bench_stack_input;
+  s_bench.mediator.on_state_changed = bench_on_state_changed;
+
+  if (!mac ||
+      (mac->set_mediator(mac, &s_bench.mediator) != ESP_OK) ||
+      (mac->init(mac) != ESP_OK) ||
+      (mac->set_addr(mac, (uint8_t *) s_mac_addr) != ESP_OK) ||
+      (mac->set_link(mac, ETH_LINK_UP) != ESP_OK) ||
+      (promiscuous && (mac->set_promiscuous(mac, true) != ESP_OK)))
+  {
+    fprintf(stderr, "Driver start failed\n");
+    return 2;
+  }
+
+  bench_wait_rx(0);
+
+  printf("W5500 driver on the simulated chip: SPI %.1f MHz, %.1f us per transaction, SEND_OK %s\n",
+         timing.spi_hz / 1e6, timing.transaction_ns / 1e3, timing.wire_mbps ? "after the wire time" : "at once");
+  printf("%u frames per test\n\n", (unsigned) frames);
+  printf("%-8s %5s %9s %11s %10s %9s\n", "test", "size", "txn/frame", "bytes/frame", "us/frame", "Mbit/s");
+
+  for (size_t i = 0; ok && (i < sizeof(s_sizes) / sizeof(s_sizes[0])); i++)
+  {
+    ok = bench_tx(mac, s_sizes[i], frames, &results[count++]) &&
+         bench_rx(s_sizes[i], frames, 1, &results[count++]) &&
+         bench_rx(s_sizes[i], frames, W5500_RX_BATCH_FRAMES, &results[count++]);
+
+    for (int j = count - 3; ok && (j < count); j++)
+      printf("%-8s %5u %9.2f %11.1f %10.2f %9.2f\n", results[j].test, (unsigned) results[j].size, results[j].txn,
+             results[j].bytes, results[j].us, results[j].size * 8 / results[j].us);
+  }
+
+#if W5500_PKTGEN
+  // After the others, so their frames land at the same places in the W5500 buffers with or without these
+  for (size_t i = 0; ok && (i < sizeof(s_sizes) / sizeof(s_sizes[0])); i++)
+  {
+    ok = bench_pktgen(mac, s_sizes[i], frames, &results[count++]) &&
+         bench_sink(mac, s_sizes[i], frames, &results[count++]);
+
+    for (int j = count - 2; ok && (j < count); j++)
+      printf("%-8s %5u %9.2f %11.1f %10.2f %9.2f\n", results[j].test, (unsigned) results[j].size, results[j].txn,
+             results[j].bytes, results[j].us, results[j].size * 8 / results[j].us);
+  }
+
+  for (size_t i = 0; ok && (i < sizeof(s_sizes) / sizeof(s_sizes[0])); i++)
+    ok = bench_pktgen_mixed(mac, s_sizes[i], frames);
+
+  if (ok)
+    printf("\npktgen with another task transmitting: all frames sent whole and in order\n");
+#endif
+
+  if (ok && pcap_in)
+  {
+    bench_result_t pcap;
+
+    ok = bench_pcap_in(pcap_in, &pcap);
+
+    // Not part of the baseline: the traffic is not fixed
+    if (ok)
+      printf("%-8s %5u %9.2f %11.1f %10.2f %9.2f\n", pcap.test, (unsigned) pcap.size, pcap.txn, pcap.bytes, pcap.us,
+             pcap.size * 8 / pcap.us);
+  }
+
+  if (s_bench.pcap_out)
+    fclose(s_bench.pcap_out);
+
+  if (!ok)
+    return 2;
+
+  if (write_baseline && !bench_write_baseline(write_baseline, frames, results, count))
+    return 2;
+
+  if (baseline && !bench_check_baseline(baseline, frames, results, count))
+    return 1;
+
+  return 0;
+
+usage:
+  bench_usage();
+
+  return 2;
+}
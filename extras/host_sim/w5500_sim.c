@@ -0,0 +1,603 @@
+/****************************************************************************************************************************
+  w5500_sim.c
+
+  Register-level model of a W5500, see w5500_sim.h
+ *****************************************************************************************************************************/
+
+#include <string.h>
+#include <pthread.h>
+#include "w5500.h"
+#include "w5500_sim.h"
+
+////////////////////////////////////////
+
+#define SIM_MEM_SIZE          0x4000
+#define SIM_MAX_FRAME         1514
+
+// Register offsets inside their block
+#define REG(map)              ((map) >> W5500_ADDR_OFFSET)
+#define COM_MR                REG(W5500_REG_MR)
+#define COM_MAC               REG(W5500_REG_MAC)
+#define COM_IR                REG(W5500_REG_IR)
+#define COM_IMR               REG(W5500_REG_IMR)
+#define COM_SIR               REG(W5500_REG_SIR)
+#define COM_SIMR              REG(W5500_REG_SIMR)
+#define COM_RTR               REG(W5500_REG_RTR)
+#define COM_RCR               REG(W5500_REG_RCR)
+#define COM_PHYCFGR           REG(W5500_REG_PHYCFGR)
+#define COM_VERSIONR          REG(W5500_REG_VERSIONR)
+#define COM_SIZE              0x40
+
+#define SOCK_MR               REG(W5500_REG_SOCK_MR(0))
+#define SOCK_CR               REG(W5500_REG_SOCK_CR(0))
+#define SOCK_IR               REG(W5500_REG_SOCK_IR(0))
+#define SOCK_SR               REG(W5500_REG_SOCK_SR(0))
+#define SOCK_RXBUF_SIZE       REG(W5500_REG_SOCK_RXBUF_SIZE(0))
+#define SOCK_TXBUF_SIZE       REG(W5500_REG_SOCK_TXBUF_SIZE(0))
+#define SOCK_TX_FSR           REG(W5500_REG_SOCK_TX_FSR(0))
+#define SOCK_TX_RD            REG(W5500_REG_SOCK_TX_RD(0))
+#define SOCK_TX_WR            REG(W5500_REG_SOCK_TX_WR(0))
+#define SOCK_RX_RSR           REG(W5500_REG_SOCK_RX_RSR(0))
+#define SOCK_RX_RD            REG(W5500_REG_SOCK_RX_RD(0))
+#define SOCK_RX_WR            REG(W5500_REG_SOCK_RX_WR(0))
+#define SOCK_IMR              REG(W5500_REG_SOCK_IMR(0))
+#define SOCK_SIZE             0x30
+
+#define SMR_PROTOCOL          0x0F
+#define SMR_MMB               (1 << 5)  // MAC RAW: block multicast
+#define SMR_BCASTB            (1 << 6)  // MAC RAW: block broadcast
+#define SSR_UDP               0x22
+
+#define PHYCFGR_LINK          0x07      // LNK, SPD (100M) and DPX (full)
+
+typedef struct
+{
+  uint8_t reg[SOCK_SIZE];
+  uint16_t tx_sent;                     // Sn_TX_WR at the last SEND
+  uint16_t tx_rd;                       // Sent up to here
+  uint16_t rx_wr;                       // Received up to here
+  uint16_t rx_rd;                       // Freed up to here, by RECV
+  bool sending;                         // SEND_OK due at send_done_ns
+  uint64_t send_done_ns;
+} sim_sock_t;
+
+static struct
+{
+  pthread_mutex_t lock;
+  w5500_sim_timing_t timing;
+  uint64_t clock_ns;                    // Modelled time, never reset
+  uint8_t com[COM_SIZE];
+  sim_sock_t sock[W5500_SOCK_NUM];
+  uint8_t tx_mem[SIM_MEM_SIZE];
+  uint8_t rx_mem[SIM_MEM_SIZE];
+  bool link_up;
+  bool int_asserted;
+  bool int_held;
+  bool int_pending;                     // An edge came while held
+  gpio_isr_t isr;
+  void *isr_arg;
+  w5500_sim_tx_cb_t tx_cb;
+  void *tx_arg;
+  w5500_sim_stats_t stats;
+} s_sim = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+////////////////////////////////////////
+
+static inline uint16_t get16(const uint8_t *reg)
+{
+  return (reg[0] << 8) | reg[1];
+}
+
+static inline void put16(uint8_t *reg, uint16_t value)
+{
+  reg[0] = value >> 8;
+  reg[1] = value & 0xFF;
+}
+
+////////////////////////////////////////
+
+// Socket memories are laid out one after the other in socket order, as in the chip
+static uint32_t sim_mem_base(int sock, uint8_t size_reg, uint32_t *size)
+{
+  uint32_t base = 0;
+
+  for (int i = 0; i < sock; i++)
+    base += s_sim.sock[i].reg[size_reg] * 1024;
+
+  *size = s_sim.sock[sock].reg[size_reg] * 1024;
+
+  if (base + *size > SIM_MEM_SIZE)
+    *size = 0;
+
+  return base;
+}
+
+////////////////////////////////////////
+
+static void sim_reset_chip(void)
+{
+  memset(s_sim.com, 0, sizeof(s_sim.com));
+  memset(s_sim.sock, 0, sizeof(s_sim.sock));
+
+  put16(&s_sim.com[COM_RTR], 0x07D0);
+  s_sim.com[COM_RCR] = 0x08;
+  s_sim.com[COM_PHYCFGR] = 0xB8 | (s_sim.link_up ? PHYCFGR_LINK : 0);
+  s_sim.com[COM_VERSIONR] = 0x04;
+
+  for (int i = 0; i < W5500_SOCK_NUM; i++)
+  {
+    s_sim.sock[i].reg[SOCK_RXBUF_SIZE] = 2;
+    s_sim.sock[i].reg[SOCK_TXBUF_SIZE] = 2;
+  }
+
+  s_sim.int_asserted = false;
+  s_sim.int_pending = false;
+}
+
+////////////////////////////////////////
+
+static void sim_complete_sends(void)
+{
+  for (int i = 0; i < W5500_SOCK_NUM; i++)
+  {
+    sim_sock_t *s = &s_sim.sock[i];
+
+    if (s->sending && (s_sim.clock_ns >= s->send_done_ns))
+    {
+      s->sending = false;
+      s->tx_rd = s->tx_sent;
+      s->reg[SOCK_IR] |= W5500_SIR_SEND;
+    }
+  }
+}
+
+////////////////////////////////////////
+
+// Computed registers, brought up to date before they are read
+static void sim_refresh_sock(int sock)
+{
+  sim_sock_t *s = &s_sim.sock[sock];
+  uint32_t size;
+
+  sim_mem_base(sock, SOCK_TXBUF_SIZE, &size);
+  put16(&s->reg[SOCK_TX_FSR], size - (uint16_t)(s->tx_sent - s->tx_rd));
+  put16(&s->reg[SOCK_TX_RD], s->tx_rd);
+  put16(&s->reg[SOCK_RX_RSR], s->rx_wr - s->rx_rd);
+  put16(&s->reg[SOCK_RX_WR], s->rx_wr);
+}
+
+static uint8_t sim_sir(void)
+{
+  uint8_t sir = 0;
+
+  for (int i = 0; i < W5500_SOCK_NUM; i++)
+  {
+    if (s_sim.sock[i].reg[SOCK_IR] & s_sim.sock[i].reg[SOCK_IMR])
+      sir |= 1 << i;
+  }
+
+  return sir;
+}
+
+////////////////////////////////////////
+
+// Returns true on a falling edge of INT which should reach the ISR now
+static bool sim_update_int(void)
+{
+  bool asserted = (sim_sir() & s_sim.com[COM_SIMR]) || (s_sim.com[COM_IR] & s_sim.com[COM_IMR]);
+  bool edge = asserted && !s_sim.int_asserted;
+
+  s_sim.int_asserted = asserted;
+
+  if (!edge)
+    return false;
+
+  s_sim.stats.interrupts++;
+
+  if (s_sim.int_held)
+  {
+    s_sim.int_pending = true;
+    return false;
+  }
+
+  return true;
+}
+
+static void sim_signal(bool edge)
+{
+  if (edge && s_sim.isr)
+    s_sim.isr(s_sim.isr_arg);
+}
+
+////////////////////////////////////////
+
+static void sim_send(int sock)
+{
+  sim_sock_t *s = &s_sim.sock[sock];
+  uint16_t tx_wr = get16(&s->reg[SOCK_TX_WR]);
+  uint16_t len = tx_wr - s->tx_sent;
+  uint32_t size;
+  uint32_t base = sim_mem_base(sock, SOCK_TXBUF_SIZE, &size);
+
+  if ((s->reg[SOCK_SR] == W5500_SSR_MACRAW) && size && len && (len <= SIM_MAX_FRAME))
+  {
+    uint8_t frame[SIM_MAX_FRAME];
+
+    for (uint16_t i = 0; i < len; i++)
+      frame[i] = s_sim.tx_mem[base + ((uint16_t)(s->tx_sent + i) & (size - 1))];
+
+    s_sim.stats.tx_frames++;
+
+    if (s_sim.tx_cb)
+      s_sim.tx_cb(frame, len, s_sim.tx_arg);
+  }
+
+  s->tx_sent = tx_wr;
+
+  if (s_sim.timing.wire_mbps && (s->reg[SOCK_SR] == W5500_SSR_MACRAW))
+  {
+    // Preamble, FCS and inter-frame gap, at least the minimum frame
+    uint32_t wire_bytes = (len < 60 ? 60 : len) + 8 + 4 + 12;
+
+    s->sending = true;
+    s->send_done_ns = s_sim.clock_ns + (uint64_t) wire_bytes * 8 * 1000 / s_sim.timing.wire_mbps;
+  }
+  else
+  {
+    s->tx_rd = tx_wr;
+    s->reg[SOCK_IR] |= W5500_SIR_SEND;
+  }
+}
+
+////////////////////////////////////////
+
+static void sim_command(int sock, uint8_t command)
+{
+  sim_sock_t *s = &s_sim.sock[sock];
+
+  switch (command)
+  {
+    case W5500_SCR_OPEN:
+      switch (s->reg[SOCK_MR] & SMR_PROTOCOL)
+      {
+        case W5500_SMR_MAC_RAW:
+          s->reg[SOCK_SR] = (sock == 0) ? W5500_SSR_MACRAW : W5500_SSR_CLOSED;
+          break;
+
+        case W5500_SMR_TCP:
+          s->reg[SOCK_SR] = W5500_SSR_INIT;
+          break;
+
+        case 0x02:
+          s->reg[SOCK_SR] = SSR_UDP;
+          break;
+
+        default:
+          s->reg[SOCK_SR] = W5500_SSR_CLOSED;
+          break;
+      }
+
+      s->tx_sent = s->tx_rd = s->rx_wr = s->rx_rd = 0;
+      s->sending = false;
+      put16(&s->reg[SOCK_TX_WR], 0);
+      put16(&s->reg[SOCK_RX_RD], 0);
+      break;
+
+    case W5500_SCR_CLOSE:
+      s->reg[SOCK_SR] = W5500_SSR_CLOSED;
+      s->sending = false;
+      break;
+
+    case W5500_SCR_SEND:
+      sim_send(sock);
+      break;
+
+    case W5500_SCR_RECV:
+      s->rx_rd = get16(&s->reg[SOCK_RX_RD]);
+
+      // Data still waiting raises RECV again
+      if (s->rx_wr != s->rx_rd)
+        s->reg[SOCK_IR] |= W5500_SIR_RECV;
+
+      break;
+
+    default:
+      // LISTEN, CONNECT, DISCON: TCP is not modelled
+      break;
+  }
+}
+
+////////////////////////////////////////
+
+static uint8_t sim_read_byte(int sock, int kind, uint16_t address)
+{
+  uint32_t size;
+  uint32_t base;
+
+  switch (kind)
+  {
+    case 0:
+      return (address < COM_SIZE) ? s_sim.com[address] : 0;
+
+    case 1:
+      // Commands are taken at once, so Sn_CR always reads back 0
+      return ((address < SOCK_SIZE) && (address != SOCK_CR)) ? s_sim.sock[sock].reg[address] : 0;
+
+    case 2:
+      base = sim_mem_base(sock, SOCK_TXBUF_SIZE, &size);
+      return size ? s_sim.tx_mem[base + (address & (size - 1))] : 0;
+
+    default:
+      base = sim_mem_base(sock, SOCK_RXBUF_SIZE, &size);
+      return size ? s_sim.rx_mem[base + (address & (size - 1))] : 0;
+  }
+}
+
+////////////////////////////////////////
+
+static void sim_write_byte(int sock, int kind, uint16_t address, uint8_t value)
+{
+  uint32_t size;
+  uint32_t base;
+  sim_sock_t *s = &s_sim.sock[sock];
+
+  switch (kind)
+  {
+    case 0:
+      if (address == COM_MR)
+      {
+        // RST clears itself once the reset is done
+        if (value & W5500_MR_RST)
+          sim_reset_chip();
+        else
+          s_sim.com[COM_MR] = value;
+      }
+      else if (address == COM_IR)
+      {
+        s_sim.com[COM_IR] &= ~value;
+      }
+      else if (address == COM_PHYCFGR)
+      {
+        s_sim.com[COM_PHYCFGR] = (value & ~PHYCFGR_LINK) | (s_sim.link_up ? PHYCFGR_LINK : 0);
+      }
+      else if ((address < COM_SIZE) && (address != COM_SIR) && (address != COM_VERSIONR))
+      {
+        s_sim.com[address] = value;
+      }
+
+      break;
+
+    case 1:
+      if (address == SOCK_CR)
+      {
+        sim_command(sock, value);
+      }
+      else if (address == SOCK_IR)
+      {
+        s->reg[SOCK_IR] &= ~value;
+      }
+      else if ((address < SOCK_SIZE) && (address != SOCK_SR) &&
+               ((address & ~1) != SOCK_TX_FSR) && ((address & ~1) != SOCK_TX_RD) &&
+               ((address & ~1) != SOCK_RX_RSR) && ((address & ~1) != SOCK_RX_WR))
+      {
+        s->reg[address] = value;
+      }
+
+      break;
+
+    case 2:
+      base = sim_mem_base(sock, SOCK_TXBUF_SIZE, &size);
+
+      if (size)
+        s_sim.tx_mem[base + (address & (size - 1))] = value;
+
+      break;
+
+    default:
+      // The RX memory is the chip's to write
+      break;
+  }
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sim_transfer(spi_transaction_t *trans)
+{
+  uint16_t address = trans->cmd;
+  uint8_t control = trans->addr;
+  uint8_t block = control >> W5500_BSB_OFFSET;
+  bool write = (control >> W5500_RWB_OFFSET) & 1;
+  uint32_t len = trans->length / 8;
+  int sock = block >> 2;
+  int kind = block & 3;   // 0 common (block 0 only), 1 socket registers, 2 TX memory, 3 RX memory
+  const uint8_t *out = (trans->flags & SPI_TRANS_USE_TXDATA) ? trans->tx_data : trans->tx_buffer;
+  uint8_t *in = (trans->flags & SPI_TRANS_USE_RXDATA) ? trans->rx_data : trans->rx_buffer;
+
+  if ((kind == 0) && (sock != 0))
+    return ESP_ERR_INVALID_ARG;
+
+  pthread_mutex_lock(&s_sim.lock);
+
+  uint64_t ns = s_sim.timing.transaction_ns + (uint64_t)(len + 3) * 8 * 1000000000ULL / s_sim.timing.spi_hz;
+
+  s_sim.clock_ns += ns;
+  s_sim.stats.time_ns += ns;
+  s_sim.stats.transactions++;
+  s_sim.stats.bytes += len + 3;
+
+  sim_complete_sends();
+
+  if (!write)
+  {
+    if (kind == 0)
+      s_sim.com[COM_SIR] = sim_sir();
+    else if (kind == 1)
+      sim_refresh_sock(sock);
+  }
+
+  // The address increases through the block; buffer addresses wrap in the socket's memory
+  for (uint32_t i = 0; i < len; i++)
+  {
+    if (write)
+      sim_write_byte(sock, kind, address + i, out[i]);
+    else
+      in[i] = sim_read_byte(sock, kind, address + i);
+  }
+
+  bool edge = sim_update_int();
+
+  pthread_mutex_unlock(&s_sim.lock);
+  sim_signal(edge);
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+bool w5500_sim_receive(const uint8_t *frame, uint32_t len)
+{
+  sim_sock_t *s = &s_sim.sock[0];
+  bool accepted = false;
+  bool edge = false;
+
+  pthread_mutex_lock(&s_sim.lock);
+
+  uint32_t size;
+  uint32_t base = sim_mem_base(0, SOCK_RXBUF_SIZE, &size);
+  uint8_t mode = s->reg[SOCK_MR];
+  bool pass = (s->reg[SOCK_SR] == W5500_SSR_MACRAW) && s_sim.link_up && (len >= 14) && (len <= SIM_MAX_FRAME);
+
+  if (pass && (mode & W5500_SMR_MAC_FILTER))
+  {
+    static const uint8_t broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+    if (memcmp(frame, broadcast, 6) == 0)
+      pass = !(mode & SMR_BCASTB);
+    else if (frame[0] & 1)
+      pass = !(mode & SMR_MMB);
+    else
+      pass = memcmp(frame, &s_sim.com[COM_MAC], 6) == 0;
+  }
+
+  if (!pass)
+  {
+    s_sim.stats.rx_filtered++;
+  }
+  else if (len + 2 > size - (uint16_t)(s->rx_wr - s->rx_rd))
+  {
+    s_sim.stats.rx_overruns++;
+  }
+  else
+  {
+    // 2 byte big endian length, itself included, then the frame
+    uint16_t record = len + 2;
+
+    s_sim.rx_mem[base + (s->rx_wr & (size - 1))] = record >> 8;
+    s_sim.rx_mem[base + ((uint16_t)(s->rx_wr + 1) & (size - 1))] = record & 0xFF;
+
+    for (uint32_t i = 0; i < len; i++)
+      s_sim.rx_mem[base + ((uint16_t)(s->rx_wr + 2 + i) & (size - 1))] = frame[i];
+
+    s->rx_wr += record;
+    s->reg[SOCK_IR] |= W5500_SIR_RECV;
+    s_sim.stats.rx_frames++;
+    accepted = true;
+    edge = sim_update_int();
+  }
+
+  pthread_mutex_unlock(&s_sim.lock);
+  sim_signal(edge);
+
+  return accepted;
+}
+
+////////////////////////////////////////
+
+void w5500_sim_hold_interrupt(bool hold)
+{
+  bool edge = false;
+
+  pthread_mutex_lock(&s_sim.lock);
+
+  s_sim.int_held = hold;
+
+  if (!hold && s_sim.int_pending)
+  {
+    s_sim.int_pending = false;
+    edge = s_sim.int_asserted;
+  }
+
+  pthread_mutex_unlock(&s_sim.lock);
+  sim_signal(edge);
+}
+
+////////////////////////////////////////
+
+void w5500_sim_init(const w5500_sim_timing_t *timing)
+{
+  pthread_mutex_lock(&s_sim.lock);
+  s_sim.timing = *timing;
+  s_sim.link_up = true;
+  sim_reset_chip();
+  memset(&s_sim.stats, 0, sizeof(s_sim.stats));
+  pthread_mutex_unlock(&s_sim.lock);
+}
+
+////////////////////////////////////////
+
+void w5500_sim_set_link(bool up)
+{
+  pthread_mutex_lock(&s_sim.lock);
+  s_sim.link_up = up;
+  s_sim.com[COM_PHYCFGR] = (s_sim.com[COM_PHYCFGR] & ~PHYCFGR_LINK) | (up ? PHYCFGR_LINK : 0);
+  pthread_mutex_unlock(&s_sim.lock);
+}
+
+////////////////////////////////////////
+
+void w5500_sim_set_tx_callback(w5500_sim_tx_cb_t callback, void *arg)
+{
+  pthread_mutex_lock(&s_sim.lock);
+  s_sim.tx_cb = callback;
+  s_sim.tx_arg = arg;
+  pthread_mutex_unlock(&s_sim.lock);
+}
+
+////////////////////////////////////////
+
+void w5500_sim_get_stats(w5500_sim_stats_t *stats)
+{
+  pthread_mutex_lock(&s_sim.lock);
+  *stats = s_sim.stats;
+  pthread_mutex_unlock(&s_sim.lock);
+}
+
+////////////////////////////////////////
+
+void w5500_sim_reset_stats(void)
+{
+  pthread_mutex_lock(&s_sim.lock);
+  memset(&s_sim.stats, 0, sizeof(s_sim.stats));
+  pthread_mutex_unlock(&s_sim.lock);
+}
+
+////////////////////////////////////////
+
+int w5500_sim_int_level(void)
+{
+  pthread_mutex_lock(&s_sim.lock);
+  int level = s_sim.int_asserted ? 0 : 1;
+  pthread_mutex_unlock(&s_sim.lock);
+
+  return level;
+}
+
+////////////////////////////////////////
+
+void w5500_sim_set_isr(gpio_isr_t isr, void *arg)
+{
+  pthread_mutex_lock(&s_sim.lock);
+  s_sim.isr = isr;
+  s_sim.isr_arg = arg;
+  pthread_mutex_unlock(&s_sim.lock);
+}
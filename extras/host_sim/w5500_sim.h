@@ -0,0 +1,58 @@
+/****************************************************************************************************************************
+  w5500_sim.h
+
+  Register-level model of a W5500 behind the host build's spi_device_polling_transmit, for running
+  src/w5500/esp_eth on Linux. See Makefile
+
+  Modelled: the common and socket registers, the 16 KB TX and RX memories split by Sn_TXBUF_SIZE /
+  Sn_RXBUF_SIZE with pointer wrap, OPEN / CLOSE / SEND / RECV, MAC RAW receive with the MAC filter,
+  Sn_IR / SIR / SIMR and the INT line, and the time each SPI transaction would take.
+  Not modelled: TCP / UDP sockets (commands are accepted and ignored), INTLEVEL, PHY negotiation
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/spi_master.h"
+#include "driver/gpio.h"
+
+typedef struct
+{
+  uint32_t spi_hz;              // SPI clock
+  uint32_t transaction_ns;      // Fixed cost of one transaction: driver, CS and DMA setup
+  uint32_t wire_mbps;           // SEND_OK after the frame's time on the wire at this rate. 0 = at once
+} w5500_sim_timing_t;
+
+typedef struct
+{
+  uint64_t transactions;
+  uint64_t bytes;               // Including the 3 command and address bytes of each transaction
+  uint64_t time_ns;             // Modelled SPI time
+  uint64_t interrupts;          // Falling edges of INT
+  uint32_t tx_frames;           // Frames sent by SEND
+  uint32_t rx_frames;           // Frames put into the RX memory
+  uint32_t rx_overruns;         // Frames which did not fit in the RX memory
+  uint32_t rx_filtered;         // Frames dropped by the MAC filter, or while SOCK0 is not open
+} w5500_sim_stats_t;
+
+// Called for every frame the driver sends
+typedef void (*w5500_sim_tx_cb_t)(const uint8_t *frame, uint32_t len, void *arg);
+
+void w5500_sim_init(const w5500_sim_timing_t *timing);
+void w5500_sim_set_link(bool up);
+void w5500_sim_set_tx_callback(w5500_sim_tx_cb_t callback, void *arg);
+
+// Deliver a frame from the wire. Returns false if it was filtered or did not fit
+bool w5500_sim_receive(const uint8_t *frame, uint32_t len);
+
+// While held, INT edges are not signalled, so a burst of frames arrives as one interrupt
+void w5500_sim_hold_interrupt(bool hold);
+
+void w5500_sim_get_stats(w5500_sim_stats_t *stats);
+void w5500_sim_reset_stats(void);
+
+// Used by the host shims
+esp_err_t w5500_sim_transfer(spi_transaction_t *trans);
+int w5500_sim_int_level(void);
+void w5500_sim_set_isr(gpio_isr_t isr, void *arg);
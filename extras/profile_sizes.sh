@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# Build a sketch with each ESP32_W5500_PROFILE and print its flash and RAM use,
+# and the difference from the STANDARD profile.
+#
+# Needs arduino-cli with the esp32 core (2.x) and the sketch's libraries installed.
+#
+# Usage: extras/profile_sizes.sh [sketch directory] [FQBN]
+
+SKETCH=${1:-examples/Example1_AsyncWebServer}
+FQBN=${2:-esp32:esp32:esp32}
+LIBRARY=$(cd "$(dirname "$0")/.." && pwd)
+
+declare -A FLASH RAM
+PROFILES="0 1 2"
+NAMES=(MINIMAL STANDARD DIAGNOSTIC)
+
+for profile in $PROFILES; do
+  output=$(arduino-cli compile --fqbn "$FQBN" --library "$LIBRARY" \
+             --build-property "compiler.c.extra_flags=-DESP32_W5500_PROFILE=$profile" \
+             --build-property "compiler.cpp.extra_flags=-DESP32_W5500_PROFILE=$profile" "$SKETCH" 2>&1)
+
+  if [ $? -ne 0 ]; then
+    echo "$output"
+    echo "Build failed for profile $profile"
+    exit 1
+  fi
+
+  # "Sketch uses 868413 bytes (66%) of program storage space..."
+  # "Global variables use 45520 bytes (13%) of dynamic memory..."
+  FLASH[$profile]=$(echo "$output" | sed -n 's/^Sketch uses \([0-9]*\) bytes.*/\1/p')
+  RAM[$profile]=$(echo "$output" | sed -n 's/^Global variables use \([0-9]*\) bytes.*/\1/p')
+done
+
+printf "%-12s %10s %10s %10s %10s\n" "Profile" "Flash" "Delta" "RAM" "Delta"
+
+for profile in $PROFILES; do
+  printf "%-12s %10d %+10d %10d %+10d\n" "${NAMES[$profile]}" \
+         "${FLASH[$profile]}" $(( FLASH[$profile] - FLASH[1] )) \
+         "${RAM[$profile]}" $(( RAM[$profile] - RAM[1] ))
+done
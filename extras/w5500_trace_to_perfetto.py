@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+#
+# Convert an ETH.dumpTrace() dump (build with -DW5500_TRACE=1) to Chrome trace JSON,
+# which opens in https://ui.perfetto.dev or chrome://tracing.
+#
+# The dump can be saved from a web page or cut from a serial log: lines before the
+# "# W5500 trace" header and after "# end" are ignored.
+#
+# Usage: extras/w5500_trace_to_perfetto.py trace.txt [trace.json]
+
+import json
+import sys
+
+TYPES = {
+    1: ("lock", "SPI lock"),
+    2: ("unlock", "SPI lock"),
+    3: ("spi_read", "SPI"),
+    4: ("spi_write", "SPI"),
+    5: ("cmd", "Commands"),
+    6: ("isr", "Interrupts"),
+    7: ("rx_frame", "Frames"),
+    8: ("tx_frame", "Frames"),
+    9: ("rx_drop", "Frames"),
+    10: ("tx_drop", "Frames"),
+}
+
+TRACKS = ["SPI lock", "SPI", "Commands", "Interrupts", "Frames"]
+
+RX_DROP_REASONS = {1: "no buffer", 2: "read error", 3: "oversize"}
+
+
+def parse(lines):
+    mhz = None
+    events = []
+
+    for line in lines:
+        line = line.strip()
+
+        if line.startswith("# W5500 trace"):
+            fields = dict(f.split("=") for f in line.split() if "=" in f)
+            mhz = float(fields["cpu_mhz"])
+            events = []
+            continue
+
+        if mhz is None or not line:
+            continue
+
+        if line == "# end":
+            break
+
+        if line.startswith("#"):
+            continue
+
+        parts = line.split()
+
+        if len(parts) != 6:
+            continue
+
+        events.append({
+            "type": int(parts[0]),
+            "core": int(parts[1]),
+            "cycles": int(parts[2], 16),
+            "duration": int(parts[3], 16),
+            "len": int(parts[4], 16),
+            "arg": int(parts[5], 16),
+        })
+
+    if mhz is None:
+        sys.exit("No '# W5500 trace' header found")
+
+    return mhz, events
+
+
+def convert(mhz, events):
+    # Each core has its own 32-bit cycle counter. It wraps every 2^32 / mhz microseconds,
+    # so unwrap it per core, assuming the events of a core are in time order
+    last = {}
+    offset = {}
+    trace = []
+
+    for core in sorted({e["core"] for e in events}):
+        trace.append({"ph": "M", "name": "process_name", "pid": core, "args": {"name": "Core %d" % core}})
+
+        for tid, track in enumerate(TRACKS):
+            trace.append({"ph": "M", "name": "thread_name", "pid": core, "tid": tid, "args": {"name": track}})
+
+    for e in events:
+        core = e["core"]
+
+        if core in last and e["cycles"] < last[core]:
+            offset[core] = offset.get(core, 0) + (1 << 32)
+
+        last[core] = e["cycles"]
+
+        end = (e["cycles"] + offset.get(core, 0)) / mhz
+        name, track = TYPES.get(e["type"], ("type %d" % e["type"], "Frames"))
+        args = {}
+
+        if e["type"] in (3, 4):
+            args = {"address": "0x%06x" % e["arg"], "bytes": e["len"]}
+        elif e["type"] == 5:
+            args = {"socket": e["arg"] >> 8, "command": "0x%02x" % (e["arg"] & 0xFF)}
+        elif e["type"] in (7, 8):
+            args = {"bytes": e["len"]}
+        elif e["type"] == 9:
+            args = {"reason": RX_DROP_REASONS.get(e["arg"], e["arg"]), "bytes": e["len"]}
+        elif e["type"] == 10:
+            args = {"error": "0x%x" % e["arg"], "bytes": e["len"]}
+
+        event = {"name": name, "pid": core, "tid": TRACKS.index(track), "args": args}
+
+        if e["duration"]:
+            event.update({"ph": "X", "ts": end - e["duration"] / mhz, "dur": e["duration"] / mhz})
+        else:
+            event.update({"ph": "i", "s": "t", "ts": end})
+
+        trace.append(event)
+
+    return {"traceEvents": trace, "displayTimeUnit": "ns"}
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("Usage: %s trace.txt [trace.json]" % sys.argv[0])
+
+    with open(sys.argv[1], errors="replace") as f:
+        mhz, events = parse(f)
+
+    output = json.dumps(convert(mhz, events))
+
+    if len(sys.argv) > 2:
+        with open(sys.argv[2], "w") as f:
+            f.write(output)
+    else:
+        print(output)
+
+    print("%d events" % len(events), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -47,6 +47,8 @@
 //////////////////////////////////////////////////////////////
 
 #include "w5500/SparkFun_esp32_w5500.h"
+#include "w5500/SparkFun_esp32_w5500_tcp.h"
+#include "w5500/SparkFun_esp32_w5500_syslog.h"
 
 #include "SparkFun_WebServer_ESP32_W5500.hpp"
 #include "SparkFun_WebServer_ESP32_W5500_Impl.h"
@@ -72,7 +72,7 @@ extern bool ESP32_W5500_eth_connected;
 
 extern void ESP32_W5500_onEvent();
 
-extern void ESP32_W5500_waitForConnect();
+extern bool ESP32_W5500_waitForConnect(uint32_t timeout_ms = ESP32_W5500_WAIT_FOREVER);
 
 extern bool ESP32_W5500_isConnected();
 
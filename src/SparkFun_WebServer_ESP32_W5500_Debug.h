@@ -21,6 +21,9 @@
 #include <Arduino.h>
 #include <stdio.h>
 
+#include "SparkFun_WebServer_ESP32_W5500_Profile.h"
+#include "w5500/esp_eth/esp_eth_w5500.h"
+
 ///////////////////////////////////////
 
 // Change _ETHERNET_WEBSERVER_LOGLEVEL_ to set tracing and logging verbosity
@@ -31,44 +34,77 @@
 // 4: DEBUG: errors, warnings, informational and debug
 // 5: VERBOSE: everything
 
+#if !ESP32_W5500_FEATURE_LOG
+  #undef _ETHERNET_WEBSERVER_LOGLEVEL_
+  #define _ETHERNET_WEBSERVER_LOGLEVEL_ 0
+#endif
+
 #ifndef _ETHERNET_WEBSERVER_LOGLEVEL_
   #define _ETHERNET_WEBSERVER_LOGLEVEL_ 0
 #endif
 
 ///////////////////////////////////////
 
-#define ET_LOGERROR0(x)        if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 0) { log_e("%s", x); }
-#define ET_LOGERROR1(x,y)      if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 0) { log_e("%s%s", x, y); }
-#define ET_LOGERROR2(x,y,z)    if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 0) { log_e("%s%s%s", x, y, z); }
-#define ET_LOGERROR3(x,y,z,w)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 0) { log_e("%s%s%s%s", x, y, z, w); }
+// With W5500_DEFERRED_LOG the messages are queued and printed by the log task (see w5500_log_write),
+// otherwise they go straight to the Arduino log_x
+
+#if W5500_DEFERRED_LOG
+  #define ET_LOG_E(format, ...)  w5500_log_write(ESP_LOG_ERROR, "ETH", format, ##__VA_ARGS__)
+  #define ET_LOG_W(format, ...)  w5500_log_write(ESP_LOG_WARN, "ETH", format, ##__VA_ARGS__)
+  #define ET_LOG_I(format, ...)  w5500_log_write(ESP_LOG_INFO, "ETH", format, ##__VA_ARGS__)
+  #define ET_LOG_D(format, ...)  w5500_log_write(ESP_LOG_DEBUG, "ETH", format, ##__VA_ARGS__)
+  #define ET_LOG_V(format, ...)  w5500_log_write(ESP_LOG_VERBOSE, "ETH", format, ##__VA_ARGS__)
+#else
+  #define ET_LOG_E(format, ...)  log_e(format, ##__VA_ARGS__)
+  #define ET_LOG_W(format, ...)  log_w(format, ##__VA_ARGS__)
+  #define ET_LOG_I(format, ...)  log_i(format, ##__VA_ARGS__)
+  #define ET_LOG_D(format, ...)  log_d(format, ##__VA_ARGS__)
+  #define ET_LOG_V(format, ...)  log_v(format, ##__VA_ARGS__)
+#endif
+
+///////////////////////////////////////
+
+// The numbered macros print their arguments one after the other, so every argument must be a C string.
+// The *F macros take a printf format (a string literal) and typed arguments, e.g.
+// ET_LOGERRORF("esp_netif_dhcpc_stop failed: %d", err)
+
+#define ET_LOGERROR0(x)        if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 0) { ET_LOG_E("%s", x); }
+#define ET_LOGERROR1(x,y)      if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 0) { ET_LOG_E("%s%s", x, y); }
+#define ET_LOGERROR2(x,y,z)    if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 0) { ET_LOG_E("%s%s%s", x, y, z); }
+#define ET_LOGERROR3(x,y,z,w)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 0) { ET_LOG_E("%s%s%s%s", x, y, z, w); }
+#define ET_LOGERRORF(format, ...)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 0) { ET_LOG_E(format, ##__VA_ARGS__); }
 
 ///////////////////////////////////////
 
-#define ET_LOGWARN0(x)        if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 1) { log_w("%s", x); }
-#define ET_LOGWARN1(x,y)      if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 1) { log_w("%s%s", x, y); }
-#define ET_LOGWARN2(x,y,z)    if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 1) { log_w("%s%s%s", x, y, z); }
-#define ET_LOGWARN3(x,y,z,w)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 1) { log_w("%s%s%s%s", x, y, z, w); }
+#define ET_LOGWARN0(x)        if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 1) { ET_LOG_W("%s", x); }
+#define ET_LOGWARN1(x,y)      if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 1) { ET_LOG_W("%s%s", x, y); }
+#define ET_LOGWARN2(x,y,z)    if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 1) { ET_LOG_W("%s%s%s", x, y, z); }
+#define ET_LOGWARN3(x,y,z,w)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 1) { ET_LOG_W("%s%s%s%s", x, y, z, w); }
+#define ET_LOGWARNF(format, ...)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 1) { ET_LOG_W(format, ##__VA_ARGS__); }
 
 ///////////////////////////////////////
 
-#define ET_LOGINFO0(x)        if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 2) { log_i("%s", x); }
-#define ET_LOGINFO1(x,y)      if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 2) { log_i("%s%s", x, y); }
-#define ET_LOGINFO2(x,y,z)    if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 2) { log_i("%s%s%s", x, y, z); }
-#define ET_LOGINFO3(x,y,z,w)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 2) { log_i("%s%s%s%s", x, y, z, w); }
+#define ET_LOGINFO0(x)        if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 2) { ET_LOG_I("%s", x); }
+#define ET_LOGINFO1(x,y)      if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 2) { ET_LOG_I("%s%s", x, y); }
+#define ET_LOGINFO2(x,y,z)    if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 2) { ET_LOG_I("%s%s%s", x, y, z); }
+#define ET_LOGINFO3(x,y,z,w)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 2) { ET_LOG_I("%s%s%s%s", x, y, z, w); }
+#define ET_LOGINFOF(format, ...)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 2) { ET_LOG_I(format, ##__VA_ARGS__); }
 
 ///////////////////////////////////////
 
-#define ET_LOGDEBUG0(x)        if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 3) { log_d("%s", x); }
-#define ET_LOGDEBUG1(x,y)      if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 3) { log_d("%s%s", x, y); }
-#define ET_LOGDEBUG2(x,y,z)    if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 3) { log_d("%s%s%s", x, y, z); }
-#define ET_LOGDEBUG3(x,y,z,w)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 3) { log_d("%s%s%s%s", x, y, z, w); }
+#define ET_LOGDEBUG0(x)        if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 3) { ET_LOG_D("%s", x); }
+#define ET_LOGDEBUG1(x,y)      if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 3) { ET_LOG_D("%s%s", x, y); }
+#define ET_LOGDEBUG2(x,y,z)    if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 3) { ET_LOG_D("%s%s%s", x, y, z); }
+#define ET_LOGDEBUG3(x,y,z,w)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 3) { ET_LOG_D("%s%s%s%s", x, y, z, w); }
+#define ET_LOGDEBUGF(format, ...)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 3) { ET_LOG_D(format, ##__VA_ARGS__); }
 
 ///////////////////////////////////////
 
-#define ET_LOG0(x)        if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 4) { log_v("%s", x); }
-#define ET_LOG1(x,y)      if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 4) { log_v("%s%s", x, y); }
-#define ET_LOG2(x,y,z)    if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 4) { log_v("%s%s%s", x, y, z); }
-#define ET_LOG3(x,y,z,w)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 4) { log_v("%s%s%s%s", x, y, z, w); }
+#define ET_LOG0(x)        if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 4) { ET_LOG_V("%s", x); }
+#define ET_LOG1(x,y)      if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 4) { ET_LOG_V("%s%s", x, y); }
+#define ET_LOG2(x,y,z)    if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 4) { ET_LOG_V("%s%s%s", x, y, z); }
+#define ET_LOG3(x,y,z,w)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 4) { ET_LOG_V("%s%s%s%s", x, y, z, w); }
+#define ET_LOGF(format, ...)  if(_ETHERNET_WEBSERVER_LOGLEVEL_ > 4) { ET_LOG_V(format, ##__VA_ARGS__); }
 
 ///////////////////////////////////////
 
@@ -18,73 +18,59 @@
 #ifndef WEBSERVER_ESP32_W5500_IMPL_H
 #define WEBSERVER_ESP32_W5500_IMPL_H
 
-//////////////////////////////////////////////////////////////
-
-bool ESP32_W5500_eth_connected = false;
+// Inline so the header can be included from more than one file.
+// ESP32_W5500_eth_connected is defined in SparkFun_esp32_w5500.cpp
 
 //////////////////////////////////////////////////////////////
 
-void ESP32_W5500_onEvent()
+inline void ESP32_W5500_onEvent()
 {
   WiFi.onEvent(ESP32_W5500_event);
 }
 
 //////////////////////////////////////////////////////////////
 
-void ESP32_W5500_waitForConnect()
+inline bool ESP32_W5500_waitForConnect(uint32_t timeout_ms)
 {
-  while (!ESP32_W5500_eth_connected)
-    delay(100);
+  // Wakes on the GOT_IP event itself rather than polling the flag
+  return ETH.waitForIP(timeout_ms);
 }
 
 //////////////////////////////////////////////////////////////
 
-bool ESP32_W5500_isConnected()
+inline bool ESP32_W5500_isConnected()
 {
   return ESP32_W5500_eth_connected;
 }
 
 //////////////////////////////////////////////////////////////
 
-void ESP32_W5500_event(WiFiEvent_t event)
+inline void ESP32_W5500_event(WiFiEvent_t event)
 {
   switch (event)
   {
     case ARDUINO_EVENT_ETH_START:
-      ET_LOG0(F("ETH Started"));
+      ET_LOG0("ETH Started");
       //set eth hostname here
       ETH.setHostname("ESP32_W5500");
       break;
 
     case ARDUINO_EVENT_ETH_CONNECTED:
-      ET_LOG0(F("ETH Connected"));
+      ET_LOG0("ETH Connected");
       break;
 
     case ARDUINO_EVENT_ETH_GOT_IP:
       if (!ESP32_W5500_eth_connected)
       {
+#if ESP32_W5500_FEATURE_LOG
         uint8_t macAddr[6] = { 0 };
         ETH.macAddress(macAddr);
-        char macStr[18] = { 0 };
-        sprintf(macStr, "%02X:%02X:%02X:%02X:%02X:%02X", macAddr[0], macAddr[1],
-                macAddr[2], macAddr[3], macAddr[4], macAddr[5]);
-
         IPAddress localIP = ETH.localIP();
-        char ipStr[18] = { 0 };
-        sprintf(ipStr, "%d.%d.%d.%d", localIP[0], localIP[1], localIP[2], localIP[3]);
-
-        ET_LOG3(F("ETH MAC: "), macStr, F(", IPv4: "), ipStr);
-
-        if (ETH.fullDuplex())
-        {
-          ET_LOG0(F("FULL_DUPLEX"));
-        }
-        else
-        {
-          ET_LOG0(F("HALF_DUPLEX"));
-        }
 
-        ET_LOG1(String(ETH.linkSpeed()), F("Mbps"));
+        ET_LOGF("ETH MAC: %02X:%02X:%02X:%02X:%02X:%02X, IPv4: %d.%d.%d.%d", macAddr[0], macAddr[1],
+                macAddr[2], macAddr[3], macAddr[4], macAddr[5], localIP[0], localIP[1], localIP[2], localIP[3]);
+        ET_LOGF("%s, %dMbps", ETH.fullDuplex() ? "FULL_DUPLEX" : "HALF_DUPLEX", ETH.linkSpeed());
+#endif
 
         ESP32_W5500_eth_connected = true;
       }
@@ -0,0 +1,73 @@
+/****************************************************************************************************************************
+  SparkFun_WebServer_ESP32_W5500_Profile.h
+
+  For Ethernet shields using ESP32_W5500 (ESP32 + W5500)
+
+  WebServer_ESP32_W5500 is a library for the ESP32 with Ethernet W5500 to run WebServer
+
+  Based on and modified from ESP32-IDF https://github.com/espressif/esp-idf
+  Built by Khoi Hoang https://github.com/khoih-prog/WebServer_ESP32_W5500
+  Modified by SparkFun
+  Licensed under GPLv3 license
+
+  Please see SparkFun_WebServer_ESP32_W5500.h for the version information
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef WEBSERVER_ESP32_W5500_PROFILE_H
+#define WEBSERVER_ESP32_W5500_PROFILE_H
+
+///////////////////////////////////////
+
+// Feature profile. The library .cpp files are compiled on their own, so set this as a build flag
+// (e.g. -DESP32_W5500_PROFILE=0), not with a #define in the sketch.
+// 0: MINIMAL: no logging, IPv6, String accessors, DHCP lease storage or DHCP fallback
+// 1: STANDARD: everything (default)
+// 2: DIAGNOSTIC: everything, and logging defaults to DEBUG
+// Each ESP32_W5500_FEATURE_* below can also be set on its own
+
+#define ESP32_W5500_PROFILE_MINIMAL     0
+#define ESP32_W5500_PROFILE_STANDARD    1
+#define ESP32_W5500_PROFILE_DIAGNOSTIC  2
+
+#ifndef ESP32_W5500_PROFILE
+  #define ESP32_W5500_PROFILE ESP32_W5500_PROFILE_STANDARD
+#endif
+
+///////////////////////////////////////
+
+// ET_LOG* and the event logging in ESP32_W5500_event
+#ifndef ESP32_W5500_FEATURE_LOG
+  #define ESP32_W5500_FEATURE_LOG           (ESP32_W5500_PROFILE != ESP32_W5500_PROFILE_MINIMAL)
+#endif
+
+// enableIpV6() and localIPv6()
+#ifndef ESP32_W5500_FEATURE_IPV6
+  #define ESP32_W5500_FEATURE_IPV6          (ESP32_W5500_PROFILE != ESP32_W5500_PROFILE_MINIMAL)
+#endif
+
+// String macAddress()
+#ifndef ESP32_W5500_FEATURE_STRING
+  #define ESP32_W5500_FEATURE_STRING        (ESP32_W5500_PROFILE != ESP32_W5500_PROFILE_MINIMAL)
+#endif
+
+// DHCP lease in NVS and INIT-REBOOT (setFastReconnect, clearLease)
+#ifndef ESP32_W5500_FEATURE_DHCP_LEASE
+  #define ESP32_W5500_FEATURE_DHCP_LEASE    (ESP32_W5500_PROFILE != ESP32_W5500_PROFILE_MINIMAL)
+#endif
+
+// Link-local / static address when DHCP times out (setDHCPFallback, usingFallbackAddress)
+#ifndef ESP32_W5500_FEATURE_DHCP_FALLBACK
+  #define ESP32_W5500_FEATURE_DHCP_FALLBACK (ESP32_W5500_PROFILE != ESP32_W5500_PROFILE_MINIMAL)
+#endif
+
+///////////////////////////////////////
+
+#if (ESP32_W5500_PROFILE == ESP32_W5500_PROFILE_DIAGNOSTIC) && !defined(_ETHERNET_WEBSERVER_LOGLEVEL_)
+  #define _ETHERNET_WEBSERVER_LOGLEVEL_ 4
+#endif
+
+///////////////////////////////////////
+
+#endif    // WEBSERVER_ESP32_W5500_PROFILE_H
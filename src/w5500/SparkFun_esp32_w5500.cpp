@@ -16,17 +16,13 @@
 #include "SparkFun_WebServer_ESP32_W5500_Debug.h"
 #include "SparkFun_esp32_w5500.h"
 
-extern "C"
-{
-  esp_eth_mac_t* w5500_begin(int POCI, int PICO, int SCLK, int CS, int INT, int SPICLOCK_MHZ,
-                             int SPIHOST, spi_device_handle_t *spi_handle);
-#include "esp_eth/esp_eth_w5500.h"
-}
-
 #include "esp_event.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "esp_eth_phy.h"
 #include "esp_eth_mac.h"
 #include "esp_eth_com.h"
+#include "esp_idf_version.h"
 
 #if CONFIG_IDF_TARGET_ESP32
   #include "soc/emac_ext_struct.h"
@@ -38,14 +34,90 @@ extern "C"
 
 extern void tcpipInit();
 
+// The esp_eth default polls the PHY link every 2s, so link up was seen up to 2s late after power on.
+// One PHYCFGR read every 250ms is cheap and the state is cached by the PHY driver
+#define W5500_CHECK_LINK_PERIOD_MS  250
+
+// begin() waits at most this long for ETHERNET_EVENT_START, so DHCP is running when it returns
+#define W5500_START_TIMEOUT_MS      50
+
+// Before IDF 5.0 the netif glue registers no event handlers, and esp_eth_set_default_handlers would drive one
+// netif from every driver's events. eth_event_handler calls the esp_netif actions for its own interface instead.
+// From IDF 5.0 the glue does this itself, for its own driver only. The stored DHCP lease is asked for right
+// after esp_netif_action_connected, so fast reconnect needs the former
+#if ESP_IDF_VERSION_MAJOR < 5
+  #define W5500_NETIF_ACTIONS         1
+#else
+  #define W5500_NETIF_ACTIONS         0
+#endif
+
+// ESP32_W5500_Config to the driver's w5500_begin_config_t
+#define W5500_BEGIN_CONFIG(config)                    \
+  {                                                   \
+    .poci_gpio = (config).poci,                       \
+    .pico_gpio = (config).pico,                       \
+    .sclk_gpio = (config).sclk,                       \
+    .cs_gpio = (config).cs,                           \
+    .int_gpio = (config).intr,                        \
+    .spi_clock_mhz = (config).spiClockMHz,            \
+    .spi_host = (config).spiHost,                     \
+    .spi_queue_size = (config).spiQueueSize,          \
+    .spi_dma_chan = (config).spiDmaChannel,           \
+    .isr_flags = (config).isrFlags,                   \
+    .rx_task_stack_size = (config).rxTaskStackSize,   \
+    .rx_task_prio = (config).rxTaskPriority,          \
+    .rx_task_core = (config).rxTaskCore,              \
+    .spi_bus_shared = (config).spiBusShared,          \
+    .spi_priority = (config).spiPriority,             \
+  }
+
 ////////////////////////////////////////
 
 ESP32_W5500::ESP32_W5500()
   : initialized(false)
   , staticIP(false)
+  , offload_sockets(0)
+  , offload_kb(0)
+  , ip_info_seq(0)
+  , ip_info()
+  , begin_us(0)
+  , phase_us(0)
+  , boot_times()
+#if ESP32_W5500_FEATURE_DHCP_LEASE
+  , fast_reconnect(true)
+  , lease_optimistic(false)
+  , lease_valid(false)
+  , lease()
+#endif
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+  , fallback_timeout_ms(0)
+  , fallback_ip(0)
+  , fallback_mask(0)
+  , fallback_gw(0)
+  , fallback_candidate(0)
+  , fallback_state(0)
+  , fallback_probes(0)
+  , fallback_attempts(0)
+  , fallback_timer(NULL)
+#endif
+  , begin_config()
+  , isr_service_ref(false)
+  , is_detached(false)
+  , instance(-1)
+  , if_key()
+  , if_desc()
+  , ip_event_instance(NULL)
+  , eth_event_instance(NULL)
   , eth_handle(NULL)
+  , netif_glue_handle(NULL)
+  , eth_phy(NULL)
+  , eth_mac(NULL)
+  , eth_netif(NULL)
+  , spi_handle(NULL)
+  , spi_host(0)
   , started(false)
   , eth_link(ETH_LINK_DOWN)
+  , eth_events(NULL)
 {
 }
 
@@ -59,48 +131,157 @@ ESP32_W5500::~ESP32_W5500()
 bool ESP32_W5500::begin(int POCI, int PICO, int SCLK, int CS, int INT, int SPICLOCK_MHZ, int SPIHOST,
                         uint8_t *W5500_Mac)
 {
+  ESP32_W5500_Config config = ESP32_W5500_DEFAULT_CONFIG(POCI, PICO, SCLK, CS, INT);
+
+  config.spiClockMHz = SPICLOCK_MHZ;
+  config.spiHost = SPIHOST;
+  config.mac = W5500_Mac;
+
+  return begin(config);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::begin(const ESP32_W5500_Config &config)
+{
+  begin_us = esp_timer_get_time();
+  memset(&boot_times, 0, sizeof(boot_times));
+
+  if (eth_events == NULL)
+  {
+#if W5500_STATIC_ALLOCATION
+    eth_events = xEventGroupCreateStatic(&eth_events_buffer);
+#else
+    eth_events = xEventGroupCreate();
+#endif
+  }
+
+  if (eth_events == NULL)
+  {
+    ET_LOGERROR0("xEventGroupCreate failed");
+
+    return false;
+  }
+
+  xEventGroupClearBits(eth_events, ESP32_W5500_STARTED_BIT | ESP32_W5500_CONNECTED_BIT | ESP32_W5500_GOT_IP_BIT);
+
+  if (!takeInstance())
+  {
+    ET_LOGERROR0("Too many ESP32_W5500 interfaces. See ESP32_W5500_MAX_INSTANCES");
+
+    return false;
+  }
+
   tcpipInit();
 
-  spi_host = SPIHOST;
+  if ((config.offloadSockets > 0) && (!reserveOffloadSockets(config.offloadSockets, config.offloadBufferKB)))
+  {
+    teardown();
+    return false;
+  }
+
+  begin_config = config;
+  spi_host = config.spiHost;
+  is_detached = false;
 
-  //esp_base_mac_addr_set( W5500_Mac );
   //ESP32 MAC is base + 0, 1, 2, 3 for WiFi, WiFi AP, BT, Ethernet
-  if ( esp_read_mac(mac_eth, ESP_MAC_WIFI_STA) == ESP_OK )
+  //The factory MAC is used so the result does not depend on esp_base_mac_addr_set
+  if ( esp_efuse_mac_get_default(mac_eth) == ESP_OK )
   {
     mac_eth[5] += 3;
-    char macStr[18] = { 0 };
 
-    sprintf(macStr, "%02X:%02X:%02X:%02X:%02X:%02X", mac_eth[0], mac_eth[1], mac_eth[2],
-            mac_eth[3], mac_eth[4], mac_eth[5]);
+    // Further interfaces get a locally administered address derived from the Ethernet one
+    if (instance > 0)
+    {
+      uint8_t universal[6];
+
+      memcpy(universal, mac_eth, sizeof(universal));
+      esp_derive_local_mac(mac_eth, universal);
+      mac_eth[5] += instance - 1;
+    }
 
-    ET_LOGINFO1("Using built-in mac_eth = ", macStr);
+    ET_LOGINFOF("Using built-in mac_eth = %02X:%02X:%02X:%02X:%02X:%02X", mac_eth[0], mac_eth[1], mac_eth[2],
+                mac_eth[3], mac_eth[4], mac_eth[5]);
 
-    esp_base_mac_addr_set( mac_eth );
+    if (instance == 0)
+      esp_base_mac_addr_set( mac_eth );
   }
   else
   {
     ET_LOGINFO0("Using user mac_eth");
-    memcpy(mac_eth, W5500_Mac, sizeof(mac_eth));
+    memcpy(mac_eth, config.mac, sizeof(mac_eth));
 
-    esp_base_mac_addr_set( W5500_Mac );
+    if (instance == 0)
+      esp_base_mac_addr_set( config.mac );
   }
 
-  tcpip_adapter_set_default_eth_handlers();
+#if ESP32_W5500_FEATURE_DHCP_LEASE
+  if (fast_reconnect)
+    loadLease();
+#endif
+
+  // Not the tcpip_adapter default handlers, which are hard-wired to the ETH_DEF interface.
+  // eth_event_handler starts, stops and connects this netif (see W5500_NETIF_ACTIONS)
+  esp_netif_inherent_config_t netif_base = *ESP_NETIF_BASE_DEFAULT_ETH;
+
+  if (instance > 0)
+  {
+    snprintf(if_key, sizeof(if_key), "ETH_W5500_%d", instance);
+    snprintf(if_desc, sizeof(if_desc), "eth%d", instance);
+    netif_base.if_key = if_key;
+    netif_base.if_desc = if_desc;
+    netif_base.route_prio -= instance;
+  }
 
   esp_netif_config_t cfg = ESP_NETIF_DEFAULT_ETH();
-  eth_netif = NULL;
+  cfg.base = &netif_base;
   eth_netif = esp_netif_new(&cfg);
 
+  if (eth_netif == NULL)
+  {
+    ET_LOGERROR0("esp_netif_new failed");
+
+    teardown();
+    return false;
+  }
+
   eth_mac = NULL;
-  eth_mac = w5500_begin(POCI, PICO, SCLK, CS, INT, SPICLOCK_MHZ, spi_host, &spi_handle);
+  phase_us = esp_timer_get_time();
+  w5500_begin_config_t w5500_config = W5500_BEGIN_CONFIG(config);
+  eth_mac = w5500_begin(&w5500_config, &spi_handle, &isr_service_ref);
+  boot_times.spiInit = esp_timer_get_time() - phase_us;
 
   if (eth_mac == NULL)
   {
     ET_LOGERROR0("esp_eth_mac_new_esp32 failed");
 
+    teardown();
     return false;
   }
 
+  if (offload_sockets)
+  {
+    // SOCK0 keeps the largest valid buffer size which fits in what the offload sockets leave
+    uint8_t tx_kb[8] = { 0 };
+    uint8_t remain = 16 - (offload_sockets * offload_kb);
+
+    tx_kb[0] = 16;
+
+    while (tx_kb[0] > remain)
+      tx_kb[0] >>= 1;
+
+    for (int i = 1; i <= offload_sockets; i++)
+      tx_kb[i] = offload_kb;
+
+    if (w5500_set_socket_buffers(eth_mac, tx_kb, tx_kb) != ESP_OK)
+    {
+      ET_LOGERROR0("w5500_set_socket_buffers failed");
+
+      teardown();
+      return false;
+    }
+  }
+
   eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG();
   phy_config.autonego_timeout_ms = 0;       // W5500 doesn't support auto-negotiation
   phy_config.reset_gpio_num = -1;           // W5500 doesn't have a pin to reset internal PHY
@@ -111,24 +292,31 @@ bool ESP32_W5500::begin(int POCI, int PICO, int SCLK, int CS, int INT, int SPICL
   {
     ET_LOGERROR0("esp_eth_phy_new failed");
 
+    teardown();
     return false;
   }
 
   eth_handle = NULL;
   eth_config = ETH_DEFAULT_CONFIG(eth_mac, eth_phy);
+  eth_config.check_link_period_ms = W5500_CHECK_LINK_PERIOD_MS;
+
+  phase_us = esp_timer_get_time();
 
   if (esp_eth_driver_install(&eth_config, &eth_handle) != ESP_OK || eth_handle == NULL)
   {
     ET_LOG0("esp_eth_driver_install failed");
 
+    teardown();
     return false;
   }
 
+  boot_times.chipInit = esp_timer_get_time() - phase_us;
+
   eth_mac->set_addr(eth_mac, mac_eth);
 
 #if 1
 
-  if ( (SPICLOCK_MHZ < 14) || (SPICLOCK_MHZ > 25) )
+  if ( (config.spiClockMHz < 14) || (config.spiClockMHz > 25) )
   {
     ET_LOGERROR0("SPI Clock must be >= 14 and <= 25 MHz for W5500");
     ESP_ERROR_CHECK(ESP_FAIL);
@@ -136,25 +324,45 @@ bool ESP32_W5500::begin(int POCI, int PICO, int SCLK, int CS, int INT, int SPICL
 
 #endif
 
+  // Handler instances: a plain registration of the same function by a second ESP32_W5500
+  // would replace the first one's argument
+  if ((esp_event_handler_instance_register(IP_EVENT, ESP_EVENT_ANY_ID, &eth_event_handler, this,
+                                           &ip_event_instance) != ESP_OK)
+      || (esp_event_handler_instance_register(ETH_EVENT, ESP_EVENT_ANY_ID, &eth_event_handler, this,
+                                              &eth_event_instance) != ESP_OK))
+  {
+    ET_LOGERROR0("esp_event_handler_register failed");
+
+    teardown();
+    return false;
+  }
+
   /* attach Ethernet driver to TCP/IP stack */
   netif_glue_handle = esp_eth_new_netif_glue(eth_handle);
-  if (esp_netif_attach(eth_netif, netif_glue_handle) != ESP_OK)
+  if ((netif_glue_handle == NULL) || (esp_netif_attach(eth_netif, netif_glue_handle) != ESP_OK))
   {
     ET_LOGERROR0("esp_netif_attach failed");
 
+    teardown();
     return false;
   }
 
+  phase_us = esp_timer_get_time();
+
   if (esp_eth_start(eth_handle) != ESP_OK)
   {
     ET_LOG0("esp_eth_start failed");
 
+    teardown();
     return false;
   }
 
-  // holds a few microseconds to let DHCP start and enter into a good state
-  // FIX ME -- addresses issue https://github.com/espressif/arduino-esp32/issues/5733
-  delay(50);
+  // Wait for the START event to be handled so DHCP is running and in a good state
+  // Addresses issue https://github.com/espressif/arduino-esp32/issues/5733 without a fixed delay
+  if (!waitForBits(ESP32_W5500_STARTED_BIT, W5500_START_TIMEOUT_MS))
+  {
+    ET_LOGWARN0("Timeout waiting for ETHERNET_EVENT_START");
+  }
 
   return true;
 }
@@ -165,274 +373,1272 @@ bool ESP32_W5500::begin(int POCI, int PICO, int SCLK, int CS, int INT, int SPICL
 //https://github.com/Pro/open62541-esp32/blob/master/components/ethernet_helper/connect.c
 void ESP32_W5500::end()
 {
-  if (esp_eth_stop(eth_handle) != ESP_OK)
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+  stopFallback();
+#endif
+
+  // After detach() the driver is already stopped and the SPI bus belongs to someone else
+  if ((!is_detached) && (esp_eth_stop(eth_handle) != ESP_OK))
   {
     ET_LOGERROR0("esp_eth_stop failed");
   }
-  if (esp_eth_del_netif_glue(netif_glue_handle) != ESP_OK)
+
+  teardown();
+  is_detached = false;
+  updateIPInfo();
+}
+
+////////////////////////////////////////
+
+// Undo whatever begin() got as far as creating, in reverse order. The driver is stopped or was never started
+void ESP32_W5500::teardown()
+{
+  if (eth_event_instance
+      && (esp_event_handler_instance_unregister(ETH_EVENT, ESP_EVENT_ANY_ID, eth_event_instance) != ESP_OK))
+  {
+    ET_LOGERROR0("esp_event_handler_unregister failed");
+  }
+  eth_event_instance = NULL;
+  if (ip_event_instance
+      && (esp_event_handler_instance_unregister(IP_EVENT, ESP_EVENT_ANY_ID, ip_event_instance) != ESP_OK))
   {
-    ET_LOGERROR0("esp_eth_del_netif_glue failed");
+    ET_LOGERROR0("esp_event_handler_unregister failed");
   }
-  if (tcpip_adapter_clear_default_eth_handlers() != ESP_OK)
+  ip_event_instance = NULL;
+  if (netif_glue_handle && (esp_eth_del_netif_glue(netif_glue_handle) != ESP_OK))
   {
-    ET_LOGERROR0("tcpip_adapter_clear_default_eth_handlers failed");
+    ET_LOGERROR0("esp_eth_del_netif_glue failed");
   }
-  if (esp_eth_driver_uninstall(eth_handle) != ESP_OK)
+  netif_glue_handle = NULL;
+  if (eth_handle && (esp_eth_driver_uninstall(eth_handle) != ESP_OK))
   {
     ET_LOGERROR0("esp_eth_driver_uninstall failed");
   }
-  if (esp_eth_phy_delete_w5500(eth_phy) != ESP_OK)
+  eth_handle = NULL;
+  if (eth_phy && (esp_eth_phy_delete_w5500(eth_phy) != ESP_OK))
   {
     ET_LOGERROR0("esp_eth_phy_delete_w5500(eth_phy) failed");
   }
-  if (esp_eth_mac_delete_w5500(eth_mac) != ESP_OK)
+  eth_phy = NULL;
+  if (eth_mac && (esp_eth_mac_delete_w5500(eth_mac) != ESP_OK))
   {
     ET_LOGERROR0("esp_eth_mac_delete_w5500(eth_mac) failed");
   }
-  esp_netif_destroy(eth_netif);
+  eth_mac = NULL;
+  if (eth_netif)
+    esp_netif_destroy(eth_netif);
   eth_netif = NULL;
 
-  if (spi_bus_remove_device(spi_handle) != ESP_OK)
-  {
-    ET_LOGERROR0("spi_bus_remove_device failed");
-  }
-  if (spi_bus_free((spi_host_device_t)spi_host) != ESP_OK)
-  {
-    ET_LOGERROR0("spi_bus_free failed");
-  }
-  gpio_uninstall_isr_service();
+  // w5500_begin gives the bus back itself when it fails, leaving spi_handle NULL
+  if ((!is_detached) && spi_handle)
+    w5500_spi_detach(spi_host, spi_handle, isr_service_ref);
+
+  spi_handle = NULL;
+  isr_service_ref = false;
+
+  releaseInstance();
 }
 
 ////////////////////////////////////////
 
-bool ESP32_W5500::config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress dns1, IPAddress dns2)
+bool ESP32_W5500::restart(uint32_t timeout_ms)
 {
-  esp_err_t err = ESP_OK;
-  tcpip_adapter_ip_info_t info;
+  if ((eth_mac == NULL) || (eth_phy == NULL) || (eth_events == NULL))
+    return false;
 
-  if (static_cast<uint32_t>(local_ip) != 0)
-  {
-    info.ip.addr = static_cast<uint32_t>(local_ip);
-    info.gw.addr = static_cast<uint32_t>(gateway);
-    info.netmask.addr = static_cast<uint32_t>(subnet);
-  }
-  else
-  {
-    info.ip.addr = 0;
-    info.gw.addr = 0;
-    info.netmask.addr = 0;
-  }
+  int64_t start = esp_timer_get_time();
 
-  err = tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_ETH);
+  // CONNECTED is set again when the link poll sees the renegotiated link
+  xEventGroupClearBits(eth_events, ESP32_W5500_CONNECTED_BIT);
 
-  if (err != ESP_OK && err != ESP_ERR_TCPIP_ADAPTER_DHCP_ALREADY_STOPPED)
+  if (w5500_reinit(eth_mac) != ESP_OK)
   {
-    ET_LOGERROR1("DHCP could not be stopped! Error = ", err);
+    ET_LOGERROR0("w5500_reinit failed");
+
     return false;
   }
 
-  err = tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_ETH, &info);
+  boot_times.restartChip = esp_timer_get_time() - start;
 
-  if (err != ERR_OK)
+  // The chip reset also reset the PHY configuration. This marks the cached link down,
+  // so the next poll reports link up and set_link re-opens SOCK0
+  if (eth_phy->negotiate(eth_phy) != ESP_OK)
   {
-    ET_LOGERROR1("STA IP could not be configured! Error = ", err);
+    ET_LOGERROR0("PHY negotiate failed");
+
     return false;
   }
 
-  if (info.ip.addr)
+  if (!waitForBits(ESP32_W5500_CONNECTED_BIT, timeout_ms))
   {
-    staticIP = true;
+    ET_LOGWARN0("No link after restart");
+
+    return false;
   }
-  else
-  {
-    err = tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_ETH);
 
-    if (err != ESP_OK && err != ESP_ERR_TCPIP_ADAPTER_DHCP_ALREADY_STARTED)
-    {
-      ET_LOGWARN1("DHCP could not be started! Error = ", err);
-      return false;
-    }
+  boot_times.restartLink = esp_timer_get_time() - start;
 
-    staticIP = false;
-  }
+  return true;
+}
 
-  ip_addr_t d;
-  d.type = IPADDR_TYPE_V4;
+////////////////////////////////////////
 
-  if (static_cast<uint32_t>(dns1) != 0)
+bool ESP32_W5500::detach()
+{
+  if ((eth_handle == NULL) || is_detached)
+    return false;
+
+  int64_t start = esp_timer_get_time();
+
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+  stopFallback();
+#endif
+
+  if (esp_eth_stop(eth_handle) != ESP_OK)
   {
-    // Set DNS1-Server
-    d.u_addr.ip4.addr = static_cast<uint32_t>(dns1);
-    dns_setserver(0, &d);
+    ET_LOGERROR0("esp_eth_stop failed");
+
+    return false;
   }
 
-  if (static_cast<uint32_t>(dns2) != 0)
+  if (w5500_detach(eth_mac) != ESP_OK)
   {
-    // Set DNS2-Server
-    d.u_addr.ip4.addr = static_cast<uint32_t>(dns2);
-    dns_setserver(1, &d);
+    ET_LOGERROR0("w5500_detach failed");
+
+    esp_eth_start(eth_handle);
+
+    return false;
   }
 
+  w5500_spi_detach(spi_host, spi_handle, isr_service_ref);
+  spi_handle = NULL;
+  isr_service_ref = false;
+  is_detached = true;
+
+  boot_times.detach = esp_timer_get_time() - start;
+
   return true;
 }
 
 ////////////////////////////////////////
 
-IPAddress ESP32_W5500::localIP()
+bool ESP32_W5500::attach(uint32_t timeout_ms)
 {
-  tcpip_adapter_ip_info_t ip;
+  if ((eth_handle == NULL) || (!is_detached))
+    return false;
 
-  if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_ETH, &ip))
+  int64_t start = esp_timer_get_time();
+
+  w5500_begin_config_t w5500_config = W5500_BEGIN_CONFIG(begin_config);
+
+  if (w5500_spi_attach(&w5500_config, &spi_handle, &isr_service_ref) != ESP_OK)
   {
-    ET_LOGDEBUG0("localIP NULL");
+    ET_LOGERROR0("w5500_spi_attach failed. Has SPI.end() been called?");
 
-    return IPAddress();
+    return false;
   }
 
-  return IPAddress(ip.ip.addr);
-}
-
-////////////////////////////////////////
+  if (w5500_attach(eth_mac, spi_handle) != ESP_OK)
+  {
+    ET_LOGERROR0("w5500_attach failed");
 
-IPAddress ESP32_W5500::subnetMask()
-{
-  tcpip_adapter_ip_info_t ip;
+    w5500_spi_detach(spi_host, spi_handle, isr_service_ref);
+    spi_handle = NULL;
+    isr_service_ref = false;
 
-  if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_ETH, &ip))
-  {
-    return IPAddress();
+    return false;
   }
 
-  return IPAddress(ip.netmask.addr);
-}
+  is_detached = false;
 
-////////////////////////////////////////
+  // esp_eth_start renegotiates, so the link poll reports CONNECTED and DHCP (INIT-REBOOT) starts again
+  if (esp_eth_start(eth_handle) != ESP_OK)
+  {
+    ET_LOGERROR0("esp_eth_start failed");
 
-IPAddress ESP32_W5500::gatewayIP()
-{
-  tcpip_adapter_ip_info_t ip;
+    return false;
+  }
 
-  if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_ETH, &ip))
+  if (!waitForBits(ESP32_W5500_CONNECTED_BIT, timeout_ms))
   {
-    return IPAddress();
+    ET_LOGWARN0("No link after attach");
+
+    return false;
   }
 
-  return IPAddress(ip.gw.addr);
+  boot_times.attach = esp_timer_get_time() - start;
+
+  return true;
 }
 
 ////////////////////////////////////////
 
-IPAddress ESP32_W5500::dnsIP(uint8_t dns_no)
+bool ESP32_W5500::detached()
 {
-  const ip_addr_t * dns_ip = dns_getserver(dns_no);
-
-  return IPAddress(dns_ip->u_addr.ip4.addr);
+  return is_detached;
 }
 
 ////////////////////////////////////////
 
-IPAddress ESP32_W5500::broadcastIP()
+// Interface numbers in use, one bit each. Only changed by begin() and end()
+static uint32_t instances_in_use = 0;
+
+bool ESP32_W5500::takeInstance()
 {
-  tcpip_adapter_ip_info_t ip;
+  if (instance >= 0)
+    return true;
 
-  if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_ETH, &ip))
+  for (int i = 0; i < ESP32_W5500_MAX_INSTANCES; i++)
   {
-    return IPAddress();
+    if (!(instances_in_use & (1 << i)))
+    {
+      instances_in_use |= (1 << i);
+      instance = i;
+
+      return true;
+    }
   }
 
-  return WiFiGenericClass::calculateBroadcast(IPAddress(ip.gw.addr), IPAddress(ip.netmask.addr));
+  return false;
 }
 
 ////////////////////////////////////////
 
-IPAddress ESP32_W5500::networkID()
+void ESP32_W5500::releaseInstance()
 {
-  tcpip_adapter_ip_info_t ip;
-
-  if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_ETH, &ip))
-  {
-    return IPAddress();
-  }
+  if (instance >= 0)
+    instances_in_use &= ~(1 << instance);
 
-  return WiFiGenericClass::calculateNetworkID(IPAddress(ip.gw.addr), IPAddress(ip.netmask.addr));
+  instance = -1;
 }
 
 ////////////////////////////////////////
 
-uint8_t ESP32_W5500::subnetCIDR()
+int8_t ESP32_W5500::instanceNumber()
 {
-  tcpip_adapter_ip_info_t ip;
-
-  if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_ETH, &ip))
-  {
-    return (uint8_t)0;
-  }
-
-  return WiFiGenericClass::calculateSubnetCIDR(IPAddress(ip.netmask.addr));
+  return instance;
 }
 
 ////////////////////////////////////////
 
-const char * ESP32_W5500::getHostname()
+void ESP32_W5500::eth_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
-  const char * hostname;
+  ESP32_W5500 *eth = (ESP32_W5500 *)arg;
 
-  if (tcpip_adapter_get_hostname(TCPIP_ADAPTER_IF_ETH, &hostname))
+  if (event_base == IP_EVENT)
   {
-    return NULL;
+    if (event_id == IP_EVENT_ETH_GOT_IP)
+    {
+      ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+
+      if (event->esp_netif != eth->eth_netif)
+        return;
+
+#if W5500_NETIF_ACTIONS
+      esp_netif_action_got_ip(eth->eth_netif, event_base, event_id, event_data);
+#endif
+
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+      // Our own announcement of the fallback address, or a real answer from DHCP
+      bool fallback = eth->usingFallbackAddress() && (event->ip_info.ip.addr == eth->fallback_candidate);
+
+      if (!fallback)
+        eth->stopFallback();
+#else
+      bool fallback = false;
+#endif
+
+      // The offload sockets use the W5500's own TCP/IP engine. Give it the address lwIP is using
+      w5500_set_ip_info(eth->eth_mac, event->ip_info.ip.addr, event->ip_info.netmask.addr, event->ip_info.gw.addr);
+
+#if ESP32_W5500_FEATURE_DHCP_LEASE
+      if (!fallback && !eth->staticIP && eth->fast_reconnect)
+        eth->saveLease(event);
+#else
+      (void)fallback;
+#endif
+
+      if (eth->boot_times.gotIP == 0)
+      {
+        int64_t now = esp_timer_get_time();
+
+        eth->boot_times.dhcp = now - eth->phase_us;
+        eth->boot_times.gotIP = now - eth->begin_us;
+        eth->boot_times.sincePowerOn = now;
+      }
+
+      eth->updateIPInfo();
+      xEventGroupSetBits(eth->eth_events, ESP32_W5500_GOT_IP_BIT);
+
+      return;
+    }
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+    // IDF 4.4 has no LOST_IP for Ethernet. There, DISCONNECTED and STOP re-read the netif
+    if ((event_id == IP_EVENT_ETH_LOST_IP) && (((ip_event_got_ip_t *)event_data)->esp_netif == eth->eth_netif))
+      eth->updateIPInfo();
+#endif
+
+    // Anything else is about another interface, or IPv6 which ESP32_W5500_IPInfo does not carry
   }
+  else if (event_base == ETH_EVENT)
+  {
+    if ((event_data == NULL) || (*(esp_eth_handle_t *)event_data != eth->eth_handle))
+      return;
 
-  return hostname;
+    int64_t now = esp_timer_get_time();
+
+    switch (event_id)
+    {
+      case ETHERNET_EVENT_START:
+#if W5500_NETIF_ACTIONS
+        esp_netif_action_start(eth->eth_netif, event_base, event_id, event_data);
+#endif
+
+        if (eth->boot_times.start == 0)
+        {
+          eth->boot_times.start = now - eth->phase_us;
+          eth->phase_us = now;
+        }
+
+        xEventGroupSetBits(eth->eth_events, ESP32_W5500_STARTED_BIT);
+        break;
+
+      case ETHERNET_EVENT_CONNECTED:
+        if (eth->boot_times.phyLink == 0)
+        {
+          eth->boot_times.phyLink = now - eth->phase_us;
+          eth->phase_us = now;
+        }
+
+#if W5500_NETIF_ACTIONS
+        // Brings the lwIP netif up and starts the DHCP client, in the tcpip thread, before it returns
+        esp_netif_action_connected(eth->eth_netif, event_base, event_id, event_data);
+
+#if ESP32_W5500_FEATURE_DHCP_LEASE
+        // The DHCP client is running now, so it can be asked for the stored lease
+        eth->requestLeaseReboot();
+#endif
+#endif
+
+        xEventGroupSetBits(eth->eth_events, ESP32_W5500_CONNECTED_BIT);
+
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+        eth->startFallback();
+#endif
+        break;
+
+      case ETHERNET_EVENT_DISCONNECTED:
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+        eth->stopFallback();
+#endif
+#if W5500_NETIF_ACTIONS
+        esp_netif_action_disconnected(eth->eth_netif, event_base, event_id, event_data);
+#endif
+        xEventGroupClearBits(eth->eth_events, ESP32_W5500_CONNECTED_BIT | ESP32_W5500_GOT_IP_BIT);
+        eth->updateIPInfo();
+        break;
+
+      case ETHERNET_EVENT_STOP:
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+        eth->stopFallback();
+#endif
+#if W5500_NETIF_ACTIONS
+        esp_netif_action_stop(eth->eth_netif, event_base, event_id, event_data);
+#endif
+        xEventGroupClearBits(eth->eth_events, ESP32_W5500_STARTED_BIT | ESP32_W5500_CONNECTED_BIT | ESP32_W5500_GOT_IP_BIT);
+        eth->updateIPInfo();
+        break;
+
+      default:
+        break;
+    }
+  }
 }
 
 ////////////////////////////////////////
 
-bool ESP32_W5500::setHostname(const char * hostname)
+bool ESP32_W5500::waitForBits(EventBits_t bits, uint32_t timeout_ms)
 {
-  return tcpip_adapter_set_hostname(TCPIP_ADAPTER_IF_ETH, hostname) == 0;
+  if (eth_events == NULL)
+    return false;
+
+  TickType_t ticks = (timeout_ms == ESP32_W5500_WAIT_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+
+  return (xEventGroupWaitBits(eth_events, bits, pdFALSE, pdTRUE, ticks) & bits) == bits;
 }
 
 ////////////////////////////////////////
 
-bool ESP32_W5500::fullDuplex()
+bool ESP32_W5500::waitForIP(uint32_t timeout_ms)
 {
-  eth_duplex_t duplex;
-  w5500_get_duplex(eth_phy, &duplex);
-  return (duplex == ETH_DUPLEX_FULL);
+  return waitForBits(ESP32_W5500_GOT_IP_BIT, timeout_ms);
 }
 
 ////////////////////////////////////////
 
-bool ESP32_W5500::linkUp()
+const ESP32_W5500_BootTimes &ESP32_W5500::bootTimes()
 {
-  eth_link_t link_status;
-  w5500_get_link_status(eth_phy, &link_status);
-  return (link_status == ETH_LINK_UP);
+  return boot_times;
 }
 
 ////////////////////////////////////////
 
-uint8_t ESP32_W5500::linkSpeed()
+static portMUX_TYPE ip_info_mux = portMUX_INITIALIZER_UNLOCKED;
+
+void ESP32_W5500::updateIPInfo()
 {
-  eth_speed_t speed;
+  esp_netif_ip_info_t ip;
+  uint32_t dns[2] = { 0, 0 };
+
+  if ((eth_netif == NULL) || (esp_netif_get_ip_info(eth_netif, &ip) != ESP_OK))
+  {
+    memset(&ip, 0, sizeof(ip));
+  }
+
+  for (int i = 0; i < 2; i++)
+  {
+    const ip_addr_t * dns_ip = dns_getserver(i);
+
+    if (dns_ip)
+      dns[i] = dns_ip->u_addr.ip4.addr;
+  }
+
+  // Writers (event loop task and config()) are serialized by the spinlock. Readers never block:
+  // they retry if the sequence number is odd or changed while they copied
+  portENTER_CRITICAL(&ip_info_mux);
+
+  // Unchanged: keep the generation, so readers polling it only wake for a real change
+  if ((ip_info.ip == ip.ip.addr) && (ip_info.netmask == ip.netmask.addr) && (ip_info.gateway == ip.gw.addr)
+      && (ip_info.dns[0] == dns[0]) && (ip_info.dns[1] == dns[1]))
+  {
+    portEXIT_CRITICAL(&ip_info_mux);
+
+    return;
+  }
+
+  uint32_t seq = ip_info_seq + 1;
+
+  __atomic_store_n(&ip_info_seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  __atomic_store_n(&ip_info.generation, (seq + 1) >> 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&ip_info.ip, ip.ip.addr, __ATOMIC_RELAXED);
+  __atomic_store_n(&ip_info.netmask, ip.netmask.addr, __ATOMIC_RELAXED);
+  __atomic_store_n(&ip_info.gateway, ip.gw.addr, __ATOMIC_RELAXED);
+  __atomic_store_n(&ip_info.dns[0], dns[0], __ATOMIC_RELAXED);
+  __atomic_store_n(&ip_info.dns[1], dns[1], __ATOMIC_RELAXED);
+
+  __atomic_store_n(&ip_info_seq, seq + 1, __ATOMIC_RELEASE);
+
+  portEXIT_CRITICAL(&ip_info_mux);
+}
+
+////////////////////////////////////////
+
+uint32_t ESP32_W5500::getIPInfo(ESP32_W5500_IPInfo &info)
+{
+  uint32_t seq;
+
+  do
+  {
+    seq = __atomic_load_n(&ip_info_seq, __ATOMIC_ACQUIRE);
+
+    info.generation = __atomic_load_n(&ip_info.generation, __ATOMIC_RELAXED);
+    info.ip = __atomic_load_n(&ip_info.ip, __ATOMIC_RELAXED);
+    info.netmask = __atomic_load_n(&ip_info.netmask, __ATOMIC_RELAXED);
+    info.gateway = __atomic_load_n(&ip_info.gateway, __ATOMIC_RELAXED);
+    info.dns[0] = __atomic_load_n(&ip_info.dns[0], __ATOMIC_RELAXED);
+    info.dns[1] = __atomic_load_n(&ip_info.dns[1], __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || (seq != __atomic_load_n(&ip_info_seq, __ATOMIC_RELAXED)));
+
+  return info.generation;
+}
+
+////////////////////////////////////////
+
+uint32_t ESP32_W5500::ipInfoGeneration()
+{
+  uint32_t seq = __atomic_load_n(&ip_info_seq, __ATOMIC_ACQUIRE);
+
+  return (seq + 1) >> 1;
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress dns1, IPAddress dns2)
+{
+  esp_err_t err = ESP_OK;
+  esp_netif_ip_info_t info;
+
+  if (eth_netif == NULL)
+  {
+    ET_LOGERROR0("config must be called after begin");
+    return false;
+  }
+
+  if (static_cast<uint32_t>(local_ip) != 0)
+  {
+    info.ip.addr = static_cast<uint32_t>(local_ip);
+    info.gw.addr = static_cast<uint32_t>(gateway);
+    info.netmask.addr = static_cast<uint32_t>(subnet);
+  }
+  else
+  {
+    info.ip.addr = 0;
+    info.gw.addr = 0;
+    info.netmask.addr = 0;
+  }
+
+  err = esp_netif_dhcpc_stop(eth_netif);
+
+  if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED)
+  {
+    ET_LOGERRORF("DHCP could not be stopped! Error = %d", err);
+    return false;
+  }
+
+  err = esp_netif_set_ip_info(eth_netif, &info);
+
+  if (err != ERR_OK)
+  {
+    ET_LOGERRORF("STA IP could not be configured! Error = %d", err);
+    return false;
+  }
+
+  if (info.ip.addr)
+  {
+    staticIP = true;
+  }
+  else
+  {
+    err = esp_netif_dhcpc_start(eth_netif);
+
+    if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED)
+    {
+      ET_LOGWARNF("DHCP could not be started! Error = %d", err);
+      return false;
+    }
+
+    staticIP = false;
+  }
+
+  ip_addr_t d;
+  d.type = IPADDR_TYPE_V4;
+
+  if (static_cast<uint32_t>(dns1) != 0)
+  {
+    // Set DNS1-Server
+    d.u_addr.ip4.addr = static_cast<uint32_t>(dns1);
+    dns_setserver(0, &d);
+  }
+
+  if (static_cast<uint32_t>(dns2) != 0)
+  {
+    // Set DNS2-Server
+    d.u_addr.ip4.addr = static_cast<uint32_t>(dns2);
+    dns_setserver(1, &d);
+  }
+
+  updateIPInfo();
+
+  return true;
+}
+
+////////////////////////////////////////
+
+IPAddress ESP32_W5500::localIP()
+{
+  ESP32_W5500_IPInfo info;
+  getIPInfo(info);
+
+  return IPAddress(info.ip);
+}
+
+////////////////////////////////////////
+
+IPAddress ESP32_W5500::subnetMask()
+{
+  ESP32_W5500_IPInfo info;
+  getIPInfo(info);
+
+  return IPAddress(info.netmask);
+}
+
+////////////////////////////////////////
+
+IPAddress ESP32_W5500::gatewayIP()
+{
+  ESP32_W5500_IPInfo info;
+  getIPInfo(info);
+
+  return IPAddress(info.gateway);
+}
+
+////////////////////////////////////////
+
+IPAddress ESP32_W5500::dnsIP(uint8_t dns_no)
+{
+  if (dns_no >= 2)
+  {
+    const ip_addr_t * dns_ip = dns_getserver(dns_no);
+
+    return IPAddress(dns_ip->u_addr.ip4.addr);
+  }
+
+  ESP32_W5500_IPInfo info;
+  getIPInfo(info);
+
+  return IPAddress(info.dns[dns_no]);
+}
+
+////////////////////////////////////////
+
+IPAddress ESP32_W5500::broadcastIP()
+{
+  ESP32_W5500_IPInfo info;
+
+  if (getIPInfo(info) == 0)
+  {
+    return IPAddress();
+  }
+
+  return WiFiGenericClass::calculateBroadcast(IPAddress(info.ip), IPAddress(info.netmask));
+}
+
+////////////////////////////////////////
+
+IPAddress ESP32_W5500::networkID()
+{
+  ESP32_W5500_IPInfo info;
+
+  if (getIPInfo(info) == 0)
+  {
+    return IPAddress();
+  }
+
+  return WiFiGenericClass::calculateNetworkID(IPAddress(info.ip), IPAddress(info.netmask));
+}
+
+////////////////////////////////////////
+
+uint8_t ESP32_W5500::subnetCIDR()
+{
+  ESP32_W5500_IPInfo info;
+
+  if (getIPInfo(info) == 0)
+  {
+    return (uint8_t)0;
+  }
+
+  return WiFiGenericClass::calculateSubnetCIDR(IPAddress(info.netmask));
+}
+
+////////////////////////////////////////
+
+const char * ESP32_W5500::getHostname()
+{
+  const char * hostname;
+
+  if ((eth_netif == NULL) || (esp_netif_get_hostname(eth_netif, &hostname) != ESP_OK))
+  {
+    return NULL;
+  }
+
+  return hostname;
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::setHostname(const char * hostname)
+{
+  return (eth_netif != NULL) && (esp_netif_set_hostname(eth_netif, hostname) == ESP_OK);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::fullDuplex()
+{
+  eth_duplex_t duplex = ETH_DUPLEX_HALF;
+  w5500_get_duplex(eth_phy, &duplex);
+  return (duplex == ETH_DUPLEX_FULL);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::linkUp()
+{
+  eth_link_t link_status = ETH_LINK_DOWN;
+  w5500_get_link_status(eth_phy, &link_status);
+  return (link_status == ETH_LINK_UP);
+}
+
+////////////////////////////////////////
+
+uint8_t ESP32_W5500::linkSpeed()
+{
+  eth_speed_t speed = ETH_SPEED_10M;
   w5500_get_speed(eth_phy, &speed);
   return (speed == ETH_SPEED_100M ? 100 : 10);
 }
 
 ////////////////////////////////////////
 
+uint32_t ESP32_W5500::linkChangeCount()
+{
+  return w5500_get_link_change_count(eth_phy);
+}
+
+////////////////////////////////////////
+
+uint32_t ESP32_W5500::heapAllocations()
+{
+  return w5500_get_alloc_count(eth_mac);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::getSchedulerStats(w5500_sched_stats_t &stats)
+{
+  return w5500_get_sched_stats(eth_mac, &stats) == ESP_OK;
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::getStats(ESP32_W5500_Stats &stats)
+{
+  memset(&stats, 0, sizeof(stats));
+
+  if ((w5500_get_stats(eth_mac, &stats.driver) != ESP_OK) || (w5500_get_sched_stats(eth_mac, &stats.sched) != ESP_OK))
+    return false;
+
+  stats.linkChanges = linkChangeCount();
+  stats.linkUp = linkUp();
+
+  return true;
+}
+
+////////////////////////////////////////
+
+static void printMetricHeader(Print &out, const char *name, const char *type, const char *help)
+{
+  out.printf("# HELP w5500_%s %s\n# TYPE w5500_%s %s\n", name, help, name, type);
+}
+
+static void printMetricValue(Print &out, const char *name, int instance, const char *labels, unsigned long long value)
+{
+  out.printf("w5500_%s{interface=\"%d\"%s} %llu\n", name, instance, labels, value);
+}
+
+static void printMetric(Print &out, const char *name, const char *type, const char *help, int instance,
+                        unsigned long long value)
+{
+  printMetricHeader(out, name, type, help);
+  printMetricValue(out, name, instance, "", value);
+}
+
+void ESP32_W5500::printMetrics(Print &out)
+{
+  ESP32_W5500_Stats stats;
+
+  if (!getStats(stats))
+    return;
+
+  const w5500_stats_t &d = stats.driver;
+  const w5500_sched_stats_t &s = stats.sched;
+
+  printMetric(out, "rx_frames_total", "counter", "Frames received and passed to lwIP", instance, d.rx_frames);
+  printMetric(out, "rx_bytes_total", "counter", "Bytes received", instance, d.rx_bytes);
+  printMetric(out, "tx_frames_total", "counter", "Frames transmitted", instance, d.tx_frames);
+  printMetric(out, "tx_bytes_total", "counter", "Bytes transmitted", instance, d.tx_bytes);
+
+  printMetricHeader(out, "rx_drops_total", "counter", "Received frames dropped, by reason");
+  printMetricValue(out, "rx_drops_total", instance, ",reason=\"no_mem\"", d.rx_drop_no_mem);
+  printMetricValue(out, "rx_drops_total", instance, ",reason=\"error\"", d.rx_drop_error);
+  printMetricValue(out, "rx_drops_total", instance, ",reason=\"oversize\"", d.rx_drop_oversize);
+
+  printMetric(out, "tx_drops_total", "counter", "Frames not transmitted", instance, d.tx_drops);
+  printMetric(out, "tx_full_total", "counter", "Frames which did not fit in the TX buffer", instance, d.tx_full);
+  printMetric(out, "rx_buffer_peak_bytes", "gauge", "Most bytes seen waiting in the RX buffer", instance, d.rx_rsr_peak);
+
+  printMetric(out, "spi_transactions_total", "counter", "SPI transactions", instance, d.spi_transactions);
+  printMetric(out, "spi_bytes_total", "counter", "SPI bytes, including command and address", instance, d.spi_bytes);
+  printMetric(out, "spi_lock_waits_total", "counter", "SPI lock acquisitions which had to wait", instance, d.lock_waits);
+  printMetric(out, "spi_lock_timeouts_total", "counter", "SPI lock acquisitions which timed out", instance,
+              s.spi_lock_timeouts);
+  printMetric(out, "cmd_timeouts_total", "counter", "Socket commands the chip did not take", instance, d.cmd_timeouts);
+  printMetric(out, "interrupts_total", "counter", "INT pin interrupts", instance, d.isr_count);
+
+  printMetricHeader(out, "turn_timeouts_total", "counter", "RX / TX waits for the other direction which timed out");
+  printMetricValue(out, "turn_timeouts_total", instance, ",direction=\"rx\"", s.rx_turn_timeouts);
+  printMetricValue(out, "turn_timeouts_total", instance, ",direction=\"tx\"", s.tx_turn_timeouts);
+
+  printMetricHeader(out, "handoffs_total", "counter", "Frame turns handed to a waiting direction");
+  printMetricValue(out, "handoffs_total", instance, ",direction=\"rx\"", s.handoffs_to_rx);
+  printMetricValue(out, "handoffs_total", instance, ",direction=\"tx\"", s.handoffs_to_tx);
+
+  printMetric(out, "rx_status_errors_total", "counter", "Failed interrupt status reads, retried", instance,
+              s.rx_status_errors);
+  printMetric(out, "rx_batch_limited_total", "counter", "Interrupts with more frames than one RX batch", instance,
+              s.rx_batch_limited);
+
+  printMetric(out, "link_changes_total", "counter", "Link state changes", instance, stats.linkChanges);
+  printMetric(out, "link_up", "gauge", "1 if the link is up", instance, stats.linkUp);
+}
+
+////////////////////////////////////////
+
+#if W5500_TRACE
+
+void ESP32_W5500::startTrace()
+{
+  w5500_trace_start();
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::stopTrace()
+{
+  w5500_trace_stop();
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::clearTrace()
+{
+  w5500_trace_clear();
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::dumpTrace(Print &out, bool restart)
+{
+  w5500_trace_event_t event;
+  uint32_t lost;
+
+  w5500_trace_stop();
+
+  uint32_t count = w5500_trace_count(&lost);
+
+  // Text, so the same dump works from a web page or a serial log. The header is how the converter finds the start
+  out.printf("# W5500 trace v1 cpu_mhz=%u events=%u lost=%u\n", (unsigned)getCpuFrequencyMhz(), count, lost);
+  out.printf("# type core cycles duration len arg\n");
+
+  for (uint32_t i = 0; w5500_trace_get(i, &event); i++)
+  {
+    out.printf("%u %u %08x %08x %04x %08x\n", event.type, event.core, event.cycles, event.duration, event.len, event.arg);
+  }
+
+  out.printf("# end\n");
+
+  if (restart)
+    w5500_trace_start();
+}
+
+#endif
+
+////////////////////////////////////////
+
+#if W5500_LATENCY_HISTOGRAMS
+
+bool ESP32_W5500::getLatencyHistogram(w5500_hist_id_t id, w5500_hist_t &hist)
+{
+  return w5500_get_histogram(eth_mac, id, &hist) == ESP_OK;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::resetLatencyHistograms()
+{
+  w5500_reset_histograms(eth_mac);
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::printLatencyHistograms(Print &out)
+{
+  static const char * const names[W5500_HIST_NUM] =
+  {
+    "isr_wake", "rx_read", "rx_input", "tx_copy", "tx_send", "tx_done", "tx_total"
+  };
+
+  w5500_hist_t hist;
+  float mhz = getCpuFrequencyMhz();
+
+  out.printf("%-10s %10s %10s %10s %10s %10s\n", "Latency", "Count", "p50 us", "p99 us", "p99.9 us", "max us");
+
+  for (int id = 0; id < W5500_HIST_NUM; id++)
+  {
+    if (!getLatencyHistogram((w5500_hist_id_t)id, hist))
+      return;
+
+    uint32_t count = 0;
+
+    for (int i = 0; i < W5500_HIST_BUCKETS; i++)
+      count += hist.count[i];
+
+    out.printf("%-10s %10u %10.1f %10.1f %10.1f %10.1f\n", names[id], count,
+               w5500_hist_percentile(&hist, 500) / mhz, w5500_hist_percentile(&hist, 990) / mhz,
+               w5500_hist_percentile(&hist, 999) / mhz, hist.max_cycles / mhz);
+  }
+}
+
+#endif
+
+////////////////////////////////////////
+
+#if W5500_CYCLE_ACCOUNTING
+
+bool ESP32_W5500::getCycleStats(w5500_cycle_stats_t &stats)
+{
+  return w5500_get_cycle_stats(eth_mac, &stats) == ESP_OK;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::resetCycleStats()
+{
+  w5500_reset_cycle_stats(eth_mac);
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::printCycleStats(Print &out)
+{
+  static const char * const names[W5500_STAGE_NUM] =
+  {
+    "rx_alloc", "rx_parse", "rx_spi", "rx_cmd", "rx_input", "tx_prep", "tx_spi", "tx_cmd"
+  };
+
+  w5500_cycle_stats_t stats;
+
+  if (!getCycleStats(stats))
+    return;
+
+  // Cycles available on each core over the window
+  double window = (double)stats.elapsed_us * getCpuFrequencyMhz();
+  uint64_t total[2][2] = { };   // [direction][core]
+
+  out.printf("%u RX and %u TX frames in %.1f s\n", stats.rx_frames, stats.tx_frames, stats.elapsed_us / 1e6);
+  out.printf("%-10s %12s %8s %8s\n", "Stage", "Cycles/frame", "Core0%", "Core1%");
+
+  for (int stage = 0; stage < W5500_STAGE_NUM; stage++)
+  {
+    int tx = (stage >= W5500_STAGE_TX_PREP) ? 1 : 0;
+    uint32_t frames = tx ? stats.tx_frames : stats.rx_frames;
+    uint64_t cycles = stats.cycles[0][stage] + stats.cycles[1][stage];
+
+    total[tx][0] += stats.cycles[0][stage];
+    total[tx][1] += stats.cycles[1][stage];
+
+    out.printf("%-10s %12u %7.2f%% %7.2f%%\n", names[stage], frames ? (uint32_t)(cycles / frames) : 0,
+               window ? 100.0 * stats.cycles[0][stage] / window : 0.0,
+               window ? 100.0 * stats.cycles[1][stage] / window : 0.0);
+  }
+
+  for (int tx = 0; tx < 2; tx++)
+  {
+    uint32_t frames = tx ? stats.tx_frames : stats.rx_frames;
+
+    out.printf("%-10s %12u %7.2f%% %7.2f%%\n", tx ? "tx_total" : "rx_total",
+               frames ? (uint32_t)((total[tx][0] + total[tx][1]) / frames) : 0,
+               window ? 100.0 * total[tx][0] / window : 0.0, window ? 100.0 * total[tx][1] / window : 0.0);
+  }
+}
+
+#endif
+
+////////////////////////////////////////
+
+#if W5500_CAPTURE
+
+bool ESP32_W5500::startCapture(const w5500_capture_config_t &config)
+{
+  esp_err_t err = w5500_capture_start(eth_mac, &config);
+
+  if (err != ESP_OK)
+  {
+    ET_LOGERROR1("startCapture: w5500_capture_start failed: ", esp_err_to_name(err));
+    return false;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::stopCapture()
+{
+  w5500_capture_stop(eth_mac);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::getCaptureStats(w5500_capture_stats_t &stats)
+{
+  return w5500_capture_get_stats(eth_mac, &stats) == ESP_OK;
+}
+
+////////////////////////////////////////
+
+size_t ESP32_W5500::readCapture(uint8_t *buffer, size_t maxLen, size_t index)
+{
+  size_t length = 0;
+
+  if (index == 0)
+  {
+    if ((maxLen < 24) || (w5500_capture_file_header(eth_mac, buffer) != ESP_OK))
+      return 0;
+
+    length = 24;
+  }
+
+  return length + w5500_capture_read(eth_mac, buffer + length, maxLen - length);
+}
+
+////////////////////////////////////////
+
+size_t ESP32_W5500::streamCapture(Print &out, bool header)
+{
+  uint8_t buffer[512];
+  size_t total = 0;
+  size_t length = readCapture(buffer, sizeof(buffer), header ? 0 : 1);
+
+  while (length)
+  {
+    total += out.write(buffer, length);
+    length = readCapture(buffer, sizeof(buffer), 1);
+  }
+
+  return total;
+}
+
+#endif
+
+////////////////////////////////////////
+
+#if W5500_FLOW_TABLE
+
+size_t ESP32_W5500::getTopFlows(w5500_flow_t *flows, size_t n, bool byBytes)
+{
+  return w5500_flow_top(eth_mac, flows, n, byBytes);
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::resetFlows()
+{
+  w5500_flow_reset(eth_mac);
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::printTopFlows(Print &out, size_t n, bool byBytes)
+{
+  // Plain malloc: a diagnostic print is not one of the driver's allocations, so heapAllocations() is unchanged
+  w5500_flow_t *flow = (w5500_flow_t *)malloc(n * sizeof(*flow));
+
+  if (!flow)
+    return;
+
+  size_t count = getTopFlows(flow, n, byBytes);
+
+  out.printf("%-17s %6s %-15s %5s %5s %10s %12s %10s %12s\n", "MAC", "Type", "IP", "Proto", "Port",
+             "RxPackets", "RxBytes", "TxPackets", "TxBytes");
+
+  for (size_t i = 0; i < count; i++)
+  {
+    const uint8_t *mac = flow[i].mac;
+    const uint8_t *ip = (const uint8_t *)&flow[i].ip;
+    char address[16];
+
+    snprintf(address, sizeof(address), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+    out.printf("%02x:%02x:%02x:%02x:%02x:%02x 0x%04x %-15s %5u %5u %10u %12llu %10u %12llu\n",
+               mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], flow[i].ether_type, flow[i].ip ? address : "-",
+               flow[i].protocol, flow[i].port, flow[i].rx_packets, (unsigned long long)flow[i].rx_bytes,
+               flow[i].tx_packets, (unsigned long long)flow[i].tx_bytes);
+  }
+
+  free(flow);
+  out.printf("%u flows evicted\n", w5500_flow_evictions(eth_mac));
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::setFlowSampling(uint32_t rate, w5500_flow_sample_cb_t callback, void *arg)
+{
+  return w5500_flow_set_sampling(eth_mac, rate, callback, arg) == ESP_OK;
+}
+
+#endif
+
+////////////////////////////////////////
+
+#if W5500_PKTGEN
+
+// Frames/s, Mbit/s of frame data, and Mbit/s of line use: each frame also takes a preamble, an FCS
+// and an inter-frame gap, 24 bytes in all
+static void printLineRate(Print &out, uint32_t frames, uint64_t bytes, uint32_t elapsedUs)
+{
+  double seconds = elapsedUs / 1000000.0;
+
+  if (seconds <= 0)
+  {
+    out.printf("%u frames\n", frames);
+    return;
+  }
+
+  out.printf("%u frames in %.3f s: %.0f frames/s, %.2f Mbit/s, %.2f Mbit/s on the line\n", frames, seconds,
+             frames / seconds, (bytes * 8.0) / elapsedUs, ((bytes + frames * 24ULL) * 8.0) / elapsedUs);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::runPacketGenerator(const w5500_pktgen_config_t &config, w5500_pktgen_result_t &result)
+{
+  esp_err_t err = w5500_pktgen_run(eth_mac, &config, &result);
+
+  if (err != ESP_OK)
+  {
+    ET_LOGERROR1("runPacketGenerator: w5500_pktgen_run failed: ", esp_err_to_name(err));
+    return false;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::printPacketGeneratorResult(Print &out, const w5500_pktgen_result_t &result)
+{
+  out.print("Sent ");
+  printLineRate(out, result.frames, result.bytes, result.elapsed_us);
+
+  if (result.errors || result.late)
+    out.printf("%u failed, %u late\n", result.errors, result.late);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::startSink(uint16_t etherType)
+{
+  return w5500_sink_start(eth_mac, etherType) == ESP_OK;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::stopSink()
+{
+  w5500_sink_stop(eth_mac);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::getSinkStats(w5500_sink_stats_t &stats)
+{
+  return w5500_sink_get_stats(eth_mac, &stats) == ESP_OK;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::printSinkStats(Print &out)
+{
+  w5500_sink_stats_t stats;
+
+  if (!getSinkStats(stats))
+    return;
+
+  uint32_t expected = stats.frames + stats.lost;
+
+  out.print("Received ");
+  printLineRate(out, stats.frames, stats.bytes, stats.elapsed_us);
+  out.printf("%u lost (%.3f%%), %u out of order, sequence %u to %u\n", stats.lost,
+             expected ? (100.0 * stats.lost) / expected : 0.0, stats.out_of_order, stats.first_seq,
+             stats.next_seq - 1);
+}
+
+#endif
+
+////////////////////////////////////////
+
+int ESP32_W5500::spiClient()
+{
+  return eth_mac ? w5500_get_spi_client(eth_mac) : -1;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::printSPIBusUsage(Print &out)
+{
+  w5500_spi_client_stats_t stats;
+
+  out.printf("SPI host %d\n", spi_host);
+  out.printf("%-12s %4s %10s %10s %7s %10s %10s\n", "Client", "Prio", "Acquired", "Contended", "Busy%",
+             "AvgWaitUs", "MaxWaitUs");
+
+  for (int client = 0; client < W5500_SPI_MAX_CLIENTS; client++)
+  {
+    if ((w5500_spi_client_get_stats(client, &stats) != ESP_OK) || (stats.spi_host != spi_host))
+      continue;
+
+    out.printf("%-12s %4d %10u %10u %6.2f%% %10u %10u\n", stats.name ? stats.name : "?", stats.priority,
+               stats.acquisitions, stats.contended,
+               stats.window_us ? (100.0 * stats.busy_us / stats.window_us) : 0.0,
+               stats.acquisitions ? (uint32_t)(stats.wait_us / stats.acquisitions) : 0, stats.max_wait_us);
+  }
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::reserveOffloadSockets(uint8_t count, uint8_t bufferKB)
+{
+  if (eth_mac != NULL)
+  {
+    ET_LOGERROR0("reserveOffloadSockets must be called before begin");
+
+    return false;
+  }
+
+  // Sockets 1-7 are available. SOCK0 needs at least 2KB to hold a full frame
+  if ((count > 7) || ((count > 0) && ((bufferKB == 0) || (bufferKB > 8) || (bufferKB & (bufferKB - 1))))
+      || ((count * bufferKB) > 14))
+  {
+    ET_LOGERROR0("Invalid offload socket reservation");
+
+    return false;
+  }
+
+  offload_sockets = count;
+  offload_kb = bufferKB;
+
+  return true;
+}
+
+////////////////////////////////////////
+
+uint8_t ESP32_W5500::offloadSockets()
+{
+  return offload_sockets;
+}
+
+////////////////////////////////////////
+
+#if ESP32_W5500_FEATURE_IPV6
+
 bool ESP32_W5500::enableIpV6()
 {
-  return tcpip_adapter_create_ip6_linklocal(TCPIP_ADAPTER_IF_ETH) == 0;
+  return (eth_netif != NULL) && (esp_netif_create_ip6_linklocal(eth_netif) == ESP_OK);
 }
 
 ////////////////////////////////////////
 
 IPv6Address ESP32_W5500::localIPv6()
 {
-  static ip6_addr_t addr;
+  esp_ip6_addr_t addr;
 
-  if (tcpip_adapter_get_ip6_linklocal(TCPIP_ADAPTER_IF_ETH, &addr))
+  if ((eth_netif == NULL) || (esp_netif_get_ip6_linklocal(eth_netif, &addr) != ESP_OK))
   {
     return IPv6Address();
   }
@@ -440,6 +1646,8 @@ IPv6Address ESP32_W5500::localIPv6()
   return IPv6Address(addr.addr);
 }
 
+#endif
+
 ////////////////////////////////////////
 
 uint8_t * ESP32_W5500::macAddress(uint8_t* mac)
@@ -460,6 +1668,8 @@ uint8_t * ESP32_W5500::macAddress(uint8_t* mac)
 
 ////////////////////////////////////////
 
+#if ESP32_W5500_FEATURE_STRING
+
 String ESP32_W5500::macAddress()
 {
   uint8_t mac[6] = {0, 0, 0, 0, 0, 0};
@@ -470,6 +1680,10 @@ String ESP32_W5500::macAddress()
   return String(macStr);
 }
 
+#endif
+
 ////////////////////////////////////////
 
 ESP32_W5500 ETH;
+
+bool ESP32_W5500_eth_connected = false;
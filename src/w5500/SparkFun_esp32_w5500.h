@@ -20,15 +20,148 @@
 #include "esp_system.h"
 #include "esp_eth.h"
 #include "driver/spi_master.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/timers.h"
 
 #include <hal/spi_types.h>
 
+#include "esp_eth/esp_eth_w5500.h"
+
+#include "SparkFun_WebServer_ESP32_W5500_Profile.h"
+
 ////////////////////////////////////////
 
 static uint8_t W5500_Default_Mac[] = { 0xFE, 0xED, 0xDE, 0xAD, 0xBE, 0xEF };
 
 ////////////////////////////////////////
 
+// Consistent copy of the interface addresses (network byte order, as IPAddress expects)
+typedef struct
+{
+  uint32_t generation;  // Changes every time one of the addresses changes. 0 = never configured
+  uint32_t ip;
+  uint32_t netmask;
+  uint32_t gateway;
+  uint32_t dns[2];
+} ESP32_W5500_IPInfo;
+
+////////////////////////////////////////
+
+// Bits of ESP32_W5500::eth_events
+#define ESP32_W5500_STARTED_BIT     (1 << 0)
+#define ESP32_W5500_CONNECTED_BIT   (1 << 1)
+#define ESP32_W5500_GOT_IP_BIT      (1 << 2)
+#define ESP32_W5500_FALLBACK_BIT    (1 << 3)  // The address is the link-local / static fallback, not from DHCP
+
+#define ESP32_W5500_WAIT_FOREVER    0xFFFFFFFF
+
+// Number of ESP32_W5500 objects which can be running at the same time
+#ifndef ESP32_W5500_MAX_INSTANCES
+  #define ESP32_W5500_MAX_INSTANCES   4
+#endif
+
+// Time spent in each phase of the last begin(), in microseconds. 0 = phase not reached yet
+typedef struct
+{
+  uint32_t spiInit;     // ISR service, SPI bus and W5500 device
+  uint32_t chipInit;    // Driver install: chip reset, version check and socket setup
+  uint32_t start;       // esp_eth_start until ETHERNET_EVENT_START
+  uint32_t phyLink;     // ETHERNET_EVENT_START until the PHY reports link
+  uint32_t dhcp;        // Link up until GOT_IP (DHCP, or the static address being applied)
+  uint32_t gotIP;       // Total: begin() until GOT_IP
+  uint32_t sincePowerOn; // Power on (esp_timer) until GOT_IP
+  uint32_t firstRequest; // Power on until the first markFirstRequest() call
+  bool fastReconnect;   // DHCP INIT-REBOOT was sent for the lease stored in NVS
+  uint32_t restartChip; // Last restart(): chip reset and reprogramming
+  uint32_t restartLink; // Last restart(): call until the PHY reported link again. Compare with spiInit + chipInit + start + phyLink
+  uint32_t detach;      // Last detach(): driver stopped, SPI bus and ISR service released
+  uint32_t attach;      // Last attach(): call until the PHY reported link again
+} ESP32_W5500_BootTimes;
+
+////////////////////////////////////////
+
+// Driver set-up for begin(const ESP32_W5500_Config &). Start from ESP32_W5500_DEFAULT_CONFIG and change what you need
+typedef struct
+{
+  int poci;
+  int pico;
+  int sclk;
+  int cs;
+  int intr;
+  int spiClockMHz;            // 14 to 25
+  int spiHost;
+  int spiQueueSize;           // Transactions queued on the SPI device
+  int spiDmaChannel;          // SPI_DMA_CH_AUTO, SPI_DMA_CH1, SPI_DMA_CH2 or SPI_DMA_DISABLED
+  int isrFlags;               // ESP_INTR_FLAG_* (e.g. the interrupt level) if we install the GPIO ISR service
+  // Share the SPI host with other spi_bus_add_device drivers: use a bus they already initialized,
+  // and arbitrate every W5500 transaction with spiPriority (see w5500_spi_acquire)
+  bool spiBusShared;
+  int spiPriority;
+  // The RX task reads frames from the W5500 and hands them to lwIP.
+  // Frames are transmitted from the sending task (normally lwIP's tcpip thread), so there is no TX task
+  uint32_t rxTaskStackSize;
+  uint32_t rxTaskPriority;
+  int rxTaskCore;             // 0, 1 or tskNO_AFFINITY
+  // W5500 socket buffers: see reserveOffloadSockets. 0 keeps the current reservation
+  uint8_t offloadSockets;
+  uint8_t offloadBufferKB;
+  uint8_t *mac;               // Only used if the built-in MAC address can not be read
+} ESP32_W5500_Config;
+
+#define W5500_RX_TASK_STACK_SIZE    2048
+#define W5500_RX_TASK_PRIORITY      1
+#define W5500_SPI_QUEUE_SIZE        20
+
+#define ESP32_W5500_DEFAULT_CONFIG(POCI, PICO, SCLK, CS, INT) \
+  {                                                           \
+    .poci = POCI,                                             \
+    .pico = PICO,                                             \
+    .sclk = SCLK,                                             \
+    .cs = CS,                                                 \
+    .intr = INT,                                              \
+    .spiClockMHz = 25,                                        \
+    .spiHost = SPI3_HOST,                                     \
+    .spiQueueSize = W5500_SPI_QUEUE_SIZE,                     \
+    .spiDmaChannel = SPI_DMA_CH_AUTO,                         \
+    .isrFlags = 0,                                            \
+    .spiBusShared = false,                                    \
+    .spiPriority = W5500_SPI_PRIORITY_DEFAULT,                \
+    .rxTaskStackSize = W5500_RX_TASK_STACK_SIZE,              \
+    .rxTaskPriority = W5500_RX_TASK_PRIORITY,                 \
+    .rxTaskCore = tskNO_AFFINITY,                             \
+    .offloadSockets = 0,                                      \
+    .offloadBufferKB = 4,                                     \
+    .mac = W5500_Default_Mac,                                 \
+  }
+
+////////////////////////////////////////
+
+// Everything getStats() returns. See w5500_stats_t and w5500_sched_stats_t in esp_eth/esp_eth_w5500.h
+typedef struct
+{
+  w5500_stats_t driver;
+  w5500_sched_stats_t sched;
+  uint32_t linkChanges;
+  bool linkUp;
+} ESP32_W5500_Stats;
+
+////////////////////////////////////////
+
+// Last DHCP lease, kept in NVS so the next boot can ask for the same address (INIT-REBOOT)
+typedef struct
+{
+  uint32_t version;
+  uint8_t mac[6];       // The lease is only reused by the interface which got it
+  uint32_t ip;
+  uint32_t netmask;
+  uint32_t gateway;
+  uint32_t dns[2];
+  uint32_t lease_s;     // Lease time granted by the server, in seconds
+} ESP32_W5500_Lease;
+
+////////////////////////////////////////
+
 class ESP32_W5500
 {
   private:
@@ -37,6 +170,70 @@ class ESP32_W5500
     
     uint8_t mac_eth[6] = { 0xFE, 0xED, 0xDE, 0xAD, 0xBE, 0xEF };
 
+    uint8_t offload_sockets;
+    uint8_t offload_kb;
+
+    // Interface addresses, published as a seqlock: ip_info_seq is odd while an update is in progress
+    uint32_t ip_info_seq;
+    ESP32_W5500_IPInfo ip_info;
+
+    void updateIPInfo();
+
+    int64_t begin_us;
+    int64_t phase_us;
+    ESP32_W5500_BootTimes boot_times;
+
+#if ESP32_W5500_FEATURE_DHCP_LEASE
+    // DHCP fast reconnect (SparkFun_esp32_w5500_dhcp.cpp)
+    bool fast_reconnect;
+    bool lease_optimistic;
+    bool lease_valid;
+    ESP32_W5500_Lease lease;
+
+    void loadLease();
+    void saveLease(const ip_event_got_ip_t *event);
+    void requestLeaseReboot();
+    static void dhcp_reboot_cb(void *arg);
+#endif
+
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+    // DHCP timeout fallback (SparkFun_esp32_w5500_dhcp.cpp)
+    uint32_t fallback_timeout_ms;
+    uint32_t fallback_ip;                 // Configured static fallback, 0 = RFC 3927 link-local
+    uint32_t fallback_mask;
+    uint32_t fallback_gw;
+    uint32_t fallback_candidate;          // Address being probed or in use
+    uint8_t fallback_state;
+    uint8_t fallback_probes;
+    uint8_t fallback_attempts;
+    TimerHandle_t fallback_timer;
+#if W5500_STATIC_ALLOCATION
+    StaticTimer_t fallback_timer_buffer;
+#endif
+
+    void startFallback();
+    void stopFallback();
+    static void fallback_timer_cb(TimerHandle_t timer);
+    static void fallback_step(void *arg);
+#endif
+
+    // Driver set-up from begin(), kept so attach() can take the bus back after detach()
+    ESP32_W5500_Config begin_config;
+    bool isr_service_ref;                 // Holding a reference on the shared GPIO ISR service
+    bool is_detached;
+
+    // Interface number, taken in begin(). 0 is the default Ethernet interface (ETH_DEF, eFuse MAC + 3).
+    // The others get their own esp_netif key, a locally administered MAC and their own NVS lease
+    int8_t instance;
+    char if_key[16];
+    char if_desc[8];
+    esp_event_handler_instance_t ip_event_instance;
+    esp_event_handler_instance_t eth_event_instance;
+
+    bool takeInstance();
+    void releaseInstance();
+    void teardown();
+
   public:
     esp_eth_handle_t eth_handle;
     esp_eth_netif_glue_handle_t netif_glue_handle;
@@ -49,6 +246,10 @@ class ESP32_W5500
 
     bool started;
     eth_link_t eth_link;
+    EventGroupHandle_t eth_events;
+#if W5500_STATIC_ALLOCATION
+    StaticEventGroup_t eth_events_buffer;
+#endif
     static void eth_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
 
     ESP32_W5500();
@@ -56,21 +257,152 @@ class ESP32_W5500
 
     bool begin(int POCI, int PICO, int SCLK, int CS, int INT, int SPICLOCK_MHZ = 25, int SPIHOST = SPI3_HOST,
                uint8_t *W5500_Mac = W5500_Default_Mac);
+    bool begin(const ESP32_W5500_Config &config);
 
     void end();
 
+    // Warm re-initialization, e.g. after a detected hang: reset and reprogram the W5500 only.
+    // The SPI bus, ISR, netif, buffers and DHCP lease are kept. Returns once the link is back
+    bool restart(uint32_t timeout_ms = 5000);
+
+    // Hand the SPI host, INT pin and GPIO ISR service over to other code (e.g. Arduino SPI and Ethernet)
+    // without a reboot. The driver is stopped but stays installed: the netif, event handlers and DHCP lease
+    // are kept. Call SPI.end() before attach(), which takes the W5500 back and waits for the link
+    bool detach();
+    bool attach(uint32_t timeout_ms = 5000);
+    bool detached();
+
+    // Interface number (0 for the first begin(), then 1, 2...). -1 if not begun
+    int8_t instanceNumber();
+
+    // Wait for GOT_IP (or any ESP32_W5500_*_BIT). Returns false on timeout
+    bool waitForIP(uint32_t timeout_ms = ESP32_W5500_WAIT_FOREVER);
+    bool waitForBits(EventBits_t bits, uint32_t timeout_ms);
+    const ESP32_W5500_BootTimes &bootTimes();
+    void markFirstRequest();
+
+#if ESP32_W5500_FEATURE_DHCP_LEASE
+    // Store the DHCP lease in NVS and ask for the same address on the next boot (on by default).
+    // optimistic: also use the stored address straight away while the request is in flight.
+    // Call before begin()
+    void setFastReconnect(bool enable, bool optimistic = false);
+    void clearLease();
+#endif
+
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+    // If DHCP has not answered timeout_ms after link up, probe for and use a fallback address:
+    // the given static address, or an RFC 3927 link-local 169.254.x.y address when ip is 0.0.0.0.
+    // DHCP keeps retrying and replaces the fallback when a server answers. timeout_ms = 0 disables
+    void setDHCPFallback(uint32_t timeout_ms, IPAddress ip = (uint32_t)0x00000000, IPAddress subnet = (uint32_t)0x00000000,
+                         IPAddress gateway = (uint32_t)0x00000000);
+    bool usingFallbackAddress();
+#endif
+
     bool config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress dns1 = (uint32_t)0x00000000,
                 IPAddress dns2 = (uint32_t)0x00000000);
 
     const char * getHostname();
     bool setHostname(const char * hostname);
 
+    // Link state is cached by the driver's link poll. These do not touch the SPI bus
     bool fullDuplex();
     bool linkUp();
     uint8_t linkSpeed();
+    uint32_t linkChangeCount();
+
+    // Heap allocations the driver has made since begin(): received frames, the capture ring and the packet
+    // generator's frame. With W5500_STATIC_ALLOCATION only received frames are left:
+    // esp_netif frees RX buffers with free(), so they can not be static
+    uint32_t heapAllocations();
+
+    // RX / TX turn taking and lock timeout counters (see w5500_sched_stats_t). Lock timeouts are
+    // counted here instead of failing silently. Returns false before begin()
+    bool getSchedulerStats(w5500_sched_stats_t &stats);
+
+    // Frame, byte, drop, SPI and interrupt counters. Returns false before begin().
+    // printMetrics writes them in the Prometheus text format (e.g. into an AsyncResponseStream for /metrics),
+    // labelled with interface="<instanceNumber()>"
+    bool getStats(ESP32_W5500_Stats &stats);
+    void printMetrics(Print &out);
+
+#if W5500_TRACE
+    // Event trace ring (build with -DW5500_TRACE=1), shared by all interfaces. dumpTrace stops recording,
+    // writes the events as text and, with restart, records again. Convert the dump with
+    // extras/w5500_trace_to_perfetto.py
+    void startTrace();
+    void stopTrace();
+    void clearTrace();
+    void dumpTrace(Print &out, bool restart = true);
+#endif
+
+#if W5500_LATENCY_HISTOGRAMS
+    // Log2 histograms of the RX and TX path latencies in CPU cycles (see w5500_hist_id_t).
+    // printLatencyHistograms lists the count, p50, p99, p99.9 and max of each in microseconds
+    bool getLatencyHistogram(w5500_hist_id_t id, w5500_hist_t &hist);
+    void resetLatencyHistograms();
+    void printLatencyHistograms(Print &out);
+#endif
 
+#if W5500_CYCLE_ACCOUNTING
+    // CPU cycles of the RX and TX frames per driver stage (see w5500_stage_t) since the last reset.
+    // printCycleStats lists the cycles per frame of each stage and its share of each core
+    bool getCycleStats(w5500_cycle_stats_t &stats);
+    void resetCycleStats();
+    void printCycleStats(Print &out);
+#endif
+
+#if W5500_CAPTURE
+    // pcap capture of the SOCK0 frames (see w5500_capture_config_t) into a ring, in PSRAM when there is some.
+    // readCapture has the shape of an AsyncWebServer chunked response callback: index 0 starts with the pcap
+    // file header and it returns 0 once the ring is empty. streamCapture writes what is in the ring to a
+    // connection, e.g. an ESP32_W5500_TCPClient, whose own frames are not captured
+    bool startCapture(const w5500_capture_config_t &config);
+    void stopCapture();
+    bool getCaptureStats(w5500_capture_stats_t &stats);
+    size_t readCapture(uint8_t *buffer, size_t maxLen, size_t index);
+    size_t streamCapture(Print &out, bool header);
+#endif
+
+#if W5500_FLOW_TABLE
+    // Packets and bytes per peer (MAC, IPv4 address, protocol and port, see w5500_flow_t) in a fixed size
+    // table. printTopFlows lists the busiest. setFlowSampling hands one frame in rate to callback, sFlow style
+    size_t getTopFlows(w5500_flow_t *flows, size_t n, bool byBytes = false);
+    void resetFlows();
+    void printTopFlows(Print &out, size_t n = 10, bool byBytes = false);
+    bool setFlowSampling(uint32_t rate, w5500_flow_sample_cb_t callback, void *arg = NULL);
+#endif
+
+#if W5500_PKTGEN
+    // Line-rate tests of the MAC without lwIP. runPacketGenerator sends test frames (see w5500_pktgen_config_t)
+    // from the calling task and returns when done. The sink counts, sequence checks and discards the test frames
+    // another board sends, before a buffer is allocated. The print functions give frames/s, Mbit/s of frame
+    // data and of line use (with the 24 bytes of preamble, FCS and gap per frame), loss and reordering
+    bool runPacketGenerator(const w5500_pktgen_config_t &config, w5500_pktgen_result_t &result);
+    void printPacketGeneratorResult(Print &out, const w5500_pktgen_result_t &result);
+    bool startSink(uint16_t etherType = 0);
+    void stopSink();
+    bool getSinkStats(w5500_sink_stats_t &stats);
+    void printSinkStats(Print &out);
+#endif
+
+    // Bus arbiter client of the W5500 when ESP32_W5500_Config::spiBusShared is set, otherwise -1.
+    // printSPIBusUsage lists the occupancy of every arbiter client on this interface's SPI host
+    int spiClient();
+    void printSPIBusUsage(Print &out);
+
+    // Reserve W5500 hardware sockets 1..count for TCP offload (ESP32_W5500_TCPClient / ESP32_W5500_TCPServer).
+    // Each gets bufferKB of TX and RX memory. SOCK0 (lwIP, MAC RAW) keeps the rest. Must be called before begin()
+    bool reserveOffloadSockets(uint8_t count, uint8_t bufferKB = 4);
+    uint8_t offloadSockets();
+
+#if ESP32_W5500_FEATURE_IPV6
     bool enableIpV6();
     IPv6Address localIPv6();
+#endif
+
+    // Lock-free copy of all the addresses at once. Returns the generation counter
+    uint32_t getIPInfo(ESP32_W5500_IPInfo &info);
+    uint32_t ipInfoGeneration();
 
     IPAddress localIP();
     IPAddress subnetMask();
@@ -82,7 +414,9 @@ class ESP32_W5500
     uint8_t subnetCIDR();
 
     uint8_t * macAddress(uint8_t* mac);
+#if ESP32_W5500_FEATURE_STRING
     String macAddress();
+#endif
 
     friend class WiFiClient;
     friend class WiFiServer;
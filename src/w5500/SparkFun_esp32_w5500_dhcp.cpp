@@ -0,0 +1,458 @@
+/****************************************************************************************************************************
+  SparkFun_esp32_w5500_dhcp.cpp
+
+  For Ethernet shields using ESP32_W5500 (ESP32 + W5500)
+
+  WebServer_ESP32_W5500 is a library for the ESP32 with Ethernet W5500 to run WebServer
+
+  Based on and modified from ESP32-IDF https://github.com/espressif/esp-idf
+  Built by Khoi Hoang https://github.com/khoih-prog/WebServer_ESP32_W5500
+  Modified by SparkFun
+  Licensed under GPLv3 license
+
+  Please see SparkFun_WebServer_ESP32_W5500.h for the version information
+ *****************************************************************************************************************************/
+
+#include "SparkFun_WebServer_ESP32_W5500_Debug.h"
+#include "SparkFun_esp32_w5500.h"
+
+#include "esp_timer.h"
+#include "esp_netif_net_stack.h"
+#include "nvs.h"
+
+#include "lwip/dns.h"
+#include "lwip/tcpip.h"
+#include "lwip/netif.h"
+#include "lwip/dhcp.h"
+#include "lwip/prot/dhcp.h"
+#include "lwip/etharp.h"
+
+// Bump when ESP32_W5500_Lease changes, so an old blob is ignored
+#define W5500_LEASE_VERSION   1
+
+#define W5500_NVS_NAMESPACE   "w5500"
+#define W5500_NVS_LEASE_KEY   "lease"     // Interface 0. Others append their number: "lease1", ...
+
+// Fallback address conflict detection. RFC 3927 asks for 3 probes 1-2s apart plus a 2s announce wait.
+// That is too slow for a technician with a laptop, so probe faster: 3 probes 200ms apart, then 200ms for replies
+#define W5500_FALLBACK_PROBE_NUM          3
+#define W5500_FALLBACK_PROBE_INTERVAL_MS  200
+#define W5500_FALLBACK_MAX_CONFLICTS      10   // Give up on link-local after this many taken addresses
+
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+
+enum
+{
+  W5500_FALLBACK_IDLE = 0,
+  W5500_FALLBACK_WAIT_DHCP,   // Link is up, waiting for DHCP to time out
+  W5500_FALLBACK_PROBING,     // ARP probing fallback_candidate
+  W5500_FALLBACK_ACTIVE,      // fallback_candidate is on the interface
+};
+
+#endif
+
+////////////////////////////////////////
+
+#if ESP32_W5500_FEATURE_DHCP_LEASE
+
+static void leaseKey(char *key, size_t len, int8_t instance)
+{
+  if (instance > 0)
+    snprintf(key, len, W5500_NVS_LEASE_KEY "%d", instance);
+  else
+    snprintf(key, len, W5500_NVS_LEASE_KEY);
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::setFastReconnect(bool enable, bool optimistic)
+{
+  fast_reconnect = enable;
+  lease_optimistic = enable && optimistic;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::loadLease()
+{
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_handle_t handle;
+  size_t len = sizeof(lease);
+
+  lease_valid = false;
+  leaseKey(key, sizeof(key), instance);
+
+  if (nvs_open(W5500_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    return;
+
+  if ((nvs_get_blob(handle, key, &lease, &len) == ESP_OK) && (len == sizeof(lease))
+      && (lease.version == W5500_LEASE_VERSION) && (memcmp(lease.mac, mac_eth, sizeof(lease.mac)) == 0)
+      && (lease.ip != 0))
+  {
+    lease_valid = true;
+
+    ET_LOGINFO1("Stored DHCP lease = ", IPAddress(lease.ip).toString().c_str());
+  }
+
+  nvs_close(handle);
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::saveLease(const ip_event_got_ip_t *event)
+{
+  ESP32_W5500_Lease latest;
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_handle_t handle;
+
+  memset(&latest, 0, sizeof(latest));
+  latest.version = W5500_LEASE_VERSION;
+  memcpy(latest.mac, mac_eth, sizeof(latest.mac));
+  latest.ip = event->ip_info.ip.addr;
+  latest.netmask = event->ip_info.netmask.addr;
+  latest.gateway = event->ip_info.gw.addr;
+
+  for (int i = 0; i < 2; i++)
+  {
+    const ip_addr_t * dns_ip = dns_getserver(i);
+
+    if (dns_ip)
+      latest.dns[i] = dns_ip->u_addr.ip4.addr;
+  }
+
+  struct netif *netif = (struct netif *)esp_netif_get_netif_impl(eth_netif);
+  struct dhcp *dhcp = netif ? netif_dhcp_data(netif) : NULL;
+
+  // Single word read outside the tcpip thread. At worst it is one renewal out of date
+  if (dhcp)
+    latest.lease_s = dhcp->offered_t0_lease;
+
+  // Renewals give the same lease back. Only write the flash when something changed
+  if (lease_valid && (memcmp(&latest, &lease, sizeof(latest)) == 0))
+    return;
+
+  leaseKey(key, sizeof(key), instance);
+
+  if (nvs_open(W5500_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+  {
+    ET_LOGERROR0("nvs_open failed");
+
+    return;
+  }
+
+  if ((nvs_set_blob(handle, key, &latest, sizeof(latest)) != ESP_OK) || (nvs_commit(handle) != ESP_OK))
+  {
+    ET_LOGERROR0("Storing the DHCP lease failed");
+  }
+  else
+  {
+    lease = latest;
+    lease_valid = true;
+  }
+
+  nvs_close(handle);
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::clearLease()
+{
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_handle_t handle;
+
+  lease_valid = false;
+  leaseKey(key, sizeof(key), instance);
+
+  if (nvs_open(W5500_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    return;
+
+  nvs_erase_key(handle, key);
+  nvs_commit(handle);
+  nvs_close(handle);
+}
+
+////////////////////////////////////////
+
+// Runs in the tcpip thread, so the DHCP client state can be changed safely
+void ESP32_W5500::dhcp_reboot_cb(void *arg)
+{
+  ESP32_W5500 *eth = (ESP32_W5500 *)arg;
+
+  if ((eth->eth_netif == NULL) || !eth->lease_valid)
+    return;
+
+  struct netif *netif = (struct netif *)esp_netif_get_netif_impl(eth->eth_netif);
+  struct dhcp *dhcp = netif ? netif_dhcp_data(netif) : NULL;
+
+  if ((dhcp == NULL) || (dhcp->state == DHCP_STATE_OFF))
+  {
+    // dhcp_start would reset anything set here. Requested right after esp_netif_action_connected, this does not happen
+    ET_LOGWARN0("DHCP client not started, no INIT-REBOOT");
+    return;
+  }
+
+  // Only take over a client which is just starting out. Anything else already has an answer
+  if ((dhcp->state != DHCP_STATE_INIT) && (dhcp->state != DHCP_STATE_SELECTING))
+    return;
+
+  ip4_addr_t ip, netmask, gw;
+
+  ip4_addr_set_u32(&ip, eth->lease.ip);
+  ip4_addr_set_u32(&netmask, eth->lease.netmask);
+  ip4_addr_set_u32(&gw, eth->lease.gateway);
+
+  // Pretend the old lease is still bound. lwIP then treats the link change as a move to a
+  // possibly different network and sends a DHCPREQUEST for the old address (INIT-REBOOT, RFC 2131 3.2).
+  // The server ACKs it in one round trip, or NAKs it and the client falls back to DISCOVER
+  dhcp->offered_ip_addr = ip;
+  dhcp->offered_sn_mask = netmask;
+  dhcp->offered_gw_addr = gw;
+  dhcp->state = DHCP_STATE_BOUND;
+  dhcp_network_changed(netif);
+
+  if (eth->lease_optimistic)
+  {
+    // Serve from the old address straight away. The ACK re-binds the same address,
+    // a NAK clears it again
+    netif_set_addr(netif, &ip, &netmask, &gw);
+
+    ip_addr_t d;
+    d.type = IPADDR_TYPE_V4;
+
+    for (int i = 0; i < 2; i++)
+    {
+      if (eth->lease.dns[i])
+      {
+        d.u_addr.ip4.addr = eth->lease.dns[i];
+        dns_setserver(i, &d);
+      }
+    }
+  }
+
+  eth->boot_times.fastReconnect = true;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::requestLeaseReboot()
+{
+  if (!fast_reconnect || !lease_valid || staticIP)
+    return;
+
+  if (tcpip_callback(dhcp_reboot_cb, this) != ERR_OK)
+  {
+    ET_LOGERROR0("tcpip_callback failed");
+  }
+}
+
+#endif
+
+////////////////////////////////////////
+
+void ESP32_W5500::markFirstRequest()
+{
+  if (boot_times.firstRequest == 0)
+    boot_times.firstRequest = esp_timer_get_time();
+}
+
+////////////////////////////////////////
+
+#if ESP32_W5500_FEATURE_DHCP_FALLBACK
+
+void ESP32_W5500::setDHCPFallback(uint32_t timeout_ms, IPAddress ip, IPAddress subnet, IPAddress gateway)
+{
+  fallback_timeout_ms = timeout_ms;
+  fallback_ip = static_cast<uint32_t>(ip);
+  fallback_mask = static_cast<uint32_t>(subnet);
+  fallback_gw = static_cast<uint32_t>(gateway);
+
+  if (fallback_ip && !fallback_mask)
+    fallback_mask = static_cast<uint32_t>(IPAddress(255, 255, 255, 0));
+
+  if (fallback_timeout_ms && (fallback_timer == NULL))
+  {
+#if W5500_STATIC_ALLOCATION
+    fallback_timer = xTimerCreateStatic("w5500_fallback", pdMS_TO_TICKS(fallback_timeout_ms), pdFALSE, this, fallback_timer_cb,
+                                        &fallback_timer_buffer);
+#else
+    fallback_timer = xTimerCreate("w5500_fallback", pdMS_TO_TICKS(fallback_timeout_ms), pdFALSE, this, fallback_timer_cb);
+#endif
+
+    if (fallback_timer == NULL)
+    {
+      ET_LOGERROR0("xTimerCreate failed");
+
+      fallback_timeout_ms = 0;
+    }
+  }
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500::usingFallbackAddress()
+{
+  return __atomic_load_n(&fallback_state, __ATOMIC_RELAXED) == W5500_FALLBACK_ACTIVE;
+}
+
+////////////////////////////////////////
+
+// Called on link up
+void ESP32_W5500::startFallback()
+{
+  if (!fallback_timeout_ms || (fallback_timer == NULL) || staticIP)
+    return;
+
+  fallback_attempts = 0;
+  __atomic_store_n(&fallback_state, (uint8_t)W5500_FALLBACK_WAIT_DHCP, __ATOMIC_RELAXED);
+  xTimerChangePeriod(fallback_timer, pdMS_TO_TICKS(fallback_timeout_ms), 0);
+}
+
+////////////////////////////////////////
+
+// Called when DHCP answers, or the link goes down
+void ESP32_W5500::stopFallback()
+{
+  if (fallback_timer)
+    xTimerStop(fallback_timer, 0);
+
+  __atomic_store_n(&fallback_state, (uint8_t)W5500_FALLBACK_IDLE, __ATOMIC_RELAXED);
+
+  if (eth_events)
+    xEventGroupClearBits(eth_events, ESP32_W5500_FALLBACK_BIT);
+}
+
+////////////////////////////////////////
+
+// Runs in the timer task. All the work is done in the tcpip thread
+void ESP32_W5500::fallback_timer_cb(TimerHandle_t timer)
+{
+  ESP32_W5500 *eth = (ESP32_W5500 *)pvTimerGetTimerID(timer);
+
+  if (tcpip_callback(fallback_step, eth) != ERR_OK)
+  {
+    // tcpip mailbox full. Try again shortly
+    xTimerChangePeriod(timer, pdMS_TO_TICKS(W5500_FALLBACK_PROBE_INTERVAL_MS), 0);
+  }
+}
+
+////////////////////////////////////////
+
+static uint32_t w5500_link_local_address(const uint8_t *mac, uint8_t attempt)
+{
+  // FNV-1a over the MAC and the attempt number: the same device gets the same address on every boot
+  uint32_t hash = 2166136261UL;
+
+  for (int i = 0; i < 6; i++)
+    hash = (hash ^ mac[i]) * 16777619UL;
+
+  hash = (hash ^ attempt) * 16777619UL;
+
+  // 169.254.1.0 - 169.254.254.255. The first and last 256 addresses are reserved (RFC 3927 2.1)
+  uint32_t host = 0x0100 + (hash % 0xFE00);
+
+  return static_cast<uint32_t>(IPAddress(169, 254, (host >> 8) & 0xFF, host & 0xFF));
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500::fallback_step(void *arg)
+{
+  ESP32_W5500 *eth = (ESP32_W5500 *)arg;
+  uint8_t state = __atomic_load_n(&eth->fallback_state, __ATOMIC_RELAXED);
+
+  if ((state != W5500_FALLBACK_WAIT_DHCP) && (state != W5500_FALLBACK_PROBING))
+    return;
+
+  struct netif *netif = eth->eth_netif ? (struct netif *)esp_netif_get_netif_impl(eth->eth_netif) : NULL;
+  struct dhcp *dhcp = netif ? netif_dhcp_data(netif) : NULL;
+
+  if ((netif == NULL) || (dhcp && (dhcp->state == DHCP_STATE_BOUND)))
+  {
+    // DHCP made it after all. The GOT_IP event stops the fallback
+    return;
+  }
+
+  ip4_addr_t candidate;
+
+  if (state == W5500_FALLBACK_WAIT_DHCP)
+  {
+    ET_LOGWARN0("No answer from DHCP. Probing for a fallback address");
+
+    eth->fallback_candidate = eth->fallback_ip ? eth->fallback_ip : w5500_link_local_address(eth->mac_eth, 0);
+    eth->fallback_probes = 0;
+    __atomic_store_n(&eth->fallback_state, (uint8_t)W5500_FALLBACK_PROBING, __ATOMIC_RELAXED);
+  }
+
+  ip4_addr_set_u32(&candidate, eth->fallback_candidate);
+
+  if (eth->fallback_probes < W5500_FALLBACK_PROBE_NUM)
+  {
+    // etharp_query leaves a pending ARP entry, so a reply from a host which already owns
+    // the address is cached and found below. While the interface has no address the
+    // sender IP is 0.0.0.0, which makes this an RFC 5227 probe
+    etharp_query(netif, &candidate, NULL);
+    eth->fallback_probes++;
+    xTimerChangePeriod(eth->fallback_timer, pdMS_TO_TICKS(W5500_FALLBACK_PROBE_INTERVAL_MS), 0);
+
+    return;
+  }
+
+  struct eth_addr *eth_ret = NULL;
+  const ip4_addr_t *ip_ret = NULL;
+
+  if (etharp_find_addr(netif, &candidate, &eth_ret, &ip_ret) >= 0)
+  {
+    ET_LOGWARN1("Fallback address is in use: ", IPAddress(eth->fallback_candidate).toString().c_str());
+
+    if (eth->fallback_ip || (++eth->fallback_attempts >= W5500_FALLBACK_MAX_CONFLICTS))
+    {
+      // Nothing else to try. Wait for DHCP, and try again after another timeout
+      eth->fallback_attempts = 0;
+      __atomic_store_n(&eth->fallback_state, (uint8_t)W5500_FALLBACK_WAIT_DHCP, __ATOMIC_RELAXED);
+      xTimerChangePeriod(eth->fallback_timer, pdMS_TO_TICKS(eth->fallback_timeout_ms), 0);
+
+      return;
+    }
+
+    eth->fallback_candidate = w5500_link_local_address(eth->mac_eth, eth->fallback_attempts);
+    eth->fallback_probes = 0;
+    fallback_step(eth);
+
+    return;
+  }
+
+  ip4_addr_t netmask, gw;
+  ip4_addr_set_u32(&netmask, eth->fallback_ip ? eth->fallback_mask : static_cast<uint32_t>(IPAddress(255, 255, 0, 0)));
+  ip4_addr_set_u32(&gw, eth->fallback_ip ? eth->fallback_gw : 0);
+
+  // The DHCP client keeps running and replaces this address when a server answers.
+  // netif_set_addr also sends the gratuitous ARP announcement
+  __atomic_store_n(&eth->fallback_state, (uint8_t)W5500_FALLBACK_ACTIVE, __ATOMIC_RELAXED);
+  netif_set_addr(netif, &candidate, &netmask, &gw);
+
+  // esp_netif only reports addresses which come from DHCP. Post GOT_IP so waitForConnect()
+  // and the Arduino event handlers see the interface as ready
+  ip_event_got_ip_t event;
+  memset(&event, 0, sizeof(event));
+  event.esp_netif = eth->eth_netif;
+  event.ip_info.ip.addr = ip4_addr_get_u32(&candidate);
+  event.ip_info.netmask.addr = ip4_addr_get_u32(&netmask);
+  event.ip_info.gw.addr = ip4_addr_get_u32(&gw);
+  event.ip_changed = true;
+
+  if (eth->eth_events)
+    xEventGroupSetBits(eth->eth_events, ESP32_W5500_FALLBACK_BIT);
+
+  if (esp_event_post(IP_EVENT, IP_EVENT_ETH_GOT_IP, &event, sizeof(event), pdMS_TO_TICKS(10)) != ESP_OK)
+  {
+    // Still usable, just not announced. Make sure waitForConnect() wakes up
+    eth->updateIPInfo();
+
+    if (eth->eth_events)
+      xEventGroupSetBits(eth->eth_events, ESP32_W5500_GOT_IP_BIT);
+  }
+}
+
+////////////////////////////////////////
+
+#endif
@@ -0,0 +1,478 @@
+/****************************************************************************************************************************
+  SparkFun_esp32_w5500_syslog.cpp
+
+  For Ethernet shields using ESP32_W5500 (ESP32 + W5500)
+
+  WebServer_ESP32_W5500 is a library for the ESP32 with Ethernet W5500 to run WebServer
+
+  Based on and modified from ESP32-IDF https://github.com/espressif/esp-idf
+  Built by Khoi Hoang https://github.com/khoih-prog/WebServer_ESP32_W5500
+  Modified by SparkFun
+  Licensed under GPLv3 license
+
+  Please see SparkFun_WebServer_ESP32_W5500.h for the version information
+ *****************************************************************************************************************************/
+
+#include "SparkFun_WebServer_ESP32_W5500_Debug.h"
+#include "SparkFun_esp32_w5500_syslog.h"
+
+#if W5500_DEFERRED_LOG
+
+#include <sys/time.h>
+#include <time.h>
+#include "lwip/sockets.h"
+
+static_assert(W5500_SYSLOG_LINE_SIZE <= W5500_SYSLOG_DATAGRAM_SIZE, "A syslog line must fit in a datagram");
+static_assert(W5500_SYSLOG_DATAGRAM_SIZE <= W5500_SYSLOG_BUFFER_SIZE, "The syslog buffer must hold a datagram");
+
+// RFC 5424 severities
+#define SYSLOG_ERROR      3
+#define SYSLOG_WARNING    4
+#define SYSLOG_INFO       6
+#define SYSLOG_DEBUG      7
+
+////////////////////////////////////////
+
+ESP32_W5500_Syslog::ESP32_W5500_Syslog(ESP32_W5500 &ethernet)
+  : eth(&ethernet)
+  , port(514)
+  , facility(16)
+  , rate(0)
+  , burst(0)
+  , tokens(0)
+  , refilled_ms(0)
+  , stats_interval_ms(0)
+  , stats_sent_ms(0)
+  , mutex(NULL)
+  , task(NULL)
+  , running(false)
+  , sock(-1)
+  , bound_ip(0)
+  , buffer(NULL)
+  , used(0)
+  , datagram(NULL)
+  , rate_limited(0)
+  , overflowed(0)
+  , datagrams(0)
+  , send_errors(0)
+{
+  hostname[0] = 0;
+  appName[0] = 0;
+}
+
+////////////////////////////////////////
+
+ESP32_W5500_Syslog::~ESP32_W5500_Syslog()
+{
+  end();
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500_Syslog::begin(IPAddress server, uint16_t port, const char *hostname, const char *appName)
+{
+  end();
+
+  this->server = server;
+  this->port = port;
+  snprintf(this->hostname, sizeof(this->hostname), "%s", hostname ? hostname : "");
+  snprintf(this->appName, sizeof(this->appName), "%s", (appName && *appName) ? appName : "-");
+
+  buffer = (char *) malloc(W5500_SYSLOG_BUFFER_SIZE);
+  datagram = (char *) malloc(W5500_SYSLOG_DATAGRAM_SIZE);
+  mutex = xSemaphoreCreateMutex();
+
+  if ((buffer == NULL) || (datagram == NULL) || (mutex == NULL))
+  {
+    ET_LOGERROR0("Syslog: no memory");
+    end();
+    return false;
+  }
+
+  used = 0;
+  stats_sent_ms = millis();
+  running = true;
+
+  if (xTaskCreatePinnedToCore(syslogTask, "w5500_syslog", W5500_SYSLOG_TASK_STACK_SIZE, this,
+                              W5500_SYSLOG_TASK_PRIORITY, &task, tskNO_AFFINITY) != pdPASS)
+  {
+    ET_LOGERROR0("Syslog: task creation failed");
+    task = NULL;
+    end();
+    return false;
+  }
+
+  w5500_log_set_sink(sink, this);
+
+  return true;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_Syslog::end()
+{
+  if (task != NULL)
+  {
+    // Returns once the log task is out of sink(), so nothing touches this object from there on
+    w5500_log_set_sink(NULL, NULL);
+
+    // Last flush, then the task clears task and exits
+    running = false;
+    xTaskNotifyGive(task);
+
+    while (task != NULL)
+      vTaskDelay(pdMS_TO_TICKS(10));
+  }
+
+  running = false;
+
+  if (sock >= 0)
+  {
+    close(sock);
+    sock = -1;
+  }
+
+  bound_ip = 0;
+
+  if (mutex != NULL)
+  {
+    vSemaphoreDelete(mutex);
+    mutex = NULL;
+  }
+
+  free(buffer);
+  buffer = NULL;
+  used = 0;
+  free(datagram);
+  datagram = NULL;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_Syslog::setFacility(uint8_t facility)
+{
+  if (facility <= 23)
+    this->facility = facility;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_Syslog::setRateLimit(uint16_t linesPerSecond, uint16_t burst)
+{
+  if (mutex != NULL)
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+  // Thousandths of a line: linesPerSecond of them come back every millisecond
+  rate = linesPerSecond;
+  this->burst = (burst ? burst : 1) * 1000;
+  tokens = this->burst;
+  refilled_ms = millis();
+
+  if (mutex != NULL)
+    xSemaphoreGive(mutex);
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_Syslog::setStatsInterval(uint32_t seconds)
+{
+  stats_interval_ms = seconds * 1000;
+}
+
+////////////////////////////////////////
+
+// Called with the mutex held
+bool ESP32_W5500_Syslog::takeToken()
+{
+  if (rate == 0)
+    return true;
+
+  uint32_t now = millis();
+  uint64_t refill = (uint64_t)(now - refilled_ms) * rate;
+
+  refilled_ms = now;
+  tokens = (tokens + refill >= burst) ? burst : (uint32_t)(tokens + refill);
+
+  if (tokens < 1000)
+    return false;
+
+  tokens -= 1000;
+
+  return true;
+}
+
+////////////////////////////////////////
+
+// RFC 5424 TIMESTAMP of a message logged at timestamp_ms (esp_log_timestamp), or "-" until the
+// clock has been set (e.g. by SNTP)
+static void syslogTimestamp(uint32_t timestamp_ms, char *out, size_t size)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  if (now.tv_sec < 1609459200)
+  {
+    snprintf(out, size, "-");
+    return;
+  }
+
+  int64_t ms = (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000 - (uint32_t)(esp_log_timestamp() - timestamp_ms);
+  time_t seconds = ms / 1000;
+  struct tm tm;
+
+  gmtime_r(&seconds, &tm);
+  snprintf(out, size, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+           tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(ms % 1000));
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_Syslog::sink(esp_log_level_t level, const char *tag, uint32_t timestamp_ms, const char *message,
+                              void *arg)
+{
+  ((ESP32_W5500_Syslog *) arg)->add(level, tag, timestamp_ms, message);
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_Syslog::add(esp_log_level_t level, const char *tag, uint32_t timestamp_ms, const char *message)
+{
+  if (!running)
+    return;
+
+  uint8_t severity;
+
+  switch (level)
+  {
+    case ESP_LOG_ERROR:
+      severity = SYSLOG_ERROR;
+      break;
+
+    case ESP_LOG_WARN:
+      severity = SYSLOG_WARNING;
+      break;
+
+    case ESP_LOG_INFO:
+      severity = SYSLOG_INFO;
+      break;
+
+    default:
+      severity = SYSLOG_DEBUG;
+      break;
+  }
+
+  char timestamp[32];
+  char host[48];
+  char line[W5500_SYSLOG_LINE_SIZE];
+
+  syslogTimestamp(timestamp_ms, timestamp, sizeof(timestamp));
+
+  const char *name = hostname[0] ? hostname : eth->getHostname();
+
+  if ((name != NULL) && *name)
+  {
+    snprintf(host, sizeof(host), "%s", name);
+  }
+  else
+  {
+    IPAddress ip = eth->localIP();
+    snprintf(host, sizeof(host), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  }
+
+  // <PRI>VERSION TIMESTAMP HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA MSG; sysUpTime is in 1/100 s
+  int header = snprintf(line, sizeof(line), "<%u>1 %s %s %s - %.32s [meta sysUpTime=\"%u\"] ",
+                        (unsigned)(facility * 8 + severity), timestamp, host, appName, (tag && *tag) ? tag : "-",
+                        (unsigned)(timestamp_ms / 10));
+
+  if ((header < 0) || (header >= (int) sizeof(line) - 1))
+    return;
+
+  // One line per message: the receiver splits the datagram at line ends
+  size_t len = header;
+
+  for (const char *c = message; *c && (len < sizeof(line) - 1); c++)
+    line[len++] = ((*c == '\n') || (*c == '\r')) ? ' ' : *c;
+
+  while ((len > (size_t) header) && (line[len - 1] == ' '))
+    len--;
+
+  line[len++] = '\n';
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+
+  bool full = false;
+
+  if (!takeToken())
+  {
+    rate_limited++;
+  }
+  else if (used + len > W5500_SYSLOG_BUFFER_SIZE)
+  {
+    overflowed++;
+  }
+  else
+  {
+    memcpy(buffer + used, line, len);
+    used += len;
+    full = used >= W5500_SYSLOG_DATAGRAM_SIZE;
+  }
+
+  xSemaphoreGive(mutex);
+
+  if (full)
+    xTaskNotifyGive(task);
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_Syslog::addStats()
+{
+  ESP32_W5500_Stats stats;
+
+  if (!eth->getStats(stats))
+    return;
+
+  const w5500_stats_t &d = stats.driver;
+  char message[W5500_SYSLOG_LINE_SIZE];
+
+  snprintf(message, sizeof(message),
+           "link=%s rx_frames=%llu rx_bytes=%llu tx_frames=%llu tx_bytes=%llu rx_drops=%u tx_drops=%u "
+           "log_dropped=%u syslog_dropped=%u",
+           stats.linkUp ? "up" : "down", (unsigned long long) d.rx_frames, (unsigned long long) d.rx_bytes,
+           (unsigned long long) d.tx_frames, (unsigned long long) d.tx_bytes,
+           (unsigned)(d.rx_drop_no_mem + d.rx_drop_error + d.rx_drop_oversize), (unsigned) d.tx_drops,
+           (unsigned) w5500_log_dropped(), (unsigned) dropped());
+
+  // Not rate limited: give it its own token
+  xSemaphoreTake(mutex, portMAX_DELAY);
+
+  if (rate)
+    tokens += 1000;
+
+  xSemaphoreGive(mutex);
+
+  add(ESP_LOG_INFO, "stats", esp_log_timestamp(), message);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500_Syslog::openSocket()
+{
+  uint32_t ip = eth->localIP();
+
+  if (ip == 0)
+    return false;
+
+  if ((sock >= 0) && (ip == bound_ip))
+    return true;
+
+  if (sock >= 0)
+    close(sock);
+
+  sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+  if (sock < 0)
+    return false;
+
+  // Bound to the W5500's address, ESP-IDF's source address routing sends through its netif even when
+  // another interface holds the default route
+  struct sockaddr_in local;
+
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = ip;
+
+  if (bind(sock, (struct sockaddr *) &local, sizeof(local)) < 0)
+  {
+    close(sock);
+    sock = -1;
+    return false;
+  }
+
+  bound_ip = ip;
+
+  return true;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_Syslog::flush()
+{
+  // Lines stay queued (and newer ones are dropped once the buffer fills) until the interface has an address
+  if (!openSocket())
+    return;
+
+  struct sockaddr_in to;
+
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons(port);
+  to.sin_addr.s_addr = (uint32_t) server;
+
+  for (;;)
+  {
+    size_t len = 0;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    // Whole lines only
+    while (len < used)
+    {
+      const char *end = (const char *) memchr(buffer + len, '\n', used - len);
+      size_t next = end - buffer + 1;
+
+      if (next > W5500_SYSLOG_DATAGRAM_SIZE)
+        break;
+
+      len = next;
+    }
+
+    memcpy(datagram, buffer, len);
+    memmove(buffer, buffer + len, used - len);
+    used -= len;
+
+    xSemaphoreGive(mutex);
+
+    if (len == 0)
+      break;
+
+    // Where lwIP sends from this task (LWIP_TCPIP_CORE_LOCKING), the driver's messages about this datagram
+    // (e.g. a TX error) would otherwise come back as another datagram. Other tasks' messages are kept
+    w5500_log_mute_driver(true);
+    int sent = sendto(sock, datagram, len, 0, (struct sockaddr *) &to, sizeof(to));
+    w5500_log_mute_driver(false);
+
+    if (sent < 0)
+      send_errors++;
+    else
+      datagrams++;
+  }
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_Syslog::syslogTask(void *arg)
+{
+  ESP32_W5500_Syslog *syslog = (ESP32_W5500_Syslog *) arg;
+
+  while (syslog->running)
+  {
+    // Woken early by add() when a datagram's worth is waiting
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(W5500_SYSLOG_FLUSH_MS));
+
+    if (syslog->stats_interval_ms && ((millis() - syslog->stats_sent_ms) >= syslog->stats_interval_ms))
+    {
+      syslog->stats_sent_ms = millis();
+      syslog->addStats();
+    }
+
+    syslog->flush();
+  }
+
+  syslog->flush();
+  syslog->task = NULL;
+  vTaskDelete(NULL);
+}
+
+#endif  // W5500_DEFERRED_LOG
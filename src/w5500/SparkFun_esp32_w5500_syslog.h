@@ -0,0 +1,136 @@
+/****************************************************************************************************************************
+  SparkFun_esp32_w5500_syslog.h
+
+  For Ethernet shields using ESP32_W5500 (ESP32 + W5500)
+
+  WebServer_ESP32_W5500 is a library for the ESP32 with Ethernet W5500 to run WebServer
+
+  Based on and modified from ESP32-IDF https://github.com/espressif/esp-idf
+  Built by Khoi Hoang https://github.com/khoih-prog/WebServer_ESP32_W5500
+  Modified by SparkFun
+  Licensed under GPLv3 license
+
+  Please see SparkFun_WebServer_ESP32_W5500.h for the version information
+ *****************************************************************************************************************************/
+
+#ifndef _ESP32_W5500_SYSLOG_H_
+#define _ESP32_W5500_SYSLOG_H_
+
+#include "SparkFun_esp32_w5500.h"
+
+#if W5500_DEFERRED_LOG
+
+#include "freertos/semphr.h"
+
+////////////////////////////////////////
+
+// Bytes of formatted syslog lines waiting to be sent. Lines which do not fit are dropped and counted
+#ifndef W5500_SYSLOG_BUFFER_SIZE
+  #define W5500_SYSLOG_BUFFER_SIZE        4096
+#endif
+
+// Largest UDP payload. 1472 fills one Ethernet frame without IP fragmentation
+#ifndef W5500_SYSLOG_DATAGRAM_SIZE
+  #define W5500_SYSLOG_DATAGRAM_SIZE      1472
+#endif
+
+// Longest single syslog line, header included. Longer messages are cut short
+#ifndef W5500_SYSLOG_LINE_SIZE
+  #define W5500_SYSLOG_LINE_SIZE          256
+#endif
+
+// How long lines may wait for a fuller datagram
+#ifndef W5500_SYSLOG_FLUSH_MS
+  #define W5500_SYSLOG_FLUSH_MS           1000
+#endif
+
+#ifndef W5500_SYSLOG_TASK_PRIORITY
+  #define W5500_SYSLOG_TASK_PRIORITY      1
+#endif
+
+#ifndef W5500_SYSLOG_TASK_STACK_SIZE
+  #define W5500_SYSLOG_TASK_STACK_SIZE    4096
+#endif
+
+////////////////////////////////////////
+
+// Sends the deferred log (the driver's ESP_LOGx and the ET_LOG* macros, build with W5500_DEFERRED_LOG=1)
+// and, optionally, the interface counters to a syslog server as RFC 5424 messages over UDP.
+// Lines are batched, one per text line, into datagrams of up to W5500_SYSLOG_DATAGRAM_SIZE bytes, so a
+// burst of messages costs a few frames rather than one each. The receiver has to split datagrams at
+// line ends (e.g. rsyslog imudp with a ruleset splitting on "\n", or syslog-ng's newline framing).
+// The driver's own messages are muted while a batch is sent, so the sink never logs about itself.
+// Only one sink can be active: it replaces the console output of the deferred log
+
+class ESP32_W5500_Syslog
+{
+  private:
+    ESP32_W5500 *eth;
+    IPAddress server;
+    uint16_t port;
+    char hostname[48];
+    char appName[32];
+    uint8_t facility;
+
+    // Token bucket for lines, in thousandths of a line
+    uint32_t rate;
+    uint32_t burst;
+    uint32_t tokens;
+    uint32_t refilled_ms;
+
+    uint32_t stats_interval_ms;
+    uint32_t stats_sent_ms;
+
+    SemaphoreHandle_t mutex;
+    TaskHandle_t task;
+    volatile bool running;
+    int sock;
+    uint32_t bound_ip;
+
+    // Lines, each ending in '\n', oldest first
+    char *buffer;
+    size_t used;
+    char *datagram;            // W5500_SYSLOG_DATAGRAM_SIZE bytes, being sent by flush()
+
+    uint32_t rate_limited;
+    uint32_t overflowed;
+    uint32_t datagrams;
+    uint32_t send_errors;
+
+    static void sink(esp_log_level_t level, const char *tag, uint32_t timestamp_ms, const char *message, void *arg);
+    static void syslogTask(void *arg);
+
+    bool takeToken();
+    void add(esp_log_level_t level, const char *tag, uint32_t timestamp_ms, const char *message);
+    void addStats();
+    bool openSocket();
+    void flush();
+
+  public:
+    ESP32_W5500_Syslog(ESP32_W5500 &ethernet = ETH);
+    ~ESP32_W5500_Syslog();
+
+    // hostname NULL = the interface's host name, else its IP address
+    bool begin(IPAddress server, uint16_t port = 514, const char *hostname = NULL, const char *appName = "w5500");
+    void end();
+
+    // Facility 0 - 23, default 16 (local0)
+    void setFacility(uint8_t facility);
+
+    // At most linesPerSecond lines on average, with bursts of up to burst lines. 0 = no limit
+    void setRateLimit(uint16_t linesPerSecond, uint16_t burst = 50);
+
+    // Send a line with the interface counters every seconds. 0 = never (the default)
+    void setStatsInterval(uint32_t seconds);
+
+    // Lines dropped by the rate limit or because the buffer was full
+    uint32_t dropped() { return rate_limited + overflowed; }
+    uint32_t datagramsSent() { return datagrams; }
+    uint32_t sendErrors() { return send_errors; }
+};
+
+#endif  // W5500_DEFERRED_LOG
+
+////////////////////////////////////////
+
+#endif /* _ESP32_W5500_SYSLOG_H_ */
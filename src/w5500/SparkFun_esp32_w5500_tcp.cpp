@@ -0,0 +1,427 @@
+/****************************************************************************************************************************
+  SparkFun_esp32_w5500_tcp.cpp
+
+  For Ethernet shields using ESP32_W5500 (ESP32 + W5500)
+
+  WebServer_ESP32_W5500 is a library for the ESP32 with Ethernet W5500 to run WebServer
+
+  Based on and modified from ESP32-IDF https://github.com/espressif/esp-idf
+  Built by Khoi Hoang https://github.com/khoih-prog/WebServer_ESP32_W5500
+  Modified by SparkFun
+  Licensed under GPLv3 license
+
+  Please see SparkFun_WebServer_ESP32_W5500.h for the version information
+ *****************************************************************************************************************************/
+
+#include "SparkFun_WebServer_ESP32_W5500_Debug.h"
+#include "SparkFun_esp32_w5500_tcp.h"
+
+extern "C"
+{
+#include "esp_eth/esp_eth_w5500.h"
+#include "esp_eth/w5500.h"
+}
+
+#define W5500_TCP_CONNECT_TIMEOUT_MS  3000
+#define W5500_TCP_WRITE_TIMEOUT_MS    5000
+
+////////////////////////////////////////
+
+static uint16_t w5500_next_local_port = 49152;
+
+static uint16_t w5500_local_port()
+{
+  // IANA dynamic port range
+  if (++w5500_next_local_port == 0)
+    w5500_next_local_port = 49152;
+
+  return w5500_next_local_port;
+}
+
+////////////////////////////////////////
+
+ESP32_W5500_TCPClient::ESP32_W5500_TCPClient(ESP32_W5500 &ethernet)
+  : eth(&ethernet)
+  , sock(-1)
+  , generation(0)
+  , timeout_ms(W5500_TCP_WRITE_TIMEOUT_MS)
+{
+}
+
+////////////////////////////////////////
+
+ESP32_W5500_TCPClient::ESP32_W5500_TCPClient(ESP32_W5500 &ethernet, int socket)
+  : eth(&ethernet)
+  , sock(socket)
+  , generation(0)
+  , timeout_ms(W5500_TCP_WRITE_TIMEOUT_MS)
+{
+  if ((sock > 0) && (eth->eth_mac != NULL))
+    generation = w5500_sock_generation(eth->eth_mac, sock);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500_TCPClient::sockValid()
+{
+  // w5500_sock_alloc takes back closed sockets whose owner never called stop. This client may be that owner
+  return (sock > 0) && (eth->eth_mac != NULL) && (w5500_sock_generation(eth->eth_mac, sock) == generation);
+}
+
+////////////////////////////////////////
+
+int ESP32_W5500_TCPClient::connect(IPAddress ip, uint16_t port)
+{
+  if (eth->eth_mac == NULL)
+    return 0;
+
+  if (sockValid())
+    stop();
+
+  sock = w5500_sock_alloc(eth->eth_mac);
+
+  if (sock < 0)
+  {
+    ET_LOGERROR0("No free offload socket");
+
+    return 0;
+  }
+
+  generation = w5500_sock_generation(eth->eth_mac, sock);
+
+  if ((w5500_sock_open_tcp(eth->eth_mac, sock, w5500_local_port()) != ESP_OK)
+      || (w5500_sock_connect(eth->eth_mac, sock, static_cast<uint32_t>(ip), port) != ESP_OK))
+  {
+    stop();
+
+    return 0;
+  }
+
+  uint32_t start = millis();
+  uint8_t status = W5500_SSR_SYNSENT;
+
+  while ((millis() - start) < W5500_TCP_CONNECT_TIMEOUT_MS)
+  {
+    if (w5500_sock_get_status(eth->eth_mac, sock, &status) != ESP_OK)
+      break;
+
+    if (status == W5500_SSR_ESTABLISHED)
+      return 1;
+
+    if (status == W5500_SSR_CLOSED)
+      break;
+
+    delay(1);
+  }
+
+  stop();
+
+  return 0;
+}
+
+////////////////////////////////////////
+
+int ESP32_W5500_TCPClient::connect(const char *host, uint16_t port)
+{
+  IPAddress ip;
+
+  if (!WiFi.hostByName(host, ip))
+    return 0;
+
+  return connect(ip, port);
+}
+
+////////////////////////////////////////
+
+size_t ESP32_W5500_TCPClient::write(uint8_t data)
+{
+  return write(&data, 1);
+}
+
+////////////////////////////////////////
+
+size_t ESP32_W5500_TCPClient::write(const uint8_t *buf, size_t size)
+{
+  size_t written = 0;
+  uint32_t start = millis();
+
+  if (!sockValid())
+    return 0;
+
+  while (written < size)
+  {
+    uint32_t sent = 0;
+
+    if (w5500_sock_send(eth->eth_mac, sock, buf + written, size - written, &sent) != ESP_OK)
+      break;
+
+    if (sent)
+    {
+      written += sent;
+      start = millis();
+    }
+    else if ((millis() - start) >= timeout_ms)
+    {
+      break;
+    }
+    else
+    {
+      delay(1); // TX buffer full, wait for the W5500 to drain it
+    }
+  }
+
+  return written;
+}
+
+////////////////////////////////////////
+
+int ESP32_W5500_TCPClient::available()
+{
+  uint16_t size = 0;
+
+  if (!sockValid() || (w5500_sock_available(eth->eth_mac, sock, &size) != ESP_OK))
+    return 0;
+
+  return size;
+}
+
+////////////////////////////////////////
+
+int ESP32_W5500_TCPClient::read()
+{
+  uint8_t data;
+
+  if (read(&data, 1) != 1)
+    return -1;
+
+  return data;
+}
+
+////////////////////////////////////////
+
+int ESP32_W5500_TCPClient::read(uint8_t *buf, size_t size)
+{
+  uint32_t received = 0;
+
+  if (!sockValid() || (w5500_sock_recv(eth->eth_mac, sock, buf, size, &received, false) != ESP_OK))
+    return -1;
+
+  return (received ? (int)received : -1);
+}
+
+////////////////////////////////////////
+
+int ESP32_W5500_TCPClient::peek()
+{
+  uint8_t data;
+  uint32_t received = 0;
+
+  if (!sockValid() || (w5500_sock_recv(eth->eth_mac, sock, &data, 1, &received, true) != ESP_OK) || !received)
+    return -1;
+
+  return data;
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_TCPClient::flush()
+{
+  // Nothing is buffered on the ESP32 side. The data is in the W5500 TX buffer as soon as write returns
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_TCPClient::stop()
+{
+  if (!sockValid())
+  {
+    sock = -1;
+
+    return;
+  }
+
+  uint8_t status = W5500_SSR_CLOSED;
+
+  if ((w5500_sock_get_status(eth->eth_mac, sock, &status) == ESP_OK)
+      && ((status == W5500_SSR_ESTABLISHED) || (status == W5500_SSR_CLOSE_WAIT)))
+  {
+    // Try a graceful close first so the peer gets the tail of the data
+    w5500_sock_disconnect(eth->eth_mac, sock);
+
+    uint32_t start = millis();
+
+    while ((millis() - start) < 100)
+    {
+      if ((w5500_sock_get_status(eth->eth_mac, sock, &status) != ESP_OK) || (status == W5500_SSR_CLOSED))
+        break;
+
+      delay(1);
+    }
+  }
+
+  w5500_sock_close(eth->eth_mac, sock);
+  w5500_sock_release(eth->eth_mac, sock);
+  sock = -1;
+}
+
+////////////////////////////////////////
+
+uint8_t ESP32_W5500_TCPClient::connected()
+{
+  uint8_t status = W5500_SSR_CLOSED;
+
+  if (!sockValid() || (w5500_sock_get_status(eth->eth_mac, sock, &status) != ESP_OK))
+    return 0;
+
+  // Still report connected while there is unread data from a peer which has closed its side
+  return (status == W5500_SSR_ESTABLISHED) || ((status == W5500_SSR_CLOSE_WAIT) && (available() > 0));
+}
+
+////////////////////////////////////////
+
+ESP32_W5500_TCPClient::operator bool()
+{
+  return connected();
+}
+
+////////////////////////////////////////
+
+IPAddress ESP32_W5500_TCPClient::remoteIP()
+{
+  uint32_t ip = 0;
+  uint16_t port = 0;
+
+  if (!sockValid() || (w5500_sock_get_remote(eth->eth_mac, sock, &ip, &port) != ESP_OK))
+    return IPAddress();
+
+  return IPAddress(ip);
+}
+
+////////////////////////////////////////
+
+uint16_t ESP32_W5500_TCPClient::remotePort()
+{
+  uint32_t ip = 0;
+  uint16_t port = 0;
+
+  if (!sockValid() || (w5500_sock_get_remote(eth->eth_mac, sock, &ip, &port) != ESP_OK))
+    return 0;
+
+  return port;
+}
+
+////////////////////////////////////////
+
+ESP32_W5500_TCPServer::ESP32_W5500_TCPServer(uint16_t port, ESP32_W5500 &ethernet)
+  : eth(&ethernet)
+  , port(port)
+  , sock(-1)
+  , generation(0)
+{
+}
+
+////////////////////////////////////////
+
+ESP32_W5500_TCPServer::~ESP32_W5500_TCPServer()
+{
+  end();
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500_TCPServer::sockValid()
+{
+  // A listening socket which got a connection that then closed can be taken back by w5500_sock_alloc
+  return (sock > 0) && (eth->eth_mac != NULL) && (w5500_sock_generation(eth->eth_mac, sock) == generation);
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500_TCPServer::listen()
+{
+  if (!sockValid())
+  {
+    sock = w5500_sock_alloc(eth->eth_mac);
+
+    if (sock < 0)
+      return false;
+
+    generation = w5500_sock_generation(eth->eth_mac, sock);
+  }
+
+  if ((w5500_sock_open_tcp(eth->eth_mac, sock, port) != ESP_OK) || (w5500_sock_listen(eth->eth_mac, sock) != ESP_OK))
+  {
+    w5500_sock_close(eth->eth_mac, sock);
+    w5500_sock_release(eth->eth_mac, sock);
+    sock = -1;
+
+    return false;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
+bool ESP32_W5500_TCPServer::begin()
+{
+  if (eth->eth_mac == NULL)
+    return false;
+
+  return listen();
+}
+
+////////////////////////////////////////
+
+void ESP32_W5500_TCPServer::end()
+{
+  if (sockValid())
+  {
+    w5500_sock_close(eth->eth_mac, sock);
+    w5500_sock_release(eth->eth_mac, sock);
+  }
+
+  sock = -1;
+}
+
+////////////////////////////////////////
+
+ESP32_W5500_TCPClient ESP32_W5500_TCPServer::available()
+{
+  uint8_t status = W5500_SSR_CLOSED;
+
+  if (eth->eth_mac == NULL)
+    return ESP32_W5500_TCPClient(*eth);
+
+  if (!sockValid())
+  {
+    // All offload sockets were busy last time, or w5500_sock_alloc gave ours to someone else: leave it to them
+    sock = -1;
+    listen();
+
+    return ESP32_W5500_TCPClient(*eth);
+  }
+
+  if (w5500_sock_get_status(eth->eth_mac, sock, &status) != ESP_OK)
+    return ESP32_W5500_TCPClient(*eth);
+
+  if ((status == W5500_SSR_ESTABLISHED) || (status == W5500_SSR_CLOSE_WAIT))
+  {
+    // Hand the connected socket to the client and listen on a fresh one
+    ESP32_W5500_TCPClient client(*eth, sock);
+    client.generation = generation;
+    sock = -1;
+    listen();
+
+    return client;
+  }
+
+  if (status == W5500_SSR_CLOSED)
+  {
+    listen(); // The listening socket timed out or was reset. Re-arm it
+  }
+
+  return ESP32_W5500_TCPClient(*eth);
+}
+
+////////////////////////////////////////
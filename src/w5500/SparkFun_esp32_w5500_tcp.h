@@ -0,0 +1,93 @@
+/****************************************************************************************************************************
+  SparkFun_esp32_w5500_tcp.h
+
+  For Ethernet shields using ESP32_W5500 (ESP32 + W5500)
+
+  WebServer_ESP32_W5500 is a library for the ESP32 with Ethernet W5500 to run WebServer
+
+  Based on and modified from ESP32-IDF https://github.com/espressif/esp-idf
+  Built by Khoi Hoang https://github.com/khoih-prog/WebServer_ESP32_W5500
+  Modified by SparkFun
+  Licensed under GPLv3 license
+
+  Please see SparkFun_WebServer_ESP32_W5500.h for the version information
+ *****************************************************************************************************************************/
+
+#ifndef _ESP32_W5500_TCP_H_
+#define _ESP32_W5500_TCP_H_
+
+#include "SparkFun_esp32_w5500.h"
+
+////////////////////////////////////////
+
+// TCP connections terminated by the W5500's own TCP/IP engine (hardware sockets 1-7).
+// lwIP keeps serving everything else through SOCK0 in MAC RAW mode.
+// Reserve the sockets with ETH.reserveOffloadSockets() before ETH.begin()
+
+class ESP32_W5500_TCPClient : public Client
+{
+  private:
+    ESP32_W5500 *eth;
+    int sock;
+    uint8_t generation;        // w5500_sock_generation when the socket was claimed
+    uint32_t timeout_ms;
+
+    bool sockValid();
+
+    friend class ESP32_W5500_TCPServer;
+
+  public:
+    ESP32_W5500_TCPClient(ESP32_W5500 &ethernet = ETH);
+    ESP32_W5500_TCPClient(ESP32_W5500 &ethernet, int socket);
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char *host, uint16_t port);
+
+    size_t write(uint8_t data);
+    size_t write(const uint8_t *buf, size_t size);
+    using Print::write;
+
+    int available();
+    int read();
+    int read(uint8_t *buf, size_t size);
+    int peek();
+    void flush();
+    void stop();
+    uint8_t connected();
+    operator bool();
+
+    IPAddress remoteIP();
+    uint16_t remotePort();
+
+    void setTimeoutMs(uint32_t timeout) { timeout_ms = timeout; }
+    int socketNumber() { return sock; }
+};
+
+////////////////////////////////////////
+
+class ESP32_W5500_TCPServer
+{
+  private:
+    ESP32_W5500 *eth;
+    uint16_t port;
+    int sock;
+    uint8_t generation;        // w5500_sock_generation when the socket was claimed
+
+    bool sockValid();
+    bool listen();
+
+  public:
+    ESP32_W5500_TCPServer(uint16_t port, ESP32_W5500 &ethernet = ETH);
+    ~ESP32_W5500_TCPServer();
+
+    bool begin();
+    void end();
+
+    // Returns a connected client, or an invalid one (operator bool false) if nobody has connected.
+    // The server starts listening again on the next free offload socket
+    ESP32_W5500_TCPClient available();
+};
+
+////////////////////////////////////////
+
+#endif /* _ESP32_W5500_TCP_H_ */
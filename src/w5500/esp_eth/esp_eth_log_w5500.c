@@ -0,0 +1,578 @@
+/****************************************************************************************************************************
+  esp_eth_log_w5500.c
+
+  For Ethernet shields using ESP32_W5500 (ESP32 + W5500)
+
+  WebServer_ESP32_W5500 is a library for the ESP32 with Ethernet W5500 to run WebServer
+
+  Based on and modified from ESP32-IDF https://github.com/espressif/esp-idf
+  Built by Khoi Hoang https://github.com/khoih-prog/WebServer_ESP32_W5500
+  Modified by SparkFun
+  Licensed under GPLv3 license
+
+  Please see SparkFun_WebServer_ESP32_W5500.h for the version information
+ *****************************************************************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_eth_w5500.h"
+
+#if W5500_DEFERRED_LOG
+
+#define W5500_LOG_MESSAGE_SIZE  256
+
+// One queued message: the format and tag pointers, and the arguments packed back to back in their
+// va_arg types. Strings are copied in, NUL included
+typedef struct
+{
+  uint32_t seq;                          // See w5500_log_seq
+  uint32_t timestamp;                    // esp_log_timestamp()
+  const char *tag;
+  const char *format;
+  uint8_t level;
+  uint8_t truncated;                     // The arguments did not all fit
+  uint16_t length;                       // Bytes used in data
+  uint8_t data[W5500_LOG_SLOT_SIZE - 20];
+} w5500_log_slot_t;
+
+typedef enum
+{
+  W5500_LOG_ARG_INT,
+  W5500_LOG_ARG_LONG,
+  W5500_LOG_ARG_LLONG,
+  W5500_LOG_ARG_SIZE,
+  W5500_LOG_ARG_PTR,
+  W5500_LOG_ARG_DOUBLE,
+  W5500_LOG_ARG_STRING,
+  W5500_LOG_ARG_PERCENT,
+  W5500_LOG_ARG_BAD,
+} w5500_log_arg_t;
+
+// Bounded multi-producer queue (D. Vyukov): a producer claims a slot by moving s_log_head on with a
+// compare and swap, fills it, then publishes it through its sequence number. Only the log task consumes
+static w5500_log_slot_t s_log[W5500_LOG_SLOTS];
+static uint32_t s_log_head = 0;          // Next position to claim
+static uint32_t s_log_tail = 0;          // Next position to format, log task only
+static uint32_t s_log_dropped = 0;
+static TaskHandle_t s_log_mute_task = NULL;  // Task whose driver messages are muted
+static uint32_t s_log_mute = 0;          // Its w5500_log_mute_driver nesting count
+static uint32_t s_log_muted = 0;
+static bool s_log_started = false;
+static portMUX_TYPE s_log_mux = portMUX_INITIALIZER_UNLOCKED;
+static w5500_log_sink_t s_log_sink = NULL;
+static void *s_log_sink_arg = NULL;
+static w5500_log_sink_t s_log_in_sink = NULL;  // The sink the log task is in now, under s_log_mux
+static void *s_log_in_sink_arg = NULL;
+static TaskHandle_t s_log_task = NULL;
+
+#if W5500_STATIC_ALLOCATION
+static StaticTask_t s_log_task_buffer;
+static StackType_t s_log_task_stack[W5500_LOG_TASK_STACK_SIZE];
+#endif
+
+////////////////////////////////////////
+
+// The queue wants each slot's sequence to start at its index. Storing it minus the index lets the
+// zeroed static array start out right
+static inline uint32_t w5500_log_seq(w5500_log_slot_t *slot)
+{
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) + (uint32_t)(slot - s_log);
+}
+
+static inline void w5500_log_set_seq(w5500_log_slot_t *slot, uint32_t seq)
+{
+  __atomic_store_n(&slot->seq, seq - (uint32_t)(slot - s_log), __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////
+
+// Parse the conversion after a '%'. Returns the character after it, and the number of '*' arguments in stars
+static const char *w5500_log_parse(const char *format, w5500_log_arg_t *type, int *stars)
+{
+  int length = 0;   // 1 = l, 2 = ll or j, 3 = z or t, -1 = L
+
+  *stars = 0;
+
+  while (*format && strchr("-+ #0", *format))
+    format++;
+
+  if (*format == '*')
+  {
+    (*stars)++;
+    format++;
+  }
+
+  while ((*format >= '0') && (*format <= '9'))
+    format++;
+
+  if (*format == '.')
+  {
+    format++;
+
+    if (*format == '*')
+    {
+      (*stars)++;
+      format++;
+    }
+
+    while ((*format >= '0') && (*format <= '9'))
+      format++;
+  }
+
+  while (*format && strchr("hlzjtL", *format))
+  {
+    if (*format == 'l')
+      length = length ? 2 : 1;
+    else if (*format == 'j')
+      length = 2;
+    else if ((*format == 'z') || (*format == 't'))
+      length = 3;
+    else if (*format == 'L')
+      length = -1;
+
+    format++;
+  }
+
+  switch (*format)
+  {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      *type = (length == 1) ? W5500_LOG_ARG_LONG : (length == 2) ? W5500_LOG_ARG_LLONG
+              : (length == 3) ? W5500_LOG_ARG_SIZE : W5500_LOG_ARG_INT;
+      break;
+
+    case 'p':
+      *type = W5500_LOG_ARG_PTR;
+      break;
+
+    case 's':
+      *type = W5500_LOG_ARG_STRING;
+      break;
+
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      *type = (length < 0) ? W5500_LOG_ARG_BAD : W5500_LOG_ARG_DOUBLE;
+      break;
+
+    case '%':
+      *type = W5500_LOG_ARG_PERCENT;
+      break;
+
+    default:
+      *type = W5500_LOG_ARG_BAD;
+      return format;
+  }
+
+  return format + 1;
+}
+
+////////////////////////////////////////
+
+static inline bool w5500_log_put(w5500_log_slot_t *slot, const void *value, size_t len)
+{
+  if (slot->length + len > sizeof(slot->data))
+    return false;
+
+  memcpy(slot->data + slot->length, value, len);
+  slot->length += len;
+  return true;
+}
+
+#define W5500_LOG_PUT(slot, args, type) \
+  ({ type value_ = va_arg(args, type); w5500_log_put((slot), &value_, sizeof(value_)); })
+
+// Pack the arguments of format. Stops at the first one that does not fit
+static void w5500_log_pack(w5500_log_slot_t *slot, const char *format, va_list args)
+{
+  w5500_log_arg_t type;
+  int stars;
+  bool fits = true;
+
+  while (fits && (format = strchr(format, '%')))
+  {
+    format = w5500_log_parse(format + 1, &type, &stars);
+
+    for (int i = 0; fits && (i < stars); i++)
+      fits = W5500_LOG_PUT(slot, args, int);
+
+    if (!fits)
+      break;
+
+    switch (type)
+    {
+      case W5500_LOG_ARG_INT:     fits = W5500_LOG_PUT(slot, args, int);            break;
+      case W5500_LOG_ARG_LONG:    fits = W5500_LOG_PUT(slot, args, long);           break;
+      case W5500_LOG_ARG_LLONG:   fits = W5500_LOG_PUT(slot, args, long long);      break;
+      case W5500_LOG_ARG_SIZE:    fits = W5500_LOG_PUT(slot, args, size_t);         break;
+      case W5500_LOG_ARG_PTR:     fits = W5500_LOG_PUT(slot, args, void *);         break;
+      case W5500_LOG_ARG_DOUBLE:  fits = W5500_LOG_PUT(slot, args, double);         break;
+      case W5500_LOG_ARG_PERCENT:                                                   break;
+
+      case W5500_LOG_ARG_STRING:
+      {
+        const char *string = va_arg(args, const char *);
+        size_t room = sizeof(slot->data) - slot->length;
+        size_t len = strlen(string ? string : "(null)");
+
+        if (room == 0)
+        {
+          fits = false;
+          break;
+        }
+
+        // Keep what fits, so the formatter can print it before the cut
+        if (len >= room)
+        {
+          len = room - 1;
+          fits = false;
+        }
+
+        memcpy(slot->data + slot->length, string ? string : "(null)", len);
+        slot->data[slot->length + len] = 0;
+        slot->length += len + 1;
+        break;
+      }
+
+      default:
+        fits = false;
+        break;
+    }
+  }
+
+  slot->truncated = !fits;
+}
+
+////////////////////////////////////////
+
+void w5500_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+  uint32_t position = __atomic_load_n(&s_log_head, __ATOMIC_RELAXED);
+  w5500_log_slot_t *slot;
+
+  TaskHandle_t mute_task = __atomic_load_n(&s_log_mute_task, __ATOMIC_RELAXED);
+
+  if (mute_task && (mute_task == xTaskGetCurrentTaskHandle()) && (strncmp(tag, "w5500.", 6) == 0))
+  {
+    __atomic_fetch_add(&s_log_muted, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  for (;;)
+  {
+    slot = &s_log[position & (W5500_LOG_SLOTS - 1)];
+    int32_t diff = (int32_t)(w5500_log_seq(slot) - position);
+
+    if (diff == 0)
+    {
+      // On failure position is reloaded with the current head
+      if (__atomic_compare_exchange_n(&s_log_head, &position, position + 1, true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+    {
+      // Full: the log task has not formatted this slot yet
+      __atomic_fetch_add(&s_log_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else
+    {
+      position = __atomic_load_n(&s_log_head, __ATOMIC_RELAXED);
+    }
+  }
+
+  va_list args;
+
+  slot->timestamp = esp_log_timestamp();
+  slot->tag = tag;
+  slot->format = format;
+  slot->level = level;
+  slot->length = 0;
+  va_start(args, format);
+  w5500_log_pack(slot, format, args);
+  va_end(args);
+
+  w5500_log_set_seq(slot, position + 1);
+}
+
+////////////////////////////////////////
+
+static inline bool w5500_log_take(const w5500_log_slot_t *slot, size_t *offset, void *value, size_t len)
+{
+  if (*offset + len > slot->length)
+    return false;
+
+  memcpy(value, slot->data + *offset, len);
+  *offset += len;
+  return true;
+}
+
+#define W5500_LOG_FORMAT(type)                                                                            \
+  ({                                                                                                      \
+    type value_;                                                                                          \
+    bool taken_ = w5500_log_take(slot, &offset, &value_, sizeof(value_));                                 \
+    if (taken_)                                                                                           \
+      written = (stars == 0) ? snprintf(out, room, spec, value_)                                          \
+                : (stars == 1) ? snprintf(out, room, spec, star[0], value_)                               \
+                : snprintf(out, room, spec, star[0], star[1], value_);                                    \
+    taken_;                                                                                               \
+  })
+
+// Rebuild the message of a slot, one conversion at a time
+static void w5500_log_format(const w5500_log_slot_t *slot, char *message, size_t size)
+{
+  const char *format = slot->format;
+  size_t offset = 0;
+  size_t used = 0;
+
+  while (*format && (used < size - 1))
+  {
+    const char *percent = strchr(format, '%');
+    size_t literal = percent ? (size_t)(percent - format) : strlen(format);
+
+    if (literal > size - 1 - used)
+      literal = size - 1 - used;
+
+    memcpy(message + used, format, literal);
+    used += literal;
+
+    if (!percent || (used >= size - 1))
+      break;
+
+    w5500_log_arg_t type;
+    int stars;
+    int star[2] = { 0, 0 };
+    char spec[24];
+    const char *end = w5500_log_parse(percent + 1, &type, &stars);
+    size_t spec_len = end - percent;
+    char *out = message + used;
+    size_t room = size - used;
+    int written = 0;
+    bool taken = true;
+
+    format = end;
+
+    if ((type == W5500_LOG_ARG_BAD) || (spec_len >= sizeof(spec)))
+      break;
+
+    memcpy(spec, percent, spec_len);
+    spec[spec_len] = 0;
+
+    for (int i = 0; taken && (i < stars); i++)
+      taken = w5500_log_take(slot, &offset, &star[i], sizeof(star[i]));
+
+    if (taken)
+    {
+      switch (type)
+      {
+        case W5500_LOG_ARG_INT:     taken = W5500_LOG_FORMAT(int);           break;
+        case W5500_LOG_ARG_LONG:    taken = W5500_LOG_FORMAT(long);          break;
+        case W5500_LOG_ARG_LLONG:   taken = W5500_LOG_FORMAT(long long);     break;
+        case W5500_LOG_ARG_SIZE:    taken = W5500_LOG_FORMAT(size_t);        break;
+        case W5500_LOG_ARG_PTR:     taken = W5500_LOG_FORMAT(void *);        break;
+        case W5500_LOG_ARG_DOUBLE:  taken = W5500_LOG_FORMAT(double);        break;
+        case W5500_LOG_ARG_PERCENT: written = snprintf(out, room, "%%");     break;
+
+        case W5500_LOG_ARG_STRING:
+        {
+          const char *string = (const char *)slot->data + offset;
+
+          taken = offset < slot->length;
+
+          if (taken)
+          {
+            offset += strlen(string) + 1;
+            written = (stars == 0) ? snprintf(out, room, spec, string)
+                      : (stars == 1) ? snprintf(out, room, spec, star[0], string)
+                      : snprintf(out, room, spec, star[0], star[1], string);
+          }
+
+          break;
+        }
+
+        default:
+          break;
+      }
+    }
+
+    if (written > 0)
+      used += ((size_t)written < room) ? (size_t)written : room - 1;
+
+    if (!taken)
+      break;
+  }
+
+  message[used] = 0;
+
+  if (slot->truncated && (used + 4 < size))
+    strcpy(message + used, " ...");
+}
+
+////////////////////////////////////////
+
+static void w5500_log_output(esp_log_level_t level, const char *tag, uint32_t timestamp, const char *message)
+{
+  w5500_log_sink_t sink;
+  void *arg;
+
+  portENTER_CRITICAL(&s_log_mux);
+  sink = s_log_sink;
+  arg = s_log_sink_arg;
+  s_log_in_sink = sink;
+  s_log_in_sink_arg = arg;
+  portEXIT_CRITICAL(&s_log_mux);
+
+  if (sink)
+  {
+    sink(level, tag, timestamp, message, arg);
+
+    portENTER_CRITICAL(&s_log_mux);
+    s_log_in_sink = NULL;
+    s_log_in_sink_arg = NULL;
+    portEXIT_CRITICAL(&s_log_mux);
+  }
+  else
+    printf("%c (%u) %s: %s\n", "NEWIDV"[(level <= ESP_LOG_VERBOSE) ? level : 0], (unsigned)timestamp, tag,
+           message);
+}
+
+////////////////////////////////////////
+
+static void w5500_log_task(void *arg)
+{
+  char message[W5500_LOG_MESSAGE_SIZE];
+  uint32_t reported = 0;
+
+  for (;;)
+  {
+    for (;;)
+    {
+      w5500_log_slot_t *slot = &s_log[s_log_tail & (W5500_LOG_SLOTS - 1)];
+
+      if (w5500_log_seq(slot) != s_log_tail + 1)
+        break;
+
+      w5500_log_format(slot, message, sizeof(message));
+
+      esp_log_level_t level = (esp_log_level_t)slot->level;
+      const char *tag = slot->tag;
+      uint32_t timestamp = slot->timestamp;
+
+      // Give the slot back before the (maybe slow) output
+      w5500_log_set_seq(slot, s_log_tail + W5500_LOG_SLOTS);
+      s_log_tail++;
+
+      w5500_log_output(level, tag, timestamp, message);
+    }
+
+    uint32_t dropped = __atomic_load_n(&s_log_dropped, __ATOMIC_RELAXED);
+
+    if (dropped != reported)
+    {
+      snprintf(message, sizeof(message), "%u log messages dropped", (unsigned)(dropped - reported));
+      w5500_log_output(ESP_LOG_WARN, "w5500.log", esp_log_timestamp(), message);
+      reported = dropped;
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(W5500_LOG_FLUSH_MS));
+  }
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_log_start(void)
+{
+  if (__atomic_exchange_n(&s_log_started, true, __ATOMIC_ACQ_REL))
+    return ESP_OK;
+
+#if W5500_STATIC_ALLOCATION
+  TaskHandle_t task = xTaskCreateStaticPinnedToCore(w5500_log_task, "w5500_log", W5500_LOG_TASK_STACK_SIZE, NULL,
+                                                    W5500_LOG_TASK_PRIORITY, s_log_task_stack, &s_log_task_buffer,
+                                                    tskNO_AFFINITY);
+  bool created = task != NULL;
+#else
+  TaskHandle_t task = NULL;
+  bool created = xTaskCreatePinnedToCore(w5500_log_task, "w5500_log", W5500_LOG_TASK_STACK_SIZE, NULL,
+                                         W5500_LOG_TASK_PRIORITY, &task, tskNO_AFFINITY) == pdPASS;
+#endif
+
+  __atomic_store_n(&s_log_task, task, __ATOMIC_RELEASE);
+
+  if (!created)
+  {
+    __atomic_store_n(&s_log_started, false, __ATOMIC_RELEASE);
+    return ESP_FAIL;
+  }
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+void w5500_log_set_sink(w5500_log_sink_t sink, void *arg)
+{
+  portENTER_CRITICAL(&s_log_mux);
+  w5500_log_sink_t old = s_log_sink;
+  void *old_arg = s_log_sink_arg;
+  s_log_sink = sink;
+  s_log_sink_arg = arg;
+  portEXIT_CRITICAL(&s_log_mux);
+
+  // The log task may be in the old sink with the old argument. Wait for it to come out, so the caller can
+  // free them on return. Not from the sink itself: that would wait for its own return
+  if ((old == NULL) || (xTaskGetCurrentTaskHandle() == __atomic_load_n(&s_log_task, __ATOMIC_ACQUIRE)))
+    return;
+
+  for (;;)
+  {
+    portENTER_CRITICAL(&s_log_mux);
+    bool busy = (s_log_in_sink == old) && (s_log_in_sink_arg == old_arg);
+    portEXIT_CRITICAL(&s_log_mux);
+
+    if (!busy)
+      break;
+
+    vTaskDelay(1);
+  }
+}
+
+////////////////////////////////////////
+
+uint32_t w5500_log_dropped(void)
+{
+  return __atomic_load_n(&s_log_dropped, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////
+
+void w5500_log_mute_driver(bool mute)
+{
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  TaskHandle_t owner = NULL;
+
+  // Only the owner touches s_log_mute, so plain updates
+  if (mute)
+  {
+    if (__atomic_compare_exchange_n(&s_log_mute_task, &owner, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+        || (owner == self))
+      s_log_mute++;
+  }
+  else if (__atomic_load_n(&s_log_mute_task, __ATOMIC_RELAXED) == self)
+  {
+    if (--s_log_mute == 0)
+      __atomic_store_n(&s_log_mute_task, NULL, __ATOMIC_RELEASE);
+  }
+}
+
+////////////////////////////////////////
+
+uint32_t w5500_log_muted(void)
+{
+  return __atomic_load_n(&s_log_muted, __ATOMIC_RELAXED);
+}
+
+#endif  // W5500_DEFERRED_LOG
@@ -0,0 +1,41 @@
+/****************************************************************************************************************************
+  esp_eth_log_w5500.h
+
+  For Ethernet shields using ESP32_W5500 (ESP32 + W5500)
+
+  WebServer_ESP32_W5500 is a library for the ESP32 with Ethernet W5500 to run WebServer
+
+  Based on and modified from ESP32-IDF https://github.com/espressif/esp-idf
+  Built by Khoi Hoang https://github.com/khoih-prog/WebServer_ESP32_W5500
+  Modified by SparkFun
+  Licensed under GPLv3 license
+
+  Please see SparkFun_WebServer_ESP32_W5500.h for the version information
+ *****************************************************************************************************************************/
+
+// Driver sources only, after esp_log.h and esp_check.h: sends their ESP_LOGx (and so the ESP_GOTO_ON_*
+// messages) to the deferred log ring instead of formatting them on the spot
+
+#pragma once
+
+#include "esp_log.h"
+#include "esp_eth_w5500.h"
+
+#if W5500_DEFERRED_LOG
+
+#undef ESP_LOGE
+#undef ESP_LOGW
+#undef ESP_LOGI
+#undef ESP_LOGD
+#undef ESP_LOGV
+
+#define W5500_LOG_DEFERRED(level, tag, format, ...) \
+  do { if (LOG_LOCAL_LEVEL >= (level)) w5500_log_write((level), (tag), format, ##__VA_ARGS__); } while (0)
+
+#define ESP_LOGE(tag, format, ...)  W5500_LOG_DEFERRED(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)  W5500_LOG_DEFERRED(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)  W5500_LOG_DEFERRED(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)  W5500_LOG_DEFERRED(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)  W5500_LOG_DEFERRED(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
+#endif  // W5500_DEFERRED_LOG
@@ -29,7 +29,9 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/cdefs.h>
+#include <sys/time.h>
 #include "driver/gpio.h"
 #include "driver/spi_master.h"
 #include "esp_attr.h"
@@ -40,11 +42,15 @@
 #include "esp_intr_alloc.h"
 #include "esp_heap_caps.h"
 #include "esp_rom_gpio.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "hal/cpu_hal.h"
 #include "w5500.h"
+#include "esp_eth_w5500.h"
+#include "esp_eth_log_w5500.h"
 #include "sdkconfig.h"
 
 ////////////////////////////////////////
@@ -52,40 +58,715 @@
 static const char *TAG = "w5500.mac";
 
 #define W5500_SPI_LOCK_TIMEOUT_MS (50)
+#define W5500_SCHED_RX (0)
+#define W5500_SCHED_TX (1)
+
+// 64-bit counters with one writer at a time. The store is atomic so that a reader on the other core never
+// sees one half way through an update (w5500_get_stats, w5500_get_cycle_stats)
+#define W5500_STAT64_ADD(counter, n)        __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+#if W5500_LATENCY_HISTOGRAMS || W5500_TRACE
+  #define W5500_CYCLES()                    cpu_hal_get_cycle_count()
+#else
+  #define W5500_CYCLES()                    0
+#endif
+
+#if W5500_LATENCY_HISTOGRAMS
+  #define W5500_HIST_ADD(emac, id, start)   w5500_hist_add(&(emac)->hist[id], cpu_hal_get_cycle_count() - (start))
+#else
+  #define W5500_HIST_ADD(emac, id, start)   ((void)(start))
+#endif
+
+#if W5500_TRACE
+  #define W5500_TRACE_SPAN(type, len, arg, start) w5500_trace_add((type), (len), (arg), cpu_hal_get_cycle_count() - (start))
+  #define W5500_TRACE_EVENT(type, len, arg)       w5500_trace_add((type), (len), (arg), 0)
+#else
+  #define W5500_TRACE_SPAN(type, len, arg, start) ((void)(arg), (void)(start))
+  #define W5500_TRACE_EVENT(type, len, arg)       do { } while (0)
+#endif
+
+#if W5500_CYCLE_ACCOUNTING
+  #define W5500_STAGE_BEGIN(emac, dir, stage)     w5500_stage_begin((emac), (dir), (stage))
+  #define W5500_STAGE_SWITCH(emac, dir, stage)    w5500_stage_switch((emac), &(emac)->stage_ctx[dir], (stage))
+  #define W5500_STAGE_END(emac, dir, frames)      w5500_stage_end((emac), (dir), (frames))
+  #define W5500_STAGE_PUSH(emac, rx_stage, tx_stage) w5500_stage_push((emac), (rx_stage), (tx_stage))
+  #define W5500_STAGE_POP(emac, prev)             w5500_stage_pop((emac), (prev))
+#else
+  #define W5500_STAGE_BEGIN(emac, dir, stage)     do { } while (0)
+  #define W5500_STAGE_SWITCH(emac, dir, stage)    do { } while (0)
+  #define W5500_STAGE_END(emac, dir, frames)      ((void)(frames))
+  #define W5500_STAGE_PUSH(emac, rx_stage, tx_stage) (-1)
+  #define W5500_STAGE_POP(emac, prev)             ((void)(prev))
+#endif
+
+#if W5500_CAPTURE
+  #define W5500_CAPTURE_FRAME(emac, direction, frame, len) \
+    do { if ((emac)->capture && (emac)->capture->on) w5500_capture_frame((emac), (direction), (frame), (len)); } while (0)
+#else
+  #define W5500_CAPTURE_FRAME(emac, direction, frame, len) do { } while (0)
+#endif
+
+#if W5500_FLOW_TABLE
+  #define W5500_FLOW_FRAME(emac, direction, frame, len) w5500_flow_frame((emac), (direction), (frame), (len))
+#else
+  #define W5500_FLOW_FRAME(emac, direction, frame, len) do { } while (0)
+#endif
 #define W5500_TX_MEM_SIZE (0x4000)
 #define W5500_RX_MEM_SIZE (0x4000)
+#define W5500_SOCK_SEND_TIMEOUT_MS (5000)
+#define W5500_SOCK_KEEPALIVE (2)  // Keep alive interval in units of 5s
+#define W5500_RESET_POLL_US (50)
+#define W5500_RESET_SPIN_US (2000) // Busy-poll for this long before yielding to other tasks
 
 ////////////////////////////////////////
 
+#if W5500_CYCLE_ACCOUNTING
+// A frame being timed, see w5500_stage_switch
+typedef struct
+{
+  TaskHandle_t task;                     // Task handling the frame, NULL when none
+  uint8_t stage;                         // Stage being charged, W5500_STAGE_NUM = none
+  uint8_t core;                          // Core and cycle count at the last switch
+  uint32_t last;
+} w5500_stage_ctx_t;
+#endif
+
+#if W5500_CAPTURE
+// pcap capture ring, see w5500_capture_start. Frames are added while holding the RX / TX turn, so there is
+// one writer at a time, and taken out by one reader
+typedef struct
+{
+  w5500_capture_config_t config;
+  uint8_t *ring;
+  uint32_t mask;                         // Ring size - 1
+  uint32_t head;                         // Bytes added, free running. Stored after the record is copied in
+  uint32_t tail;                         // Bytes taken out, free running
+  volatile bool on;
+  w5500_capture_stats_t stats;           // Written by the frame writer
+} w5500_capture_t;
+#endif
+
 typedef struct
 {
   esp_eth_mac_t parent;
   esp_eth_mediator_t *eth;
   spi_device_handle_t spi_hdl;
   SemaphoreHandle_t spi_lock;
+  int spi_client;                        // Bus arbiter client, -1 if the bus is not shared
   TaskHandle_t rx_task_hdl;
   uint32_t sw_reset_timeout_ms;
   int int_gpio_num;
   uint8_t addr[6];
   bool packets_remain;
+  bool link_up;                          // Set by set_link from the PHY link poll
+  bool reinit_in_progress;               // w5500_reinit is resetting the chip. RX and TX stay away (w5500_sched_take_frame)
+  uint16_t sock_tx_size[W5500_SOCK_NUM]; // TX buffer size of each socket, in bytes
+  uint16_t sock_rx_size[W5500_SOCK_NUM]; // RX buffer size of each socket, in bytes
+  uint8_t sock_in_use;                   // Bit mask of the offload sockets handed out by w5500_sock_alloc
+  uint8_t sock_connected;                // Bit mask of the handed out sockets seen ESTABLISHED since they were claimed
+  uint8_t sock_generation[W5500_SOCK_NUM]; // Bumped each time a socket is handed out, see w5500_sock_generation
+  bool sock_send_pending[W5500_SOCK_NUM]; // Offload sockets waiting for SEND_OK
+  uint32_t ip_addr;                      // Source IP, netmask and gateway for the offload sockets (network order)
+  uint32_t netmask;
+  uint32_t gateway;
+  uint32_t heap_allocs;                  // Allocations made through w5500_heap_alloc since the driver was created
+  // RX / TX turn taking, see w5500_sched_take. RX is the RX task. TX is any task calling transmit:
+  // lwIP's tcpip thread, w5500_pktgen_run... The turn is held for one frame
+  portMUX_TYPE sched_mux;
+  int8_t sched_owner;                    // W5500_SCHED_RX / _TX holding the turn, -1 = free
+  TaskHandle_t sched_owner_task;         // Task holding the turn. NULL while handed to a waiter which has not woken yet
+  uint8_t sched_waiting[2];              // Tasks per direction blocked in w5500_sched_take
+  SemaphoreHandle_t sched_grant[2];      // Given when the turn is handed to a waiter of that direction
+  StaticSemaphore_t sched_grant_buffer[2];
+  w5500_sched_stats_t sched_stats;       // Updated with __atomic_fetch_add, read with w5500_get_sched_stats
+  w5500_stats_t stats;                   // See w5500_get_stats for who writes what
+#if W5500_LATENCY_HISTOGRAMS
+  w5500_hist_t hist[W5500_HIST_NUM];     // RX ones written by the RX task only, TX ones by the transmitting task
+  uint32_t isr_cycles;                   // Cycle count and core of the last interrupt, for W5500_HIST_ISR_WAKE
+  int isr_core;
+  bool isr_stamped;
+#endif
+#if W5500_TRACE
+  uint32_t lock_cycles;                  // When the SPI lock was taken, for W5500_TRACE_UNLOCK
+#endif
+#if W5500_CYCLE_ACCOUNTING
+  w5500_stage_ctx_t stage_ctx[2];        // Per direction (W5500_SCHED_RX / _TX), written by the task timing the frame
+  w5500_cycle_stats_t cycle_stats;       // RX stages written by the RX task only, TX stages by the transmitting task
+  int64_t cycle_stats_since;             // esp_timer_get_time() at the last reset
+#endif
+#if W5500_CAPTURE
+  w5500_capture_t *capture;              // NULL until the first w5500_capture_start
+#endif
+#if W5500_FLOW_TABLE
+  portMUX_TYPE flow_mux;                 // Guards the flow table and the sampling state
+  w5500_flow_t flows[W5500_FLOW_ENTRIES]; // Open addressed, linear probing. last_seen 0 = empty
+  uint32_t flow_clock;                   // Frames counted, for last_seen
+  uint32_t flow_evictions;
+  uint32_t flow_sample_rate;             // 0 = not sampling
+  uint32_t flow_sample_skip;             // Frames until the next sample
+  uint32_t flow_sample_pool;             // Frames since the last sample
+  w5500_flow_sample_cb_t flow_sample_cb;
+  void *flow_sample_arg;
+#endif
+#if W5500_PKTGEN
+  bool sink_on;                          // Set by w5500_sink_start, read by the RX task
+  bool sink_reset;                       // w5500_sink_start asks the RX task to zero sink_stats
+  uint16_t sink_ether_type;              // Network order
+  w5500_sink_stats_t sink_stats;         // Written by the RX task only. lost and elapsed_us are worked out on read
+  int64_t sink_first_us;
+  int64_t sink_last_us;
+#if W5500_STATIC_ALLOCATION
+  bool pktgen_busy;                      // w5500_pktgen_run is using pktgen_frame
+  uint8_t pktgen_frame[1514];            // w5500_pktgen_run's frame, instead of a heap buffer
+#endif
+#endif
+#if W5500_STATIC_ALLOCATION
+  bool in_use;                           // This s_emac slot is taken
+  StaticSemaphore_t spi_lock_buffer;
+  StaticTask_t rx_task_buffer;
+  StackType_t rx_task_stack[W5500_STATIC_RX_TASK_STACK_SIZE];
+#endif
 } emac_w5500_t;
 
+#if W5500_STATIC_ALLOCATION
+static emac_w5500_t s_emac[W5500_STATIC_INSTANCES];
+static portMUX_TYPE s_emac_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+////////////////////////////////////////
+
+// Every allocation the driver makes after it was created goes through here, so w5500_get_alloc_count
+// shows all of them. Freed with free() / heap_caps_free()
+static void *w5500_heap_alloc(emac_w5500_t *emac, size_t size, uint32_t caps)
+{
+  void *ptr = heap_caps_malloc(size, caps);
+
+  if (ptr)
+    __atomic_fetch_add(&emac->heap_allocs, 1, __ATOMIC_RELAXED);
+
+  return ptr;
+}
+
+////////////////////////////////////////
+
+#if W5500_TRACE
+
+static w5500_trace_event_t s_trace[W5500_TRACE_EVENTS];
+static uint32_t s_trace_head = 0;        // Events recorded since the last clear. The slot is head % W5500_TRACE_EVENTS
+static volatile bool s_trace_on = false;
+
+// Inlined everywhere, including the ISR
+static inline __attribute__((always_inline)) void w5500_trace_add(uint8_t type, uint16_t len, uint32_t arg,
+                                                                  uint32_t duration)
+{
+  if (!s_trace_on)
+    return;
+
+  uint32_t now = cpu_hal_get_cycle_count();
+  w5500_trace_event_t *event = &s_trace[__atomic_fetch_add(&s_trace_head, 1, __ATOMIC_RELAXED) & (W5500_TRACE_EVENTS - 1)];
+
+  event->cycles = now;
+  event->type = type;
+  event->core = cpu_hal_get_core_id();
+  event->len = len;
+  event->arg = arg;
+  event->duration = duration;
+}
+
+#endif
+
+////////////////////////////////////////
+
+#if W5500_LATENCY_HISTOGRAMS
+
+static inline void w5500_hist_add(w5500_hist_t *hist, uint32_t cycles)
+{
+  hist->count[31 - __builtin_clz(cycles | 1)]++;
+
+  if (cycles > hist->max_cycles)
+    hist->max_cycles = cycles;
+}
+
+#endif
+
+////////////////////////////////////////
+
+#if W5500_CYCLE_ACCOUNTING
+
+// Charge the cycles since the last switch to the current stage and move on to stage. Each core has its
+// own cycle counter, so an interval over which the task moved to the other core is dropped
+static inline void w5500_stage_switch(emac_w5500_t *emac, w5500_stage_ctx_t *ctx, uint8_t stage)
+{
+  uint32_t now = cpu_hal_get_cycle_count();
+  uint8_t core = cpu_hal_get_core_id();
+
+  if ((ctx->stage < W5500_STAGE_NUM) && (core == ctx->core))
+    W5500_STAT64_ADD(emac->cycle_stats.cycles[core][ctx->stage], (uint32_t)(now - ctx->last));
+
+  ctx->stage = stage;
+  ctx->core = core;
+  ctx->last = now;
+}
+
+static inline void w5500_stage_begin(emac_w5500_t *emac, int dir, uint8_t stage)
+{
+  w5500_stage_ctx_t *ctx = &emac->stage_ctx[dir];
+
+  ctx->task = xTaskGetCurrentTaskHandle();
+  ctx->stage = W5500_STAGE_NUM;
+  w5500_stage_switch(emac, ctx, stage);
+}
+
+static inline void w5500_stage_end(emac_w5500_t *emac, int dir, uint32_t frames)
+{
+  w5500_stage_switch(emac, &emac->stage_ctx[dir], W5500_STAGE_NUM);
+  emac->stage_ctx[dir].task = NULL;
+
+  if (dir == W5500_SCHED_RX)
+    emac->cycle_stats.rx_frames += frames;
+  else
+    emac->cycle_stats.tx_frames += frames;
+}
+
+// For the SPI and command helpers, which do not know who called them: if the calling task is timing a frame,
+// switch it to rx_stage or tx_stage. Returns what w5500_stage_pop needs to switch back, -1 if not timing
+static inline int w5500_stage_push(emac_w5500_t *emac, uint8_t rx_stage, uint8_t tx_stage)
+{
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+  for (int dir = W5500_SCHED_RX; dir <= W5500_SCHED_TX; dir++)
+  {
+    w5500_stage_ctx_t *ctx = &emac->stage_ctx[dir];
+
+    if (ctx->task == self)
+    {
+      int prev = (dir << 8) | ctx->stage;
+
+      w5500_stage_switch(emac, ctx, (dir == W5500_SCHED_RX) ? rx_stage : tx_stage);
+      return prev;
+    }
+  }
+
+  return -1;
+}
+
+static inline void w5500_stage_pop(emac_w5500_t *emac, int prev)
+{
+  if (prev >= 0)
+    w5500_stage_switch(emac, &emac->stage_ctx[prev >> 8], prev & 0xFF);
+}
+
+#endif
+
+////////////////////////////////////////
+
+#if W5500_CAPTURE
+
+static bool w5500_capture_match(const w5500_capture_config_t *config, const uint8_t *frame, uint32_t len)
+{
+  uint32_t offset = 12;
+
+  if (len < 14)
+    return false;
+
+  uint16_t type = (frame[offset] << 8) | frame[offset + 1];
+
+  if ((type == 0x8100) && (len >= 18))
+  {
+    offset += 4;
+    type = (frame[offset] << 8) | frame[offset + 1];
+  }
+
+  offset += 2;
+
+  if (config->ether_type && (type != config->ether_type))
+    return false;
+
+  if (!config->port && !config->skip_port)
+    return true;
+
+  // IPv4 TCP or UDP, first fragment only
+  bool has_ports = false;
+  uint16_t src = 0;
+  uint16_t dst = 0;
+
+  if ((type == 0x0800) && (len >= offset + 20))
+  {
+    const uint8_t *ip = frame + offset;
+    uint32_t ip_len = (ip[0] & 0x0F) * 4;
+
+    if (((ip[9] == 6) || (ip[9] == 17)) && !(((ip[6] & 0x1F) << 8) | ip[7]) && (len >= offset + ip_len + 4))
+    {
+      has_ports = true;
+      src = (ip[ip_len] << 8) | ip[ip_len + 1];
+      dst = (ip[ip_len + 2] << 8) | ip[ip_len + 3];
+    }
+  }
+
+  if (config->skip_port && has_ports && ((src == config->skip_port) || (dst == config->skip_port)))
+    return false;
+
+  if (config->port && !(has_ports && ((src == config->port) || (dst == config->port))))
+    return false;
+
+  return true;
+}
+
+////////////////////////////////////////
+
+static void w5500_capture_copy(w5500_capture_t *capture, uint32_t position, const void *data, uint32_t len)
+{
+  uint32_t offset = position & capture->mask;
+  uint32_t first = capture->mask + 1 - offset;
+
+  if (first > len)
+    first = len;
+
+  memcpy(capture->ring + offset, data, first);
+  memcpy(capture->ring, (const uint8_t *)data + first, len - first);
+}
+
+////////////////////////////////////////
+
+// Only called with the capture on, so the hot path pays one test when it is off
+static void w5500_capture_frame(emac_w5500_t *emac, uint8_t direction, const uint8_t *frame, uint32_t len)
+{
+  w5500_capture_t *capture = emac->capture;
+
+  if (!(capture->config.directions & direction))
+    return;
+
+  if (!w5500_capture_match(&capture->config, frame, len))
+  {
+    capture->stats.filtered++;
+    return;
+  }
+
+  uint32_t kept = (capture->config.snap_len && (len > capture->config.snap_len)) ? capture->config.snap_len : len;
+  uint32_t head = capture->head;
+  uint32_t tail = __atomic_load_n(&capture->tail, __ATOMIC_ACQUIRE);
+
+  // A full ring keeps the older frames, the reader will want those first
+  if ((16 + kept) > (capture->mask + 1 - (head - tail)))
+  {
+    capture->stats.dropped++;
+    return;
+  }
+
+  // pcap record header: seconds, microseconds, bytes kept, frame length
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  uint32_t record[4] = { (uint32_t)now.tv_sec, (uint32_t)now.tv_usec, kept, len };
+
+  w5500_capture_copy(capture, head, record, sizeof(record));
+  w5500_capture_copy(capture, head + sizeof(record), frame, kept);
+  __atomic_store_n(&capture->head, head + sizeof(record) + kept, __ATOMIC_RELEASE);
+
+  capture->stats.frames++;
+  capture->stats.bytes += sizeof(record) + kept;
+}
+
+#endif
+
+////////////////////////////////////////
+
+#if W5500_FLOW_TABLE
+
+// Random, so periodic traffic does not alias with the sampling. Averages rate
+static inline uint32_t w5500_flow_next_skip(uint32_t rate)
+{
+  return (rate > 1) ? (1 + esp_random() % (2 * rate - 1)) : 1;
+}
+
+////////////////////////////////////////
+
+static void w5500_flow_frame(emac_w5500_t *emac, int direction, const uint8_t *frame, uint32_t len)
+{
+  w5500_flow_t key;
+  uint32_t offset = 12;
+
+  if (len < 14)
+    return;
+
+  // The peer is the source of RX frames and the destination of TX frames
+  memset(&key, 0, 16);
+  memcpy(key.mac, frame + ((direction == W5500_FLOW_RX) ? 6 : 0), 6);
+  key.ether_type = (frame[offset] << 8) | frame[offset + 1];
+
+  if ((key.ether_type == 0x8100) && (len >= 18))
+  {
+    offset += 4;
+    key.ether_type = (frame[offset] << 8) | frame[offset + 1];
+  }
+
+  offset += 2;
+
+  if ((key.ether_type == 0x0800) && (len >= offset + 20))
+  {
+    const uint8_t *ip = frame + offset;
+    uint32_t ip_len = (ip[0] & 0x0F) * 4;
+
+    key.protocol = ip[9];
+    memcpy(&key.ip, ip + ((direction == W5500_FLOW_RX) ? 12 : 16), 4);
+
+    // TCP or UDP, first fragment only
+    if (((ip[9] == 6) || (ip[9] == 17)) && !(((ip[6] & 0x1F) << 8) | ip[7]) && (len >= offset + ip_len + 4))
+    {
+      const uint8_t *ports = ip + ip_len + ((direction == W5500_FLOW_RX) ? 0 : 2);
+
+      key.port = (ports[0] << 8) | ports[1];
+    }
+  }
+
+  // FNV-1a over the 16 byte key
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < 16; i++)
+    hash = (hash ^ ((const uint8_t *)&key)[i]) * 16777619u;
+
+  w5500_flow_t *flow = NULL;
+  w5500_flow_t *oldest = NULL;
+  bool sample = false;
+  w5500_flow_sample_t info;
+  w5500_flow_sample_cb_t callback = NULL;
+  void *arg = NULL;
+
+  portENTER_CRITICAL(&emac->flow_mux);
+
+  // 0 marks an empty slot
+  if (++emac->flow_clock == 0)
+    emac->flow_clock = 1;
+
+  // No flow is ever removed on its own, so the search can stop at the first empty slot
+  for (int probe = 0; probe < W5500_FLOW_PROBES; probe++)
+  {
+    w5500_flow_t *slot = &emac->flows[(hash + probe) & (W5500_FLOW_ENTRIES - 1)];
+
+    if (!slot->last_seen || !memcmp(slot, &key, 16))
+    {
+      flow = slot;
+      break;
+    }
+
+    if (!oldest || ((int32_t)(slot->last_seen - oldest->last_seen) < 0))
+      oldest = slot;
+  }
+
+  if (!flow || !flow->last_seen)
+  {
+    if (!flow)
+    {
+      flow = oldest;
+      emac->flow_evictions++;
+    }
+
+    memset(flow, 0, sizeof(*flow));
+    memcpy(flow, &key, 16);
+  }
+
+  flow->last_seen = emac->flow_clock;
+
+  if (direction == W5500_FLOW_RX)
+  {
+    flow->rx_packets++;
+    flow->rx_bytes += len;
+  }
+  else
+  {
+    flow->tx_packets++;
+    flow->tx_bytes += len;
+  }
+
+  if (emac->flow_sample_rate)
+  {
+    emac->flow_sample_pool++;
+
+    if (--emac->flow_sample_skip == 0)
+    {
+      sample = true;
+      info.sample_pool = emac->flow_sample_pool;
+      callback = emac->flow_sample_cb;
+      arg = emac->flow_sample_arg;
+      emac->flow_sample_pool = 0;
+      emac->flow_sample_skip = w5500_flow_next_skip(emac->flow_sample_rate);
+    }
+  }
+
+  portEXIT_CRITICAL(&emac->flow_mux);
+
+  if (sample)
+  {
+    info.direction = direction;
+    info.frame_len = len;
+    info.header_len = (len < 128) ? len : 128;
+    info.header = frame;
+    callback(&info, arg);
+  }
+}
+
+#endif
+
 ////////////////////////////////////////
 
 static inline bool w5500_lock(emac_w5500_t *emac)
 {
-  return (xSemaphoreTake(emac->spi_lock, pdMS_TO_TICKS(W5500_SPI_LOCK_TIMEOUT_MS)) == pdTRUE);
+  uint32_t start = W5500_CYCLES();
+
+  if (xSemaphoreTake(emac->spi_lock, 0) != pdTRUE)
+  {
+    __atomic_fetch_add(&emac->stats.lock_waits, 1, __ATOMIC_RELAXED);
+
+    if (xSemaphoreTake(emac->spi_lock, pdMS_TO_TICKS(W5500_SPI_LOCK_TIMEOUT_MS)) != pdTRUE)
+    {
+      __atomic_fetch_add(&emac->sched_stats.spi_lock_timeouts, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+  }
+
+  // Shared bus: one arbitration per transaction, so other devices get in between the reads of a frame
+  if ((emac->spi_client >= 0) && !w5500_spi_acquire(emac->spi_client, W5500_SPI_LOCK_TIMEOUT_MS))
+  {
+    __atomic_fetch_add(&emac->sched_stats.spi_lock_timeouts, 1, __ATOMIC_RELAXED);
+    xSemaphoreGive(emac->spi_lock);
+    return false;
+  }
+
+  W5500_TRACE_SPAN(W5500_TRACE_LOCK, 0, 0, start);
+#if W5500_TRACE
+  emac->lock_cycles = cpu_hal_get_cycle_count();
+#endif
+
+  return true;
 }
 
 ////////////////////////////////////////
 
 static inline bool w5500_unlock(emac_w5500_t *emac)
 {
+#if W5500_TRACE
+  W5500_TRACE_SPAN(W5500_TRACE_UNLOCK, 0, 0, emac->lock_cycles);
+#endif
+
+  if (emac->spi_client >= 0)
+    w5500_spi_release(emac->spi_client);
+
   return xSemaphoreGive(emac->spi_lock) == pdTRUE;
 }
 
 ////////////////////////////////////////
 
+// RX and TX both hold spi_lock for one transaction at a time. A FreeRTOS mutex does not hand over to
+// its waiter, so the higher priority side (usually TX in the tcpip thread) can re-take it straight away
+// and starve the other until W5500_SPI_LOCK_TIMEOUT_MS. Frames therefore also take a turn: it is held
+// for one frame and, on release, handed to the other direction if that is waiting, else to another task
+// of the same direction. Both pending = alternate. Only one task holds the turn, whatever its direction
+static bool w5500_sched_take(emac_w5500_t *emac, int dir)
+{
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  int64_t start_us = esp_timer_get_time();
+  bool granted = false;
+
+  portENTER_CRITICAL(&emac->sched_mux);
+
+  if (emac->sched_owner < 0)
+  {
+    emac->sched_owner = dir;
+    emac->sched_owner_task = self;
+    granted = true;
+  }
+  else
+  {
+    emac->sched_waiting[dir]++;
+  }
+
+  portEXIT_CRITICAL(&emac->sched_mux);
+
+  while (!granted)
+  {
+    int64_t waited_ms = (esp_timer_get_time() - start_us) / 1000;
+    TickType_t ticks = (waited_ms >= W5500_SPI_LOCK_TIMEOUT_MS) ? 0 : pdMS_TO_TICKS(W5500_SPI_LOCK_TIMEOUT_MS - waited_ms);
+    bool woken = (xSemaphoreTake(emac->sched_grant[dir], ticks) == pdTRUE);
+
+    /* The grant only says the turn went to some waiter of this direction. Whoever gets here first claims
+       it, so a waiter which timed out just as the turn came takes it rather than leave it stranded.
+       A grant left over from such a race wakes a waiter with nothing to claim: it waits again */
+    portENTER_CRITICAL(&emac->sched_mux);
+
+    if ((emac->sched_owner == dir) && (emac->sched_owner_task == NULL))
+    {
+      emac->sched_owner_task = self;
+      granted = true;
+    }
+    else if (!woken)
+    {
+      emac->sched_waiting[dir]--;
+    }
+
+    portEXIT_CRITICAL(&emac->sched_mux);
+
+    if (!granted && !woken)
+    {
+      __atomic_fetch_add(dir == W5500_SCHED_RX ? &emac->sched_stats.rx_turn_timeouts : &emac->sched_stats.tx_turn_timeouts,
+                         1, __ATOMIC_RELAXED);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
+static void w5500_sched_give(emac_w5500_t *emac, int dir)
+{
+  int other = dir ^ 1;
+  int next = -1;
+
+  portENTER_CRITICAL(&emac->sched_mux);
+
+  if (emac->sched_waiting[other])
+    next = other;
+  else if (emac->sched_waiting[dir])
+    next = dir;
+
+  if (next >= 0)
+    emac->sched_waiting[next]--;
+
+  emac->sched_owner = next;
+  emac->sched_owner_task = NULL;
+
+  portEXIT_CRITICAL(&emac->sched_mux);
+
+  if (next >= 0)
+  {
+    if (next == other)
+      __atomic_fetch_add(other == W5500_SCHED_RX ? &emac->sched_stats.handoffs_to_rx : &emac->sched_stats.handoffs_to_tx,
+                         1, __ATOMIC_RELAXED);
+
+    xSemaphoreGive(emac->sched_grant[next]);
+  }
+}
+
+////////////////////////////////////////
+
+// The turn for one RX or TX frame. w5500_reinit and w5500_detach set reinit_in_progress, then take the turn
+// themselves: a task which was past its check of the flag waits for them here, then backs off
+static bool w5500_sched_take_frame(emac_w5500_t *emac, int dir)
+{
+  if (!w5500_sched_take(emac, dir))
+    return false;
+
+  if (__atomic_load_n(&emac->reinit_in_progress, __ATOMIC_ACQUIRE))
+  {
+    w5500_sched_give(emac, dir);
+    return false;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
 static esp_err_t w5500_write(emac_w5500_t *emac, uint32_t address, const void *value, uint32_t len)
 {
   esp_err_t ret = ESP_OK;
@@ -97,14 +778,29 @@ static esp_err_t w5500_write(emac_w5500_t *emac, uint32_t address, const void *v
     .length = 8 * len,
     .tx_buffer = value
   };
+  int stage = W5500_STAGE_PUSH(emac, W5500_STAGE_RX_SPI, W5500_STAGE_TX_SPI);
 
   if (w5500_lock(emac))
   {
-    if (spi_device_polling_transmit(emac->spi_hdl, &trans) != ESP_OK)
+    uint32_t start = W5500_CYCLES();
+
+    if (emac->spi_hdl == NULL)
+    {
+      // Detached: the SPI device belongs to someone else until w5500_attach
+      ret = ESP_ERR_INVALID_STATE;
+    }
+    else if (spi_device_polling_transmit(emac->spi_hdl, &trans) != ESP_OK)
     {
       ESP_LOGE(TAG, "%s(%d): SPI transmit failed", __FUNCTION__, __LINE__);
       ret = ESP_FAIL;
     }
+    else
+    {
+      // Under the lock, so a plain update. 3 bytes of command and address
+      W5500_STAT64_ADD(emac->stats.spi_transactions, 1);
+      W5500_STAT64_ADD(emac->stats.spi_bytes, len + 3);
+      W5500_TRACE_SPAN(W5500_TRACE_SPI_WRITE, len, address, start);
+    }
 
     w5500_unlock(emac);
   }
@@ -113,6 +809,8 @@ static esp_err_t w5500_write(emac_w5500_t *emac, uint32_t address, const void *v
     ret = ESP_ERR_TIMEOUT;
   }
 
+  W5500_STAGE_POP(emac, stage);
+
   return ret;
 }
 
@@ -131,14 +829,29 @@ static esp_err_t w5500_read(emac_w5500_t *emac, uint32_t address, void *value, u
     .length = 8 * len,
     .rx_buffer = value
   };
+  int stage = W5500_STAGE_PUSH(emac, W5500_STAGE_RX_SPI, W5500_STAGE_TX_SPI);
 
   if (w5500_lock(emac))
   {
-    if (spi_device_polling_transmit(emac->spi_hdl, &trans) != ESP_OK)
+    uint32_t start = W5500_CYCLES();
+
+    if (emac->spi_hdl == NULL)
+    {
+      // Detached: the SPI device belongs to someone else until w5500_attach
+      ret = ESP_ERR_INVALID_STATE;
+    }
+    else if (spi_device_polling_transmit(emac->spi_hdl, &trans) != ESP_OK)
     {
       ESP_LOGE(TAG, "%s(%d): SPI transmit failed", __FUNCTION__, __LINE__);
       ret = ESP_FAIL;
     }
+    else
+    {
+      // Under the lock, so a plain update. 3 bytes of command and address
+      W5500_STAT64_ADD(emac->stats.spi_transactions, 1);
+      W5500_STAT64_ADD(emac->stats.spi_bytes, len + 3);
+      W5500_TRACE_SPAN(W5500_TRACE_SPI_READ, len, address, start);
+    }
 
     w5500_unlock(emac);
   }
@@ -147,6 +860,8 @@ static esp_err_t w5500_read(emac_w5500_t *emac, uint32_t address, void *value, u
     ret = ESP_ERR_TIMEOUT;
   }
 
+  W5500_STAGE_POP(emac, stage);
+
   if ((trans.flags & SPI_TRANS_USE_RXDATA) && len <= 4)
   {
     memcpy(value, trans.rx_data, len);  // copy register values to output
@@ -157,18 +872,21 @@ static esp_err_t w5500_read(emac_w5500_t *emac, uint32_t address, void *value, u
 
 ////////////////////////////////////////
 
-static esp_err_t w5500_send_command(emac_w5500_t *emac, uint8_t command, uint32_t timeout_ms)
+static esp_err_t w5500_send_command(emac_w5500_t *emac, int sock, uint8_t command, uint32_t timeout_ms)
 {
   esp_err_t ret = ESP_OK;
+  uint32_t start = W5500_CYCLES();
+  uint32_t arg = (sock << 8) | command;
+  int stage = W5500_STAGE_PUSH(emac, W5500_STAGE_RX_CMD, W5500_STAGE_TX_CMD);
 
-  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_CR(0), &command, sizeof(command)), err, TAG, "Write SCR failed");
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_CR(sock), &command, sizeof(command)), err, TAG, "Write SCR failed");
 
   // after W5500 accepts the command, the command register will be cleared automatically
   uint32_t to = 0;
 
   for (to = 0; to < timeout_ms / 10; to++)
   {
-    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_CR(0), &command, sizeof(command)), err, TAG, "Read SCR failed");
+    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_CR(sock), &command, sizeof(command)), err, TAG, "Read SCR failed");
 
     if (!command)
     {
@@ -178,15 +896,22 @@ static esp_err_t w5500_send_command(emac_w5500_t *emac, uint8_t command, uint32_
     vTaskDelay(pdMS_TO_TICKS(10));
   }
 
+  if (to >= timeout_ms / 10)
+  {
+    __atomic_fetch_add(&emac->stats.cmd_timeouts, 1, __ATOMIC_RELAXED);
+  }
+
   ESP_GOTO_ON_FALSE(to < timeout_ms / 10, ESP_ERR_TIMEOUT, err, TAG, "Send command timeout");
+  W5500_TRACE_SPAN(W5500_TRACE_CMD, 0, arg, start);
 
 err:
+  W5500_STAGE_POP(emac, stage);
   return ret;
 }
 
 ////////////////////////////////////////
 
-static esp_err_t w5500_get_tx_free_size(emac_w5500_t *emac, uint16_t *size)
+static esp_err_t w5500_get_tx_free_size(emac_w5500_t *emac, int sock, uint16_t *size)
 {
   esp_err_t ret = ESP_OK;
   uint16_t free0, free1 = 0;
@@ -195,8 +920,8 @@ static esp_err_t w5500_get_tx_free_size(emac_w5500_t *emac, uint16_t *size)
   // this is a trick because we might be interrupted between reading the high/low part of the TX_FSR register (16 bits in length)
   do
   {
-    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_TX_FSR(0), &free0, sizeof(free0)), err, TAG, "Read TX FSR failed");
-    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_TX_FSR(0), &free1, sizeof(free1)), err, TAG, "Read TX FSR failed");
+    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_TX_FSR(sock), &free0, sizeof(free0)), err, TAG, "Read TX FSR failed");
+    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_TX_FSR(sock), &free1, sizeof(free1)), err, TAG, "Read TX FSR failed");
   } while (free0 != free1);
 
   *size = __builtin_bswap16(free0);
@@ -207,16 +932,16 @@ err:
 
 ////////////////////////////////////////
 
-static esp_err_t w5500_get_rx_received_size(emac_w5500_t *emac, uint16_t *size)
+static esp_err_t w5500_get_rx_received_size(emac_w5500_t *emac, int sock, uint16_t *size)
 {
   esp_err_t ret = ESP_OK;
   uint16_t received0, received1 = 0;
 
   do
   {
-    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_RX_RSR(0), &received0, sizeof(received0)), err, TAG,
+    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_RX_RSR(sock), &received0, sizeof(received0)), err, TAG,
                       "Read RX RSR failed");
-    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_RX_RSR(0), &received1, sizeof(received1)), err, TAG,
+    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_RX_RSR(sock), &received1, sizeof(received1)), err, TAG,
                       "Read RX RSR failed");
   } while (received0 != received1);
 
@@ -228,23 +953,24 @@ err:
 
 ////////////////////////////////////////
 
-static esp_err_t w5500_write_buffer(emac_w5500_t *emac, const void *buffer, uint32_t len, uint16_t offset)
+static esp_err_t w5500_write_buffer(emac_w5500_t *emac, int sock, const void *buffer, uint32_t len, uint16_t offset)
 {
   esp_err_t ret = ESP_OK;
   uint32_t remain = len;
   const uint8_t *buf = buffer;
-  offset %= W5500_TX_MEM_SIZE;
+  uint16_t mem_size = emac->sock_tx_size[sock];
+  offset %= mem_size;
 
-  if (offset + len > W5500_TX_MEM_SIZE)
+  if (offset + len > mem_size)
   {
-    remain = (offset + len) % W5500_TX_MEM_SIZE;
-    len = W5500_TX_MEM_SIZE - offset;
-    ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_MEM_SOCK_TX(0, offset), buf, len), err, TAG, "Write TX buffer failed");
-    offset += len;
+    remain = (offset + len) % mem_size;
+    len = mem_size - offset;
+    ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_MEM_SOCK_TX(sock, offset), buf, len), err, TAG, "Write TX buffer failed");
+    offset = 0;
     buf += len;
   }
 
-  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_MEM_SOCK_TX(0, offset), buf, remain), err, TAG, "Write TX buffer failed");
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_MEM_SOCK_TX(sock, offset), buf, remain), err, TAG, "Write TX buffer failed");
 
 err:
   return ret;
@@ -252,23 +978,24 @@ err:
 
 ////////////////////////////////////////
 
-static esp_err_t w5500_read_buffer(emac_w5500_t *emac, void *buffer, uint32_t len, uint16_t offset)
+static esp_err_t w5500_read_buffer(emac_w5500_t *emac, int sock, void *buffer, uint32_t len, uint16_t offset)
 {
   esp_err_t ret = ESP_OK;
   uint32_t remain = len;
   uint8_t *buf = buffer;
-  offset %= W5500_RX_MEM_SIZE;
+  uint16_t mem_size = emac->sock_rx_size[sock];
+  offset %= mem_size;
 
-  if (offset + len > W5500_RX_MEM_SIZE)
+  if (offset + len > mem_size)
   {
-    remain = (offset + len) % W5500_RX_MEM_SIZE;
-    len = W5500_RX_MEM_SIZE - offset;
-    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_MEM_SOCK_RX(0, offset), buf, len), err, TAG, "Read RX buffer failed");
-    offset += len;
+    remain = (offset + len) % mem_size;
+    len = mem_size - offset;
+    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_MEM_SOCK_RX(sock, offset), buf, len), err, TAG, "Read RX buffer failed");
+    offset = 0;
     buf += len;
   }
 
-  ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_MEM_SOCK_RX(0, offset), buf, remain), err, TAG, "Read RX buffer failed");
+  ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_MEM_SOCK_RX(sock, offset), buf, remain), err, TAG, "Read RX buffer failed");
 
 err:
   return ret;
@@ -297,9 +1024,12 @@ static esp_err_t w5500_reset(emac_w5500_t *emac)
 
   ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_MR, &mr, sizeof(mr)), err, TAG, "Write MR failed");
 
-  uint32_t to = 0;
+  /* The RST bit normally clears well within a millisecond. Poll it closely at first
+     instead of sleeping a whole 10ms step, then fall back to yielding once per tick */
+  int64_t start = esp_timer_get_time();
+  int64_t elapsed = 0;
 
-  for (to = 0; to < emac->sw_reset_timeout_ms / 10; to++)
+  while (1)
   {
     ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_MR, &mr, sizeof(mr)), err, TAG, "Read MR failed");
 
@@ -308,12 +1038,22 @@ static esp_err_t w5500_reset(emac_w5500_t *emac)
       break;
     }
 
-    vTaskDelay(pdMS_TO_TICKS(10));
-  }
+    elapsed = esp_timer_get_time() - start;
+    ESP_GOTO_ON_FALSE(elapsed < (int64_t)emac->sw_reset_timeout_ms * 1000, ESP_ERR_TIMEOUT, err, TAG, "Reset timeout");
 
-  ESP_GOTO_ON_FALSE(to < emac->sw_reset_timeout_ms / 10, ESP_ERR_TIMEOUT, err, TAG, "Reset timeout");
-
-err:
+    if (elapsed < W5500_RESET_SPIN_US)
+    {
+      esp_rom_delay_us(W5500_RESET_POLL_US);
+    }
+    else
+    {
+      vTaskDelay(1);
+    }
+  }
+
+  ESP_LOGD(TAG, "reset took %dus", (int)(esp_timer_get_time() - start));
+
+err:
   return ret;
 }
 
@@ -337,24 +1077,25 @@ err:
 static esp_err_t w5500_setup_default(emac_w5500_t *emac)
 {
   esp_err_t ret = ESP_OK;
-  uint8_t reg_value = 16;
-
-  // Only SOCK0 can be used as MAC RAW mode, so we give the whole buffer (16KB TX and 16KB RX) to SOCK0
-  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_RXBUF_SIZE(0), &reg_value, sizeof(reg_value)), err, TAG,
-                    "Set rx buffer size failed");
-  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_TXBUF_SIZE(0), &reg_value, sizeof(reg_value)), err, TAG,
-                    "Set tx buffer size failed");
-
-  reg_value = 0;
+  uint8_t reg_value = 0;
 
-  for (int i = 1; i < 8; i++)
+  // Only SOCK0 can be used as MAC RAW mode. By default it gets the whole buffer (16KB TX and 16KB RX),
+  // unless w5500_set_socket_buffers has carved out space for the TCP offload sockets
+  for (int i = 0; i < W5500_SOCK_NUM; i++)
   {
+    reg_value = emac->sock_rx_size[i] / 1024;
     ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_RXBUF_SIZE(i), &reg_value, sizeof(reg_value)), err, TAG,
                       "Set SOCK_RXBUF_SIZE failed");
+    reg_value = emac->sock_tx_size[i] / 1024;
     ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_TXBUF_SIZE(i), &reg_value, sizeof(reg_value)), err, TAG,
                       "Set SOCK_TXBUF_SIZE failed");
   }
 
+  /* Source IP, netmask and gateway are only used by the offload sockets. Restore them after a reset */
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SIPR, &emac->ip_addr, 4), err, TAG, "Write SIPR failed");
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SUBR, &emac->netmask, 4), err, TAG, "Write SUBR failed");
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_GAR, &emac->gateway, 4), err, TAG, "Write GAR failed");
+
   /* Enable ping block, disable PPPoE, WOL */
   reg_value = W5500_MR_PB;
   ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_MR, &reg_value, sizeof(reg_value)), err, TAG, "Write MR failed");
@@ -391,7 +1132,7 @@ static esp_err_t emac_w5500_start(esp_eth_mac_t *mac)
 
   uint8_t reg_value = 0;
   /* open SOCK0 */
-  ESP_GOTO_ON_ERROR(w5500_send_command(emac, W5500_SCR_OPEN, 100), err, TAG, "Issue OPEN command failed");
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, 0, W5500_SCR_OPEN, 100), err, TAG, "Issue OPEN command failed");
 
   /* enable interrupt for SOCK0 */
   reg_value = W5500_SIMR_SOCK0;
@@ -410,7 +1151,7 @@ static esp_err_t emac_w5500_stop(esp_eth_mac_t *mac)
   /* disable interrupt */
   ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SIMR, &reg_value, sizeof(reg_value)), err, TAG, "Write SIMR failed");
   /* close SOCK0 */
-  ESP_GOTO_ON_ERROR(w5500_send_command(emac, W5500_SCR_CLOSE, 100), err, TAG, "Issue SCR_CLOSE command failed");
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, 0, W5500_SCR_CLOSE, 100), err, TAG, "Issue SCR_CLOSE command failed");
 
 err:
   return ret;
@@ -423,6 +1164,15 @@ IRAM_ATTR static void w5500_isr_handler(void *arg)
   emac_w5500_t *emac = (emac_w5500_t *)arg;
   BaseType_t high_task_wakeup = pdFALSE;
 
+  emac->stats.isr_count++;
+  W5500_TRACE_EVENT(W5500_TRACE_ISR, 0, 0);
+
+#if W5500_LATENCY_HISTOGRAMS
+  emac->isr_cycles = cpu_hal_get_cycle_count();
+  emac->isr_core = cpu_hal_get_core_id();
+  emac->isr_stamped = true;
+#endif
+
   /* notify w5500 task */
   vTaskNotifyGiveFromISR(emac->rx_task_hdl, &high_task_wakeup);
 
@@ -434,12 +1184,105 @@ IRAM_ATTR static void w5500_isr_handler(void *arg)
 
 ////////////////////////////////////////
 
+#if W5500_PKTGEN
+
+// Called by the RX task, holding the RX turn, before it allocates a buffer. Reads the W5500 frame header,
+// the Ethernet header and the sequence number in one transaction. A test frame is counted and skipped over
+// in the W5500 (*consumed = true). Any other frame is left for emac_w5500_receive
+static esp_err_t w5500_sink_frame(emac_w5500_t *emac, bool *consumed)
+{
+  esp_err_t ret = ESP_OK;
+  uint16_t offset = 0;
+  uint16_t rx_len = 0;
+  uint16_t remain_bytes = 0;
+  uint8_t head[2 + 14 + 4];              // Frame length, destination, source, EtherType, sequence number
+  w5500_sink_stats_t *stats = &emac->sink_stats;
+  emac->packets_remain = false;
+  *consumed = false;
+
+  if (__atomic_load_n(&emac->sink_reset, __ATOMIC_ACQUIRE))
+  {
+    memset(stats, 0, sizeof(*stats));
+    __atomic_store_n(&emac->sink_reset, false, __ATOMIC_RELEASE);
+  }
+
+  ESP_GOTO_ON_ERROR(w5500_get_rx_received_size(emac, 0, &remain_bytes), err, TAG, "Read RX RSR failed");
+
+  if (remain_bytes == 0)
+  {
+    // Nothing to read: spare the buffer too
+    *consumed = true;
+    goto err;
+  }
+
+  ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_RX_RD(0), &offset, sizeof(offset)), err, TAG, "Read RX RD failed");
+  offset = __builtin_bswap16(offset);
+  ESP_GOTO_ON_ERROR(w5500_read_buffer(emac, 0, head, sizeof(head), offset), err, TAG, "Read frame header failed");
+
+  rx_len = ((head[0] << 8) | head[1]) - 2; // data size includes 2 bytes of header
+
+  if ((rx_len < 18) || (memcmp(&head[14], &emac->sink_ether_type, 2) != 0))
+  {
+    emac->packets_remain = true;
+    goto err;
+  }
+
+  uint32_t seq = ((uint32_t)head[16] << 24) | ((uint32_t)head[17] << 16) | ((uint32_t)head[18] << 8) | head[19];
+  int64_t now = esp_timer_get_time();
+
+  if (stats->frames == 0)
+  {
+    stats->first_seq = seq;
+    stats->next_seq = seq + 1;
+    emac->sink_first_us = now;
+  }
+  else if ((int32_t)(seq - stats->next_seq) >= 0)
+  {
+    stats->next_seq = seq + 1;
+  }
+  else
+  {
+    stats->out_of_order++;
+
+    if ((int32_t)(seq - stats->first_seq) < 0)
+      stats->first_seq = seq;
+  }
+
+  stats->frames++;
+  stats->bytes += rx_len;
+  emac->sink_last_us = now;
+  W5500_STAT64_ADD(emac->stats.rx_frames, 1);
+  W5500_STAT64_ADD(emac->stats.rx_bytes, rx_len);
+
+  // skip the frame
+  offset += rx_len + 2;
+  offset = __builtin_bswap16(offset);
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_RX_RD(0), &offset, sizeof(offset)), err, TAG, "Write RX RD failed");
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, 0, W5500_SCR_RECV, 100), err, TAG, "Issue RECV command failed");
+
+  remain_bytes -= rx_len + 2;
+  emac->packets_remain = remain_bytes > 0;
+  *consumed = true;
+
+err:
+  return ret;
+}
+
+#endif
+
+////////////////////////////////////////
+
 static void emac_w5500_task(void *arg)
 {
   emac_w5500_t *emac = (emac_w5500_t *)arg;
   uint8_t status = 0;
   uint8_t *buffer = NULL;
   uint32_t length = 0;
+  esp_err_t ret;
+  int frames;
+  bool retry;
+  uint32_t start;
+  bool drain = false;                   // Frames were left in the W5500 last time. SOCK_IR is already cleared
 
   while (1)
   {
@@ -451,43 +1294,168 @@ static void emac_w5500_task(void *arg)
       continue;                                                // -> just continue to check again
     }
 
-    /* read interrupt status */
-    w5500_read(emac, W5500_REG_SOCK_IR(0), &status, sizeof(status));
+#if W5500_LATENCY_HISTOGRAMS
+    if (emac->isr_stamped)
+    {
+      // The cycle counters of the two cores are not in step
+      if (emac->isr_core == cpu_hal_get_core_id())
+        W5500_HIST_ADD(emac, W5500_HIST_ISR_WAKE, emac->isr_cycles);
+
+      emac->isr_stamped = false;
+    }
+#endif
+
+    if (__atomic_load_n(&emac->reinit_in_progress, __ATOMIC_ACQUIRE))
+    {
+      // The chip is being reset. Its registers are meaningless until w5500_reinit is done
+      continue;
+    }
+
+    status = 0;
+
+    if (!drain)
+    {
+      if (!w5500_sched_take_frame(emac, W5500_SCHED_RX))
+      {
+        // Timed out (counted), or the chip is being reset. Come straight back: the interrupt is still pending
+        xTaskNotifyGive(xTaskGetCurrentTaskHandle());
+        continue;
+      }
+
+      /* read interrupt status */
+      ret = w5500_read(emac, W5500_REG_SOCK_IR(0), &status, sizeof(status));
+
+      /* packet received */
+      if ((ret == ESP_OK) && (status & W5500_SIR_RECV))
+      {
+        status = W5500_SIR_RECV;
+        // clear interrupt status
+        ret = w5500_write(emac, W5500_REG_SOCK_IR(0), &status, sizeof(status));
+      }
+
+      w5500_sched_give(emac, W5500_SCHED_RX);
+
+      if (ret != ESP_OK)
+      {
+        // Lock timeout or SPI error. Without the status the frames would sit in the W5500 until the next
+        // interrupt, so count it, give the other side a tick and try again
+        __atomic_fetch_add(&emac->sched_stats.rx_status_errors, 1, __ATOMIC_RELAXED);
+        xTaskNotifyGive(xTaskGetCurrentTaskHandle());
+        vTaskDelay(1);
+        continue;
+      }
+    }
 
-    /* packet received */
-    if (status & W5500_SIR_RECV)
+    if (drain || (status & W5500_SIR_RECV))
     {
-      status = W5500_SIR_RECV;
-      // clear interrupt status
-      w5500_write(emac, W5500_REG_SOCK_IR(0), &status, sizeof(status));
+      frames = 0;
+      retry = false;
+      drain = false;
 
+      // At most W5500_RX_BATCH_FRAMES per wake-up, then let equal priority tasks run
       do
       {
+#if W5500_PKTGEN
+        if (__atomic_load_n(&emac->sink_on, __ATOMIC_ACQUIRE))
+        {
+          bool consumed;
+
+          if (!w5500_sched_take_frame(emac, W5500_SCHED_RX))
+          {
+            retry = true;
+            break;
+          }
+
+          ret = w5500_sink_frame(emac, &consumed);
+          w5500_sched_give(emac, W5500_SCHED_RX);
+
+          if (ret != ESP_OK)
+          {
+            emac->stats.rx_drop_error++;
+            W5500_TRACE_EVENT(W5500_TRACE_RX_DROP, 0, 2);
+            continue;
+          }
+
+          // A test frame, discarded without a buffer
+          if (consumed)
+            continue;
+        }
+#endif
+
         length = ETH_MAX_PACKET_SIZE;
-        buffer = heap_caps_malloc(length, MALLOC_CAP_DMA);
+        W5500_STAGE_BEGIN(emac, W5500_SCHED_RX, W5500_STAGE_RX_ALLOC);
+        buffer = w5500_heap_alloc(emac, length, MALLOC_CAP_DMA);
 
         if (!buffer)
         {
+          W5500_STAGE_END(emac, W5500_SCHED_RX, 0);
+          emac->stats.rx_drop_no_mem++;
+          W5500_TRACE_EVENT(W5500_TRACE_RX_DROP, 0, 1);
           ESP_LOGE(TAG, "No mem for receive buffer");
           break;
         }
-        else if (emac->parent.receive(&emac->parent, buffer, &length) == ESP_OK)
+
+        // Waiting for the turn is not charged to the frame
+        W5500_STAGE_SWITCH(emac, W5500_SCHED_RX, W5500_STAGE_NUM);
+
+        if (!w5500_sched_take_frame(emac, W5500_SCHED_RX))
+        {
+          W5500_STAGE_END(emac, W5500_SCHED_RX, 0);
+          free(buffer);
+          retry = true;
+          break;
+        }
+
+        W5500_STAGE_SWITCH(emac, W5500_SCHED_RX, W5500_STAGE_RX_PARSE);
+        start = W5500_CYCLES();
+        ret = emac->parent.receive(&emac->parent, buffer, &length);
+
+        // Still holding the turn, which keeps the capture ring to one writer
+        if ((ret == ESP_OK) && length)
+          W5500_CAPTURE_FRAME(emac, W5500_CAPTURE_RX, buffer, length);
+
+        w5500_sched_give(emac, W5500_SCHED_RX);
+
+        if (ret == ESP_OK)
         {
           /* pass the buffer to stack (e.g. TCP/IP layer) */
           if (length)
           {
+            W5500_HIST_ADD(emac, W5500_HIST_RX_READ, start);
+            W5500_TRACE_SPAN(W5500_TRACE_RX_FRAME, length, 0, start);
+            W5500_STAT64_ADD(emac->stats.rx_frames, 1);
+            W5500_STAT64_ADD(emac->stats.rx_bytes, length);
+
+            start = W5500_CYCLES();
+            W5500_STAGE_SWITCH(emac, W5500_SCHED_RX, W5500_STAGE_RX_INPUT);
             emac->eth->stack_input(emac->eth, buffer, length);
+            W5500_STAGE_END(emac, W5500_SCHED_RX, 1);
+            W5500_HIST_ADD(emac, W5500_HIST_RX_INPUT, start);
           }
           else
           {
+            W5500_STAGE_END(emac, W5500_SCHED_RX, 0);
             free(buffer);
           }
         }
         else
         {
+          W5500_STAGE_END(emac, W5500_SCHED_RX, 0);
+          emac->stats.rx_drop_error++;
+          W5500_TRACE_EVENT(W5500_TRACE_RX_DROP, 0, 2);
           free(buffer);
         }
-      } while (emac->packets_remain);
+      } while (emac->packets_remain && (++frames < W5500_RX_BATCH_FRAMES));
+
+      if (emac->packets_remain || retry)
+      {
+        if (!retry)
+          __atomic_fetch_add(&emac->sched_stats.rx_batch_limited, 1, __ATOMIC_RELAXED);
+
+        drain = true;
+        xTaskNotifyGive(xTaskGetCurrentTaskHandle());
+        taskYIELD();
+      }
     }
   }
 
@@ -577,15 +1545,19 @@ static esp_err_t emac_w5500_set_link(esp_eth_mac_t *mac, eth_link_t link)
 {
   esp_err_t ret = ESP_OK;
 
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
   switch (link)
   {
     case ETH_LINK_UP:
       ESP_LOGD(TAG, "Link is up");
       ESP_GOTO_ON_ERROR(mac->start(mac), err, TAG, "W5500 start failed");
+      __atomic_store_n(&emac->link_up, true, __ATOMIC_RELAXED);
       break;
 
     case ETH_LINK_DOWN:
       ESP_LOGD(TAG, "link is down");
+      __atomic_store_n(&emac->link_up, false, __ATOMIC_RELAXED);
       ESP_GOTO_ON_ERROR(mac->stop(mac), err, TAG, "W5500 stop failed");
       break;
 
@@ -693,29 +1665,28 @@ static esp_err_t emac_w5500_set_peer_pause_ability(esp_eth_mac_t *mac, uint32_t
 
 static inline bool is_w5500_sane_for_rxtx(emac_w5500_t *emac)
 {
-  uint8_t phycfg;
-
-  /* phy is ok for rx and tx operations if bits RST and LNK are set (no link down, no reset) */
-  if (w5500_read(emac, W5500_REG_PHYCFGR, &phycfg, 1) == ESP_OK && (phycfg & 0x8001))
-  {
-    return true;
-  }
-
-  return false;
+  /* phy is ok for rx and tx operations if the link is up. Use the state cached by set_link
+     rather than reading PHYCFGR, so the TX retry loop does not compete with the RX task for the SPI bus */
+  return __atomic_load_n(&emac->link_up, __ATOMIC_RELAXED);
 }
 
 ////////////////////////////////////////
 
-static esp_err_t emac_w5500_transmit(esp_eth_mac_t *mac, uint8_t *buf, uint32_t length)
+static esp_err_t w5500_transmit_frame(emac_w5500_t *emac, uint8_t *buf, uint32_t length)
 {
   esp_err_t ret = ESP_OK;
-
-  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
   uint16_t offset = 0;
+  uint32_t start = W5500_CYCLES();
 
   // check if there're free memory to store this packet
   uint16_t free_size = 0;
-  ESP_GOTO_ON_ERROR(w5500_get_tx_free_size(emac, &free_size), err, TAG, "Get free size failed");
+  ESP_GOTO_ON_ERROR(w5500_get_tx_free_size(emac, 0, &free_size), err, TAG, "Get free size failed");
+
+  if (length > free_size)
+  {
+    emac->stats.tx_full++;
+  }
+
   ESP_GOTO_ON_FALSE(length <= free_size, ESP_ERR_NO_MEM, err, TAG, "Free size (%d) < send length (%d)", length,
                     free_size);
 
@@ -724,15 +1695,19 @@ static esp_err_t emac_w5500_transmit(esp_eth_mac_t *mac, uint8_t *buf, uint32_t
   offset = __builtin_bswap16(offset);
 
   // copy data to tx memory
-  ESP_GOTO_ON_ERROR(w5500_write_buffer(emac, buf, length, offset), err, TAG, "Write frame failed");
+  ESP_GOTO_ON_ERROR(w5500_write_buffer(emac, 0, buf, length, offset), err, TAG, "Write frame failed");
 
   // update write pointer
   offset += length;
   offset = __builtin_bswap16(offset);
   ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_TX_WR(0), &offset, sizeof(offset)), err, TAG, "Write TX WR failed");
+  W5500_HIST_ADD(emac, W5500_HIST_TX_COPY, start);
 
   // issue SEND command
-  ESP_GOTO_ON_ERROR(w5500_send_command(emac, W5500_SCR_SEND, 100), err, TAG, "Issue SEND command failed");
+  start = W5500_CYCLES();
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, 0, W5500_SCR_SEND, 100), err, TAG, "Issue SEND command failed");
+  W5500_HIST_ADD(emac, W5500_HIST_TX_SEND, start);
+  start = W5500_CYCLES();
 
   // pooling the TX done event
   int retry = 0;
@@ -751,8 +1726,54 @@ static esp_err_t emac_w5500_transmit(esp_eth_mac_t *mac, uint8_t *buf, uint32_t
   // clear the event bit
   status  = W5500_SIR_SEND;
   ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_IR(0), &status, sizeof(status)), err, TAG, "Write SOCK0 IR failed");
+  W5500_HIST_ADD(emac, W5500_HIST_TX_DONE, start);
+  W5500_CAPTURE_FRAME(emac, W5500_CAPTURE_TX, buf, length);
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+static esp_err_t emac_w5500_transmit(esp_eth_mac_t *mac, uint8_t *buf, uint32_t length)
+{
+  esp_err_t ret = ESP_OK;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  uint32_t start = W5500_CYCLES();
+
+  ESP_GOTO_ON_FALSE(!__atomic_load_n(&emac->reinit_in_progress, __ATOMIC_ACQUIRE), ESP_ERR_INVALID_STATE, err, TAG,
+                    "Re-initialization in progress");
+
+  if (!w5500_sched_take_frame(emac, W5500_SCHED_TX))
+  {
+    // Timed out, or w5500_reinit / w5500_detach got the turn while this task waited for it
+    ret = __atomic_load_n(&emac->reinit_in_progress, __ATOMIC_ACQUIRE) ? ESP_ERR_INVALID_STATE : ESP_ERR_TIMEOUT;
+    ESP_LOGE(TAG, "%s", (ret == ESP_ERR_TIMEOUT) ? "TX turn timeout" : "Re-initialization in progress");
+    goto err;
+  }
+
+  W5500_STAGE_BEGIN(emac, W5500_SCHED_TX, W5500_STAGE_TX_PREP);
+  ret = w5500_transmit_frame(emac, buf, length);
+  W5500_STAGE_END(emac, W5500_SCHED_TX, (ret == ESP_OK) ? 1 : 0);
+  w5500_sched_give(emac, W5500_SCHED_TX);
 
 err:
+  // After the turn is given back, so several transmitting tasks (lwIP, w5500_pktgen_run) may count at once
+  if (ret == ESP_OK)
+  {
+    W5500_HIST_ADD(emac, W5500_HIST_TX_TOTAL, start);
+    W5500_TRACE_SPAN(W5500_TRACE_TX_FRAME, length, 0, start);
+    W5500_FLOW_FRAME(emac, W5500_FLOW_TX, buf, length);
+    __atomic_fetch_add(&emac->stats.tx_frames, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&emac->stats.tx_bytes, length, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    __atomic_fetch_add(&emac->stats.tx_drops, 1, __ATOMIC_RELAXED);
+    W5500_TRACE_EVENT(W5500_TRACE_TX_DROP, length, ret);
+  }
+
   return ret;
 }
 
@@ -767,9 +1788,16 @@ static esp_err_t emac_w5500_receive(esp_eth_mac_t *mac, uint8_t *buf, uint32_t *
   uint16_t offset = 0;
   uint16_t rx_len = 0;
   uint16_t remain_bytes = 0;
+  bool oversize = false;
   emac->packets_remain  = false;
 
-  w5500_get_rx_received_size(emac, &remain_bytes);
+  ESP_GOTO_ON_ERROR(w5500_get_rx_received_size(emac, 0, &remain_bytes), err, TAG, "Read RX RSR failed");
+
+  // Only the RX task receives, so a plain update
+  if (remain_bytes > emac->stats.rx_rsr_peak)
+  {
+    emac->stats.rx_rsr_peak = remain_bytes;
+  }
 
   if (remain_bytes)
   {
@@ -779,14 +1807,26 @@ static esp_err_t emac_w5500_receive(esp_eth_mac_t *mac, uint8_t *buf, uint32_t *
     offset = __builtin_bswap16(offset);
 
     // read head first
-    ESP_GOTO_ON_ERROR(w5500_read_buffer(emac, &rx_len, sizeof(rx_len), offset), err, TAG, "Read frame header failed");
+    ESP_GOTO_ON_ERROR(w5500_read_buffer(emac, 0, &rx_len, sizeof(rx_len), offset), err, TAG, "Read frame header failed");
 
     rx_len = __builtin_bswap16(rx_len) - 2; // data size includes 2 bytes of header
     offset += 2;
 
-    // read the payload
-    ESP_GOTO_ON_ERROR(w5500_read_buffer(emac, buf, rx_len, offset), err, TAG, "Read payload failed, len=%d, offset=%d",
-                      rx_len, offset);
+    if (rx_len > *length)
+    {
+      // Would overrun buf. Skip it
+      oversize = true;
+      emac->stats.rx_drop_oversize++;
+      W5500_TRACE_EVENT(W5500_TRACE_RX_DROP, rx_len, 3);
+      ESP_LOGE(TAG, "Frame too long (%d)", rx_len);
+    }
+    else
+    {
+      // read the payload
+      ESP_GOTO_ON_ERROR(w5500_read_buffer(emac, 0, buf, rx_len, offset), err, TAG, "Read payload failed, len=%d, offset=%d",
+                        rx_len, offset);
+      W5500_FLOW_FRAME(emac, W5500_FLOW_RX, buf, rx_len);
+    }
 
     offset += rx_len;
 
@@ -795,14 +1835,14 @@ static esp_err_t emac_w5500_receive(esp_eth_mac_t *mac, uint8_t *buf, uint32_t *
     ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_RX_RD(0), &offset, sizeof(offset)), err, TAG, "Write RX RD failed");
 
     /* issue RECV command */
-    ESP_GOTO_ON_ERROR(w5500_send_command(emac, W5500_SCR_RECV, 100), err, TAG, "Issue RECV command failed");
+    ESP_GOTO_ON_ERROR(w5500_send_command(emac, 0, W5500_SCR_RECV, 100), err, TAG, "Issue RECV command failed");
 
     // check if there're more data need to process
     remain_bytes -= rx_len + 2;
     emac->packets_remain = remain_bytes > 0;
   }
 
-  *length = rx_len;
+  *length = oversize ? 0 : rx_len;
 
 err:
   return ret;
@@ -862,27 +1902,89 @@ static esp_err_t emac_w5500_deinit(esp_eth_mac_t *mac)
 
 ////////////////////////////////////////
 
+static emac_w5500_t *w5500_emac_alloc(void)
+{
+#if W5500_STATIC_ALLOCATION
+  emac_w5500_t *emac = NULL;
+
+  portENTER_CRITICAL(&s_emac_mux);
+
+  for (int i = 0; i < W5500_STATIC_INSTANCES; i++)
+  {
+    if (!s_emac[i].in_use)
+    {
+      s_emac[i].in_use = true;
+      emac = &s_emac[i];
+      break;
+    }
+  }
+
+  portEXIT_CRITICAL(&s_emac_mux);
+
+  if (emac)
+  {
+    memset(emac, 0, offsetof(emac_w5500_t, in_use));
+  }
+
+  return emac;
+#else
+  return calloc(1, sizeof(emac_w5500_t));
+#endif
+}
+
+////////////////////////////////////////
+
+static void w5500_emac_free(emac_w5500_t *emac)
+{
+#if W5500_STATIC_ALLOCATION
+  portENTER_CRITICAL(&s_emac_mux);
+  emac->in_use = false;
+  portEXIT_CRITICAL(&s_emac_mux);
+#else
+  free(emac);
+#endif
+}
+
+////////////////////////////////////////
+
+
 static esp_err_t emac_w5500_del(esp_eth_mac_t *mac)
 {
   emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
 
   vTaskDelete(emac->rx_task_hdl);
   vSemaphoreDelete(emac->spi_lock);
-  free(emac);
+  vSemaphoreDelete(emac->sched_grant[W5500_SCHED_RX]);
+  vSemaphoreDelete(emac->sched_grant[W5500_SCHED_TX]);
+  w5500_spi_client_unregister(emac->spi_client);
+#if W5500_CAPTURE
+  if (emac->capture)
+  {
+    heap_caps_free(emac->capture->ring);
+    free(emac->capture);
+  }
+#endif
+  w5500_emac_free(emac);
 
   return ESP_OK;
 }
 
 ////////////////////////////////////////
 
-esp_eth_mac_t *esp_eth_mac_new_w5500(const eth_w5500_config_t *w5500_config, const eth_mac_config_t *mac_config)
+esp_eth_mac_t *esp_eth_mac_new_w5500_on_core(const eth_w5500_config_t *w5500_config, const eth_mac_config_t *mac_config,
+                                             int rx_task_core)
 {
   esp_eth_mac_t *ret = NULL;
   emac_w5500_t *emac = NULL;
 
+#if W5500_DEFERRED_LOG
+  // A log task that did not start leaves the messages in the ring, which is not worth failing for
+  w5500_log_start();
+#endif
+
   ESP_GOTO_ON_FALSE(w5500_config && mac_config, NULL, err, TAG, "Invalid argument");
 
-  emac = calloc(1, sizeof(emac_w5500_t));
+  emac = w5500_emac_alloc();
   ESP_GOTO_ON_FALSE(emac, NULL, err, TAG, "No mem for MAC instance");
 
   /* w5500 driver is interrupt driven */
@@ -890,8 +1992,21 @@ esp_eth_mac_t *esp_eth_mac_new_w5500(const eth_w5500_config_t *w5500_config, con
 
   /* bind methods and attributes */
   emac->sw_reset_timeout_ms = mac_config->sw_reset_timeout_ms;
+  emac->sock_tx_size[0] = W5500_TX_MEM_SIZE;
+  emac->sock_rx_size[0] = W5500_RX_MEM_SIZE;
   emac->int_gpio_num = w5500_config->int_gpio_num;
   emac->spi_hdl = w5500_config->spi_hdl;
+  emac->spi_client = -1;
+  portMUX_INITIALIZE(&emac->sched_mux);
+  emac->sched_owner = -1;
+#if W5500_CYCLE_ACCOUNTING
+  emac->cycle_stats_since = esp_timer_get_time();
+#endif
+#if W5500_FLOW_TABLE
+  portMUX_INITIALIZE(&emac->flow_mux);
+#endif
+  emac->sched_grant[W5500_SCHED_RX] = xSemaphoreCreateBinaryStatic(&emac->sched_grant_buffer[W5500_SCHED_RX]);
+  emac->sched_grant[W5500_SCHED_TX] = xSemaphoreCreateBinaryStatic(&emac->sched_grant_buffer[W5500_SCHED_TX]);
   emac->parent.set_mediator = emac_w5500_set_mediator;
   emac->parent.init = emac_w5500_init;
   emac->parent.deinit = emac_w5500_deinit;
@@ -911,21 +2026,29 @@ esp_eth_mac_t *esp_eth_mac_new_w5500(const eth_w5500_config_t *w5500_config, con
   emac->parent.transmit = emac_w5500_transmit;
   emac->parent.receive = emac_w5500_receive;
 
+#if W5500_STATIC_ALLOCATION
+  ESP_GOTO_ON_FALSE(mac_config->rx_task_stack_size <= W5500_STATIC_RX_TASK_STACK_SIZE, NULL, err, TAG,
+                    "RX task stack larger than W5500_STATIC_RX_TASK_STACK_SIZE");
+
   /* create mutex */
-  emac->spi_lock = xSemaphoreCreateMutex();
+  emac->spi_lock = xSemaphoreCreateMutexStatic(&emac->spi_lock_buffer);
   ESP_GOTO_ON_FALSE(emac->spi_lock, NULL, err, TAG, "Create lock failed");
 
   /* create w5500 task */
-  BaseType_t core_num = tskNO_AFFINITY;
-
-  if (mac_config->flags & ETH_MAC_FLAG_PIN_TO_CORE)
-  {
-    core_num = cpu_hal_get_core_id();
-  }
+  emac->rx_task_hdl = xTaskCreateStaticPinnedToCore(emac_w5500_task, "w5500_tsk", W5500_STATIC_RX_TASK_STACK_SIZE, emac,
+                                                    mac_config->rx_task_prio, emac->rx_task_stack, &emac->rx_task_buffer,
+                                                    rx_task_core);
+  ESP_GOTO_ON_FALSE(emac->rx_task_hdl, NULL, err, TAG, "Create w5500 task failed");
+#else
+  /* create mutex */
+  emac->spi_lock = xSemaphoreCreateMutex();
+  ESP_GOTO_ON_FALSE(emac->spi_lock, NULL, err, TAG, "Create lock failed");
 
+  /* create w5500 task */
   BaseType_t xReturned = xTaskCreatePinnedToCore(emac_w5500_task, "w5500_tsk", mac_config->rx_task_stack_size, emac,
-                                                 mac_config->rx_task_prio, &emac->rx_task_hdl, core_num);
+                                                 mac_config->rx_task_prio, &emac->rx_task_hdl, rx_task_core);
   ESP_GOTO_ON_FALSE(xReturned == pdPASS, NULL, err, TAG, "Create w5500 task failed");
+#endif
 
   return &(emac->parent);
 
@@ -943,7 +2066,7 @@ err:
       vSemaphoreDelete(emac->spi_lock);
     }
 
-    free(emac);
+    w5500_emac_free(emac);
   }
 
   return ret;
@@ -951,6 +2074,20 @@ err:
 
 ////////////////////////////////////////
 
+esp_eth_mac_t *esp_eth_mac_new_w5500(const eth_w5500_config_t *w5500_config, const eth_mac_config_t *mac_config)
+{
+  BaseType_t core_num = tskNO_AFFINITY;
+
+  if (mac_config && (mac_config->flags & ETH_MAC_FLAG_PIN_TO_CORE))
+  {
+    core_num = cpu_hal_get_core_id();
+  }
+
+  return esp_eth_mac_new_w5500_on_core(w5500_config, mac_config, core_num);
+}
+
+////////////////////////////////////////
+
 esp_err_t esp_eth_mac_delete_w5500(esp_eth_mac_t *mac)
 {
   esp_err_t ret = mac->deinit(mac);
@@ -962,3 +2099,1260 @@ esp_err_t esp_eth_mac_delete_w5500(esp_eth_mac_t *mac)
 
 ////////////////////////////////////////
 
+
+esp_err_t w5500_set_socket_buffers(esp_eth_mac_t *mac, const uint8_t *tx_kb, const uint8_t *rx_kb)
+{
+  esp_err_t ret = ESP_OK;
+  uint32_t tx_total = 0;
+  uint32_t rx_total = 0;
+
+  ESP_GOTO_ON_FALSE(mac && tx_kb && rx_kb, ESP_ERR_INVALID_ARG, err, TAG, "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  for (int i = 0; i < W5500_SOCK_NUM; i++)
+  {
+    // The W5500 only accepts 0, 1, 2, 4, 8 and 16KB per socket
+    ESP_GOTO_ON_FALSE((tx_kb[i] <= 16) && !(tx_kb[i] & (tx_kb[i] - 1)), ESP_ERR_INVALID_ARG, err, TAG,
+                      "Invalid TX buffer size (%d) for socket %d", tx_kb[i], i);
+    ESP_GOTO_ON_FALSE((rx_kb[i] <= 16) && !(rx_kb[i] & (rx_kb[i] - 1)), ESP_ERR_INVALID_ARG, err, TAG,
+                      "Invalid RX buffer size (%d) for socket %d", rx_kb[i], i);
+    tx_total += tx_kb[i];
+    rx_total += rx_kb[i];
+  }
+
+  ESP_GOTO_ON_FALSE((tx_total * 1024 <= W5500_TX_MEM_SIZE) && (rx_total * 1024 <= W5500_RX_MEM_SIZE), ESP_ERR_INVALID_SIZE,
+                    err, TAG, "Socket buffers exceed the W5500 memory");
+
+  // SOCK0 carries every lwIP frame in MAC RAW mode, so it must be able to hold at least one full frame
+  ESP_GOTO_ON_FALSE((tx_kb[0] >= 2) && (rx_kb[0] >= 2), ESP_ERR_INVALID_SIZE, err, TAG, "SOCK0 needs at least 2KB");
+
+  for (int i = 0; i < W5500_SOCK_NUM; i++)
+  {
+    emac->sock_tx_size[i] = tx_kb[i] * 1024;
+    emac->sock_rx_size[i] = rx_kb[i] * 1024;
+  }
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_set_ip_info(esp_eth_mac_t *mac, uint32_t ip_addr, uint32_t netmask, uint32_t gateway)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac, ESP_ERR_INVALID_ARG, err, TAG, "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  emac->ip_addr = ip_addr;
+  emac->netmask = netmask;
+  emac->gateway = gateway;
+
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SIPR, &emac->ip_addr, 4), err, TAG, "Write SIPR failed");
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SUBR, &emac->netmask, 4), err, TAG, "Write SUBR failed");
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_GAR, &emac->gateway, 4), err, TAG, "Write GAR failed");
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+int w5500_sock_alloc(esp_eth_mac_t *mac)
+{
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  int sock = -1;
+  uint8_t candidates;
+
+  vTaskSuspendAll();
+
+  for (int i = 1; i < W5500_SOCK_NUM; i++)
+  {
+    if (emac->sock_tx_size[i] && emac->sock_rx_size[i] && !(emac->sock_in_use & (1 << i)))
+    {
+      emac->sock_in_use |= (1 << i);
+      __atomic_fetch_and(&emac->sock_connected, (uint8_t)~(1 << i), __ATOMIC_RELAXED);
+      emac->sock_generation[i]++;
+      sock = i;
+      break;
+    }
+  }
+  candidates = emac->sock_in_use & __atomic_load_n(&emac->sock_connected, __ATOMIC_RELAXED);
+
+  xTaskResumeAll();
+
+  if (sock > 0)
+    return sock;
+
+  /* Nothing free. Like Arduino Ethernet, take back a socket whose connection is over but whose owner
+     never called stop: CLOSED or closing first, then CLOSE_WAIT. Sockets never seen ESTABLISHED
+     (claimed but not opened yet, or a server still listening) are left alone */
+  int best_rank = 0;
+
+  for (int i = 1; i < W5500_SOCK_NUM; i++)
+  {
+    uint8_t status;
+
+    if (!(candidates & (1 << i)) || (w5500_read(emac, W5500_REG_SOCK_SR(i), &status, sizeof(status)) != ESP_OK))
+      continue;
+
+    int rank = 0;
+
+    switch (status)
+    {
+      case W5500_SSR_CLOSED:
+        rank = 3;
+        break;
+      case W5500_SSR_FIN_WAIT:
+      case W5500_SSR_CLOSING:
+      case W5500_SSR_TIME_WAIT:
+      case W5500_SSR_LAST_ACK:
+        rank = 2;
+        break;
+      case W5500_SSR_CLOSE_WAIT:
+        rank = 1;
+        break;
+      default:
+        break;
+    }
+
+    if (rank > best_rank)
+    {
+      best_rank = rank;
+      sock = i;
+    }
+  }
+
+  if (sock < 0)
+    return -1;
+
+  vTaskSuspendAll();
+
+  // The owner may have released or re-opened it while the status was read
+  if ((emac->sock_in_use & __atomic_load_n(&emac->sock_connected, __ATOMIC_RELAXED)) & (1 << sock))
+  {
+    __atomic_fetch_and(&emac->sock_connected, (uint8_t)~(1 << sock), __ATOMIC_RELAXED);
+    emac->sock_send_pending[sock] = false;
+    emac->sock_generation[sock]++;
+  }
+  else
+  {
+    sock = -1;
+  }
+
+  xTaskResumeAll();
+
+  if (sock < 0)
+    return w5500_sock_alloc(mac);
+
+  ESP_LOGW(TAG, "Reclaiming offload socket %d, its owner never called stop", sock);
+  w5500_send_command(emac, sock, W5500_SCR_CLOSE, 100);
+
+  return sock;
+}
+
+////////////////////////////////////////
+
+uint8_t w5500_sock_generation(esp_eth_mac_t *mac, int sock)
+{
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  if ((sock <= 0) || (sock >= W5500_SOCK_NUM))
+    return 0;
+
+  return __atomic_load_n(&emac->sock_generation[sock], __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////
+
+void w5500_sock_release(esp_eth_mac_t *mac, int sock)
+{
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  if ((sock > 0) && (sock < W5500_SOCK_NUM))
+  {
+    vTaskSuspendAll();
+    emac->sock_in_use &= ~(1 << sock);
+    __atomic_fetch_and(&emac->sock_connected, (uint8_t)~(1 << sock), __ATOMIC_RELAXED);
+    emac->sock_send_pending[sock] = false;
+    xTaskResumeAll();
+  }
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sock_open_tcp(esp_eth_mac_t *mac, int sock, uint16_t local_port)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac && (sock > 0) && (sock < W5500_SOCK_NUM), ESP_ERR_INVALID_ARG, err, TAG, "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  ESP_GOTO_ON_FALSE(emac->ip_addr, ESP_ERR_INVALID_STATE, err, TAG, "No IP address for the offload sockets");
+
+  uint8_t reg_value = W5500_SMR_TCP | W5500_SMR_ND;
+  uint16_t port = __builtin_bswap16(local_port);
+
+  // make sure the socket starts from a clean state
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, sock, W5500_SCR_CLOSE, 100), err, TAG, "Issue CLOSE command failed");
+  emac->sock_send_pending[sock] = false;
+
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_MR(sock), &reg_value, sizeof(reg_value)), err, TAG,
+                    "Write SOCK MR failed");
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_PORT(sock), &port, sizeof(port)), err, TAG, "Write SOCK PORT failed");
+  reg_value = W5500_SOCK_KEEPALIVE;
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_KPALVTR(sock), &reg_value, sizeof(reg_value)), err, TAG,
+                    "Write SOCK KPALVTR failed");
+  reg_value = 0xFF;
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_IR(sock), &reg_value, sizeof(reg_value)), err, TAG,
+                    "Write SOCK IR failed");
+
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, sock, W5500_SCR_OPEN, 100), err, TAG, "Issue OPEN command failed");
+
+  ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_SR(sock), &reg_value, sizeof(reg_value)), err, TAG,
+                    "Read SOCK SR failed");
+  ESP_GOTO_ON_FALSE(reg_value == W5500_SSR_INIT, ESP_FAIL, err, TAG, "Socket %d did not open (SR=0x%02x)", sock, reg_value);
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sock_listen(esp_eth_mac_t *mac, int sock)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac && (sock > 0) && (sock < W5500_SOCK_NUM), ESP_ERR_INVALID_ARG, err, TAG, "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, sock, W5500_SCR_LISTEN, 100), err, TAG, "Issue LISTEN command failed");
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sock_connect(esp_eth_mac_t *mac, int sock, uint32_t ip_addr, uint16_t port)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac && (sock > 0) && (sock < W5500_SOCK_NUM), ESP_ERR_INVALID_ARG, err, TAG, "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  port = __builtin_bswap16(port);
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_DIPR(sock), &ip_addr, 4), err, TAG, "Write SOCK DIPR failed");
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_DPORT(sock), &port, sizeof(port)), err, TAG,
+                    "Write SOCK DPORT failed");
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, sock, W5500_SCR_CONNECT, 100), err, TAG, "Issue CONNECT command failed");
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sock_disconnect(esp_eth_mac_t *mac, int sock)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac && (sock > 0) && (sock < W5500_SOCK_NUM), ESP_ERR_INVALID_ARG, err, TAG, "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, sock, W5500_SCR_DISCON, 100), err, TAG, "Issue DISCON command failed");
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sock_close(esp_eth_mac_t *mac, int sock)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac && (sock > 0) && (sock < W5500_SOCK_NUM), ESP_ERR_INVALID_ARG, err, TAG, "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  emac->sock_send_pending[sock] = false;
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, sock, W5500_SCR_CLOSE, 100), err, TAG, "Issue CLOSE command failed");
+
+  uint8_t status = 0xFF;
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_IR(sock), &status, sizeof(status)), err, TAG,
+                    "Write SOCK IR failed");
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sock_get_status(esp_eth_mac_t *mac, int sock, uint8_t *status)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac && status && (sock > 0) && (sock < W5500_SOCK_NUM), ESP_ERR_INVALID_ARG, err, TAG,
+                    "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_SR(sock), status, sizeof(uint8_t)), err, TAG, "Read SOCK SR failed");
+
+  // Once connected, the socket may be reclaimed by w5500_sock_alloc when it closes
+  if (*status == W5500_SSR_ESTABLISHED)
+    __atomic_fetch_or(&emac->sock_connected, (uint8_t)(1 << sock), __ATOMIC_RELAXED);
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sock_get_remote(esp_eth_mac_t *mac, int sock, uint32_t *ip_addr, uint16_t *port)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac && ip_addr && port && (sock > 0) && (sock < W5500_SOCK_NUM), ESP_ERR_INVALID_ARG, err, TAG,
+                    "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_DIPR(sock), ip_addr, 4), err, TAG, "Read SOCK DIPR failed");
+  ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_DPORT(sock), port, sizeof(uint16_t)), err, TAG,
+                    "Read SOCK DPORT failed");
+  *port = __builtin_bswap16(*port);
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sock_available(esp_eth_mac_t *mac, int sock, uint16_t *size)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac && size && (sock > 0) && (sock < W5500_SOCK_NUM), ESP_ERR_INVALID_ARG, err, TAG,
+                    "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  ESP_GOTO_ON_ERROR(w5500_get_rx_received_size(emac, sock, size), err, TAG, "Get received size failed");
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+static esp_err_t w5500_sock_wait_send_done(emac_w5500_t *emac, int sock)
+{
+  esp_err_t ret = ESP_OK;
+  uint8_t status = 0;
+  uint32_t waited_ms = 0;
+
+  // the previous SEND must complete before the TX write pointer can be moved again
+  while (emac->sock_send_pending[sock])
+  {
+    ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_IR(sock), &status, sizeof(status)), err, TAG,
+                      "Read SOCK IR failed");
+
+    if (status & W5500_SIR_SEND)
+    {
+      status = W5500_SIR_SEND;
+      ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_IR(sock), &status, sizeof(status)), err, TAG,
+                        "Write SOCK IR failed");
+      emac->sock_send_pending[sock] = false;
+      break;
+    }
+
+    ESP_GOTO_ON_FALSE(!(status & (W5500_SIR_TIMEOUT | W5500_SIR_DISCON)), ESP_ERR_INVALID_STATE, err, TAG,
+                      "Socket %d closed while sending", sock);
+    ESP_GOTO_ON_FALSE(waited_ms < W5500_SOCK_SEND_TIMEOUT_MS, ESP_ERR_TIMEOUT, err, TAG, "Socket %d send timeout", sock);
+
+    vTaskDelay(1);
+    waited_ms += portTICK_PERIOD_MS;
+  }
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sock_send(esp_eth_mac_t *mac, int sock, const uint8_t *buf, uint32_t length, uint32_t *sent)
+{
+  esp_err_t ret = ESP_OK;
+  uint16_t free_size = 0;
+  uint16_t offset = 0;
+  uint8_t status = 0;
+
+  ESP_GOTO_ON_FALSE(mac && buf && sent && (sock > 0) && (sock < W5500_SOCK_NUM), ESP_ERR_INVALID_ARG, err, TAG,
+                    "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  *sent = 0;
+
+  ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_SR(sock), &status, sizeof(status)), err, TAG, "Read SOCK SR failed");
+  ESP_GOTO_ON_FALSE((status == W5500_SSR_ESTABLISHED) || (status == W5500_SSR_CLOSE_WAIT), ESP_ERR_INVALID_STATE, err,
+                    TAG, "Socket %d not connected (SR=0x%02x)", sock, status);
+
+  ESP_GOTO_ON_ERROR(w5500_sock_wait_send_done(emac, sock), err, TAG, "Previous send failed");
+
+  // the W5500 segments, acknowledges and retransmits on its own. We only have to fill the socket TX buffer
+  ESP_GOTO_ON_ERROR(w5500_get_tx_free_size(emac, sock, &free_size), err, TAG, "Get free size failed");
+
+  if (length > free_size)
+  {
+    length = free_size;
+  }
+
+  if (length == 0)
+  {
+    return ESP_OK;
+  }
+
+  ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_TX_WR(sock), &offset, sizeof(offset)), err, TAG, "Read TX WR failed");
+  offset = __builtin_bswap16(offset);
+
+  ESP_GOTO_ON_ERROR(w5500_write_buffer(emac, sock, buf, length, offset), err, TAG, "Write socket data failed");
+
+  offset += length;
+  offset = __builtin_bswap16(offset);
+  ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_TX_WR(sock), &offset, sizeof(offset)), err, TAG,
+                    "Write TX WR failed");
+
+  ESP_GOTO_ON_ERROR(w5500_send_command(emac, sock, W5500_SCR_SEND, 100), err, TAG, "Issue SEND command failed");
+  emac->sock_send_pending[sock] = true;
+
+  *sent = length;
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sock_recv(esp_eth_mac_t *mac, int sock, uint8_t *buf, uint32_t length, uint32_t *received, bool peek)
+{
+  esp_err_t ret = ESP_OK;
+  uint16_t rx_size = 0;
+  uint16_t offset = 0;
+
+  ESP_GOTO_ON_FALSE(mac && buf && received && (sock > 0) && (sock < W5500_SOCK_NUM), ESP_ERR_INVALID_ARG, err, TAG,
+                    "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  *received = 0;
+
+  ESP_GOTO_ON_ERROR(w5500_get_rx_received_size(emac, sock, &rx_size), err, TAG, "Get received size failed");
+
+  if (length > rx_size)
+  {
+    length = rx_size;
+  }
+
+  if (length == 0)
+  {
+    return ESP_OK;
+  }
+
+  ESP_GOTO_ON_ERROR(w5500_read(emac, W5500_REG_SOCK_RX_RD(sock), &offset, sizeof(offset)), err, TAG, "Read RX RD failed");
+  offset = __builtin_bswap16(offset);
+
+  ESP_GOTO_ON_ERROR(w5500_read_buffer(emac, sock, buf, length, offset), err, TAG, "Read socket data failed");
+
+  if (!peek)
+  {
+    offset += length;
+    offset = __builtin_bswap16(offset);
+    ESP_GOTO_ON_ERROR(w5500_write(emac, W5500_REG_SOCK_RX_RD(sock), &offset, sizeof(offset)), err, TAG,
+                      "Write RX RD failed");
+
+    /* issue RECV command so the W5500 can reopen the receive window */
+    ESP_GOTO_ON_ERROR(w5500_send_command(emac, sock, W5500_SCR_RECV, 100), err, TAG, "Issue RECV command failed");
+  }
+
+  *received = length;
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_reinit(esp_eth_mac_t *mac)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac, ESP_ERR_INVALID_ARG, err, TAG, "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  __atomic_store_n(&emac->reinit_in_progress, true, __ATOMIC_RELEASE);
+
+  /* New frames see the flag. Holding the turn waits for the one in flight, if any, and keeps out those
+     which were already past the flag until the chip is reprogrammed */
+  ESP_GOTO_ON_FALSE(w5500_sched_take(emac, W5500_SCHED_TX), ESP_ERR_TIMEOUT, err_flag, TAG, "Frame turn timeout");
+
+  /* SOCK0 is re-opened by set_link when the PHY reports the link again */
+  __atomic_store_n(&emac->link_up, false, __ATOMIC_RELAXED);
+  emac->packets_remain = false;
+
+  /* Best effort: the chip may be the reason we are here */
+  uint8_t reg_value = 0;
+  w5500_write(emac, W5500_REG_SIMR, &reg_value, sizeof(reg_value));
+
+  /* The SPI bus, interrupt handler, RX task and buffers are all kept. Only the chip is reset and
+     reprogrammed: socket buffer split, offload IP info and MAC address come from the emac instance */
+  ESP_GOTO_ON_ERROR(w5500_reset(emac), err_turn, TAG, "Reset w5500 failed");
+  ESP_GOTO_ON_ERROR(w5500_verify_id(emac), err_turn, TAG, "Verify chip ID failed");
+  ESP_GOTO_ON_ERROR(w5500_setup_default(emac), err_turn, TAG, "W5500 default setup failed");
+  ESP_GOTO_ON_ERROR(w5500_set_mac_addr(emac), err_turn, TAG, "Set MAC address failed");
+
+  /* The offload sockets were closed by the reset. Their owners see SOCK_CLOSED and release them */
+  memset(emac->sock_send_pending, 0, sizeof(emac->sock_send_pending));
+
+err_turn:
+  w5500_sched_give(emac, W5500_SCHED_TX);
+
+err_flag:
+  __atomic_store_n(&emac->reinit_in_progress, false, __ATOMIC_RELEASE);
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_detach(esp_eth_mac_t *mac)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac, ESP_ERR_INVALID_ARG, err, TAG, "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  /* Keep the RX task and transmit away from the SPI device which is about to be removed. The flag stays
+     set until w5500_attach */
+  __atomic_store_n(&emac->reinit_in_progress, true, __ATOMIC_RELEASE);
+
+  /* Wait for the frame in flight, as w5500_reinit does, then for any other transaction (offload sockets) */
+  ESP_GOTO_ON_FALSE(w5500_sched_take(emac, W5500_SCHED_TX), ESP_ERR_TIMEOUT, err_flag, TAG, "Frame turn timeout");
+  ESP_GOTO_ON_FALSE(w5500_lock(emac), ESP_ERR_TIMEOUT, err_turn, TAG, "SPI lock timeout");
+
+  __atomic_store_n(&emac->link_up, false, __ATOMIC_RELAXED);
+  emac->packets_remain = false;
+  gpio_isr_handler_remove(emac->int_gpio_num);
+  emac->spi_hdl = NULL;
+  w5500_unlock(emac);
+  w5500_sched_give(emac, W5500_SCHED_TX);
+
+  return ESP_OK;
+
+  /* Still attached: let RX and TX carry on */
+err_turn:
+  w5500_sched_give(emac, W5500_SCHED_TX);
+
+err_flag:
+  __atomic_store_n(&emac->reinit_in_progress, false, __ATOMIC_RELEASE);
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_attach(esp_eth_mac_t *mac, spi_device_handle_t spi_hdl)
+{
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_FALSE(mac && spi_hdl, ESP_ERR_INVALID_ARG, err, TAG, "Invalid argument");
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  emac->spi_hdl = spi_hdl;
+
+  /* Whoever had the pin may have changed its configuration */
+  gpio_set_direction(emac->int_gpio_num, GPIO_MODE_INPUT);
+  gpio_set_pull_mode(emac->int_gpio_num, GPIO_PULLUP_ONLY);
+  gpio_set_intr_type(emac->int_gpio_num, GPIO_INTR_NEGEDGE); // active low
+  gpio_intr_enable(emac->int_gpio_num);
+  ESP_GOTO_ON_ERROR(gpio_isr_handler_add(emac->int_gpio_num, w5500_isr_handler, emac), err, TAG,
+                    "Add ISR handler failed");
+
+  /* The chip was programmed by someone else. Reset it and write our configuration back.
+     This also lets the RX task and transmit back in */
+  ESP_GOTO_ON_ERROR(w5500_reinit(mac), err, TAG, "Reinit failed");
+
+err:
+  return ret;
+}
+
+////////////////////////////////////////
+
+uint32_t w5500_get_alloc_count(esp_eth_mac_t *mac)
+{
+  if (mac == NULL)
+    return 0;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  return __atomic_load_n(&emac->heap_allocs, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////
+
+void *w5500_alloc(esp_eth_mac_t *mac, size_t size, uint32_t caps)
+{
+  if (mac == NULL)
+    return NULL;
+
+  return w5500_heap_alloc(__containerof(mac, emac_w5500_t, parent), size, caps);
+}
+
+////////////////////////////////////////
+
+void w5500_set_spi_client(esp_eth_mac_t *mac, int client)
+{
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  // Not while a transaction is in flight: lock and unlock must agree on the client
+  if (xSemaphoreTake(emac->spi_lock, portMAX_DELAY) == pdTRUE)
+  {
+    emac->spi_client = client;
+    xSemaphoreGive(emac->spi_lock);
+  }
+}
+
+////////////////////////////////////////
+
+int w5500_get_spi_client(esp_eth_mac_t *mac)
+{
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  return emac->spi_client;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_get_sched_stats(esp_eth_mac_t *mac, w5500_sched_stats_t *stats)
+{
+  if ((mac == NULL) || (stats == NULL))
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  const uint32_t *from = (const uint32_t *)&emac->sched_stats;
+  uint32_t *to = (uint32_t *)stats;
+
+  // Each counter is read atomically. They are not a consistent snapshot of each other
+  for (size_t i = 0; i < sizeof(*stats) / sizeof(uint32_t); i++)
+    to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_get_stats(esp_eth_mac_t *mac, w5500_stats_t *stats)
+{
+  if ((mac == NULL) || (stats == NULL))
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  // Every counter has one writer at a time (the RX task, the turn or SPI lock holder, the ISR), or is
+  // updated with __atomic_fetch_add. The 64-bit ones are stored atomically (W5500_STAT64_ADD), so each
+  // is read whole. The copy is not a snapshot: counters may move on between two loads
+#define W5500_STATS_LOAD(field) stats->field = __atomic_load_n(&emac->stats.field, __ATOMIC_RELAXED)
+  W5500_STATS_LOAD(rx_frames);
+  W5500_STATS_LOAD(rx_bytes);
+  W5500_STATS_LOAD(tx_frames);
+  W5500_STATS_LOAD(tx_bytes);
+  W5500_STATS_LOAD(spi_transactions);
+  W5500_STATS_LOAD(spi_bytes);
+  W5500_STATS_LOAD(rx_drop_no_mem);
+  W5500_STATS_LOAD(rx_drop_error);
+  W5500_STATS_LOAD(rx_drop_oversize);
+  W5500_STATS_LOAD(tx_drops);
+  W5500_STATS_LOAD(tx_full);
+  W5500_STATS_LOAD(lock_waits);
+  W5500_STATS_LOAD(cmd_timeouts);
+  W5500_STATS_LOAD(rx_rsr_peak);
+  W5500_STATS_LOAD(isr_count);
+#undef W5500_STATS_LOAD
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+#if W5500_LATENCY_HISTOGRAMS
+
+esp_err_t w5500_get_histogram(esp_eth_mac_t *mac, w5500_hist_id_t id, w5500_hist_t *hist)
+{
+  if ((mac == NULL) || (hist == NULL) || (id < 0) || (id >= W5500_HIST_NUM))
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  memcpy(hist, &emac->hist[id], sizeof(*hist));
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+void w5500_reset_histograms(esp_eth_mac_t *mac)
+{
+  if (mac == NULL)
+    return;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  // A sample being added at the same time may survive the reset
+  memset(emac->hist, 0, sizeof(emac->hist));
+}
+
+////////////////////////////////////////
+
+uint32_t w5500_hist_percentile(const w5500_hist_t *hist, uint32_t per_mille)
+{
+  uint64_t total = 0;
+  uint64_t seen = 0;
+
+  for (int i = 0; i < W5500_HIST_BUCKETS; i++)
+    total += hist->count[i];
+
+  if (total == 0)
+    return 0;
+
+  // Rank of the wanted sample, rounded up
+  uint64_t rank = (total * per_mille + 999) / 1000;
+
+  if (rank == 0)
+    rank = 1;
+
+  for (int i = 0; i < W5500_HIST_BUCKETS; i++)
+  {
+    seen += hist->count[i];
+
+    if (seen >= rank)
+    {
+      uint32_t upper = (i == 31) ? 0xFFFFFFFF : ((2u << i) - 1);
+
+      return (upper < hist->max_cycles) ? upper : hist->max_cycles;
+    }
+  }
+
+  return hist->max_cycles;
+}
+
+#endif  // W5500_LATENCY_HISTOGRAMS
+
+////////////////////////////////////////
+
+#if W5500_CYCLE_ACCOUNTING
+
+esp_err_t w5500_get_cycle_stats(esp_eth_mac_t *mac, w5500_cycle_stats_t *stats)
+{
+  if ((mac == NULL) || (stats == NULL))
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  // One writer per direction, 64-bit counts stored atomically, see w5500_get_stats
+  for (int core = 0; core < 2; core++)
+  {
+    for (int stage = 0; stage < W5500_STAGE_NUM; stage++)
+      stats->cycles[core][stage] = __atomic_load_n(&emac->cycle_stats.cycles[core][stage], __ATOMIC_RELAXED);
+  }
+
+  stats->rx_frames = __atomic_load_n(&emac->cycle_stats.rx_frames, __ATOMIC_RELAXED);
+  stats->tx_frames = __atomic_load_n(&emac->cycle_stats.tx_frames, __ATOMIC_RELAXED);
+
+  stats->elapsed_us = esp_timer_get_time() - emac->cycle_stats_since;
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+void w5500_reset_cycle_stats(esp_eth_mac_t *mac)
+{
+  if (mac == NULL)
+    return;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  // A frame being timed at the same time may leave a few cycles behind
+  memset(&emac->cycle_stats, 0, sizeof(emac->cycle_stats));
+  emac->cycle_stats_since = esp_timer_get_time();
+}
+
+#endif  // W5500_CYCLE_ACCOUNTING
+
+////////////////////////////////////////
+
+#if W5500_TRACE
+
+void w5500_trace_start(void)
+{
+  s_trace_on = true;
+}
+
+////////////////////////////////////////
+
+void w5500_trace_stop(void)
+{
+  s_trace_on = false;
+
+  // Let an event which was being recorded on the other core finish
+  esp_rom_delay_us(10);
+}
+
+////////////////////////////////////////
+
+void w5500_trace_clear(void)
+{
+  w5500_trace_stop();
+  __atomic_store_n(&s_trace_head, 0, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////
+
+uint32_t w5500_trace_count(uint32_t *lost)
+{
+  uint32_t head = __atomic_load_n(&s_trace_head, __ATOMIC_RELAXED);
+  uint32_t count = (head < W5500_TRACE_EVENTS) ? head : W5500_TRACE_EVENTS;
+
+  if (lost)
+    *lost = head - count;
+
+  return count;
+}
+
+////////////////////////////////////////
+
+bool w5500_trace_get(uint32_t index, w5500_trace_event_t *event)
+{
+  uint32_t lost;
+  uint32_t count = w5500_trace_count(&lost);
+
+  if ((index >= count) || (event == NULL))
+    return false;
+
+  *event = s_trace[(lost + index) & (W5500_TRACE_EVENTS - 1)];
+
+  return true;
+}
+
+#endif  // W5500_TRACE
+
+////////////////////////////////////////
+
+#if W5500_CAPTURE
+
+esp_err_t w5500_capture_start(esp_eth_mac_t *mac, const w5500_capture_config_t *config)
+{
+  if ((mac == NULL) || (config == NULL))
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  w5500_capture_t *capture = emac->capture;
+
+  if (capture && capture->on)
+    return ESP_ERR_INVALID_STATE;
+
+  if (!capture)
+  {
+#if W5500_STATIC_ALLOCATION
+    // The ring is too big to set aside in static memory for a debug feature
+    return ESP_ERR_NOT_SUPPORTED;
+#else
+    uint32_t size = config->ring_size ? config->ring_size : W5500_CAPTURE_RING_SIZE;
+
+    // Power of two, big enough for a full frame
+    size = 1u << (31 - __builtin_clz(size));
+
+    if (size < 4096)
+      size = 4096;
+
+    capture = w5500_heap_alloc(emac, sizeof(*capture), MALLOC_CAP_8BIT);
+
+    if (capture)
+    {
+      memset(capture, 0, sizeof(*capture));
+      capture->ring = w5500_heap_alloc(emac, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+      if (!capture->ring)
+        capture->ring = w5500_heap_alloc(emac, size, MALLOC_CAP_8BIT);
+    }
+
+    if (!capture || !capture->ring)
+    {
+      ESP_LOGE(TAG, "No mem for a %u byte capture ring", size);
+      free(capture);
+      return ESP_ERR_NO_MEM;
+    }
+
+    capture->mask = size - 1;
+    emac->capture = capture;
+#endif
+  }
+
+  capture->config = *config;
+  capture->head = 0;
+  capture->tail = 0;
+  memset(&capture->stats, 0, sizeof(capture->stats));
+  __atomic_store_n(&capture->on, true, __ATOMIC_RELEASE);
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+void w5500_capture_stop(esp_eth_mac_t *mac)
+{
+  if (mac == NULL)
+    return;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  if (emac->capture)
+    __atomic_store_n(&emac->capture->on, false, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////
+
+size_t w5500_capture_read(esp_eth_mac_t *mac, void *buffer, size_t len)
+{
+  if ((mac == NULL) || (buffer == NULL))
+    return 0;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  w5500_capture_t *capture = emac->capture;
+
+  if (!capture)
+    return 0;
+
+  uint32_t tail = capture->tail;
+  uint32_t available = __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE) - tail;
+
+  if (len > available)
+    len = available;
+
+  uint32_t offset = tail & capture->mask;
+  uint32_t first = capture->mask + 1 - offset;
+
+  if (first > len)
+    first = len;
+
+  memcpy(buffer, capture->ring + offset, first);
+  memcpy((uint8_t *)buffer + first, capture->ring, len - first);
+  __atomic_store_n(&capture->tail, tail + len, __ATOMIC_RELEASE);
+
+  return len;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_capture_file_header(esp_eth_mac_t *mac, uint8_t header[24])
+{
+  if ((mac == NULL) || (header == NULL))
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  uint32_t snap_len = (emac->capture && emac->capture->config.snap_len) ? emac->capture->config.snap_len : 65535;
+
+  // Native byte order, the magic number tells the reader which. Version 2.4, UTC, LINKTYPE_ETHERNET
+  uint32_t magic = 0xA1B2C3D4;
+  uint16_t version[2] = { 2, 4 };
+  uint32_t zone[2] = { 0, 0 };
+  uint32_t link_type = 1;
+
+  memcpy(header, &magic, 4);
+  memcpy(header + 4, version, 4);
+  memcpy(header + 8, zone, 8);
+  memcpy(header + 16, &snap_len, 4);
+  memcpy(header + 20, &link_type, 4);
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_capture_get_stats(esp_eth_mac_t *mac, w5500_capture_stats_t *stats)
+{
+  if ((mac == NULL) || (stats == NULL))
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  if (emac->capture)
+    memcpy(stats, &emac->capture->stats, sizeof(*stats));
+  else
+    memset(stats, 0, sizeof(*stats));
+
+  return ESP_OK;
+}
+
+#endif  // W5500_CAPTURE
+
+////////////////////////////////////////
+
+#if W5500_FLOW_TABLE
+
+size_t w5500_flow_top(esp_eth_mac_t *mac, w5500_flow_t *flows, size_t n, bool by_bytes)
+{
+  if ((mac == NULL) || (flows == NULL))
+    return 0;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  size_t count = 0;
+
+  portENTER_CRITICAL(&emac->flow_mux);
+
+  // Insertion into the sorted top n, in place
+  for (int i = 0; i < W5500_FLOW_ENTRIES; i++)
+  {
+    const w5500_flow_t *flow = &emac->flows[i];
+
+    if (!flow->last_seen)
+      continue;
+
+    uint64_t weight = by_bytes ? (flow->rx_bytes + flow->tx_bytes) : ((uint64_t)flow->rx_packets + flow->tx_packets);
+    size_t position = count;
+
+    while ((position > 0) && (weight > (by_bytes ? (flows[position - 1].rx_bytes + flows[position - 1].tx_bytes)
+                                                 : ((uint64_t)flows[position - 1].rx_packets + flows[position - 1].tx_packets))))
+      position--;
+
+    if (position >= n)
+      continue;
+
+    if (count < n)
+      count++;
+
+    memmove(&flows[position + 1], &flows[position], (count - 1 - position) * sizeof(*flows));
+    flows[position] = *flow;
+  }
+
+  portEXIT_CRITICAL(&emac->flow_mux);
+
+  return count;
+}
+
+////////////////////////////////////////
+
+void w5500_flow_reset(esp_eth_mac_t *mac)
+{
+  if (mac == NULL)
+    return;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  portENTER_CRITICAL(&emac->flow_mux);
+  memset(emac->flows, 0, sizeof(emac->flows));
+  emac->flow_clock = 0;
+  emac->flow_evictions = 0;
+  portEXIT_CRITICAL(&emac->flow_mux);
+}
+
+////////////////////////////////////////
+
+uint32_t w5500_flow_evictions(esp_eth_mac_t *mac)
+{
+  if (mac == NULL)
+    return 0;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  return emac->flow_evictions;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_flow_set_sampling(esp_eth_mac_t *mac, uint32_t rate, w5500_flow_sample_cb_t callback, void *arg)
+{
+  if ((mac == NULL) || (rate && (callback == NULL)))
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  portENTER_CRITICAL(&emac->flow_mux);
+  emac->flow_sample_rate = rate;
+  emac->flow_sample_cb = callback;
+  emac->flow_sample_arg = arg;
+  emac->flow_sample_pool = 0;
+  emac->flow_sample_skip = w5500_flow_next_skip(rate);
+  portEXIT_CRITICAL(&emac->flow_mux);
+
+  return ESP_OK;
+}
+
+#endif  // W5500_FLOW_TABLE
+
+////////////////////////////////////////
+
+#if W5500_PKTGEN
+
+esp_err_t w5500_pktgen_run(esp_eth_mac_t *mac, const w5500_pktgen_config_t *config, w5500_pktgen_result_t *result)
+{
+  // 60 to 1514 bytes: the shortest and longest Ethernet frames without the FCS, which the W5500 adds
+  if ((mac == NULL) || (config == NULL) || (config->frame_len < 60) || (config->frame_len > 1514) ||
+      ((config->count == 0) && (config->duration_ms == 0)))
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+  w5500_pktgen_result_t done;
+  uint16_t ether_type = config->ether_type ? config->ether_type : W5500_PKTGEN_ETHERTYPE;
+#if W5500_STATIC_ALLOCATION
+  uint8_t *frame = emac->pktgen_frame;
+
+  if (__atomic_exchange_n(&emac->pktgen_busy, true, __ATOMIC_ACQUIRE))
+    return ESP_ERR_INVALID_STATE;
+#else
+  uint8_t *frame = w5500_heap_alloc(emac, config->frame_len, MALLOC_CAP_DMA);
+
+  if (!frame)
+    return ESP_ERR_NO_MEM;
+#endif
+
+  memset(&done, 0, sizeof(done));
+  memset(frame, 0, config->frame_len);
+  memcpy(frame, config->dest, 6);
+  memcpy(frame + 6, emac->addr, 6);
+  frame[12] = ether_type >> 8;
+  frame[13] = ether_type & 0xff;
+
+  // Frame n is due at start + n / rate_pps. In 1/65536 us, so rates that do not divide 10^6 do not drift
+  uint64_t interval = config->rate_pps ? (1000000ULL << 16) / config->rate_pps : 0;
+  uint32_t seq = config->first_seq;
+  uint32_t sent = 0;                     // Frames tried, successful or not
+  int64_t start = esp_timer_get_time();
+  int64_t now = start;
+  int64_t slept = start;                 // Last time this task let lower priority tasks run
+
+  while (((config->count == 0) || (sent < config->count)) &&
+         ((config->duration_ms == 0) || ((now - start) < (int64_t)config->duration_ms * 1000)))
+  {
+    // Sending flat out never blocks. Let IDLE run so the task watchdog is fed
+    if ((now - slept) >= W5500_PKTGEN_YIELD_MS * 1000)
+    {
+      vTaskDelay(1);
+      now = slept = esp_timer_get_time();
+    }
+
+    if (interval)
+    {
+      int64_t due = start + (int64_t)((sent * interval) >> 16);
+      int64_t wait = due - now;
+
+      if (wait >= 1000 * portTICK_PERIOD_MS)
+      {
+        // Sleep a tick at a time. vTaskDelay(1) can return early, so check again
+        vTaskDelay(1);
+        now = slept = esp_timer_get_time();
+        continue;
+      }
+
+      if (wait > 0)
+      {
+        // Less than a tick to go: spin
+        while (esp_timer_get_time() < due)
+          ;
+      }
+      else if (-wait > (int64_t)(interval >> 16))
+      {
+        done.late++;
+      }
+    }
+
+    frame[14] = seq >> 24;
+    frame[15] = seq >> 16;
+    frame[16] = seq >> 8;
+    frame[17] = seq;
+    sent++;
+
+    // A frame which was not sent keeps its sequence number, so the receiver only counts what the wire lost
+    if (emac_w5500_transmit(mac, frame, config->frame_len) == ESP_OK)
+    {
+      done.frames++;
+      done.bytes += config->frame_len;
+      seq++;
+    }
+    else
+    {
+      done.errors++;
+      vTaskDelay(1);
+    }
+
+    now = esp_timer_get_time();
+  }
+
+  done.next_seq = seq;
+  done.elapsed_us = now - start;
+#if W5500_STATIC_ALLOCATION
+  __atomic_store_n(&emac->pktgen_busy, false, __ATOMIC_RELEASE);
+#else
+  free(frame);
+#endif
+
+  if (result)
+    *result = done;
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sink_start(esp_eth_mac_t *mac, uint16_t ether_type)
+{
+  if (mac == NULL)
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  __atomic_store_n(&emac->sink_on, false, __ATOMIC_RELEASE);
+  emac->sink_ether_type = __builtin_bswap16(ether_type ? ether_type : W5500_PKTGEN_ETHERTYPE);
+  __atomic_store_n(&emac->sink_reset, true, __ATOMIC_RELEASE);
+  __atomic_store_n(&emac->sink_on, true, __ATOMIC_RELEASE);
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+void w5500_sink_stop(esp_eth_mac_t *mac)
+{
+  if (mac == NULL)
+    return;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  __atomic_store_n(&emac->sink_on, false, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_sink_get_stats(esp_eth_mac_t *mac, w5500_sink_stats_t *stats)
+{
+  if ((mac == NULL) || (stats == NULL))
+    return ESP_ERR_INVALID_ARG;
+
+  emac_w5500_t *emac = __containerof(mac, emac_w5500_t, parent);
+
+  // Not zeroed yet if no frame came since w5500_sink_start
+  if (__atomic_load_n(&emac->sink_reset, __ATOMIC_ACQUIRE))
+  {
+    memset(stats, 0, sizeof(*stats));
+    return ESP_OK;
+  }
+
+  *stats = emac->sink_stats;
+
+  uint32_t expected = stats->next_seq - stats->first_seq;
+
+  stats->lost = (stats->frames && (expected > stats->frames)) ? expected - stats->frames : 0;
+  stats->elapsed_us = stats->frames ? (uint32_t)(emac->sink_last_us - emac->sink_first_us) : 0;
+
+  return ESP_OK;
+}
+
+#endif  // W5500_PKTGEN
+
+////////////////////////////////////////
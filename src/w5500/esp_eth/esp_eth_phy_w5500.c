@@ -42,6 +42,7 @@
 #include "esp_rom_sys.h"
 #include "w5500.h"
 #include "esp_eth_w5500.h"
+#include "esp_eth_log_w5500.h"
 
 ////////////////////////////////////////
 
@@ -82,8 +83,49 @@ typedef struct
   int reset_gpio_num;
   eth_speed_t speed;
   eth_duplex_t duplex;
+  uint32_t link_state; // Cached link, speed and duplex plus a change counter. Read with __atomic_load_n
+#if W5500_STATIC_ALLOCATION
+  bool in_use;         // This s_phy slot is taken
+#endif
 } phy_w5500_t;
 
+#if W5500_STATIC_ALLOCATION
+static phy_w5500_t s_phy[W5500_STATIC_INSTANCES];
+static portMUX_TYPE s_phy_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+////////////////////////////////////////
+
+// link_state bit fields. The whole word is published with a single atomic store
+// so readers on the other core always see a consistent link / speed / duplex triple
+#define W5500_LINK_STATE_UP           (1 << 0)
+#define W5500_LINK_STATE_100M         (1 << 1)
+#define W5500_LINK_STATE_FULL         (1 << 2)
+#define W5500_LINK_STATE_COUNT_SHIFT  8
+
+////////////////////////////////////////
+
+static void w5500_publish_link_state(phy_w5500_t *w5500)
+{
+  uint32_t state = __atomic_load_n(&w5500->link_state, __ATOMIC_RELAXED);
+  uint32_t count = (state >> W5500_LINK_STATE_COUNT_SHIFT) + 1;
+
+  state = count << W5500_LINK_STATE_COUNT_SHIFT;
+
+  if (w5500->link_status == ETH_LINK_UP)
+  {
+    state |= W5500_LINK_STATE_UP;
+
+    if (w5500->speed == ETH_SPEED_100M)
+      state |= W5500_LINK_STATE_100M;
+
+    if (w5500->duplex == ETH_DUPLEX_FULL)
+      state |= W5500_LINK_STATE_FULL;
+  }
+
+  __atomic_store_n(&w5500->link_state, state, __ATOMIC_RELEASE);
+}
+
 ////////////////////////////////////////
 
 static esp_err_t w5500_update_link_duplex_speed(phy_w5500_t *w5500)
@@ -131,6 +173,7 @@ static esp_err_t w5500_update_link_duplex_speed(phy_w5500_t *w5500)
 
     ESP_GOTO_ON_ERROR(eth->on_state_changed(eth, ETH_STATE_LINK, (void *)link), err, TAG, "Change link failed");
     w5500->link_status = link;
+    w5500_publish_link_state(w5500);
   }
 
   return ESP_OK;
@@ -178,12 +221,11 @@ esp_err_t w5500_get_link_status(esp_eth_phy_t *phy, eth_link_t *link_status)
 {
   esp_err_t ret = ESP_OK;
 
+  ESP_GOTO_ON_FALSE(phy && link_status, ESP_ERR_INVALID_ARG, err, TAG, "Invalid arguments");
   phy_w5500_t *w5500 = __containerof(phy, phy_w5500_t, parent);
 
-  /* Updata information about link, speed, duplex */
-  ESP_GOTO_ON_ERROR(w5500_update_link_duplex_speed(w5500), err, TAG, "Update link duplex speed failed");
-
-  *link_status = w5500->link_status;
+  /* Cached by the esp_eth link poll. No SPI access */
+  *link_status = (__atomic_load_n(&w5500->link_state, __ATOMIC_ACQUIRE) & W5500_LINK_STATE_UP) ? ETH_LINK_UP : ETH_LINK_DOWN;
 
   return ESP_OK;
 
@@ -197,12 +239,10 @@ esp_err_t w5500_get_speed(esp_eth_phy_t *phy, eth_speed_t *speed)
 {
   esp_err_t ret = ESP_OK;
 
+  ESP_GOTO_ON_FALSE(phy && speed, ESP_ERR_INVALID_ARG, err, TAG, "Invalid arguments");
   phy_w5500_t *w5500 = __containerof(phy, phy_w5500_t, parent);
 
-  /* Updata information about link, speed, duplex */
-  ESP_GOTO_ON_ERROR(w5500_update_link_duplex_speed(w5500), err, TAG, "Update link duplex speed failed");
-
-  *speed = w5500->speed;
+  *speed = (__atomic_load_n(&w5500->link_state, __ATOMIC_ACQUIRE) & W5500_LINK_STATE_100M) ? ETH_SPEED_100M : ETH_SPEED_10M;
 
   return ESP_OK;
 
@@ -216,12 +256,10 @@ esp_err_t w5500_get_duplex(esp_eth_phy_t *phy, eth_duplex_t *duplex)
 {
   esp_err_t ret = ESP_OK;
 
+  ESP_GOTO_ON_FALSE(phy && duplex, ESP_ERR_INVALID_ARG, err, TAG, "Invalid arguments");
   phy_w5500_t *w5500 = __containerof(phy, phy_w5500_t, parent);
 
-  /* Updata information about link, speed, duplex */
-  ESP_GOTO_ON_ERROR(w5500_update_link_duplex_speed(w5500), err, TAG, "Update link duplex speed failed");
-
-  *duplex = w5500->duplex;
+  *duplex = (__atomic_load_n(&w5500->link_state, __ATOMIC_ACQUIRE) & W5500_LINK_STATE_FULL) ? ETH_DUPLEX_FULL : ETH_DUPLEX_HALF;
 
   return ESP_OK;
 
@@ -231,13 +269,30 @@ err:
 
 ////////////////////////////////////////
 
+uint32_t w5500_get_link_change_count(esp_eth_phy_t *phy)
+{
+  if (phy == NULL)
+    return 0;
+
+  phy_w5500_t *w5500 = __containerof(phy, phy_w5500_t, parent);
+
+  return __atomic_load_n(&w5500->link_state, __ATOMIC_ACQUIRE) >> W5500_LINK_STATE_COUNT_SHIFT;
+}
+
+////////////////////////////////////////
+
 static esp_err_t w5500_reset(esp_eth_phy_t *phy)
 {
   esp_err_t ret = ESP_OK;
 
   phy_w5500_t *w5500 = __containerof(phy, phy_w5500_t, parent);
 
-  w5500->link_status = ETH_LINK_DOWN;
+  if (w5500->link_status != ETH_LINK_DOWN)
+  {
+    w5500->link_status = ETH_LINK_DOWN;
+    w5500_publish_link_state(w5500);
+  }
+
   esp_eth_mediator_t *eth = w5500->eth;
 
   phycfg_reg_t phycfg;
@@ -288,7 +343,12 @@ static esp_err_t w5500_negotiate(esp_eth_phy_t *phy)
   esp_eth_mediator_t *eth = w5500->eth;
 
   /* in case any link status has changed, let's assume we're in link down status */
-  w5500->link_status = ETH_LINK_DOWN;
+  if (w5500->link_status != ETH_LINK_DOWN)
+  {
+    w5500->link_status = ETH_LINK_DOWN;
+    w5500_publish_link_state(w5500);
+  }
+
   phycfg_reg_t phycfg;
   ESP_GOTO_ON_ERROR(eth->phy_reg_read(eth, w5500->addr, W5500_REG_PHYCFGR, (uint32_t *) & (phycfg.val)), err, TAG,
                     "Read PHYCFG failed");
@@ -339,10 +399,44 @@ err:
 
 ////////////////////////////////////////
 
+static phy_w5500_t *w5500_phy_alloc(void)
+{
+#if W5500_STATIC_ALLOCATION
+  phy_w5500_t *w5500 = NULL;
+
+  portENTER_CRITICAL(&s_phy_mux);
+
+  for (int i = 0; i < W5500_STATIC_INSTANCES; i++)
+  {
+    if (!s_phy[i].in_use)
+    {
+      memset(&s_phy[i], 0, sizeof(s_phy[i]));
+      s_phy[i].in_use = true;
+      w5500 = &s_phy[i];
+      break;
+    }
+  }
+
+  portEXIT_CRITICAL(&s_phy_mux);
+
+  return w5500;
+#else
+  return calloc(1, sizeof(phy_w5500_t));
+#endif
+}
+
+////////////////////////////////////////
+
 static esp_err_t w5500_del(esp_eth_phy_t *phy)
 {
   phy_w5500_t *w5500 = __containerof(phy, phy_w5500_t, parent);
+#if W5500_STATIC_ALLOCATION
+  portENTER_CRITICAL(&s_phy_mux);
+  w5500->in_use = false;
+  portEXIT_CRITICAL(&s_phy_mux);
+#else
   free(w5500);
+#endif
 
   return ESP_OK;
 }
@@ -404,7 +498,7 @@ esp_eth_phy_t *esp_eth_phy_new_w5500(const eth_phy_config_t *config)
 
   ESP_GOTO_ON_FALSE(config, NULL, err, TAG, "Invalid arguments");
 
-  phy_w5500_t *w5500 = calloc(1, sizeof(phy_w5500_t));
+  phy_w5500_t *w5500 = w5500_phy_alloc();
   ESP_GOTO_ON_FALSE(w5500, NULL, err, TAG, "No mem for PHY instance");
 
   /* bind methods and attributes */
@@ -18,6 +18,7 @@
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_netif.h"
 #include "esp_eth.h"
 #include "esp_event.h"
@@ -27,55 +28,136 @@
 
 #include "esp_log.h"
 #include "esp_check.h"
+#include "esp_eth_log_w5500.h"
+#include "esp_timer.h"
 
 static const char *TAG = "w5500.spi";
 
+// The GPIO ISR service is shared by every W5500 (and anyone else, e.g. Arduino attachInterrupt).
+// It is installed by the first user and uninstalled after the last one, but only if we installed it.
+// begin / end / attach / detach are called from the application, so these need no lock
+static int s_isr_service_refs = 0;
+static bool s_isr_service_installed = false;
+
+// W5500 devices on each SPI host. The bus is freed with the last one, but only if we initialized it
+static int s_bus_refs[SPI_HOST_MAX] = { 0 };
+static bool s_bus_owned[SPI_HOST_MAX] = { false };
+
+// Cooperative bus arbiter, see w5500_spi_acquire
+typedef struct
+{
+  bool in_use;
+  const char *name;
+  int spi_host;
+  int priority;
+  SemaphoreHandle_t grant;        // Given by w5500_spi_release when the bus is handed to this client
+  StaticSemaphore_t grant_buffer;
+  int64_t acquired_us;
+  uint32_t acquisitions;
+  uint32_t contended;
+  uint64_t busy_us;
+  uint64_t wait_us;
+  uint32_t max_wait_us;
+} w5500_spi_client_t;
+
+typedef struct
+{
+  int owner;                      // Client holding the bus, -1 = free
+  uint32_t waiting;               // Bit mask of the clients blocked in w5500_spi_acquire
+  int64_t stats_since_us;
+} w5500_spi_bus_t;
+
+static w5500_spi_client_t s_spi_clients[W5500_SPI_MAX_CLIENTS];
+static w5500_spi_bus_t s_spi_bus[SPI_HOST_MAX] = { [0 ... SPI_HOST_MAX - 1] = { .owner = -1 } };
+static portMUX_TYPE s_spi_arbiter_mux = portMUX_INITIALIZER_UNLOCKED;
+
 ////////////////////////////////////////
 
-esp_eth_mac_t* w5500_new_mac( spi_device_handle_t *spi_handle, int INT_GPIO )
+static esp_eth_mac_t* w5500_new_mac( const w5500_begin_config_t *config, spi_device_handle_t *spi_handle )
 {
   eth_w5500_config_t w5500_config = ETH_W5500_DEFAULT_CONFIG( *spi_handle );
-  w5500_config.int_gpio_num = INT_GPIO;
+  w5500_config.int_gpio_num = config->int_gpio;
 
   eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
 
   //eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG();
   //phy_config.reset_gpio_num = -1;
 
-  mac_config.smi_mdc_gpio_num  = -1; // w5500 doesn't have SMI interface
-  mac_config.smi_mdio_gpio_num = -1;
-  mac_config.rx_task_prio      = 1;
+  mac_config.smi_mdc_gpio_num   = -1; // w5500 doesn't have SMI interface
+  mac_config.smi_mdio_gpio_num  = -1;
+  mac_config.rx_task_prio       = config->rx_task_prio;
+  mac_config.rx_task_stack_size = config->rx_task_stack_size;
 
-  return esp_eth_mac_new_w5500( &w5500_config, &mac_config );
+  return esp_eth_mac_new_w5500_on_core( &w5500_config, &mac_config, config->rx_task_core );
 }
 
 ////////////////////////////////////////
 
-esp_eth_mac_t* w5500_begin(int POCI_GPIO, int PICO_GPIO, int SCLK_GPIO, int CS_GPIO, int INT_GPIO, int SPICLOCK_MHZ,
-                           int SPIHOST, spi_device_handle_t *spi_handle)
+static void w5500_isr_service_release(void)
 {
-  if (ESP_OK != gpio_install_isr_service(0))
+  if ((s_isr_service_refs > 0) && (--s_isr_service_refs == 0) && s_isr_service_installed)
   {
-    ESP_LOGE(TAG, "%s(%d): Error gpio_install_isr_service", __FUNCTION__, __LINE__);
+    gpio_uninstall_isr_service();
+    s_isr_service_installed = false;
+  }
+}
 
-    return NULL;
+////////////////////////////////////////
+
+esp_err_t w5500_spi_attach(const w5500_begin_config_t *config, spi_device_handle_t *spi_handle, bool *isr_service_ref)
+{
+  esp_err_t ret = ESP_OK;
+
+  if (s_isr_service_refs == 0)
+  {
+    // Already installed by someone else: share it and leave it installed
+    ret = gpio_install_isr_service(config->isr_flags);
+
+    if ((ret != ESP_OK) && (ret != ESP_ERR_INVALID_STATE))
+    {
+      ESP_LOGE(TAG, "%s(%d): Error gpio_install_isr_service", __FUNCTION__, __LINE__);
+
+      return ret;
+    }
+
+    s_isr_service_installed = (ret == ESP_OK);
   }
 
+  s_isr_service_refs++;
+  *isr_service_ref = true;
+
   /* w5500 ethernet driver is based on spi driver */
   spi_bus_config_t buscfg =
   {
-    .miso_io_num   = POCI_GPIO,
-    .mosi_io_num   = PICO_GPIO,
-    .sclk_io_num   = SCLK_GPIO,
+    .miso_io_num   = config->poci_gpio,
+    .mosi_io_num   = config->pico_gpio,
+    .sclk_io_num   = config->sclk_gpio,
     .quadwp_io_num = -1,
     .quadhd_io_num = -1,
   };
 
-  if ( ESP_OK != spi_bus_initialize( SPIHOST, &buscfg, SPI_DMA_CH_AUTO ))
+  ESP_GOTO_ON_FALSE((config->spi_host >= 0) && (config->spi_host < SPI_HOST_MAX), ESP_ERR_INVALID_ARG, err, TAG,
+                    "Invalid SPI host");
+
+  if (s_bus_refs[config->spi_host] == 0)
   {
-    ESP_LOGE(TAG, "%s(%d): Error spi_bus_initialize", __FUNCTION__, __LINE__);
+    ret = spi_bus_initialize( config->spi_host, &buscfg, config->spi_dma_chan );
 
-    return NULL;
+    if ((ESP_ERR_INVALID_STATE == ret) && config->spi_bus_shared)
+    {
+      // Initialized by another driver (e.g. an SD card). Add our device to it and leave it to them to free
+      s_bus_owned[config->spi_host] = false;
+    }
+    else if ( ESP_OK != ret )
+    {
+      ESP_LOGE(TAG, "%s(%d): Error spi_bus_initialize", __FUNCTION__, __LINE__);
+
+      goto err;
+    }
+    else
+    {
+      s_bus_owned[config->spi_host] = true;
+    }
   }
 
   spi_device_interface_config_t devcfg =
@@ -83,23 +165,347 @@ esp_eth_mac_t* w5500_begin(int POCI_GPIO, int PICO_GPIO, int SCLK_GPIO, int CS_G
     .command_bits = 16,
     .address_bits = 8,
     .mode = 0,
-    .clock_speed_hz = SPICLOCK_MHZ * 1000 * 1000,
-    .spics_io_num = CS_GPIO,
-    .queue_size = 20,
-    .cs_ena_posttrans = w5500_cal_spi_cs_hold_time(SPICLOCK_MHZ),
+    .clock_speed_hz = config->spi_clock_mhz * 1000 * 1000,
+    .spics_io_num = config->cs_gpio,
+    .queue_size = config->spi_queue_size,
+    .cs_ena_posttrans = w5500_cal_spi_cs_hold_time(config->spi_clock_mhz),
   };
 
   *spi_handle = NULL;
 
-  if (ESP_OK != spi_bus_add_device( SPIHOST, &devcfg, spi_handle ))
+  ret = spi_bus_add_device( config->spi_host, &devcfg, spi_handle );
+
+  if ( ESP_OK != ret )
   {
     ESP_LOGE(TAG, "%s(%d): Error spi_bus_add_device", __FUNCTION__, __LINE__);
 
+    if ((s_bus_refs[config->spi_host] == 0) && s_bus_owned[config->spi_host])
+      spi_bus_free( config->spi_host );
+
+    goto err;
+  }
+
+  s_bus_refs[config->spi_host]++;
+
+  return ESP_OK;
+
+err:
+  w5500_isr_service_release();
+  *isr_service_ref = false;
+
+  return ret;
+}
+
+////////////////////////////////////////
+
+void w5500_spi_detach(int spi_host, spi_device_handle_t spi_handle, bool isr_service_ref)
+{
+  if (ESP_OK != spi_bus_remove_device( spi_handle ))
+  {
+    ESP_LOGE(TAG, "%s(%d): Error spi_bus_remove_device", __FUNCTION__, __LINE__);
+  }
+
+  if ((s_bus_refs[spi_host] > 0) && (--s_bus_refs[spi_host] == 0) && s_bus_owned[spi_host])
+  {
+    // Fails if other drivers still have devices on a shared bus. It is then theirs to free
+    if (ESP_OK != spi_bus_free( spi_host ))
+    {
+      ESP_LOGE(TAG, "%s(%d): Error spi_bus_free", __FUNCTION__, __LINE__);
+    }
+  }
+
+  if (isr_service_ref)
+    w5500_isr_service_release();
+}
+
+////////////////////////////////////////
+
+esp_eth_mac_t* w5500_begin(const w5500_begin_config_t *config, spi_device_handle_t *spi_handle, bool *isr_service_ref)
+{
+  if (ESP_OK != w5500_spi_attach(config, spi_handle, isr_service_ref))
+  {
     return NULL;
   }
 
-  return w5500_new_mac( spi_handle, INT_GPIO );
+  esp_eth_mac_t *mac = w5500_new_mac( config, spi_handle );
+
+  if (mac && config->spi_bus_shared)
+  {
+    int client = w5500_spi_client_register(config->spi_host, "w5500", config->spi_priority);
+
+    if (client < 0)
+    {
+      mac->del(mac);
+      mac = NULL;
+    }
+    else
+    {
+      w5500_set_spi_client(mac, client);
+    }
+  }
+
+  if (mac == NULL)
+  {
+    w5500_spi_detach( config->spi_host, *spi_handle, *isr_service_ref );
+    *spi_handle = NULL;
+    *isr_service_ref = false;
+  }
+
+  return mac;
+}
+
+////////////////////////////////////////
+
+int w5500_spi_client_register(int spi_host, const char *name, int priority)
+{
+  int client = -1;
+
+  if ((spi_host < 0) || (spi_host >= SPI_HOST_MAX))
+    return -1;
+
+  portENTER_CRITICAL(&s_spi_arbiter_mux);
+
+  for (int i = 0; i < W5500_SPI_MAX_CLIENTS; i++)
+  {
+    if (!s_spi_clients[i].in_use)
+    {
+      s_spi_clients[i].in_use = true;
+      client = i;
+      break;
+    }
+  }
+
+  portEXIT_CRITICAL(&s_spi_arbiter_mux);
+
+  if (client < 0)
+  {
+    ESP_LOGE(TAG, "%s(%d): No free SPI client, see W5500_SPI_MAX_CLIENTS", __FUNCTION__, __LINE__);
+
+    return -1;
+  }
+
+  w5500_spi_client_t *c = &s_spi_clients[client];
+
+  c->name = name;
+  c->spi_host = spi_host;
+  c->priority = priority;
+  c->acquisitions = 0;
+  c->contended = 0;
+  c->busy_us = 0;
+  c->wait_us = 0;
+  c->max_wait_us = 0;
+
+  // The grant semaphore lives in the client slot, so registering never touches the heap
+  if (c->grant == NULL)
+    c->grant = xSemaphoreCreateBinaryStatic(&c->grant_buffer);
+
+  if (s_spi_bus[spi_host].stats_since_us == 0)
+    s_spi_bus[spi_host].stats_since_us = esp_timer_get_time();
+
+  return client;
+}
+
+////////////////////////////////////////
+
+// Call with s_spi_arbiter_mux held. Hands the bus straight to the highest priority waiter, so a lower
+// priority client calling w5500_spi_acquire in the meantime can not jump in. Returns the new owner, or -1
+static int w5500_spi_pass_bus(w5500_spi_bus_t *bus)
+{
+  int next = -1;
+
+  for (int i = 0; i < W5500_SPI_MAX_CLIENTS; i++)
+  {
+    if ((bus->waiting & (1 << i)) && ((next < 0) || (s_spi_clients[i].priority > s_spi_clients[next].priority)))
+      next = i;
+  }
+
+  if (next >= 0)
+    bus->waiting &= ~(1 << next);
+
+  bus->owner = next;
+
+  return next;
 }
 
 ////////////////////////////////////////
 
+void w5500_spi_client_unregister(int client)
+{
+  int next = -1;
+
+  if ((client < 0) || (client >= W5500_SPI_MAX_CLIENTS))
+    return;
+
+  portENTER_CRITICAL(&s_spi_arbiter_mux);
+
+  if (s_spi_clients[client].in_use)
+  {
+    w5500_spi_bus_t *bus = &s_spi_bus[s_spi_clients[client].spi_host];
+
+    // A client going away while it holds the bus, or is queued for it, would wedge everyone else
+    bus->waiting &= ~(1 << client);
+
+    if (bus->owner == client)
+      next = w5500_spi_pass_bus(bus);
+
+    s_spi_clients[client].in_use = false;
+  }
+
+  portEXIT_CRITICAL(&s_spi_arbiter_mux);
+
+  if (next >= 0)
+    xSemaphoreGive(s_spi_clients[next].grant);
+}
+
+////////////////////////////////////////
+
+bool w5500_spi_acquire(int client, uint32_t timeout_ms)
+{
+  w5500_spi_client_t *c = &s_spi_clients[client];
+  w5500_spi_bus_t *bus = &s_spi_bus[c->spi_host];
+  int64_t start_us = esp_timer_get_time();
+  bool granted = false;
+
+  portENTER_CRITICAL(&s_spi_arbiter_mux);
+
+  if (bus->owner < 0)
+  {
+    bus->owner = client;
+    granted = true;
+  }
+  else
+  {
+    bus->waiting |= (1 << client);
+    c->contended++;
+  }
+
+  portEXIT_CRITICAL(&s_spi_arbiter_mux);
+
+  while (!granted)
+  {
+    int64_t waited_ms = (esp_timer_get_time() - start_us) / 1000;
+    TickType_t ticks = (waited_ms >= timeout_ms) ? 0 : pdMS_TO_TICKS(timeout_ms - waited_ms);
+    bool woken = (xSemaphoreTake(c->grant, ticks) == pdTRUE);
+
+    // A grant given just after an earlier timeout can be left in the semaphore, so check the owner
+    portENTER_CRITICAL(&s_spi_arbiter_mux);
+
+    if (bus->owner == client)
+    {
+      granted = true;
+    }
+    else if (!woken)
+    {
+      bus->waiting &= ~(1 << client);
+    }
+
+    portEXIT_CRITICAL(&s_spi_arbiter_mux);
+
+    if (!granted && !woken)
+      return false;
+  }
+
+  c->acquired_us = esp_timer_get_time();
+
+  uint32_t waited_us = c->acquired_us - start_us;
+
+  c->acquisitions++;
+  c->wait_us += waited_us;
+
+  if (waited_us > c->max_wait_us)
+    c->max_wait_us = waited_us;
+
+  return true;
+}
+
+////////////////////////////////////////
+
+void w5500_spi_release(int client)
+{
+  w5500_spi_client_t *c = &s_spi_clients[client];
+  w5500_spi_bus_t *bus = &s_spi_bus[c->spi_host];
+  int next;
+
+  c->busy_us += esp_timer_get_time() - c->acquired_us;
+
+  portENTER_CRITICAL(&s_spi_arbiter_mux);
+  next = w5500_spi_pass_bus(bus);
+  portEXIT_CRITICAL(&s_spi_arbiter_mux);
+
+  if (next >= 0)
+    xSemaphoreGive(s_spi_clients[next].grant);
+}
+
+////////////////////////////////////////
+
+bool w5500_spi_yield(int client, uint32_t timeout_ms)
+{
+  w5500_spi_client_t *c = &s_spi_clients[client];
+  w5500_spi_bus_t *bus = &s_spi_bus[c->spi_host];
+  bool preempt = false;
+
+  portENTER_CRITICAL(&s_spi_arbiter_mux);
+
+  for (int i = 0; i < W5500_SPI_MAX_CLIENTS; i++)
+  {
+    if ((bus->waiting & (1 << i)) && (s_spi_clients[i].priority > c->priority))
+      preempt = true;
+  }
+
+  portEXIT_CRITICAL(&s_spi_arbiter_mux);
+
+  if (!preempt)
+    return true;
+
+  w5500_spi_release(client);
+
+  return w5500_spi_acquire(client, timeout_ms);
+}
+
+////////////////////////////////////////
+
+esp_err_t w5500_spi_client_get_stats(int client, w5500_spi_client_stats_t *stats)
+{
+  if ((client < 0) || (client >= W5500_SPI_MAX_CLIENTS) || !s_spi_clients[client].in_use || (stats == NULL))
+    return ESP_ERR_INVALID_ARG;
+
+  const w5500_spi_client_t *c = &s_spi_clients[client];
+
+  stats->name = c->name;
+  stats->spi_host = c->spi_host;
+  stats->priority = c->priority;
+  stats->acquisitions = c->acquisitions;
+  stats->contended = c->contended;
+  stats->busy_us = c->busy_us;
+  stats->wait_us = c->wait_us;
+  stats->max_wait_us = c->max_wait_us;
+  stats->window_us = esp_timer_get_time() - s_spi_bus[c->spi_host].stats_since_us;
+
+  return ESP_OK;
+}
+
+////////////////////////////////////////
+
+void w5500_spi_bus_reset_stats(int spi_host)
+{
+  if ((spi_host < 0) || (spi_host >= SPI_HOST_MAX))
+    return;
+
+  for (int i = 0; i < W5500_SPI_MAX_CLIENTS; i++)
+  {
+    w5500_spi_client_t *c = &s_spi_clients[i];
+
+    if (c->in_use && (c->spi_host == spi_host))
+    {
+      c->acquisitions = 0;
+      c->contended = 0;
+      c->busy_us = 0;
+      c->wait_us = 0;
+      c->max_wait_us = 0;
+    }
+  }
+
+  s_spi_bus[spi_host].stats_since_us = esp_timer_get_time();
+}
+
+////////////////////////////////////////
@@ -37,12 +37,163 @@ extern "C" {
 
 #include "esp_eth_phy.h"
 #include "esp_eth_mac.h"
+#include "esp_log.h"
 #include "driver/spi_master.h"
 
 ////////////////////////////////////////
 
 #define CS_HOLD_TIME_MIN_NS     210
 
+// Build option: 1 = the MAC and PHY instances, SPI lock, RX task (and its stack) come from static memory
+// instead of the heap. RX frame buffers are still allocated per frame: esp_netif frees them with free().
+// The packet generator uses a static frame and the capture ring is not available. See w5500_get_alloc_count
+#ifndef W5500_STATIC_ALLOCATION
+  #define W5500_STATIC_ALLOCATION         0
+#endif
+
+// Number of static MAC / PHY instances, and the RX task stack each one gets (bytes)
+#ifndef W5500_STATIC_INSTANCES
+  #define W5500_STATIC_INSTANCES          1
+#endif
+
+#ifndef W5500_STATIC_RX_TASK_STACK_SIZE
+  #define W5500_STATIC_RX_TASK_STACK_SIZE 2048
+#endif
+
+// Build option: 1 = time the RX and TX paths with the CPU cycle counter into w5500_hist_t histograms.
+// Off in the MINIMAL profile
+#ifndef W5500_LATENCY_HISTOGRAMS
+  #if defined(ESP32_W5500_PROFILE) && (ESP32_W5500_PROFILE == 0)
+    #define W5500_LATENCY_HISTOGRAMS      0
+  #else
+    #define W5500_LATENCY_HISTOGRAMS      1
+  #endif
+#endif
+
+// Build option: 1 = charge the CPU cycles of each RX and TX frame to driver stages (see w5500_get_cycle_stats).
+// Off in the MINIMAL profile
+#ifndef W5500_CYCLE_ACCOUNTING
+  #if defined(ESP32_W5500_PROFILE) && (ESP32_W5500_PROFILE == 0)
+    #define W5500_CYCLE_ACCOUNTING        0
+  #else
+    #define W5500_CYCLE_ACCOUNTING        1
+  #endif
+#endif
+
+// Build option: 1 = record SPI, lock, command, interrupt and frame events in a RAM ring (see w5500_trace_start)
+#ifndef W5500_TRACE
+  #define W5500_TRACE                     0
+#endif
+
+// Events in the trace ring, 16 bytes each. Must be a power of two
+#ifndef W5500_TRACE_EVENTS
+  #define W5500_TRACE_EVENTS              1024
+#endif
+
+// Build option: 1 = frames can be copied into a pcap capture ring (see w5500_capture_start).
+// Off in the MINIMAL profile
+#ifndef W5500_CAPTURE
+  #if defined(ESP32_W5500_PROFILE) && (ESP32_W5500_PROFILE == 0)
+    #define W5500_CAPTURE                 0
+  #else
+    #define W5500_CAPTURE                 1
+  #endif
+#endif
+
+// Capture ring size used when w5500_capture_config_t::ring_size is 0
+#ifndef W5500_CAPTURE_RING_SIZE
+  #define W5500_CAPTURE_RING_SIZE         (256 * 1024)
+#endif
+
+// Build option: 1 = count packets and bytes per peer in a flow table (see w5500_flow_top).
+// Off in the MINIMAL profile
+#ifndef W5500_FLOW_TABLE
+  #if defined(ESP32_W5500_PROFILE) && (ESP32_W5500_PROFILE == 0)
+    #define W5500_FLOW_TABLE              0
+  #else
+    #define W5500_FLOW_TABLE              1
+  #endif
+#endif
+
+// Flows in the table, 48 bytes each. Must be a power of two
+#ifndef W5500_FLOW_ENTRIES
+  #define W5500_FLOW_ENTRIES              64
+#endif
+
+// Slots searched for a flow before the least recently used one of them is replaced
+#ifndef W5500_FLOW_PROBES
+  #define W5500_FLOW_PROBES               8
+#endif
+
+// Build option: 1 = raw frame generator and RX sink for line-rate tests of the MAC alone (see w5500_pktgen_run
+// and w5500_sink_start). Off in the MINIMAL profile
+#ifndef W5500_PKTGEN
+  #if defined(ESP32_W5500_PROFILE) && (ESP32_W5500_PROFILE == 0)
+    #define W5500_PKTGEN                  0
+  #else
+    #define W5500_PKTGEN                  1
+  #endif
+#endif
+
+// EtherType of the test frames when none is given: IEEE 802 local experimental 1
+#ifndef W5500_PKTGEN_ETHERTYPE
+  #define W5500_PKTGEN_ETHERTYPE          0x88B5
+#endif
+
+// w5500_pktgen_run sleeps for a tick at least this often, so lower priority tasks on its core (IDLE and its
+// watchdog feed, the Arduino loop) still run. Costs up to one tick of sending per period
+#ifndef W5500_PKTGEN_YIELD_MS
+  #define W5500_PKTGEN_YIELD_MS           50
+#endif
+
+// Build option: 1 = the driver's ESP_LOGx and the ET_LOG* macros queue the format and its arguments in a
+// ring, and a low priority task formats and prints them (see w5500_log_write). On in the DIAGNOSTIC profile
+#ifndef W5500_DEFERRED_LOG
+  #if defined(ESP32_W5500_PROFILE) && (ESP32_W5500_PROFILE == 2)
+    #define W5500_DEFERRED_LOG            1
+  #else
+    #define W5500_DEFERRED_LOG            0
+  #endif
+#endif
+
+// Deferred log slots. Must be a power of two
+#ifndef W5500_LOG_SLOTS
+  #define W5500_LOG_SLOTS                 32
+#endif
+
+// Bytes per deferred log slot, 20 of them header. Longer arguments are cut short
+#ifndef W5500_LOG_SLOT_SIZE
+  #define W5500_LOG_SLOT_SIZE             128
+#endif
+
+#ifndef W5500_LOG_TASK_PRIORITY
+  #define W5500_LOG_TASK_PRIORITY         1
+#endif
+
+#ifndef W5500_LOG_TASK_STACK_SIZE
+  #define W5500_LOG_TASK_STACK_SIZE       3072
+#endif
+
+// How often the log task looks at the ring
+#ifndef W5500_LOG_FLUSH_MS
+  #define W5500_LOG_FLUSH_MS              20
+#endif
+
+// Frames the RX task reads per interrupt before letting other tasks of its priority run
+#ifndef W5500_RX_BATCH_FRAMES
+  #define W5500_RX_BATCH_FRAMES           8
+#endif
+
+// Clients of the SPI bus arbiter (w5500_spi_client_register), across all hosts. At most 32
+#ifndef W5500_SPI_MAX_CLIENTS
+  #define W5500_SPI_MAX_CLIENTS           8
+#endif
+
+// Arbiter priority of the W5500 itself. Higher wins
+#ifndef W5500_SPI_PRIORITY_DEFAULT
+  #define W5500_SPI_PRIORITY_DEFAULT      10
+#endif
+
 ////////////////////////////////////////
 
 /*
@@ -106,6 +257,73 @@ static inline uint8_t w5500_cal_spi_cs_hold_time(int clock_speed_mhz)
 esp_eth_mac_t *esp_eth_mac_new_w5500(const eth_w5500_config_t *w5500_config,
                                      const eth_mac_config_t *mac_config);
 
+/**
+  @brief Create w5500 Ethernet MAC instance with the RX task on a given core
+
+  @param[in] w5500_config: w5500 specific configuration
+  @param[in] mac_config: Ethernet MAC configuration. ETH_MAC_FLAG_PIN_TO_CORE is ignored
+  @param[in] rx_task_core: core for the RX task, or tskNO_AFFINITY
+
+  @return
+       - instance: create MAC instance successfully
+       - NULL: create MAC instance failed because some error occurred
+*/
+esp_eth_mac_t *esp_eth_mac_new_w5500_on_core(const eth_w5500_config_t *w5500_config,
+                                             const eth_mac_config_t *mac_config, int rx_task_core);
+
+////////////////////////////////////////
+
+// Everything w5500_begin needs: pins, SPI bus and device, GPIO ISR service and RX task set-up
+typedef struct
+{
+  int poci_gpio;
+  int pico_gpio;
+  int sclk_gpio;
+  int cs_gpio;
+  int int_gpio;
+  int spi_clock_mhz;
+  int spi_host;
+  int spi_queue_size;         // Transactions queued on the SPI device
+  int spi_dma_chan;           // SPI_DMA_CH_AUTO, SPI_DMA_CH1, SPI_DMA_CH2 or SPI_DMA_DISABLED
+  int isr_flags;              // ESP_INTR_FLAG_* for gpio_install_isr_service. Only used if we install the service
+  uint32_t rx_task_stack_size;
+  uint32_t rx_task_prio;
+  int rx_task_core;           // 0, 1 or tskNO_AFFINITY
+  bool spi_bus_shared;        // Accept a bus initialized by another driver and go through the bus arbiter
+  int spi_priority;           // Arbiter priority when spi_bus_shared
+} w5500_begin_config_t;
+
+/**
+  @brief Take a reference on the GPIO ISR service (installing it if nobody has), initialize the SPI bus
+         and add the W5500 device. The bus is only initialized by the first W5500 on the host. With
+         spi_bus_shared, a bus already initialized by another driver is used as it is
+
+  @param[in] config: pins and SPI set-up
+  @param[out] spi_handle: the new SPI device
+  @param[out] isr_service_ref: true if a reference on the ISR service is held. Pass it back to w5500_spi_detach
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_spi_attach(const w5500_begin_config_t *config, spi_device_handle_t *spi_handle, bool *isr_service_ref);
+
+/**
+  @brief Undo w5500_spi_attach: remove the SPI device and drop the ISR service reference. The bus is freed
+         with the last W5500 on the host, if w5500_spi_attach initialized it. The service is uninstalled
+         with the last reference, if it was installed by w5500_spi_attach
+*/
+void w5500_spi_detach(int spi_host, spi_device_handle_t spi_handle, bool isr_service_ref);
+
+/**
+  @brief w5500_spi_attach, then create the MAC instance. With spi_bus_shared the MAC is registered with
+         the bus arbiter as "w5500"
+
+  @return
+       - instance: create MAC instance successfully
+       - NULL: create MAC instance failed because some error occurred
+*/
+esp_eth_mac_t *w5500_begin(const w5500_begin_config_t *config, spi_device_handle_t *spi_handle, bool *isr_service_ref);
+
 ////////////////////////////////////////
 
 /**
@@ -161,7 +379,8 @@ esp_err_t w5500_set_phy_duplex(esp_eth_phy_t *phy, eth_duplex_t duplex);
 ////////////////////////////////////////
 
 /**
-  @brief Update and return the link status
+  @brief Return the cached link status. No SPI access, safe to poll from any task.
+         The cache is refreshed by the esp_eth link check timer
 
   @param phy: pointer to the esp_eth_phy_t
   @param link_status: pointer to the link status
@@ -174,7 +393,8 @@ esp_err_t w5500_get_link_status(esp_eth_phy_t *phy, eth_link_t *link_status);
 ////////////////////////////////////////
 
 /**
-  @brief Update and return the link speed
+  @brief Return the cached link speed. No SPI access, safe to poll from any task.
+         The cache is refreshed by the esp_eth link check timer
 
   @param phy: pointer to the esp_eth_phy_t
   @param speed: pointer to the speed
@@ -187,7 +407,8 @@ esp_err_t w5500_get_speed(esp_eth_phy_t *phy, eth_speed_t *speed);
 ////////////////////////////////////////
 
 /**
-  @brief Update and return the link duplex
+  @brief Return the cached link duplex. No SPI access, safe to poll from any task.
+         The cache is refreshed by the esp_eth link check timer
 
   @param phy: pointer to the esp_eth_phy_t
   @param duplex: pointer to the duplex mode
@@ -199,6 +420,805 @@ esp_err_t w5500_get_duplex(esp_eth_phy_t *phy, eth_duplex_t *duplex);
 
 ////////////////////////////////////////
 
+/**
+  @brief Return the number of link state changes seen by the PHY. The counter only ever increases,
+         so a caller can compare it against a previous value to spot a link flap between two polls
+
+  @param phy: pointer to the esp_eth_phy_t
+
+  @return
+       - the change counter (24 bits, wraps)
+*/
+uint32_t w5500_get_link_change_count(esp_eth_phy_t *phy);
+
+////////////////////////////////////////
+
+/**
+  @brief Split the W5500 socket memory between the MAC RAW socket and the TCP offload sockets.
+         Must be called before esp_eth_driver_install (the split is programmed during MAC init)
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param tx_kb: TX buffer size in KB for each of the 8 sockets (0, 1, 2, 4, 8 or 16)
+  @param rx_kb: RX buffer size in KB for each of the 8 sockets (0, 1, 2, 4, 8 or 16)
+
+  @return
+       - ESP_OK: split accepted
+       - ESP_ERR_INVALID_ARG / ESP_ERR_INVALID_SIZE: sizes are not valid or exceed 16KB
+*/
+esp_err_t w5500_set_socket_buffers(esp_eth_mac_t *mac, const uint8_t *tx_kb, const uint8_t *rx_kb);
+
+////////////////////////////////////////
+
+/**
+  @brief Set the source IP, netmask and gateway used by the TCP offload sockets.
+         The MAC RAW socket does not use them, lwIP owns addressing for everything else
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param ip_addr: IPv4 address (network byte order)
+  @param netmask: IPv4 netmask (network byte order)
+  @param gateway: IPv4 gateway (network byte order)
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_set_ip_info(esp_eth_mac_t *mac, uint32_t ip_addr, uint32_t netmask, uint32_t gateway);
+
+////////////////////////////////////////
+
+/**
+  @brief Claim a free TCP offload socket (a socket 1-7 which was given buffer memory)
+
+  When every socket is claimed, a socket which has been connected and is now CLOSED, closing or in
+  CLOSE_WAIT is taken back from its owner, the way Arduino Ethernet does. This keeps sockets from
+  leaking when the owner is dropped without w5500_sock_release. The old owner finds out through
+  w5500_sock_generation
+
+  @param mac: pointer to the esp_eth_mac_t
+
+  @return
+       - socket number, or -1 if no socket is free
+*/
+int w5500_sock_alloc(esp_eth_mac_t *mac);
+
+/**
+  @brief Return a counter bumped each time w5500_sock_alloc hands out the socket. An owner keeps the
+         value it got with the socket and stops using the socket once the value changes
+*/
+uint8_t w5500_sock_generation(esp_eth_mac_t *mac, int sock);
+
+/**
+  @brief Return a socket claimed with w5500_sock_alloc. The socket should be closed first
+*/
+void w5500_sock_release(esp_eth_mac_t *mac, int sock);
+
+////////////////////////////////////////
+
+/**
+  @brief Open an offload socket in TCP mode on local_port. The socket is left in the INIT state,
+         ready for w5500_sock_listen or w5500_sock_connect
+*/
+esp_err_t w5500_sock_open_tcp(esp_eth_mac_t *mac, int sock, uint16_t local_port);
+
+/**
+  @brief Wait for an incoming connection (TCP server)
+*/
+esp_err_t w5500_sock_listen(esp_eth_mac_t *mac, int sock);
+
+/**
+  @brief Start a connection to ip_addr (network byte order) : port (TCP client).
+         Poll w5500_sock_get_status for W5500_SSR_ESTABLISHED
+*/
+esp_err_t w5500_sock_connect(esp_eth_mac_t *mac, int sock, uint32_t ip_addr, uint16_t port);
+
+/**
+  @brief Send a FIN to the peer
+*/
+esp_err_t w5500_sock_disconnect(esp_eth_mac_t *mac, int sock);
+
+/**
+  @brief Close the socket immediately
+*/
+esp_err_t w5500_sock_close(esp_eth_mac_t *mac, int sock);
+
+////////////////////////////////////////
+
+/**
+  @brief Read the socket status register (W5500_SSR_*)
+*/
+esp_err_t w5500_sock_get_status(esp_eth_mac_t *mac, int sock, uint8_t *status);
+
+/**
+  @brief Read the peer address (network byte order) and port of a connected socket
+*/
+esp_err_t w5500_sock_get_remote(esp_eth_mac_t *mac, int sock, uint32_t *ip_addr, uint16_t *port);
+
+/**
+  @brief Return the number of received bytes waiting in the socket RX buffer
+*/
+esp_err_t w5500_sock_available(esp_eth_mac_t *mac, int sock, uint16_t *size);
+
+////////////////////////////////////////
+
+/**
+  @brief Copy up to length bytes into the socket TX buffer and issue SEND.
+         Segmentation, ACK processing and retransmission are done by the W5500
+
+  @param sent: number of bytes accepted. May be less than length (or zero) when the TX buffer is full
+
+  @return
+       - ESP_OK: data queued (check sent)
+       - ESP_ERR_INVALID_STATE: socket is not connected
+       - ESP_ERR_TIMEOUT: the previous SEND did not complete
+*/
+esp_err_t w5500_sock_send(esp_eth_mac_t *mac, int sock, const uint8_t *buf, uint32_t length, uint32_t *sent);
+
+/**
+  @brief Copy up to length received bytes out of the socket RX buffer
+
+  @param received: number of bytes copied
+  @param peek: true to leave the data in the RX buffer
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_sock_recv(esp_eth_mac_t *mac, int sock, uint8_t *buf, uint32_t length, uint32_t *received, bool peek);
+
+////////////////////////////////////////
+
+/**
+  @brief Reset and reprogram the W5500 without tearing the driver down. The SPI bus and device,
+         GPIO interrupt, RX task, netif and DHCP lease are kept. The socket buffer split, MAC address
+         and offload IP info are written back. SOCK0 re-opens when the PHY reports link again,
+         so follow this with phy->negotiate(). A frame being sent or received is finished first,
+         and frames are dropped until the chip is reprogrammed
+
+  @param mac: pointer to the esp_eth_mac_t
+
+  @return
+       - ESP_OK: the chip answered and was reprogrammed
+       - ESP_ERR_TIMEOUT: the frame in flight did not finish, or the chip did not come out of reset
+*/
+esp_err_t w5500_reinit(esp_eth_mac_t *mac);
+
+////////////////////////////////////////
+
+/**
+  @brief Release the SPI device and INT pin so other code can use the W5500. The driver must be
+         stopped (esp_eth_stop) first. The RX task and transmit stay idle until w5500_attach
+
+  @param mac: pointer to the esp_eth_mac_t
+
+  @return
+       - ESP_OK: the caller may now remove the SPI device and free the bus
+       - ESP_ERR_TIMEOUT: a frame or an SPI transaction did not finish. The driver is still attached
+*/
+esp_err_t w5500_detach(esp_eth_mac_t *mac);
+
+/**
+  @brief Take the W5500 back after w5500_detach: use the new SPI device, re-install the INT pin
+         handler and reset and reprogram the chip (see w5500_reinit). Follow this with esp_eth_start
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param spi_hdl: the SPI device added for the W5500 on the re-initialized bus
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_attach(esp_eth_mac_t *mac, spi_device_handle_t spi_hdl);
+
+////////////////////////////////////////
+
+/**
+  @brief Number of heap allocations the driver has made since it was created: RX frame buffers, which
+         esp_netif frees after lwIP is done with them, the capture ring, the packet generator's frame and
+         anything allocated with w5500_alloc
+
+  @param mac: pointer to the esp_eth_mac_t
+
+  @return
+       - number of allocations (0 if mac is NULL)
+*/
+uint32_t w5500_get_alloc_count(esp_eth_mac_t *mac);
+
+/**
+  @brief heap_caps_malloc, counted in w5500_get_alloc_count. For the library's own run time allocations.
+         Free with free()
+*/
+void *w5500_alloc(esp_eth_mac_t *mac, size_t size, uint32_t caps);
+
+////////////////////////////////////////
+
+// Driver counters, since the MAC was created. Each one has a single writer at a time (or an atomic add),
+// so updating them takes no lock. The 64-bit ones are stored atomically and always read whole
+typedef struct
+{
+  uint64_t rx_frames;           // Frames passed to lwIP
+  uint64_t rx_bytes;
+  uint64_t tx_frames;           // Frames sent
+  uint64_t tx_bytes;
+  uint64_t spi_transactions;    // Completed SPI transactions, from every user of the chip
+  uint64_t spi_bytes;           // Including the 3 command and address bytes of each
+  uint32_t rx_drop_no_mem;      // No buffer for a received frame ("No mem for receive buffer")
+  uint32_t rx_drop_error;       // Reading a frame failed
+  uint32_t rx_drop_oversize;    // Frame longer than ETH_MAX_PACKET_SIZE, skipped
+  uint32_t tx_drops;            // Frames not sent, for any reason (including tx_full)
+  uint32_t tx_full;             // Not enough free TX buffer for the frame ("Free size < send length")
+  uint32_t lock_waits;          // The SPI lock was busy and had to be waited for
+  uint32_t cmd_timeouts;        // The chip did not take a socket command ("Send command timeout")
+  uint32_t rx_rsr_peak;         // Most bytes seen waiting in the SOCK0 RX buffer
+  uint32_t isr_count;           // INT pin interrupts
+} w5500_stats_t;
+
+/**
+  @brief Copy the driver counters
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param stats: the counters
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_get_stats(esp_eth_mac_t *mac, w5500_stats_t *stats);
+
+////////////////////////////////////////
+
+#if W5500_LATENCY_HISTOGRAMS
+
+// Log2 latency histogram in CPU cycles: count[i] holds the samples of 2^i to 2^(i+1) - 1 cycles
+#define W5500_HIST_BUCKETS 32
+
+typedef struct
+{
+  uint32_t count[W5500_HIST_BUCKETS];
+  uint32_t max_cycles;
+} w5500_hist_t;
+
+typedef enum
+{
+  W5500_HIST_ISR_WAKE = 0,    // INT pin interrupt until the RX task runs. Only sampled when both are on the same core
+  W5500_HIST_RX_READ,         // Reading one frame over SPI (emac_w5500_receive)
+  W5500_HIST_RX_INPUT,        // Handing the frame to lwIP (stack_input)
+  W5500_HIST_TX_COPY,         // TX: free size check, frame copy and write pointer update
+  W5500_HIST_TX_SEND,         // TX: SEND command until the chip took it
+  W5500_HIST_TX_DONE,         // TX: polling for SEND_OK and clearing it
+  W5500_HIST_TX_TOTAL,        // emac_w5500_transmit end to end, including waiting for the turn
+  W5500_HIST_NUM
+} w5500_hist_id_t;
+
+/**
+  @brief Copy one latency histogram. The buckets are copied one by one while the driver may be adding samples
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param id: which histogram
+  @param hist: the copy
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_get_histogram(esp_eth_mac_t *mac, w5500_hist_id_t id, w5500_hist_t *hist);
+
+/**
+  @brief Zero all the latency histograms
+*/
+void w5500_reset_histograms(esp_eth_mac_t *mac);
+
+/**
+  @brief Upper bound of the bucket holding the per_mille'th sample (e.g. 999 for the 99.9th percentile),
+         capped at the largest sample
+
+  @return
+       - cycles, 0 if the histogram is empty
+*/
+uint32_t w5500_hist_percentile(const w5500_hist_t *hist, uint32_t per_mille);
+
+#endif  // W5500_LATENCY_HISTOGRAMS
+
+////////////////////////////////////////
+
+#if W5500_CYCLE_ACCOUNTING
+
+// Where the cycles of a frame go. Each frame is timed from its buffer allocation (RX) or the transmit call (TX)
+// to the hand-off, and every cycle in between is charged to exactly one stage. Waiting for the RX / TX turn is
+// not charged. The counts are elapsed cycles, so time the task spends preempted is charged to its stage too
+typedef enum
+{
+  W5500_STAGE_RX_ALLOC = 0,   // Allocating the frame buffer
+  W5500_STAGE_RX_PARSE,       // Received size, read pointer and frame header bookkeeping, outside SPI
+  W5500_STAGE_RX_SPI,         // RX SPI transactions, including waiting for the SPI lock
+  W5500_STAGE_RX_CMD,         // RECV command polling, outside SPI
+  W5500_STAGE_RX_INPUT,       // Handing the frame to lwIP (stack_input)
+  W5500_STAGE_TX_PREP,        // Free size check and write pointer bookkeeping, outside SPI
+  W5500_STAGE_TX_SPI,         // TX SPI transactions, including waiting for the SPI lock
+  W5500_STAGE_TX_CMD,         // SEND command polling, outside SPI
+  W5500_STAGE_NUM
+} w5500_stage_t;
+
+typedef struct
+{
+  uint64_t cycles[2][W5500_STAGE_NUM];  // Per core, as a task may run on either
+  uint32_t rx_frames;                   // Frames handed to lwIP. Dropped frames are charged but not counted
+  uint32_t tx_frames;                   // Frames sent
+  uint64_t elapsed_us;                  // Since the last w5500_reset_cycle_stats (or start)
+} w5500_cycle_stats_t;
+
+/**
+  @brief Copy the per-stage cycle counts. Divide by the frames for cycles per frame, or by
+         elapsed_us * CPU MHz for the share of a core
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param stats: the copy
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_get_cycle_stats(esp_eth_mac_t *mac, w5500_cycle_stats_t *stats);
+
+/**
+  @brief Zero the cycle counts and restart elapsed_us
+*/
+void w5500_reset_cycle_stats(esp_eth_mac_t *mac);
+
+#endif  // W5500_CYCLE_ACCOUNTING
+
+////////////////////////////////////////
+
+#if W5500_TRACE
+
+// Event trace, shared by all the W5500 interfaces. Recording an event is a cycle counter read,
+// an atomic increment of the ring head and a 16 byte store. The oldest events are overwritten
+typedef enum
+{
+  W5500_TRACE_LOCK = 1,       // SPI lock taken. duration = wait
+  W5500_TRACE_UNLOCK,         // SPI lock given back. duration = held
+  W5500_TRACE_SPI_READ,       // arg = W5500 address (control phase << 16 | offset), len = bytes, duration = transaction
+  W5500_TRACE_SPI_WRITE,
+  W5500_TRACE_CMD,            // arg = socket << 8 | command, duration = until the chip took it
+  W5500_TRACE_ISR,            // INT pin interrupt
+  W5500_TRACE_RX_FRAME,       // len = frame length, duration = SPI read of the frame
+  W5500_TRACE_TX_FRAME,       // len = frame length, duration = transmit end to end
+  W5500_TRACE_RX_DROP,        // arg = 1 no buffer, 2 read error, 3 oversize
+  W5500_TRACE_TX_DROP,        // arg = esp_err_t
+} w5500_trace_type_t;
+
+typedef struct
+{
+  uint32_t cycles;            // CPU cycle counter of the recording core when the event ended
+  uint8_t type;               // w5500_trace_type_t
+  uint8_t core;
+  uint16_t len;
+  uint32_t arg;
+  uint32_t duration;          // Cycles, 0 for instant events
+} w5500_trace_event_t;
+
+/**
+  @brief Start or stop recording. Recording is off until w5500_trace_start
+*/
+void w5500_trace_start(void);
+void w5500_trace_stop(void);
+
+/**
+  @brief Stop recording and empty the ring
+*/
+void w5500_trace_clear(void);
+
+/**
+  @brief Number of events in the ring (at most W5500_TRACE_EVENTS). Stop recording before reading them
+
+  @param lost: if not NULL, the number of events overwritten since the last clear
+*/
+uint32_t w5500_trace_count(uint32_t *lost);
+
+/**
+  @brief Copy event index (0 = oldest) out of the ring
+
+  @return
+       - false if index >= w5500_trace_count()
+*/
+bool w5500_trace_get(uint32_t index, w5500_trace_event_t *event);
+
+#endif  // W5500_TRACE
+
+////////////////////////////////////////
+
+#if W5500_CAPTURE
+
+#define W5500_CAPTURE_RX      (1 << 0)
+#define W5500_CAPTURE_TX      (1 << 1)
+
+typedef struct
+{
+  uint8_t directions;         // W5500_CAPTURE_RX and / or W5500_CAPTURE_TX
+  uint32_t snap_len;          // Bytes kept of each frame, 0 = all
+  uint16_t ether_type;        // Only this EtherType (looking past one VLAN tag), 0 = any
+  uint16_t port;              // Only IPv4 TCP / UDP with this source or destination port, 0 = any
+  uint16_t skip_port;         // Never IPv4 TCP / UDP with this port, e.g. the web server serving the capture
+  uint32_t ring_size;         // Bytes, rounded down to a power of two. 0 = W5500_CAPTURE_RING_SIZE
+} w5500_capture_config_t;
+
+typedef struct
+{
+  uint32_t frames;            // Frames copied into the ring
+  uint32_t bytes;             // Bytes copied, including the pcap record headers
+  uint32_t filtered;          // Frames not matching the filter
+  uint32_t dropped;           // Matching frames that did not fit in the ring
+} w5500_capture_stats_t;
+
+/**
+  @brief Start copying SOCK0 frames into a pcap capture ring. Each frame becomes a pcap record
+         (LINKTYPE_ETHERNET) stamped with gettimeofday(). The ring is allocated in PSRAM when there is
+         some, on the first start, and kept until the driver is deleted, so ring_size only counts the first
+         time. Starting again empties the ring. Frames through the offload sockets are not captured
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param config: what to capture
+
+  @return
+       - ESP_ERR_INVALID_STATE: already capturing
+       - ESP_ERR_NO_MEM: no memory for the ring
+       - ESP_ERR_NOT_SUPPORTED: built with W5500_STATIC_ALLOCATION, which has no ring
+       - esp_err_t
+*/
+esp_err_t w5500_capture_start(esp_eth_mac_t *mac, const w5500_capture_config_t *config);
+
+/**
+  @brief Stop capturing. What is in the ring can still be read
+*/
+void w5500_capture_stop(esp_eth_mac_t *mac);
+
+/**
+  @brief Take up to len bytes of pcap records out of the ring. Records may be split across calls.
+         The pcap file header is not included, see w5500_capture_file_header. One reader at a time
+
+  @return
+       - bytes copied to buffer, 0 if the ring is empty
+*/
+size_t w5500_capture_read(esp_eth_mac_t *mac, void *buffer, size_t len);
+
+/**
+  @brief Fill in the 24 byte pcap file header for the current capture
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_capture_file_header(esp_eth_mac_t *mac, uint8_t header[24]);
+
+/**
+  @brief Copy the capture counters
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_capture_get_stats(esp_eth_mac_t *mac, w5500_capture_stats_t *stats);
+
+#endif  // W5500_CAPTURE
+
+////////////////////////////////////////
+
+#if W5500_FLOW_TABLE
+
+// One peer: the source of RX frames and the destination of TX frames. The first 16 bytes are the key
+typedef struct
+{
+  uint8_t mac[6];
+  uint16_t ether_type;
+  uint32_t ip;                // IPv4 address (network order), 0 for other EtherTypes
+  uint16_t port;              // TCP / UDP port, 0 for other protocols
+  uint8_t protocol;           // IPv4 protocol, 0 for other EtherTypes
+  uint8_t reserved;
+  uint32_t rx_packets;
+  uint32_t tx_packets;
+  uint64_t rx_bytes;
+  uint64_t tx_bytes;
+  uint32_t last_seen;         // Table frame count at its last frame, for the LRU replacement
+} w5500_flow_t;
+
+#define W5500_FLOW_RX         0
+#define W5500_FLOW_TX         1
+
+typedef struct
+{
+  uint8_t direction;          // W5500_FLOW_RX or W5500_FLOW_TX
+  uint32_t frame_len;
+  uint32_t sample_pool;       // Frames since the previous sample, this one included
+  uint32_t header_len;        // Bytes at header, at most 128
+  const uint8_t *header;      // Start of the frame. Only valid during the callback
+} w5500_flow_sample_t;
+
+// Called from the RX task or the transmitting task with the frame on hold, so keep it short (e.g. queue a copy)
+typedef void (*w5500_flow_sample_cb_t)(const w5500_flow_sample_t *sample, void *arg);
+
+/**
+  @brief Copy the busiest flows, busiest first
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param flows: room for n flows
+  @param n: how many
+  @param by_bytes: rank by RX + TX bytes instead of packets
+
+  @return
+       - flows copied
+*/
+size_t w5500_flow_top(esp_eth_mac_t *mac, w5500_flow_t *flows, size_t n, bool by_bytes);
+
+/**
+  @brief Empty the flow table and zero the evictions
+*/
+void w5500_flow_reset(esp_eth_mac_t *mac);
+
+/**
+  @brief Flows replaced to make room for a new one since the last reset
+*/
+uint32_t w5500_flow_evictions(esp_eth_mac_t *mac);
+
+/**
+  @brief Pass one frame in rate (on average, at random intervals) to callback. rate 0 stops sampling
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_flow_set_sampling(esp_eth_mac_t *mac, uint32_t rate, w5500_flow_sample_cb_t callback, void *arg);
+
+#endif  // W5500_FLOW_TABLE
+
+////////////////////////////////////////
+
+#if W5500_PKTGEN
+
+// Test frames are destination, source, EtherType, then a 32 bit big endian sequence number.
+// The rest of the frame is zeros
+typedef struct
+{
+  uint8_t dest[6];            // Destination MAC, e.g. the receiving board's or ff:ff:ff:ff:ff:ff
+  uint16_t ether_type;        // 0 = W5500_PKTGEN_ETHERTYPE
+  uint16_t frame_len;         // 60 to 1514 bytes, without the FCS
+  uint32_t rate_pps;          // Frames per second, 0 = as fast as the driver can send them
+  uint32_t count;             // Stop after this many frames, 0 = no limit
+  uint32_t duration_ms;       // Stop after this long, 0 = no limit. count or duration_ms must be set
+  uint32_t first_seq;         // Sequence number of the first frame
+} w5500_pktgen_config_t;
+
+typedef struct
+{
+  uint32_t frames;            // Frames sent
+  uint64_t bytes;             // Their bytes, without preamble, FCS and gap
+  uint32_t errors;            // Frames the driver failed to send (also counted in w5500_stats_t::tx_drops)
+  uint32_t late;              // Frames sent after their time, when a rate was set: the rate was not reached
+  uint32_t next_seq;          // Sequence number the next frame would have had
+  uint32_t elapsed_us;
+} w5500_pktgen_result_t;
+
+typedef struct
+{
+  uint32_t frames;            // Test frames received and discarded
+  uint64_t bytes;
+  uint32_t lost;              // Sequence numbers from the first to the highest seen that did not arrive
+  uint32_t out_of_order;      // Frames with a lower sequence number than one already seen
+  uint32_t first_seq;
+  uint32_t next_seq;          // Highest sequence number seen + 1
+  uint32_t elapsed_us;        // First test frame to the last
+} w5500_sink_stats_t;
+
+/**
+  @brief Send test frames through the MAC's transmit, the way lwIP does, in the calling task, and return when
+         done. One frame buffer is allocated (a static one with W5500_STATIC_ALLOCATION), and only its
+         sequence number changes from frame to frame.
+         lwIP can keep sending at the same time: the frames take turns. The frames are counted in
+         w5500_stats_t, the flow table and the capture like any other.
+         The calling task sleeps for a tick every W5500_PKTGEN_YIELD_MS, and between paced frames which are
+         more than a tick apart, so it does not starve the task watchdog. Waits shorter than a tick are spun
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param config: what to send
+  @param result: what was sent, may be NULL
+
+  @return
+       - ESP_ERR_INVALID_ARG: frame_len out of range, or neither count nor duration_ms set
+       - ESP_ERR_NO_MEM: no memory for the frame
+       - ESP_ERR_INVALID_STATE: W5500_STATIC_ALLOCATION and the static frame is in use by another run
+       - ESP_OK: even if some frames failed, see result->errors
+*/
+esp_err_t w5500_pktgen_run(esp_eth_mac_t *mac, const w5500_pktgen_config_t *config, w5500_pktgen_result_t *result);
+
+/**
+  @brief Count, sequence check and discard the received frames of one EtherType. The RX task reads the
+         EtherType and the sequence number of each frame before it allocates a buffer, so test frames cost
+         SPI reads only: no allocation, no copy and no lwIP. Other frames take the usual path, after one
+         extra SPI read. The test frames are counted in w5500_stats_t::rx_frames and rx_bytes but not in
+         the flow table or the capture. Starting again zeroes the counters
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param ether_type: 0 = W5500_PKTGEN_ETHERTYPE
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_sink_start(esp_eth_mac_t *mac, uint16_t ether_type);
+
+/**
+  @brief Stop discarding. The counters can still be read
+*/
+void w5500_sink_stop(esp_eth_mac_t *mac);
+
+/**
+  @brief Copy the sink counters. They are updated by the RX task without a lock
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_sink_get_stats(esp_eth_mac_t *mac, w5500_sink_stats_t *stats);
+
+#endif  // W5500_PKTGEN
+
+////////////////////////////////////////
+
+#if W5500_DEFERRED_LOG
+
+// Where the log task sends each formatted message (without a line end)
+typedef void (*w5500_log_sink_t)(esp_log_level_t level, const char *tag, uint32_t timestamp_ms, const char *message,
+                                 void *arg);
+
+/**
+  @brief Queue a log message without formatting it. Never blocks: when the ring is full the message is
+         dropped and counted. The format and tag must be string literals (they are kept as pointers);
+         %s arguments are copied. Not for interrupt handlers
+
+  @param level: ESP_LOG_ERROR ... ESP_LOG_VERBOSE
+  @param tag: e.g. "w5500.mac"
+  @param format: printf format. Conversions: d i u x X o c p s f e g, with flags, width, precision
+                 (including *) and the hh h l ll z j t lengths
+*/
+void w5500_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+  __attribute__((format(printf, 3, 4)));
+
+/**
+  @brief Start the task that formats the queued messages. Called by esp_eth_mac_new_w5500, and harmless
+         to call again. Messages queued before it starts are kept
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_log_start(void);
+
+/**
+  @brief Send the formatted messages to sink instead of the console. NULL = back to the console.
+         Returns once the log task is no longer in the previous sink, so its argument can be freed.
+         Called from within a sink, it returns at once
+*/
+void w5500_log_set_sink(w5500_log_sink_t sink, void *arg);
+
+/**
+  @brief Messages dropped because the ring was full
+*/
+uint32_t w5500_log_dropped(void);
+
+/**
+  @brief Drop the driver's own messages (tags "w5500.*") logged by the calling task while muted, e.g. while
+         a log sink sends its batch through the driver, so that the sink never logs about itself. Messages
+         from other tasks are kept. Calls nest. One task at a time: while another task has the driver
+         muted, calls do nothing
+
+  @param mute: true to mute, false to undo one earlier true
+*/
+void w5500_log_mute_driver(bool mute);
+
+/**
+  @brief Messages dropped by w5500_log_mute_driver
+*/
+uint32_t w5500_log_muted(void);
+
+#endif  // W5500_DEFERRED_LOG
+
+////////////////////////////////////////
+
+// RX / TX scheduling. All uint32_t, counting since the MAC was created
+typedef struct
+{
+  uint32_t spi_lock_timeouts;   // Register accesses which gave up waiting for the SPI lock (or the bus arbiter)
+  uint32_t rx_turn_timeouts;    // RX waited W5500_SPI_LOCK_TIMEOUT_MS for the turn (a TX frame to finish)
+  uint32_t tx_turn_timeouts;    // A transmitting task waited as long for the turn. The frame was dropped
+  uint32_t rx_status_errors;    // Reading or clearing the SOCK0 interrupt status failed. Retried
+  uint32_t rx_batch_limited;    // Interrupts with more than W5500_RX_BATCH_FRAMES frames waiting
+  uint32_t handoffs_to_rx;      // TX finished a frame and RX was waiting
+  uint32_t handoffs_to_tx;      // RX finished a frame and TX was waiting
+} w5500_sched_stats_t;
+
+/**
+  @brief Copy the RX / TX scheduling and lock timeout counters
+
+  @param mac: pointer to the esp_eth_mac_t
+  @param stats: the counters
+
+  @return
+       - esp_err_t
+*/
+esp_err_t w5500_get_sched_stats(esp_eth_mac_t *mac, w5500_sched_stats_t *stats);
+
+////////////////////////////////////////
+
+// SPI bus arbiter. The ESP-IDF SPI master already serializes transactions of the devices on a bus,
+// but first come first served. Drivers sharing a bus with the W5500 (SD card, ADC...) can register
+// here and wrap their transactions with w5500_spi_acquire / w5500_spi_release. When the bus is released
+// it goes to the highest priority waiter, so the W5500 RX path can get in between the blocks of
+// a bulk SD write. Arbitration is cooperative: a device which does not acquire is not held off
+
+typedef struct
+{
+  const char *name;
+  int spi_host;
+  int priority;
+  uint32_t acquisitions;
+  uint32_t contended;         // Acquisitions which had to wait for another client
+  uint64_t busy_us;           // Time holding the bus
+  uint64_t wait_us;           // Time waiting for the bus
+  uint32_t max_wait_us;
+  uint64_t window_us;         // Time since the statistics were reset. busy_us / window_us is the bus occupancy
+} w5500_spi_client_stats_t;
+
+/**
+  @brief Register an arbiter client on spi_host. Register the device with spi_bus_add_device as usual
+
+  @param spi_host: SPI host the client's device is on
+  @param name: kept (not copied) for the statistics
+  @param priority: higher wins when several clients are waiting
+
+  @return
+       - client number, or -1 if all W5500_SPI_MAX_CLIENTS are in use
+*/
+int w5500_spi_client_register(int spi_host, const char *name, int priority);
+
+/**
+  @brief Remove a client. If it still holds the bus, the bus goes to the next waiter. If it is queued for
+         the bus, it is taken out of the queue. Its task must not be inside w5500_spi_acquire
+*/
+void w5500_spi_client_unregister(int client);
+
+/**
+  @brief Wait for the bus. Hold it for one transaction, or a few short ones, at a time
+
+  @return
+       - true: the client now owns the bus. Call w5500_spi_release
+       - false: timeout
+*/
+bool w5500_spi_acquire(int client, uint32_t timeout_ms);
+
+/**
+  @brief Give the bus to the highest priority waiter, if any
+*/
+void w5500_spi_release(int client);
+
+/**
+  @brief For long bursts: release and re-acquire the bus if a higher priority client is waiting.
+         Call between transactions
+
+  @return
+       - true: the client (still or again) owns the bus
+       - false: timeout re-acquiring it. The bus is not held
+*/
+bool w5500_spi_yield(int client, uint32_t timeout_ms);
+
+/**
+  @brief Copy a client's bus occupancy and wait statistics
+*/
+esp_err_t w5500_spi_client_get_stats(int client, w5500_spi_client_stats_t *stats);
+
+/**
+  @brief Zero the statistics of every client on spi_host and restart the measurement window
+*/
+void w5500_spi_bus_reset_stats(int spi_host);
+
+/**
+  @brief Make every SPI transaction of the MAC go through the arbiter as client (-1 = don't arbitrate).
+         The client is unregistered when the MAC is deleted
+*/
+void w5500_set_spi_client(esp_eth_mac_t *mac, int client);
+
+/**
+  @brief The MAC's arbiter client, or -1
+*/
+int w5500_get_spi_client(esp_eth_mac_t *mac);
+
+////////////////////////////////////////
+
 #ifdef __cplusplus
 }
 #endif
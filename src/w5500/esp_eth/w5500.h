@@ -59,7 +59,10 @@
 ////////////////////////////////////////
 
 #define W5500_REG_MR        W5500_MAKE_MAP(0x0000, W5500_BSB_COM_REG) // Mode
+#define W5500_REG_GAR       W5500_MAKE_MAP(0x0001, W5500_BSB_COM_REG) // Gateway IP Address
+#define W5500_REG_SUBR      W5500_MAKE_MAP(0x0005, W5500_BSB_COM_REG) // Subnet Mask
 #define W5500_REG_MAC       W5500_MAKE_MAP(0x0009, W5500_BSB_COM_REG) // MAC Address
+#define W5500_REG_SIPR      W5500_MAKE_MAP(0x000F, W5500_BSB_COM_REG) // Source IP Address
 #define W5500_REG_INTLEVEL  W5500_MAKE_MAP(0x0013, W5500_BSB_COM_REG) // Interrupt Level Timeout
 #define W5500_REG_IR        W5500_MAKE_MAP(0x0015, W5500_BSB_COM_REG) // Interrupt
 #define W5500_REG_IMR       W5500_MAKE_MAP(0x0016, W5500_BSB_COM_REG) // Interrupt Mask
@@ -75,7 +78,10 @@
 #define W5500_REG_SOCK_MR(s)         W5500_MAKE_MAP(0x0000, W5500_BSB_SOCK_REG(s)) // Socket Mode
 #define W5500_REG_SOCK_CR(s)         W5500_MAKE_MAP(0x0001, W5500_BSB_SOCK_REG(s)) // Socket Command
 #define W5500_REG_SOCK_IR(s)         W5500_MAKE_MAP(0x0002, W5500_BSB_SOCK_REG(s)) // Socket Interrupt
-#define W5500_REG_SOCK_SR(s)         W5500_MAKE_MAP(0x0004, W5500_BSB_SOCK_REG(s)) // Socket Status
+#define W5500_REG_SOCK_SR(s)         W5500_MAKE_MAP(0x0003, W5500_BSB_SOCK_REG(s)) // Socket Status
+#define W5500_REG_SOCK_PORT(s)       W5500_MAKE_MAP(0x0004, W5500_BSB_SOCK_REG(s)) // Socket Source Port
+#define W5500_REG_SOCK_DIPR(s)       W5500_MAKE_MAP(0x000C, W5500_BSB_SOCK_REG(s)) // Socket Destination IP Address
+#define W5500_REG_SOCK_DPORT(s)      W5500_MAKE_MAP(0x0010, W5500_BSB_SOCK_REG(s)) // Socket Destination Port
 #define W5500_REG_SOCK_RXBUF_SIZE(s) W5500_MAKE_MAP(0x001E, W5500_BSB_SOCK_REG(s)) // Socket Receive Buffer Size
 #define W5500_REG_SOCK_TXBUF_SIZE(s) W5500_MAKE_MAP(0x001F, W5500_BSB_SOCK_REG(s)) // Socket Transmit Buffer Size
 #define W5500_REG_SOCK_TX_FSR(s)     W5500_MAKE_MAP(0x0020, W5500_BSB_SOCK_REG(s)) // Socket TX Free Size
@@ -85,6 +91,7 @@
 #define W5500_REG_SOCK_RX_RD(s)      W5500_MAKE_MAP(0x0028, W5500_BSB_SOCK_REG(s)) // Socket RX Read Pointer
 #define W5500_REG_SOCK_RX_WR(s)      W5500_MAKE_MAP(0x002A, W5500_BSB_SOCK_REG(s)) // Socket RX Write Pointer
 #define W5500_REG_SOCK_IMR(s)        W5500_MAKE_MAP(0x002C, W5500_BSB_SOCK_REG(s)) // Socket Interrupt Mask
+#define W5500_REG_SOCK_KPALVTR(s)    W5500_MAKE_MAP(0x002F, W5500_BSB_SOCK_REG(s)) // Socket Keep Alive Timer
 
 ////////////////////////////////////////
 
@@ -98,24 +105,51 @@
 
 ////////////////////////////////////////
 
+#define W5500_SOCK_NUM    (8)    // Number of hardware sockets
+
+////////////////////////////////////////
+
 #define W5500_SIMR_SOCK0 (1<<0) // Socket 0 interrupt
 
 ////////////////////////////////////////
 
+#define W5500_SMR_TCP        (1<<0) // TCP mode
 #define W5500_SMR_MAC_RAW    (1<<2) // MAC RAW mode
+#define W5500_SMR_ND         (1<<5) // No delayed ACK (TCP)
 #define W5500_SMR_MAC_FILTER (1<<7) // MAC filter
 
 ////////////////////////////////////////
 
-#define W5500_SCR_OPEN  (0x01) // Open command
-#define W5500_SCR_CLOSE (0x10) // Close command
-#define W5500_SCR_SEND  (0x20) // Send command
-#define W5500_SCR_RECV  (0x40) // Recv command
+#define W5500_SCR_OPEN    (0x01) // Open command
+#define W5500_SCR_LISTEN  (0x02) // Listen command (TCP server)
+#define W5500_SCR_CONNECT (0x04) // Connect command (TCP client)
+#define W5500_SCR_DISCON  (0x08) // Disconnect command (TCP)
+#define W5500_SCR_CLOSE   (0x10) // Close command
+#define W5500_SCR_SEND    (0x20) // Send command
+#define W5500_SCR_RECV    (0x40) // Recv command
+
+////////////////////////////////////////
+
+#define W5500_SIR_CON     (1<<0)  // Connection established
+#define W5500_SIR_DISCON  (1<<1)  // FIN or FIN/ACK received from peer
+#define W5500_SIR_RECV    (1<<2)  // Receive done
+#define W5500_SIR_TIMEOUT (1<<3)  // ARP or TCP timeout
+#define W5500_SIR_SEND    (1<<4)  // Send done
 
 ////////////////////////////////////////
 
-#define W5500_SIR_RECV (1<<2)  // Receive done
-#define W5500_SIR_SEND (1<<4)  // Send done
+#define W5500_SSR_CLOSED      (0x00) // Socket closed
+#define W5500_SSR_INIT        (0x13) // TCP socket opened
+#define W5500_SSR_LISTEN      (0x14) // TCP socket waiting for a connection
+#define W5500_SSR_SYNSENT     (0x15) // TCP CONNECT issued, SYN sent
+#define W5500_SSR_SYNRECV     (0x16) // TCP SYN received from peer
+#define W5500_SSR_ESTABLISHED (0x17) // TCP connection established
+#define W5500_SSR_FIN_WAIT    (0x18) // TCP closing
+#define W5500_SSR_CLOSING     (0x1A) // TCP closing
+#define W5500_SSR_TIME_WAIT   (0x1B) // TCP closing
+#define W5500_SSR_CLOSE_WAIT  (0x1C) // TCP FIN received from peer
+#define W5500_SSR_LAST_ACK    (0x1D) // TCP closing
+#define W5500_SSR_MACRAW      (0x42) // MAC RAW socket opened
 
 ////////////////////////////////////////
 